@@ -39,7 +39,14 @@ size_t		 m;
 	SIMPLEQ_INIT(&article->art_groups);
 	article->art_content = xstrdup(text_);
 
-	otext = text = xstrdup(text_);
+	/*
+	 * Parsing modifies the text, so work on a copy; only the headers are
+	 * needed, which matters for a large article.
+	 */
+	if ((p = strstr(text_, "\r\n\r\n")) != NULL)
+		otext = text = xstrndup(text_, p - text_ + 4);
+	else
+		otext = text = xstrdup(text_);
 	line = next_line(&text);
 
 	if (!line) {
@@ -165,7 +172,7 @@ size_t		 m;
 		goto err;
 	}
 
-	article->art_body = xstrdup(p + 4);
+	article->art_body = p + 4;
 	article->art_flags |= article_classify(article);
 
 	groups = groups_ = xstrdup(article->art_newsgroups);
@@ -199,9 +206,9 @@ strlist_entry_t	*ge;
 		return;
 
 	free(art->art_path);
-	free(art->art_body);
 	free(art->art_msgid);
 	free(art->art_content);
+	free(art->art_path_prefix);
 	free(art->art_posting_host);
 	free(art->art_newsgroups);
 	
@@ -257,11 +264,19 @@ size_t		 n;
 		strlcat(mypath, "!", sizeof(mypath));
 	}
 
-	art->art_content = realloc(art->art_content, strlen(art->art_content) + strlen(mypath) + 1);
-	bcopy(art->art_content + n,
-	      art->art_content + n + strlen(mypath),
-	      (strlen(art->art_content) - n) + 1);
-	bcopy(mypath, art->art_content + n, strlen(mypath));
+	free(art->art_path_prefix);
+	art->art_path_prefix = xstrdup(mypath);
+	art->art_path_off = n;
+}
+
+size_t
+article_length(art)
+	article_t const	*art;
+{
+size_t	len = strlen(art->art_content);
+	if (art->art_path_prefix)
+		len += strlen(art->art_path_prefix);
+	return len;
 }
 
 static int
@@ -42,12 +42,13 @@
 #define ART_TYPE_ODD_TEXT	0x0F000000
 
 #define	ART_COMPRESSED		0x10000000	/* (spool) Article is compressed */
+#define	ART_ZSTD		0x20000000	/* (spool) Compressed with zstd */
 
 typedef struct article {
 	char		*art_path;
 	char		*art_msgid;
 	char		*art_content;
-	char		*art_body;
+	char		*art_body;		/* Points into art_content */
 	char		*art_posting_host;
 	char		*art_newsgroups;
 	strlist_t	 art_groups;
@@ -62,6 +63,8 @@ typedef struct article {
 	uint16_t	 art_hdr_len;
 	int		 art_refs;
 	bs_word_t	*art_filters;
+	char		*art_path_prefix;	/* Added to Path: by munging */
+	size_t		 art_path_off;		/* ... at this offset in art_content */
 } article_t;
 
 /*
@@ -70,10 +73,17 @@ typedef struct article {
 article_t	*article_parse(char const *);
 
 /*
- * Add our name to an article's Path: header
+ * Add our name to an article's Path: header.  art_content isn't changed;
+ * instead art_path_prefix is set to the text to be inserted at
+ * art_path_off, and whatever writes the article out splices it in.
  */
 void		 article_munge_path(article_t *);
 
+/*
+ * The length of the article's text, including any Path: prefix.
+ */
+size_t		 article_length(article_t const *);
+
 /*
  * Free an article.
  */
@@ -21,6 +21,8 @@
 #include	<time.h>
 #include	<errno.h>
 #include	<fcntl.h>
+#include	<unistd.h>
+#include	<limits.h>
 #include	<pthread.h>
 
 #include	"uv.h"
@@ -64,6 +66,32 @@ static client_list_t	client_timeout_list;
 static uv_timer_t	timeout_timer;
 static void	client_handle_timeouts(uv_timer_t *, int);
 
+static client_mem_stats_t	 mem_stats;
+static uv_timer_t		 mem_release_timer;
+static void	client_mem_throttle(void);
+static void	client_mem_release(uv_timer_t *, int);
+
+/*
+ * A staging file request; see artbuf_io_start().
+ */
+#define	ARTBUF_IO_OPEN		0
+#define	ARTBUF_IO_WRITE		1
+#define	ARTBUF_IO_UNLINK	2
+#define	ARTBUF_IO_CLOSE		3
+
+typedef struct artbuf_io {
+	uv_fs_t		 ai_req;
+	artbuf_t	*ai_buf;	/* NULL if not holding a reference */
+	int		 ai_op;
+	char		*ai_data;
+	size_t		 ai_len;
+} artbuf_io_t;
+
+static unsigned long	 artbuf_stage_seq;
+static void	artbuf_io_start(artbuf_t *, int, char *, size_t);
+static void	on_artbuf_io_done(uv_fs_t *);
+static void	artbuf_spill(artbuf_t *);
+
 static struct {
 	char const	*cmd;
 	cmd_handler	 handler;
@@ -110,6 +138,7 @@ client_run()
 
 	uv_timer_init(loop, &timeout_timer);
 	uv_timer_start(&timeout_timer, client_handle_timeouts, 10000, 10000);
+	uv_timer_init(loop, &mem_release_timer);
 	incoming_run();
 	return 0;
 }
@@ -345,10 +374,12 @@ client_t	*cl = stream->data;
 		if (DEBUG(CIO))
 			client_log(LOG_DEBUG, cl, "on_client_read: client is paused");
 
+		client_mem_update(cl);
 		return;
 	}
 
 	client_handle_io(cl);
+	client_mem_update(cl);
 }
 
 static void
@@ -371,6 +402,13 @@ client_handle_io(cl)
 
 		if (cl->cl_flags & (CL_DEAD | CL_PAUSED))
 			break;
+
+		/* Throttled clients stop between commands */
+		if ((cl->cl_flags & CL_THROTTLED) &&
+		    cl->cl_state == CS_WAIT_COMMAND) {
+			uv_read_stop((uv_stream_t *) cl->cl_stream);
+			break;
+		}
 	}
 }
 
@@ -409,25 +447,300 @@ client_handle_line(cl, line)
 		if (strcmp(line, ".") == 0) {
 			client_takethis_done(cl);
 		} else {
-			if (buf->ab_len <= max_article_size) {
-			size_t	newsz = (strlen(line) + 3 + buf->ab_len);
+			if (buf->ab_len <= max_article_size)
+				artbuf_append(buf, line);
 
-				if (newsz >= buf->ab_alloc) {
-					buf->ab_alloc *= 2;
-					if (newsz >= buf->ab_alloc)
-						buf->ab_alloc = newsz + 1;
+			buf->ab_len += strlen(line) + 2;
+		}
+	}
+}
 
-					buf->ab_text = xrealloc(buf->ab_text,
-								buf->ab_alloc);
-				}
+artbuf_t *
+artbuf_new(cl, msgid, type)
+	client_t	*cl;
+	char const	*msgid;
+	ab_type_t	 type;
+{
+artbuf_t	*buf;
 
-				strlcat(buf->ab_text, line, buf->ab_alloc);
-				strlcat(buf->ab_text, "\r\n", buf->ab_alloc);
-			}
+	buf = xcalloc(1, sizeof(*buf));
+	buf->ab_msgid = xstrdup(msgid);
+	buf->ab_alloc = ARTBUF_START_SIZE;
+	buf->ab_text = xmalloc(buf->ab_alloc);
+	buf->ab_text[0] = 0;
+	buf->ab_spill = -1;
+	buf->ab_client = cl;
+	buf->ab_type = type;
+	return buf;
+}
 
-			buf->ab_len += strlen(line) + 2;
+void
+artbuf_free(buf)
+	artbuf_t	*buf;
+{
+	/* The last staging request to finish will free it */
+	if (buf->ab_spill_reqs) {
+		buf->ab_flags |= AB_FREED;
+		return;
+	}
+
+	if (buf->ab_spill != -1)
+		artbuf_io_start(buf, ARTBUF_IO_CLOSE, NULL, 0);
+	free(buf->ab_msgid);
+	free(buf->ab_text);
+	free(buf);
+}
+
+/*
+ * Staging file I/O is done with uv_fs requests, so a slow staging disk
+ * doesn't hold up the main loop.  Each request holds a reference on the
+ * buffer; the article isn't handed to a worker (AB_SPILLWAIT), and the
+ * buffer isn't freed (AB_FREED), until they have all finished.
+ */
+static void
+artbuf_io_start(buf, op, data, len)
+	artbuf_t	*buf;
+	int		 op;
+	char		*data;
+	size_t		 len;
+{
+artbuf_io_t	*ai;
+char		 fname[PATH_MAX];
+int		 err;
+
+	ai = xcalloc(1, sizeof(*ai));
+	ai->ai_req.data = ai;
+	ai->ai_op = op;
+	ai->ai_data = data;
+	ai->ai_len = len;
+
+	/* Unlink and close outlive the buffer */
+	if (op == ARTBUF_IO_OPEN || op == ARTBUF_IO_WRITE) {
+		ai->ai_buf = buf;
+		buf->ab_spill_reqs++;
+		buf->ab_spill_mem += len;
+	}
+
+	switch (op) {
+	case ARTBUF_IO_OPEN:
+		snprintf(fname, sizeof(fname), "%s/stage.%ld.%lu", spill_path,
+			 (long) getpid(), ++artbuf_stage_seq);
+		err = uv_fs_open(loop, &ai->ai_req, fname,
+				 O_RDWR | O_CREAT | O_EXCL, 0600, on_artbuf_io_done);
+		break;
+
+	case ARTBUF_IO_WRITE:
+		err = uv_fs_write(loop, &ai->ai_req, buf->ab_spill,
+				  data + buf->ab_hdrlen, len,
+				  buf->ab_spilled, on_artbuf_io_done);
+		break;
+
+	case ARTBUF_IO_UNLINK:
+		err = uv_fs_unlink(loop, &ai->ai_req, data, on_artbuf_io_done);
+		break;
+
+	case ARTBUF_IO_CLOSE:
+		err = uv_fs_close(loop, &ai->ai_req, buf->ab_spill,
+				  on_artbuf_io_done);
+		if (err)
+			close(buf->ab_spill);
+		buf->ab_spill = -1;
+		break;
+	}
+
+	if (err) {
+		ai->ai_req.result = err;
+		on_artbuf_io_done(&ai->ai_req);
+	}
+}
+
+static void
+on_artbuf_io_done(req)
+	uv_fs_t	*req;
+{
+artbuf_io_t	*ai = req->data;
+artbuf_t	*buf = ai->ai_buf;
+ssize_t		 ret = req->result;
+client_t	*cl;
+
+	if (buf) {
+		buf->ab_spill_reqs--;
+		buf->ab_spill_mem -= ai->ai_len;
+	}
+
+	switch (ai->ai_op) {
+	case ARTBUF_IO_OPEN:
+		buf->ab_flags &= ~AB_SPILLOPEN;
+
+		if (ret < 0) {
+			/* Not fatal; carry on in memory */
+			if (!(buf->ab_flags & AB_FREED))
+				client_log(LOG_WARNING, buf->ab_client,
+					   "%s: cannot create staging file: %s",
+					   spill_path, uv_strerror(ret));
+			buf->ab_flags |= AB_NOSPILL;
+			break;
 		}
+
+		buf->ab_spill = ret;
+		artbuf_io_start(buf, ARTBUF_IO_UNLINK, (char *) req->path, 0);
+		break;
+
+	case ARTBUF_IO_WRITE:
+		if (ret != (ssize_t) ai->ai_len &&
+		    !(buf->ab_flags & (AB_SPILLERR | AB_FREED))) {
+			client_log(LOG_WARNING, buf->ab_client,
+				   "%s: cannot write staging file: %s",
+				   buf->ab_msgid,
+				   ret < 0 ? uv_strerror(ret) : "short write");
+			buf->ab_flags |= AB_SPILLERR;
+		}
+		free(ai->ai_data);
+		break;
 	}
+
+	uv_fs_req_cleanup(req);
+	free(ai);
+
+	if (buf == NULL || buf->ab_spill_reqs)
+		return;
+
+	if (buf->ab_flags & AB_FREED) {
+		buf->ab_flags &= ~AB_FREED;
+		artbuf_free(buf);
+		return;
+	}
+
+	cl = buf->ab_client;
+	client_mem_update(cl);
+
+	if (buf->ab_flags & AB_SPILLWAIT) {
+		buf->ab_flags &= ~AB_SPILLWAIT;
+		client_takethis_done(cl);
+		if (cl->cl_state == CS_WAIT_COMMAND)
+			client_unpause(cl);
+	} else if (buf->ab_spill != -1 &&
+		   buf->ab_used - buf->ab_hdrlen >= ARTBUF_SPILL_CHUNK)
+		/* Catch up with what arrived while the file was opened */
+		artbuf_spill(buf);
+}
+
+/*
+ * Hand the body text held in memory to a staging write, leaving only the
+ * headers.  The whole buffer goes with the write, so the body isn't copied;
+ * only the headers are copied to a new buffer.  If a write fails,
+ * AB_SPILLERR is set, and the article is still read to the end, but will be
+ * refused.
+ */
+static void
+artbuf_spill(buf)
+	artbuf_t	*buf;
+{
+char	*old = buf->ab_text;
+size_t	 len = buf->ab_used - buf->ab_hdrlen;
+
+	buf->ab_alloc = buf->ab_hdrlen + ARTBUF_SPILL_CHUNK * 2;
+	buf->ab_text = xmalloc(buf->ab_alloc);
+	bcopy(old, buf->ab_text, buf->ab_hdrlen);
+	buf->ab_used = buf->ab_hdrlen;
+	buf->ab_text[buf->ab_used] = 0;
+
+	artbuf_io_start(buf, ARTBUF_IO_WRITE, old, len);
+	buf->ab_spilled += len;
+}
+
+/*
+ * Add a line of article text to the buffer.  Once an article is larger
+ * than spill-size and its headers are complete, the body is moved to an
+ * (unlinked) staging file as it arrives, so a connection only holds the
+ * headers and the last ARTBUF_SPILL_CHUNK of body in memory, plus whatever
+ * is still being written.
+ */
+void
+artbuf_append(buf, line)
+	artbuf_t	*buf;
+	char const	*line;
+{
+size_t	len = strlen(line);
+
+	if (buf->ab_flags & AB_SPILLERR)
+		return;
+
+	if (buf->ab_used + len + 3 > buf->ab_alloc) {
+		buf->ab_alloc *= 2;
+		if (buf->ab_used + len + 3 > buf->ab_alloc)
+			buf->ab_alloc = buf->ab_used + len + 3;
+		buf->ab_text = xrealloc(buf->ab_text, buf->ab_alloc);
+	}
+
+	bcopy(line, buf->ab_text + buf->ab_used, len);
+	bcopy("\r\n", buf->ab_text + buf->ab_used + len, 3);
+	buf->ab_used += len + 2;
+
+	if (len == 0 && buf->ab_hdrlen == 0)
+		buf->ab_hdrlen = buf->ab_used;
+
+	if (!spill_path || buf->ab_hdrlen == 0 ||
+	    (buf->ab_flags & (AB_NOSPILL | AB_SPILLOPEN)))
+		return;
+
+	if (buf->ab_spill == -1) {
+		if (buf->ab_used < spill_size)
+			return;
+
+		buf->ab_flags |= AB_SPILLOPEN;
+		artbuf_io_start(buf, ARTBUF_IO_OPEN, NULL, 0);
+		return;
+	}
+
+	if (buf->ab_used - buf->ab_hdrlen >= ARTBUF_SPILL_CHUNK)
+		artbuf_spill(buf);
+}
+
+/*
+ * Return the complete text of the article, reading back any part of it
+ * that was spilled, or NULL if the staging file can't be read.  If
+ * nothing was spilled this is ab_text itself; otherwise the caller must
+ * free it.  This is called from the incoming worker, once every staging
+ * write has finished.
+ */
+char *
+artbuf_text(buf)
+	artbuf_t	*buf;
+{
+char	*text, *p;
+size_t	 left;
+ssize_t	 n;
+off_t	 off = 0;
+
+	if (buf->ab_flags & AB_SPILLERR)
+		return NULL;
+
+	if (buf->ab_spill == -1)
+		return buf->ab_text;
+
+	text = xmalloc(buf->ab_spilled + buf->ab_used + 1);
+	bcopy(buf->ab_text, text, buf->ab_hdrlen);
+	p = text + buf->ab_hdrlen;
+
+	for (left = buf->ab_spilled; left; left -= n, p += n, off += n) {
+		if ((n = pread(buf->ab_spill, p, left, off)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			client_log(LOG_WARNING, buf->ab_client,
+				   "%s: cannot read staging file: %s",
+				   buf->ab_msgid,
+				   n == 0 ? "short read" : strerror(errno));
+			free(text);
+			return NULL;
+		}
+	}
+
+	bcopy(buf->ab_text + buf->ab_hdrlen, p,
+	      buf->ab_used - buf->ab_hdrlen + 1);
+	return text;
 }
 
 static void
@@ -509,6 +822,8 @@ client_t		*cl = cwr->client;
 
 	if (status == 0) {
 		client_mark_alive(cl);
+		if (!(cl->cl_flags & CL_DEAD))
+			client_mem_update(cl);
 		return;
 	}
 
@@ -565,6 +880,7 @@ client_write_req_t	*cwr;
 		bcopy(buf, nb, sz);
 		cq_append(cl->cl_wrbuf, nb, sz);
 		client_tls_write_pending(cl);
+		client_mem_update(cl);
 		return;
 	}
 #endif
@@ -579,6 +895,7 @@ client_write_req_t	*cwr;
 	wr->data = cwr;
 
 	uv_write(wr, (uv_stream_t *) cl->cl_stream, &ubuf, 1, on_client_write_done);
+	client_mem_update(cl);
 }
 
 void
@@ -636,7 +953,11 @@ client_t	*cl = handle->data;
 		client_log(LOG_DEBUG, cl, "on_client_close_done cl_buffer=%p",
 			   cl->cl_buffer);
 
-	if (!cl->cl_buffer)
+	/*
+	 * If a worker is processing the client's article, wait for it to
+	 * finish before freeing the client.
+	 */
+	if (!cl->cl_buffer || !(cl->cl_buffer->ab_flags & AB_INWORKER))
 		client_destroy(cl);
 	else
 		cl->cl_flags |= CL_DESTROY;
@@ -695,11 +1016,21 @@ msglist_t	*msg;
 	SIMPLEQ_REMOVE(&client_timeout_list, cl, client, cl_timeout_list);
 
 	if (cl->cl_buffer) {
-		free(cl->cl_buffer->ab_msgid);
-		free(cl->cl_buffer->ab_text);
-		free(cl->cl_buffer);
+		pending_abandon(cl->cl_buffer);
+		artbuf_free(cl->cl_buffer);
 	}
 
+	mem_stats.cms_used -= cl->cl_mem;
+	if (cl->cl_server)
+		cl->cl_server->se_mem -= cl->cl_mem;
+	if (cl->cl_flags & CL_THROTTLED)
+		--mem_stats.cms_throttled;
+
+	/* Freeing this client's memory may let the throttled ones go */
+	if (memory_budget && mem_stats.cms_throttled &&
+	    mem_stats.cms_used <= memory_budget - memory_budget / 4)
+		uv_timer_start(&mem_release_timer, client_mem_release, 0, 0);
+
 	pending_remove_client(cl);
 	free(cl->cl_stream);
 	free(cl->cl_username);
@@ -734,9 +1065,142 @@ client_unpause(cl)
 
 	if (cq_len(cl->cl_rdbuf))
 		client_handle_io(cl);
+
+	if ((cl->cl_flags & CL_THROTTLED) && cl->cl_state == CS_WAIT_COMMAND)
+		return;
 	uv_read_start((uv_stream_t *) cl->cl_stream, uv_alloc, on_client_read);
 }
 
+/*
+ * Recalculate the memory held by this client's buffers, and throttle or
+ * release clients if that takes us across the memory budget.  An article
+ * being processed is also counted for the worker's copies of it: the
+ * parsed article, and the text read back from the staging file if it
+ * was spilled.
+ */
+void
+client_mem_update(cl)
+	client_t	*cl;
+{
+size_t		 n;
+artbuf_t	*buf;
+
+	n = cq_used(cl->cl_rdbuf) + cl->cl_stream->write_queue_size;
+	if (buf = cl->cl_buffer) {
+		n += buf->ab_alloc + buf->ab_spill_mem;
+		if (buf->ab_flags & AB_INWORKER)
+			n += buf->ab_len * (buf->ab_spill == -1 ? 1 : 2);
+	}
+#ifdef	HAVE_OPENSSL
+	n += cq_used(cl->cl_wrbuf);
+#endif
+
+	mem_stats.cms_used += n - cl->cl_mem;
+	if (mem_stats.cms_used > mem_stats.cms_peak)
+		mem_stats.cms_peak = mem_stats.cms_used;
+
+	if (cl->cl_server) {
+		cl->cl_server->se_mem += n - cl->cl_mem;
+		if (cl->cl_server->se_mem > cl->cl_server->se_mem_peak)
+			cl->cl_server->se_mem_peak = cl->cl_server->se_mem;
+	}
+
+	cl->cl_mem = n;
+
+	if (!memory_budget)
+		return;
+
+	if (mem_stats.cms_used > memory_budget)
+		client_mem_throttle();
+	else if (mem_stats.cms_throttled &&
+		 mem_stats.cms_used <= memory_budget - memory_budget / 4)
+		/* Resuming clients may re-enter us, so do it from the loop */
+		uv_timer_start(&mem_release_timer, client_mem_release, 0, 0);
+}
+
+/*
+ * Throttle the largest unthrottled clients until the throttled clients
+ * between them hold at least the excess over the budget.  A client that
+ * is part way through an article keeps reading until it's complete, so
+ * its buffer can be freed; stopping it there would hold the memory
+ * indefinitely.
+ */
+static void
+client_mem_throttle()
+{
+uint64_t	excess = mem_stats.cms_used - memory_budget;
+
+	for (;;) {
+	client_t	*cl, *big = NULL;
+	uint64_t	 held = 0;
+
+		/* Every client is on the timeout list, authenticated or not */
+		SIMPLEQ_FOREACH(cl, &client_timeout_list, cl_timeout_list) {
+			if (cl->cl_flags & CL_THROTTLED)
+				held += cl->cl_mem;
+			else if (!(cl->cl_flags & CL_DEAD) && cl->cl_mem &&
+				 (!big || cl->cl_mem > big->cl_mem))
+				big = cl;
+		}
+
+		if (held >= excess || big == NULL)
+			return;
+
+		if (mem_stats.cms_throttled++ == 0)
+			nts_logm(CLIENT_fac, M_CLIENT_MEMHIGH,
+				 (long unsigned) mem_stats.cms_used,
+				 (long unsigned) memory_budget);
+		mem_stats.cms_throttle_events++;
+		big->cl_flags |= CL_THROTTLED;
+
+		if (DEBUG(CIO))
+			client_log(LOG_DEBUG, big, "throttled (%lu bytes)",
+				   (long unsigned) big->cl_mem);
+
+		if (big->cl_state == CS_WAIT_COMMAND &&
+		    !(big->cl_flags & CL_PAUSED))
+			uv_read_stop((uv_stream_t *) big->cl_stream);
+	}
+}
+
+static void
+client_mem_release(timer, status)
+	uv_timer_t	*timer;
+{
+client_t	*cl, *next;
+
+	if (!mem_stats.cms_throttled ||
+	    mem_stats.cms_used > memory_budget - memory_budget / 4)
+		return;
+
+	nts_logm(CLIENT_fac, M_CLIENT_MEMLOW, (long unsigned) mem_stats.cms_used,
+		 mem_stats.cms_throttled);
+
+	for (cl = SIMPLEQ_FIRST(&client_timeout_list); cl; cl = next) {
+		next = SIMPLEQ_NEXT(cl, cl_timeout_list);
+
+		if (!(cl->cl_flags & CL_THROTTLED))
+			continue;
+
+		cl->cl_flags &= ~CL_THROTTLED;
+		--mem_stats.cms_throttled;
+
+		if (cl->cl_flags & (CL_DEAD | CL_PAUSED))
+			continue;
+
+		/* Pick up where client_handle_io() stopped */
+		cl->cl_flags |= CL_PAUSED;
+		client_unpause(cl);
+	}
+}
+
+void
+client_get_mem_stats(cms)
+	client_mem_stats_t	*cms;
+{
+	bcopy(&mem_stats, cms, sizeof(*cms));
+}
+
 static void
 client_mark_alive(cl)
 	client_t	*cl;
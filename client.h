@@ -39,21 +39,53 @@ struct article;
  */
 #define	ARTBUF_START_SIZE	8192
 
+/*
+ * Once an article is being spilled to a staging file, body text is
+ * written out whenever this much has accumulated in memory.
+ */
+#define	ARTBUF_SPILL_CHUNK	(64 * 1024)
+
 typedef enum ab_type {
 	AB_IHAVE,
 	AB_TAKETHIS
 } ab_type_t;
 
 struct client;
+struct history_resv;
+
+#define	AB_DUPLICATE	0x01	/* Already in the history when offered */
+#define	AB_WAITING	0x02	/* Another copy is in flight; wait for it */
+#define	AB_COMPLETE	0x04	/* Whole article has been received */
+#define	AB_COMMITTED	0x08	/* History reservation was committed */
+#define	AB_INWORKER	0x10	/* Being processed by a worker thread */
+#define	AB_NOSPILL	0x20	/* Couldn't create a staging file */
+#define	AB_SPILLERR	0x40	/* Writing the staging file failed */
+#define	AB_BUSY		0x80	/* In flight and couldn't wait; try again */
+#define	AB_SPILLOPEN	0x100	/* Staging file is being created */
+#define	AB_SPILLWAIT	0x200	/* Complete; waiting for staging writes */
+#define	AB_FREED	0x400	/* Freed while staging I/O was running */
+
 typedef struct artbuf {
 	char		*ab_text;
 	size_t		 ab_alloc;
-	size_t		 ab_len;
+	size_t		 ab_used;	/* Bytes in ab_text */
+	size_t		 ab_len;	/* Bytes received */
+	size_t		 ab_hdrlen;	/* Header length, once known */
+	int		 ab_spill;	/* Staging file, or -1 */
+	uint64_t	 ab_spilled;	/* Body bytes in the staging file */
+	int		 ab_spill_reqs;	/* Staging requests running */
+	size_t		 ab_spill_mem;	/* Memory held by those requests */
 	char		*ab_msgid;
 	int		 ab_flags;
 	struct client	*ab_client;
 	ab_type_t	 ab_type;
 	int		 ab_status;
+	struct history_resv
+			*ab_resv;
+	struct pending	*ab_pending;
+
+	TAILQ_ENTRY(artbuf)
+			 ab_waitq;
 } artbuf_t;
 
 typedef struct msglist {
@@ -84,6 +116,7 @@ typedef enum client_state {
 #define	CL_SSL_ACPTING	0x080	/* SSL_accept() in progress */
 #define	CL_SSL_SHUTDN	0x100	/* SSL_shutdown() in progress */
 #define	CL_DESTROY	0x200
+#define	CL_THROTTLED	0x400	/* Over memory budget; stop reading */
 
 typedef enum {
 	SSL_NEVER = 0,
@@ -119,6 +152,7 @@ typedef struct client {
 	listener_t	*cl_listener;
 	artbuf_t	*cl_buffer;
 	uint64_t	 cl_lastalive;
+	size_t		 cl_mem;	/* Bytes held in buffers */
 
 	charq_t		*cl_rdbuf;
 
@@ -145,6 +179,27 @@ int	client_run(void);
 
 void	client_incoming_reply(client_t *, artbuf_t *);
 
+/*
+ * Memory held by incoming clients' buffers.  If memory-budget is set and
+ * this goes over it, the largest clients are throttled: they stop reading
+ * once their current article is complete, until usage falls to 3/4 of
+ * the budget.
+ */
+typedef struct client_mem_stats {
+	uint64_t	cms_used;
+	uint64_t	cms_peak;
+	int		cms_throttled;		/* Clients throttled now */
+	uint64_t	cms_throttle_events;	/* Times a client was throttled */
+} client_mem_stats_t;
+
+void	client_mem_update(client_t *);
+void	client_get_mem_stats(client_mem_stats_t *);
+
+artbuf_t	*artbuf_new(client_t *, char const *msgid, ab_type_t);
+void		 artbuf_free(artbuf_t *);
+void		 artbuf_append(artbuf_t *, char const *line);
+char		*artbuf_text(artbuf_t *);
+
 /*
  * Internal functions.
  */
@@ -155,6 +210,7 @@ void	 client_logm(msg_t fac[], int msg, client_t *, ...);
 
 extern	config_schema_stanza_t listen_stanza;
 int	client_listen(void);
+void	client_listen_start(void);
 
 #ifdef	HAVE_OPENSSL
 void	 client_accept(uv_tcp_t *, SSL_CTX *, listener_t *);
@@ -164,10 +220,22 @@ void	 client_accept(uv_tcp_t *, listener_t *);
 void	 client_close(client_t *, int);
 void	 client_destroy(client_t *);
 
+/*
+ * The pending list tracks articles which are in flight: offered with
+ * CHECK and not yet sent, or currently being received with IHAVE or
+ * TAKETHIS.  Later TAKETHIS copies of an in-flight article wait for the
+ * first copy to resolve instead of being processed themselves.
+ */
+#define	PENDING_OWNER		0	/* Caller should receive the article */
+#define	PENDING_WAIT		1	/* Another copy is in flight */
+#define	PENDING_BUSY		2	/* In flight and caller can't wait */
+#define	PENDING_DUPLICATE	3	/* Already in the history */
+
 void	 pending_init(void);
-int	 pending_check(char const *msgid);
-void	 pending_add(client_t *, char const *msgid);
-void	 pending_remove(char const *msgid);
+void	 pending_add(client_t *, char const *msgid, struct history_resv *);
+int	 pending_begin(client_t *, artbuf_t *, int canwait);
+void	 pending_done(artbuf_t *, int committed);
+void	 pending_abandon(artbuf_t *);
 void	 pending_remove_client(client_t *);
 
 void	 client_reader(client_t *);
@@ -78,6 +78,15 @@ char	*type;
 					    strcmp(client->cl_username,
 						   se->se_username_in) == 0) {
 						client->cl_server = se;
+						/*
+						 * Pipelined input may already be
+						 * counted in cl_mem; charge it to
+						 * the peer too, or client_destroy
+						 * will take back more than was given.
+						 */
+						se->se_mem += client->cl_mem;
+						if (se->se_mem > se->se_mem_peak)
+							se->se_mem_peak = se->se_mem;
 						break;
 					}
 				}
@@ -17,7 +17,8 @@ c_check(client, cmd, line)
 	client_t	*client;
 	char		*cmd, *line;
 {
-char	*msgid;
+char		*msgid;
+history_resv_t	*resv;
 
 	if ((msgid = next_word(&line)) == NULL || next_word(&line)) {
 		client_printf(client, "501 Syntax: CHECK <message-id>\r\n");
@@ -35,17 +36,33 @@ char	*msgid;
 		return;
 	}
 
-	if (pending_check(msgid)) {
-		++client->cl_server->se_in_deferred;
-		client_printf(client, "431 %s\r\n", msgid);
+	/*
+	 * Without defer-pending, there's no need to reserve the article
+	 * until it's actually sent.
+	 */
+	if (!defer_pending) {
+		if (history_check(msgid)) {
+			++client->cl_server->se_in_refused;
+			client_printf(client, "438 %s\r\n", msgid);
+		} else
+			client_printf(client, "238 %s\r\n", msgid);
 		return;
 	}
 
-	if (history_check(msgid)) {
+	switch (history_reserve(msgid, &resv)) {
+	case HISTORY_BUSY:
+		++client->cl_server->se_in_deferred;
+		client_printf(client, "431 %s\r\n", msgid);
+		break;
+
+	case HISTORY_PRESENT:
 		++client->cl_server->se_in_refused;
 		client_printf(client, "438 %s\r\n", msgid);
-	} else {
+		break;
+
+	case HISTORY_RESERVED:
 		client_printf(client, "238 %s\r\n", msgid);
-		pending_add(client, msgid);
+		pending_add(client, msgid, resv);
+		break;
 	}
 }
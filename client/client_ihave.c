@@ -32,12 +32,6 @@ artbuf_t	*buf;
 		return;
 	}
 
-	if (pending_check(msgid)) {
-		client->cl_server->se_in_deferred++;
-		client_printf(client, "436 %s Try again later.\r\n", msgid);
-		return;
-	}
-
 	if (!server_accept_offer(client->cl_server, msgid)) {
 		client->cl_server->se_in_rejected++;
 		client_printf(client, "435 %s Don't want it.\r\n", msgid);
@@ -45,24 +39,25 @@ artbuf_t	*buf;
 		return;
 	}
 
-	if (history_check(msgid)) {
+	buf = artbuf_new(client, msgid, AB_IHAVE);
+
+	switch (pending_begin(client, buf, 0)) {
+	case PENDING_BUSY:
+		client->cl_server->se_in_deferred++;
+		client_printf(client, "436 %s Try again later.\r\n", msgid);
+		artbuf_free(buf);
+		return;
+
+	case PENDING_DUPLICATE:
 		client->cl_server->se_in_refused++;
 		client_printf(client, "435 %s Already got it.\r\n", msgid);
 		log_article(msgid, NULL, client->cl_server, '-', "duplicate");
-	} else {
-		pending_add(client, msgid);
-
-		buf = xcalloc(1, sizeof(*buf));
-		buf->ab_msgid = xstrdup(msgid);
-		buf->ab_alloc = ARTBUF_START_SIZE;
-		buf->ab_text = xmalloc(buf->ab_alloc);
-		buf->ab_text[0] = 0;
-		buf->ab_client = client;
-		buf->ab_type = AB_IHAVE;
+		artbuf_free(buf);
+		return;
+	}
 
-		client->cl_buffer = buf;
-		client->cl_state = CS_IHAVE;
+	client->cl_buffer = buf;
+	client->cl_state = CS_IHAVE;
 
-		client_printf(client, "335 %s OK, send it.\r\n", msgid);
-	}
+	client_printf(client, "335 %s OK, send it.\r\n", msgid);
 }
@@ -258,13 +258,6 @@ int		 err;
 				return -1;
 			}
 
-			if (err = uv_listen((uv_stream_t *) uv, 128, on_connect)) {
-				nts_logm(CLIENT_fac, M_CLIENT_LSNFAIL,
-					 li->li_address, "uv_listen",
-					 uv_strerror(err));
-				return -1;
-			}
-
 			uv->data = li;
 		}
 
@@ -274,6 +267,30 @@ int		 err;
 	return 0;
 }
 
+/*
+ * Start accepting connections on the listeners created by client_listen.
+ * This is separate so the sockets can be bound before dropping privileges,
+ * but not accept connections until we're ready to handle them.
+ */
+void
+client_listen_start()
+{
+listener_t	*li;
+int		 i, err;
+
+	for (li = client_listeners; li; li = li->li_next) {
+		for (i = 0; i < li->li_nuv; i++) {
+			if (err = uv_listen((uv_stream_t *) &li->li_uv[i], 128,
+					    on_connect)) {
+				nts_logm(CLIENT_fac, M_CLIENT_LSNFAIL,
+					 li->li_address, "uv_listen",
+					 uv_strerror(err));
+				panic("nts: cannot start listeners");
+			}
+		}
+	}
+}
+
 static void
 on_connect(server, status)
 	uv_stream_t	*server;
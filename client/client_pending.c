@@ -8,52 +8,208 @@
  * warranty.
  */
 
+#include	<assert.h>
+
 #include	"client.h"
 #include	"queue.h"
 #include	"hash.h"
+#include	"history.h"
+#include	"server.h"
+
+/*
+ * An in-flight article.  pe_buf is set once the article is actually being
+ * received; until then the entry only records a CHECK, and holds the
+ * history reservation made by it.  Once receiving, the reservation
+ * belongs to pe_buf.
+ */
+typedef struct pending {
+	char		*pe_msgid;
+	client_t	*pe_client;
+	artbuf_t	*pe_buf;
+	history_resv_t	*pe_resv;
+
+	TAILQ_HEAD(, artbuf)
+			 pe_waiters;
+} pending_t;
 
 static hash_table_t	*pending_list;
 
+static pending_t	*pending_new(client_t *, char const *, history_resv_t *);
+static void		 pending_resume(artbuf_t *);
+
 void
 pending_init(void)
 {
-	if (!defer_pending)
-		return;
+	pending_list = hash_new(1024, NULL, NULL, NULL);
+}
 
-	pending_list = hash_new(128, NULL, NULL, NULL);
+static pending_t *
+pending_new(client, msgid, resv)
+	client_t	*client;
+	char const	*msgid;
+	history_resv_t	*resv;
+{
+pending_t	*pe;
+
+	pe = xcalloc(1, sizeof(*pe));
+	pe->pe_msgid = xstrdup(msgid);
+	pe->pe_client = client;
+	pe->pe_resv = resv;
+	TAILQ_INIT(&pe->pe_waiters);
+
+	hash_insert(pending_list, msgid, strlen(msgid), pe);
+	return pe;
 }
 
 void
-pending_add(client, msgid)
+pending_add(client, msgid, resv)
 	client_t	*client;
 	char const	*msgid;
+	history_resv_t	*resv;
 {
-	if (!defer_pending)
+	if (hash_find(pending_list, msgid, strlen(msgid))) {
+		history_cancel(resv);
 		return;
+	}
 
-	hash_insert(pending_list, msgid, strlen(msgid), client);
+	pending_new(client, msgid, resv);
 }
 
 int
-pending_check(msgid)
-	char const	*msgid;
+pending_begin(client, buf, canwait)
+	client_t	*client;
+	artbuf_t	*buf;
 {
-	if (!defer_pending)
-		return 0;
+pending_t	*pe;
+hash_item_t	*ie;
+char const	*msgid = buf->ab_msgid;
+
+	if (ie = hash_find(pending_list, msgid, strlen(msgid))) {
+		pe = ie->hi_data;
+
+		/*
+		 * Only CHECKed so far; whoever actually sends the article
+		 * first takes over the reservation.
+		 */
+		if (pe->pe_buf == NULL) {
+			buf->ab_resv = pe->pe_resv;
+			buf->ab_pending = pe;
+			pe->pe_resv = NULL;
+			pe->pe_client = client;
+			pe->pe_buf = buf;
+			return PENDING_OWNER;
+		}
+
+		if (!canwait || pe->pe_client == client)
+			return PENDING_BUSY;
+
+		buf->ab_flags |= AB_WAITING;
+		buf->ab_pending = pe;
+		TAILQ_INSERT_TAIL(&pe->pe_waiters, buf, ab_waitq);
+		return PENDING_WAIT;
+	}
 
-	return hash_find(pending_list, msgid, strlen(msgid)) != NULL;
+	switch (history_reserve(msgid, &buf->ab_resv)) {
+	case HISTORY_PRESENT:
+		return PENDING_DUPLICATE;
+	case HISTORY_BUSY:
+		return PENDING_BUSY;
+	}
+
+	pe = pending_new(client, msgid, NULL);
+	pe->pe_buf = buf;
+	buf->ab_pending = pe;
+	return PENDING_OWNER;
 }
 
+/*
+ * The article being received for this entry has been resolved.  If it
+ * went into the history, every waiting copy is a duplicate; otherwise,
+ * the waiting copies try again, and the first becomes the new owner.
+ */
 void
-pending_remove(msgid)
-	char const	*msgid;
+pending_done(buf, committed)
+	artbuf_t	*buf;
+{
+pending_t	*pe = buf->ab_pending;
+artbuf_t	*wbuf;
+
+	if (pe == NULL)
+		return;
+
+	assert(pe->pe_buf == buf);
+	buf->ab_pending = NULL;
+	hash_remove(pending_list, pe->pe_msgid, strlen(pe->pe_msgid));
+
+	while (wbuf = TAILQ_FIRST(&pe->pe_waiters)) {
+		TAILQ_REMOVE(&pe->pe_waiters, wbuf, ab_waitq);
+		wbuf->ab_pending = NULL;
+		wbuf->ab_flags &= ~AB_WAITING;
+
+		if (committed) {
+			wbuf->ab_flags |= AB_DUPLICATE;
+		} else {
+			switch (pending_begin(wbuf->ab_client, wbuf, 1)) {
+			case PENDING_WAIT:
+				continue;
+			case PENDING_DUPLICATE:
+				wbuf->ab_flags |= AB_DUPLICATE;
+				break;
+			case PENDING_BUSY:
+				wbuf->ab_flags |= AB_BUSY;
+				break;
+			}
+		}
+
+		if (wbuf->ab_flags & AB_COMPLETE)
+			pending_resume(wbuf);
+	}
+
+	free(pe->pe_msgid);
+	free(pe);
+}
+
+/*
+ * A waiting article whose body was already complete can now be handled.
+ */
+static void
+pending_resume(buf)
+	artbuf_t	*buf;
+{
+client_t	*cl = buf->ab_client;
+
+	client_takethis_done(cl);
+	if (cl->cl_state == CS_WAIT_COMMAND)
+		client_unpause(cl);
+}
+
+/*
+ * The client receiving this article has gone away.
+ */
+void
+pending_abandon(buf)
+	artbuf_t	*buf;
 {
-	if (!defer_pending)
+	if (buf->ab_resv) {
+		history_cancel(buf->ab_resv);
+		buf->ab_resv = NULL;
+	}
+
+	if (buf->ab_pending == NULL)
+		return;
+
+	if (buf->ab_flags & AB_WAITING) {
+		TAILQ_REMOVE(&buf->ab_pending->pe_waiters, buf, ab_waitq);
+		buf->ab_pending = NULL;
 		return;
+	}
 
-	hash_remove(pending_list, msgid, strlen(msgid));
+	pending_done(buf, 0);
 }
 
+/*
+ * Drop any CHECKs the client made but didn't send.
+ */
 void
 pending_remove_client(client)
 	client_t	*client;
@@ -61,16 +217,19 @@ pending_remove_client(client)
 hash_item_t	*ie, *next;
 size_t		 i;
 
-	if (!defer_pending)
-		return;
-
 	for (i = 0; i < pending_list->ht_nbuckets; i++) {
 		LIST_FOREACH_SAFE(ie, &pending_list->ht_buckets[i], hi_link, next) {
-			if (ie->hi_data == client) {
-				LIST_REMOVE(ie, hi_link);
-				free(ie->hi_key);
-				free(ie);
-			}
+		pending_t	*pe = ie->hi_data;
+
+			if (pe->pe_client != client || pe->pe_buf)
+				continue;
+
+			LIST_REMOVE(ie, hi_link);
+			history_cancel(pe->pe_resv);
+			free(pe->pe_msgid);
+			free(pe);
+			free(ie->hi_key);
+			free(ie);
 		}
 	}
 }
@@ -36,13 +36,30 @@ artbuf_t	*buf;
 		return;
 	}
 
-	buf = xcalloc(1, sizeof(*buf));
-	buf->ab_msgid = xstrdup(msgid);
-	buf->ab_alloc = ARTBUF_START_SIZE;
-	buf->ab_text = xmalloc(buf->ab_alloc);
-	buf->ab_text[0] = 0;
-	buf->ab_client = client;
-	buf->ab_type = AB_TAKETHIS;
+	buf = artbuf_new(client, msgid, AB_TAKETHIS);
+
+	/*
+	 * Register the article as in flight now, so a duplicate can be
+	 * rejected as soon as the body has been read, without parsing it.
+	 * If another peer is already sending the same article, this copy
+	 * waits for that one to finish, then is either rejected or
+	 * processed depending on how the first copy went.
+	 */
+	if (valid_msgid(msgid)) {
+		switch (pending_begin(client, buf, 1)) {
+		case PENDING_WAIT:
+			client->cl_server->se_in_inflight++;
+			break;
+
+		case PENDING_BUSY:
+			buf->ab_flags |= AB_BUSY;
+			break;
+
+		case PENDING_DUPLICATE:
+			buf->ab_flags |= AB_DUPLICATE;
+			break;
+		}
+	}
 
 	client->cl_buffer = buf;
 	client->cl_state = CS_TAKETHIS;
@@ -56,13 +73,63 @@ int		 rejected = (client->cl_state == CS_TAKETHIS) ? 439 : 437;
 artbuf_t	*buf = client->cl_buffer;
 msglist_t	*msg;
 
-#if 0
-	pending_remove(client->cl_msgid);
-#endif
+	/* on_artbuf_io_done() calls us again once the staging file is written */
+	if (buf->ab_spill_reqs) {
+		buf->ab_flags |= AB_SPILLWAIT;
+		client_pause(client);
+		return;
+	}
+
+	/*
+	 * The article was in flight but we couldn't wait for it when it was
+	 * offered.  That copy may have finished while the body was being
+	 * read, so try again.  It's not a duplicate yet, so 439 would lose
+	 * the article if the other copy fails; if it's still busy, the only
+	 * retryable answer TAKETHIS has is to drop the connection.
+	 */
+	if (buf->ab_flags & AB_BUSY) {
+		buf->ab_flags &= ~AB_BUSY;
+
+		switch (pending_begin(client, buf, 1)) {
+		case PENDING_WAIT:
+			client->cl_server->se_in_inflight++;
+			break;
+
+		case PENDING_DUPLICATE:
+			buf->ab_flags |= AB_DUPLICATE;
+			break;
+
+		case PENDING_BUSY:
+			client->cl_server->se_in_deferred++;
+			client_log(LOG_INFO, client, "disconnected (%s in flight)",
+				   buf->ab_msgid);
+			client_printf(client, "400 %s in flight, try again later\r\n",
+				      buf->ab_msgid);
+			client_close(client, 1);
+			goto err;
+		}
+	}
+
+	if (buf->ab_flags & AB_WAITING) {
+		buf->ab_flags |= AB_COMPLETE;
+		client_pause(client);
+		return;
+	}
+
+	if (buf->ab_flags & AB_DUPLICATE) {
+		client->cl_server->se_in_refused++;
+		client_printf(client, "%d %s\r\n", rejected, buf->ab_msgid);
+		log_article(buf->ab_msgid, NULL, client->cl_server, '-', "duplicate");
+		goto err;
+	}
 
 	if (buf->ab_len > max_article_size) {
 		client->cl_server->se_in_rejected++;
-		history_add(buf->ab_msgid);
+		if (buf->ab_resv) {
+			history_commit(buf->ab_resv);
+			buf->ab_resv = NULL;
+			buf->ab_flags |= AB_COMMITTED;
+		}
 		client_log(LOG_INFO, client, "%s: too large (%d > %d)",
 				buf->ab_msgid,
 				(int) buf->ab_len,
@@ -85,14 +152,18 @@ msglist_t	*msg;
 
 	client_pause(client);
 	process_article(client, buf);
+	client_mem_update(client);
 
 	return;
 
 err:
-	free(buf->ab_text);
-	free(buf->ab_msgid);
-	free(buf);
+	if (buf->ab_resv)
+		history_cancel(buf->ab_resv);
+	pending_done(buf, buf->ab_flags & AB_COMMITTED);
+	artbuf_free(buf);
+	client->cl_buffer = NULL;
 	client->cl_state = CS_WAIT_COMMAND;
+	client_mem_update(client);
 	return;
 }
 
@@ -102,16 +173,36 @@ client_incoming_reply(cl, bufs)
 	artbuf_t	*bufs;
 {
 artbuf_t	*buf = cl->cl_buffer;
+int		 closing = 0;
 
 	if (DEBUG(CIO))
 		client_log(LOG_DEBUG, cl, "got process reply");
 
+	pending_done(buf, buf->ab_flags & AB_COMMITTED);
+
 	if (cl->cl_flags & CL_DESTROY) {
 		client_destroy(cl);
 		return;
 	}
 
-	if (buf->ab_status == IN_OK)
+	/*
+	 * A staging error is local and transient, so the peer must offer
+	 * the article again.  TAKETHIS has no deferral code, so do what we
+	 * do for an article still in flight and disconnect.
+	 */
+	if (buf->ab_status == IN_ERR_STAGING) {
+		cl->cl_server->se_in_deferred++;
+		if (buf->ab_type == AB_TAKETHIS) {
+			client_log(LOG_INFO, cl, "disconnected (%s staging error)",
+				   buf->ab_msgid);
+			client_printf(cl, "400 %s staging error, try again later\r\n",
+				      buf->ab_msgid);
+			client_close(cl, 1);
+			closing = 1;
+		} else
+			client_printf(cl, "436 %s Try again later.\r\n",
+				      buf->ab_msgid);
+	} else if (buf->ab_status == IN_OK)
 		client_printf(cl, "%d %s\r\n",
 			      (buf->ab_type == AB_TAKETHIS) ? 239 : 235,
 			      buf->ab_msgid);
@@ -120,11 +211,11 @@ artbuf_t	*buf = cl->cl_buffer;
 			      (buf->ab_type == AB_TAKETHIS) ? 439 : 437,
 			      buf->ab_msgid);
 
-	free(cl->cl_buffer->ab_msgid);
-	free(cl->cl_buffer->ab_text);
-	free(cl->cl_buffer);
+	artbuf_free(cl->cl_buffer);
 	cl->cl_buffer = NULL;
 
 	cl->cl_state = CS_WAIT_COMMAND;
-	client_unpause(cl);
+	client_mem_update(cl);
+	if (!closing)
+		client_unpause(cl);
 }
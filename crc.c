@@ -33,6 +33,8 @@
 
 #include        <inttypes.h>
 
+#include	<uv.h>
+
 #include        "crc.h"
 
 static uint64_t const crc_table[256] = { 
@@ -166,15 +168,64 @@ static uint64_t const crc_table[256] = {
 	0xD80C07CD676F8394ULL, 0x9AFCE626CE85B507ULL 
 };
 
+/*
+ * Tables for computing the CRC eight bytes at a time: crc_slice[k][i] is the
+ * CRC of byte i followed by k zero bytes.  crc_slice[0] is crc_table.
+ */
+static uint64_t	 crc_slice[8][256];
+static uv_once_t crc_slice_once = UV_ONCE_INIT;
+
+static void
+crc_slice_init(void)
+{
+int	i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc_slice[0][i] = crc_table[i];
+		for (k = 1; k < 8; k++)
+			crc_slice[k][i] = crc_table[crc_slice[k - 1][i] >> 56] ^
+					  (crc_slice[k - 1][i] << 8);
+	}
+}
+
 uint64_t
 crc64(data, len)
 	void const      *data;
 	size_t           len;
 {
-uint64_t		 crc;
+	return crc64_update(0, data, len);
+}
+
+uint64_t
+crc64_update(crc, data, len)
+	uint64_t	 crc;
+	void const      *data;
+	size_t           len;
+{
 unsigned char const	*cdata = data;
 
-	crc = 0xffffffffffffffffULL;
+	uv_once(&crc_slice_once, crc_slice_init);
+
+	crc ^= 0xffffffffffffffffULL;
+
+	while (len >= 8) {
+		crc ^=	  ((uint64_t) cdata[0] << 56) | ((uint64_t) cdata[1] << 48)
+			| ((uint64_t) cdata[2] << 40) | ((uint64_t) cdata[3] << 32)
+			| ((uint64_t) cdata[4] << 24) | ((uint64_t) cdata[5] << 16)
+			| ((uint64_t) cdata[6] <<  8) | ((uint64_t) cdata[7] <<  0);
+
+		crc =	  crc_slice[7][(crc >> 56) & 0xFF]
+			^ crc_slice[6][(crc >> 48) & 0xFF]
+			^ crc_slice[5][(crc >> 40) & 0xFF]
+			^ crc_slice[4][(crc >> 32) & 0xFF]
+			^ crc_slice[3][(crc >> 24) & 0xFF]
+			^ crc_slice[2][(crc >> 16) & 0xFF]
+			^ crc_slice[1][(crc >>  8) & 0xFF]
+			^ crc_slice[0][(crc >>  0) & 0xFF];
+
+		cdata += 8;
+		len -= 8;
+	}
 
 	while (len--) {
 	int     tab_index = ((int) (crc >> 56) ^ *cdata++) & 0xFF;
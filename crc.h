@@ -16,4 +16,10 @@
 
 uint64_t	crc64(void const *, size_t);
 
+/*
+ * Continue a CRC over more data: crc64_update(crc64(a, alen), b, blen) is
+ * the CRC of a followed by b.  crc64_update(0, ...) is crc64().
+ */
+uint64_t	crc64_update(uint64_t, void const *, size_t);
+
 #endif	/* !NTS_CRC64_H */
@@ -22,6 +22,9 @@
 #include	"ctl.h"
 #include	"server.h"
 #include	"feeder.h"
+#include	"history.h"
+#include	"database.h"
+#include	"spool.h"
 #include	"auth.h"
 #include	"charq.h"
 #include	"log.h"
@@ -50,6 +53,10 @@ static void	 ctl_do_peer_stats(ctl_client_t *);
 static void	 ctl_do_filter_stats(ctl_client_t *);
 static void	 ctl_do_client_stats(ctl_client_t *);
 static void	 ctl_do_feeder_stats(ctl_client_t *);
+static void	 ctl_do_history_stats(ctl_client_t *);
+static void	 ctl_do_db_stats(ctl_client_t *);
+static void	 ctl_do_spool_stats(ctl_client_t *);
+static void	 ctl_do_memory_stats(ctl_client_t *);
 
 static char	*get_uptime(void);
 
@@ -181,6 +188,18 @@ char		*cmd;
 	} else if (strcmp(cmd, "feeder") == 0) {
 		ctl_printf(ctl, "OK\n");
 		ctl_do_feeder_stats(ctl);
+	} else if (strcmp(cmd, "database") == 0) {
+		ctl_printf(ctl, "OK\n");
+		ctl_do_db_stats(ctl);
+	} else if (strcmp(cmd, "spool") == 0) {
+		ctl_printf(ctl, "OK\n");
+		ctl_do_spool_stats(ctl);
+	} else if (strcmp(cmd, "history") == 0) {
+		ctl_printf(ctl, "OK\n");
+		ctl_do_history_stats(ctl);
+	} else if (strcmp(cmd, "memory") == 0) {
+		ctl_printf(ctl, "OK\n");
+		ctl_do_memory_stats(ctl);
 	} else if (strcmp(cmd, "uptime") == 0) {
 		ctl_printf(ctl, "OK\n%s\n", get_uptime());
 	} else if (strcmp(cmd, "shutdown") == 0) {
@@ -200,6 +219,14 @@ char		*cmd;
 		ctl_do_client_stats(ctl);
 		ctl_printf(ctl, "\n");
 		ctl_do_filter_stats(ctl);
+		ctl_printf(ctl, "\n");
+		ctl_do_history_stats(ctl);
+		ctl_printf(ctl, "\n");
+		ctl_do_db_stats(ctl);
+		ctl_printf(ctl, "\n");
+		ctl_do_spool_stats(ctl);
+		ctl_printf(ctl, "\n");
+		ctl_do_memory_stats(ctl);
 	} else
 		ctl_printf(ctl, "ERR Unknown control command\n");
 
@@ -430,6 +457,8 @@ int		 nservers = 0;
 				se->se_out_deferred, se->se_out_deferred_persec,
 				se->se_out_refused, se->se_out_refused_persec,
 				se->se_out_rejected, se->se_out_rejected_persec);
+		ctl_printf(ctl, "      in-flight duplicates %"PRIu64"\n",
+				se->se_in_inflight);
 		ctl_printf(ctl, "\n");
 
 		t_in_a += se->se_in_accepted;
@@ -554,6 +583,8 @@ int		 donehdr = 0;
 				strcat(s, "dead,");
 			if (client->cl_flags & CL_FREE)
 				strcat(s, "free,");
+			if (client->cl_flags & CL_THROTTLED)
+				strcat(s, "throttled,");
 			if (s[0])
 				s[strlen(s) - 2] = 0;
 			else
@@ -561,12 +592,14 @@ int		 donehdr = 0;
 
 			if (!donehdr) {
 				donehdr = 1;
-				ctl_printf(ctl, "%-40s %-4s %s\n", "client", "ssl", "state");
+				ctl_printf(ctl, "%-40s %-4s %8s %s\n", "client", "ssl",
+						"mem (KB)", "state");
 			}
 
-			ctl_printf(ctl, "%-40s %-4s %s\n",
+			ctl_printf(ctl, "%-40s %-4s %8lu %s\n",
 					client->cl_strname,
 					client->cl_flags & CL_SSL ? "y" : "-",
+					(long unsigned) client->cl_mem / 1024,
 					s);
 		}
 	}
@@ -575,6 +608,176 @@ int		 donehdr = 0;
 		ctl_printf(ctl, "(no incoming connections)\n");
 }
 
+void
+ctl_do_history_stats(ctl)
+	ctl_client_t	*ctl;
+{
+history_part_info_t	*parts;
+int			 nparts, i;
+uint64_t		 t_entries = 0, t_bytes = 0;
+
+	nparts = history_get_partitions(&parts);
+
+	ctl_printf(ctl, "%-26s %-16s %-16s %12s %10s\n",
+			"partition", "start", "end", "entries", "size (KB)");
+
+	for (i = 0; i < nparts; i++) {
+	history_part_info_t	*hi = &parts[i];
+	char			 start[32], end[32];
+
+		if (hi->hpi_start)
+			strftime(start, sizeof(start), "%Y-%m-%d %H:%M",
+				 localtime(&hi->hpi_start));
+		else
+			strcpy(start, "-");
+		strftime(end, sizeof(end), "%Y-%m-%d %H:%M",
+			 localtime(&hi->hpi_end));
+
+		ctl_printf(ctl, "%-26s %-16s %-16s %12"PRIu64" %10"PRIu64"\n",
+				hi->hpi_name, start, end,
+				hi->hpi_entries, hi->hpi_bytes / 1024);
+
+		t_entries += hi->hpi_entries;
+		t_bytes += hi->hpi_bytes;
+	}
+
+	ctl_printf(ctl, "%-26s %-16s %-16s %12"PRIu64" %10"PRIu64"\n",
+			"TOTAL", "", "", t_entries, t_bytes / 1024);
+	free(parts);
+}
+
+void
+ctl_do_db_stats(ctl)
+	ctl_client_t	*ctl;
+{
+db_stats_t	ds;
+uint64_t	nckp;
+int		i;
+static char const *const which[] = { "normal", "checkpoint" };
+
+	db_get_stats(&ds);
+	nckp = ds.ds_ckp_count[DB_CKP_LOG] + ds.ds_ckp_count[DB_CKP_DIRTY]
+	     + ds.ds_ckp_count[DB_CKP_TIME];
+
+	ctl_printf(ctl, "cache dirty: %d%%  log since checkpoint: %"PRIu64" KB"
+			"  trickle writes: %"PRIu64" pages\n",
+			ds.ds_dirty_pct, ds.ds_log_since_ckp / 1024,
+			ds.ds_trickle_pages);
+
+	ctl_printf(ctl, "checkpoints: %"PRIu64" (log %"PRIu64", dirty %"PRIu64
+			", time %"PRIu64")%s\n",
+			nckp, ds.ds_ckp_count[DB_CKP_LOG],
+			ds.ds_ckp_count[DB_CKP_DIRTY],
+			ds.ds_ckp_count[DB_CKP_TIME],
+			ds.ds_in_checkpoint ? " [running]" : "");
+
+	if (nckp)
+		ctl_printf(ctl, "checkpoint time: last %.3fs  avg %.3fs  max %.3fs"
+				"  (last at %s",
+				ds.ds_ckp_last_usec / 1e6,
+				ds.ds_ckp_total_usec / 1e6 / nckp,
+				ds.ds_ckp_max_usec / 1e6,
+				ctime(&ds.ds_ckp_last));
+
+	ctl_printf(ctl, "\n%-12s %12s %12s %12s\n",
+			"txn latency", "count", "avg (ms)", "max (ms)");
+	for (i = 0; i < 2; i++)
+		ctl_printf(ctl, "%-12s %12"PRIu64" %12.3f %12.3f\n",
+				which[i], ds.ds_txn_count[i],
+				ds.ds_txn_count[i] ?
+				  ds.ds_txn_usec[i] / 1e3 / ds.ds_txn_count[i] : 0.,
+				ds.ds_txn_max_usec[i] / 1e3);
+}
+
+void
+ctl_do_spool_stats(ctl)
+	ctl_client_t	*ctl;
+{
+spool_stats_t	st;
+int		i;
+
+	spool_get_stats(&st);
+
+	ctl_printf(ctl, "spool writes: %"PRIu64" articles, %"PRIu64" KB in %"PRIu64
+			" batches (avg %.1f, max %"PRIu64")\n",
+			st.sst_articles, st.sst_bytes / 1024, st.sst_batches,
+			st.sst_batches ?
+			  (double) st.sst_articles / st.sst_batches : 0.,
+			st.sst_max_batch);
+
+	if (st.sst_batches)
+		ctl_printf(ctl, "sync time: avg %.3fms  max %.3fms\n",
+				st.sst_sync_usec / 1e3 / st.sst_batches,
+				st.sst_sync_max_usec / 1e3);
+
+	if (st.sst_rotations)
+		ctl_printf(ctl, "rotations: %"PRIu64" (%"PRIu64" stalled)  max %.3fms\n",
+				st.sst_rotations, st.sst_rotate_stalls,
+				st.sst_rotate_max_usec / 1e3);
+
+	if (st.sst_cache_size)
+		ctl_printf(ctl, "article cache: %"PRIu64" articles, %"PRIu64"/%"PRIu64
+				" KB; %"PRIu64" hits, %"PRIu64" misses (%.1f%%), "
+				"%"PRIu64" evictions\n",
+				st.sst_cache_entries, st.sst_cache_used / 1024,
+				st.sst_cache_size / 1024,
+				st.sst_cache_hits, st.sst_cache_misses,
+				(st.sst_cache_hits + st.sst_cache_misses) ?
+				  100. * st.sst_cache_hits /
+				  (st.sst_cache_hits + st.sst_cache_misses) : 0.,
+				st.sst_cache_evictions);
+	else
+		ctl_printf(ctl, "article cache: disabled\n");
+
+	ctl_printf(ctl, "\n%-14s %12s\n", "latency (ms)", "articles");
+	for (i = 0; i < SPOOL_LAT_BUCKETS; i++) {
+		if (spool_lat_buckets[i] == UINT64_MAX)
+			ctl_printf(ctl, "%-14s %12"PRIu64"\n", "more",
+					st.sst_lat_hist[i]);
+		else
+			ctl_printf(ctl, "<= %-11g %12"PRIu64"\n",
+					spool_lat_buckets[i] / 1e3,
+					st.sst_lat_hist[i]);
+	}
+
+	ctl_printf(ctl, "\n%-14s %12s\n", "queue depth", "batches");
+	for (i = 0; i < SPOOL_BATCH_BUCKETS; i++) {
+		if (spool_batch_buckets[i] == UINT64_MAX)
+			ctl_printf(ctl, "%-14s %12"PRIu64"\n", "more",
+					st.sst_batch_hist[i]);
+		else
+			ctl_printf(ctl, "<= %-11"PRIu64" %12"PRIu64"\n",
+					spool_batch_buckets[i],
+					st.sst_batch_hist[i]);
+	}
+}
+
+void
+ctl_do_memory_stats(ctl)
+	ctl_client_t	*ctl;
+{
+client_mem_stats_t	 cms;
+struct server		*se;
+
+	client_get_mem_stats(&cms);
+
+	ctl_printf(ctl, "client buffers: %"PRIu64" KB used, %"PRIu64" KB peak",
+			cms.cms_used / 1024, cms.cms_peak / 1024);
+	if (memory_budget)
+		ctl_printf(ctl, ", budget %"PRIu64" KB\n", memory_budget / 1024);
+	else
+		ctl_printf(ctl, ", no budget\n");
+
+	ctl_printf(ctl, "throttled: %d clients now, %"PRIu64" times in total\n",
+			cms.cms_throttled, cms.cms_throttle_events);
+
+	ctl_printf(ctl, "\n%-30s %12s %12s\n", "peer", "used (KB)", "peak (KB)");
+	SLIST_FOREACH(se, &servers, se_list)
+		ctl_printf(ctl, "%-30s %12"PRIu64" %12"PRIu64"\n",
+				se->se_name, se->se_mem / 1024,
+				se->se_mem_peak / 1024);
+}
+
 static char *
 get_uptime()
 {
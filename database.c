@@ -12,9 +12,14 @@
 #include	<sys/types.h>
 #include	<sys/stat.h>
 
+#include	<sys/mman.h>
+
 #include	<stdlib.h>
 #include	<string.h>
 #include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<time.h>
 
 #include	"database.h"
 #include	"config.h"
@@ -22,21 +27,98 @@
 #include	"nts.h"
 #include	"msg.h"
 #include	"dbmsg.h"
+#include	"queue.h"
 
 static char	*db_location;
 static uint64_t	 db_cache_size = 1024 * 1024 * 5; /* 5 MB */
 DB_ENV		*db_env;
 
 static void	 db_errcall(DB_ENV const *, char const *, char const *);
-static void	 db_flush(uv_timer_t *, int);
-static void	 db_checkpoint(uv_timer_t *, int);
 
-static uv_timer_t	flush_timer,
-			checkpoint_timer;
+/*
+ * Log flushes, checkpoints and trickle writes are done by a maintenance
+ * thread rather than on fixed timers, so they never block the main loop.
+ * A checkpoint is done when enough log has been written since the last
+ * one, when too much of the cache is dirty, or when checkpoint-interval
+ * has passed and anything at all has been written.  In between, trickle
+ * writes clean dirty pages a few at a time, so a checkpoint doesn't have
+ * to write them all at once.
+ */
+static uint64_t		 db_ckp_log_size = 64 * 1024 * 1024;
+static int64_t		 db_ckp_dirty_pct = 50;
+static uint64_t		 db_ckp_interval = 600;
+static int64_t		 db_trickle_pct = 10;
+
+static uv_thread_t	 db_maint_thread;
+static uv_mutex_t	 db_maint_mtx;
+static uv_cond_t	 db_maint_cond;
+static int		 db_maint_running,
+			 db_maint_stop;
+static db_stats_t	 db_stats;
+
+static void	 db_maint(void *);
+static void	 db_do_checkpoint(int reason);
+
+/*
+ * Cache preload.  At startup, pages from the databases registered with
+ * db_preload_add() are read into the cache by a set of threads, so the
+ * first lookups after a restart don't all turn into random disk I/O.
+ * Databases are loaded in the order they're registered, and nothing is
+ * loaded past the size of the cache.
+ */
+typedef struct db_preload {
+	DB		*dp_db;
+	char		*dp_name;
+	uint32_t	 dp_pagesize;
+	db_pgno_t	 dp_npages;
+	db_pgno_t	 dp_next;
+	int		 dp_fd;
+
+	SIMPLEQ_ENTRY(db_preload)	dp_list;
+} db_preload_t;
+
+#define	DB_PRELOAD_CHUNK	256	/* Pages per unit of work */
+
+static SIMPLEQ_HEAD(db_preload_list, db_preload) db_preload_list =
+	SIMPLEQ_HEAD_INITIALIZER(db_preload_list);
+
+static int		 db_do_preload;
+static int64_t		 db_preload_nthreads;
+static int64_t		 db_preload_warm = 90;
+static int		 db_preload_lock;
+int			 db_preload_emp;
+int			 db_preload_queues;
+
+static uv_thread_t	*db_preload_threads;
+static uv_mutex_t	 db_preload_mtx;
+static uv_timer_t	 db_preload_timer;
+static uint64_t		 db_preload_budget,
+			 db_preload_total,
+			 db_preload_done;
+static int		 db_preload_running,
+			 db_preload_stop,
+			 db_preload_nlockfail,
+			 db_preload_warmed;
+static time_t		 db_preload_started;
+static void		(*db_preload_warm_cb) (void);
+
+static void	 db_preload_thread(void *);
+static void	 db_preload_check(uv_timer_t *, int);
+static void	 db_preload_join(void);
 
 config_schema_opt_t db_opts[] = {
 	{ "path",	OPT_TYPE_STRING,	config_simple_string, &db_location },
 	{ "cache-size",	OPT_TYPE_QUANTITY,	config_simple_quantity, &db_cache_size },
+	{ "preload",		OPT_TYPE_BOOLEAN, config_simple_boolean, &db_do_preload },
+	{ "preload-threads",	OPT_TYPE_NUMBER, config_simple_number, &db_preload_nthreads },
+	{ "preload-warm-percent", OPT_TYPE_NUMBER, config_simple_number, &db_preload_warm },
+	{ "preload-emp",	OPT_TYPE_BOOLEAN, config_simple_boolean, &db_preload_emp },
+	{ "preload-queues",	OPT_TYPE_BOOLEAN, config_simple_boolean, &db_preload_queues },
+	{ "preload-lock",	OPT_TYPE_BOOLEAN, config_simple_boolean, &db_preload_lock },
+	{ "checkpoint-log-size", OPT_TYPE_QUANTITY, config_simple_quantity, &db_ckp_log_size },
+	{ "checkpoint-dirty-percent", OPT_TYPE_NUMBER, config_simple_number, &db_ckp_dirty_pct },
+	{ "checkpoint-interval", OPT_TYPE_DURATION, config_simple_duration, &db_ckp_interval },
+	{ "trickle-percent",	OPT_TYPE_NUMBER, config_simple_number, &db_trickle_pct },
 	{ }
 };
 
@@ -63,6 +145,25 @@ int		 ncpu;
 	else
 		uv_free_cpu_info(cpu_infos, ncpu);
 
+	if (db_preload_nthreads <= 0)
+		db_preload_nthreads = ncpu;
+
+	if (db_preload_warm < 0 || db_preload_warm > 100) {
+		nts_logm(DB_fac, M_DB_BADWARM);
+		return -1;
+	}
+
+	if (db_ckp_dirty_pct < 1 || db_ckp_dirty_pct > 100 ||
+	    db_trickle_pct < 0 || db_trickle_pct > 100) {
+		nts_logm(DB_fac, M_DB_BADPCT);
+		return -1;
+	}
+
+	db_preload_budget = db_cache_size;
+	uv_mutex_init(&db_preload_mtx);
+	uv_mutex_init(&db_maint_mtx);
+	uv_cond_init(&db_maint_cond);
+
 	if (!db_location) {
 		nts_logm(DB_fac, M_DB_NOLOC);
 		return -1;
@@ -110,11 +211,24 @@ int		 ncpu;
 		return -1;
 	}
 
-	uv_timer_init(loop, &flush_timer);
-	uv_timer_start(&flush_timer, db_flush, 1000, 1000);
+	return 0;
+}
+
+/*
+ * Start the maintenance thread.  This is separate from db_run() because
+ * it must be done after forking.
+ */
+int
+db_start()
+{
+int	err;
+
+	if (err = uv_thread_create(&db_maint_thread, db_maint, NULL)) {
+		nts_logm(DB_fac, M_DB_THRFAIL, uv_strerror(err));
+		return -1;
+	}
 
-	uv_timer_init(loop, &checkpoint_timer);
-	uv_timer_start(&checkpoint_timer, db_checkpoint, 600 * 1000, 600 * 1000);
+	db_maint_running = 1;
 	return 0;
 }
 
@@ -122,6 +236,17 @@ void
 db_shutdown()
 {
 int	ret;
+	db_preload_join();
+
+	if (db_maint_running) {
+		uv_mutex_lock(&db_maint_mtx);
+		db_maint_stop = 1;
+		uv_cond_signal(&db_maint_cond);
+		uv_mutex_unlock(&db_maint_mtx);
+		uv_thread_join(&db_maint_thread);
+		db_maint_running = 0;
+	}
+
 	if (db_env && (ret = db_env->close(db_env, 0)))
 		nts_logm(DB_fac, M_DB_CLSFAIL, db_strerror(ret));
 }
@@ -210,15 +335,345 @@ db_errcall(env, pfx, msg)
 }
 
 static void
-db_flush(timer, status)
-	uv_timer_t	*timer;
+db_maint(arg)
+	void	*arg;
 {
-	db_env->log_flush(db_env, NULL);
+uint64_t	last_written = 0;
+uint64_t	last_ckp = uv_hrtime();
+
+	uv_mutex_lock(&db_maint_mtx);
+
+	while (!db_maint_stop) {
+	DB_LOG_STAT	*ls;
+	DB_MPOOL_STAT	*ms;
+	uint64_t	 written, since_ckp, now;
+	int		 dirty_pct = 0, nwrote = 0, reason = DB_CKP_NONE;
+
+		uv_cond_timedwait(&db_maint_cond, &db_maint_mtx, 1000000000ULL);
+		if (db_maint_stop)
+			break;
+		uv_mutex_unlock(&db_maint_mtx);
+
+		if (db_env->log_stat(db_env, &ls, 0)) {
+			uv_mutex_lock(&db_maint_mtx);
+			continue;
+		}
+
+		written = (uint64_t) ls->st_w_mbytes * 1024 * 1024 + ls->st_w_bytes;
+		since_ckp = (uint64_t) ls->st_wc_mbytes * 1024 * 1024 + ls->st_wc_bytes;
+		free(ls);
+
+		/* Nothing has been logged; there's nothing to do. */
+		if (written != last_written) {
+			db_env->log_flush(db_env, NULL);
+			last_written = written;
+		}
+
+		if (db_env->memp_stat(db_env, &ms, NULL, 0) == 0) {
+			if (ms->st_pages)
+				dirty_pct = (int) ((uint64_t) ms->st_page_dirty * 100
+						   / ms->st_pages);
+			free(ms);
+		}
+
+		now = uv_hrtime();
+
+		if (since_ckp >= db_ckp_log_size)
+			reason = DB_CKP_LOG;
+		else if (dirty_pct >= db_ckp_dirty_pct)
+			reason = DB_CKP_DIRTY;
+		else if (since_ckp &&
+			 now - last_ckp >= db_ckp_interval * 1000000000ULL)
+			reason = DB_CKP_TIME;
+
+		if (reason != DB_CKP_NONE) {
+			db_do_checkpoint(reason);
+			last_ckp = uv_hrtime();
+		} else if (db_trickle_pct && dirty_pct) {
+			/*
+			 * Keep trickle-percent of the cache clean, so the
+			 * next checkpoint has less to write.
+			 */
+			db_env->memp_trickle(db_env, (int) db_trickle_pct, &nwrote);
+		}
+
+		uv_mutex_lock(&db_maint_mtx);
+		db_stats.ds_dirty_pct = dirty_pct;
+		db_stats.ds_log_since_ckp = since_ckp;
+		db_stats.ds_trickle_pages += nwrote;
+	}
+
+	uv_mutex_unlock(&db_maint_mtx);
 }
 
 static void
-db_checkpoint(timer, status)
+db_do_checkpoint(reason)
+{
+uint64_t	start, took;
+int		ret;
+
+	uv_mutex_lock(&db_maint_mtx);
+	db_stats.ds_in_checkpoint = 1;
+	uv_mutex_unlock(&db_maint_mtx);
+
+	start = uv_hrtime();
+	if (ret = db_env->txn_checkpoint(db_env, 0, 0, 0))
+		nts_logm(DB_fac, M_DB_CKPFAIL, db_strerror(ret));
+	took = (uv_hrtime() - start) / 1000;
+
+	uv_mutex_lock(&db_maint_mtx);
+	db_stats.ds_in_checkpoint = 0;
+	db_stats.ds_ckp_count[reason]++;
+	db_stats.ds_ckp_last_usec = took;
+	db_stats.ds_ckp_total_usec += took;
+	if (took > db_stats.ds_ckp_max_usec)
+		db_stats.ds_ckp_max_usec = took;
+	db_stats.ds_ckp_last = time(NULL);
+	uv_mutex_unlock(&db_maint_mtx);
+}
+
+/*
+ * Record how long a write transaction took, so the effect of checkpoints
+ * on transaction latency can be seen.
+ */
+void
+db_txn_latency(usec)
+	uint64_t	usec;
+{
+int	i;
+
+	uv_mutex_lock(&db_maint_mtx);
+	i = db_stats.ds_in_checkpoint ? 1 : 0;
+	db_stats.ds_txn_count[i]++;
+	db_stats.ds_txn_usec[i] += usec;
+	if (usec > db_stats.ds_txn_max_usec[i])
+		db_stats.ds_txn_max_usec[i] = usec;
+	uv_mutex_unlock(&db_maint_mtx);
+}
+
+void
+db_get_stats(stats)
+	db_stats_t	*stats;
+{
+	uv_mutex_lock(&db_maint_mtx);
+	bcopy(&db_stats, stats, sizeof(*stats));
+	uv_mutex_unlock(&db_maint_mtx);
+}
+
+/*
+ * Register a database to be preloaded into the cache at startup.
+ */
+void
+db_preload_add(db, name)
+	DB		*db;
+	char const	*name;
+{
+db_preload_t	*dp;
+DB_MPOOLFILE	*mpf;
+db_pgno_t	 last;
+uint32_t	 pagesize;
+
+	if (!db_do_preload || db_preload_running)
+		return;
+
+	mpf = db->get_mpf(db);
+	if (db->get_pagesize(db, &pagesize) || mpf->get_last_pgno(mpf, &last))
+		return;
+
+	dp = xcalloc(1, sizeof(*dp));
+	dp->dp_db = db;
+	dp->dp_name = xstrdup(name);
+	dp->dp_pagesize = pagesize;
+	dp->dp_npages = last + 1;
+	if (db->fd(db, &dp->dp_fd))
+		dp->dp_fd = -1;
+
+	/*
+	 * There's no point loading more than the cache will hold; later
+	 * pages would only push out earlier ones.
+	 */
+	if ((uint64_t) dp->dp_npages * pagesize > db_preload_budget) {
+		dp->dp_npages = db_preload_budget / pagesize;
+		nts_logm(DB_fac, M_DB_PRELOADTRUNC, name,
+			 (unsigned long) dp->dp_npages, (unsigned long) last + 1);
+	}
+
+	db_preload_budget -= (uint64_t) dp->dp_npages * pagesize;
+	db_preload_total += dp->dp_npages;
+
+	if (dp->dp_npages == 0) {
+		free(dp->dp_name);
+		free(dp);
+		return;
+	}
+
+	SIMPLEQ_INSERT_TAIL(&db_preload_list, dp, dp_list);
+}
+
+/*
+ * Start preloading registered databases.  warm is called once the
+ * configured fraction of pages has been loaded (or immediately, if
+ * there's nothing to preload).
+ */
+void
+db_preload_start(warm)
+	void	(*warm) (void);
+{
+int	i;
+
+	if (!db_do_preload || db_preload_total == 0) {
+		warm();
+		return;
+	}
+
+	db_preload_warm_cb = warm;
+	db_preload_started = time(NULL);
+	db_preload_running = (int) db_preload_nthreads;
+	db_preload_threads = xcalloc(db_preload_nthreads,
+				     sizeof(*db_preload_threads));
+
+	nts_logm(DB_fac, M_DB_PRELOADSTART, (unsigned long) db_preload_total,
+		 (int) db_preload_nthreads);
+
+	for (i = 0; i < db_preload_nthreads; i++)
+		uv_thread_create(&db_preload_threads[i], db_preload_thread, NULL);
+
+	uv_timer_init(loop, &db_preload_timer);
+	uv_timer_start(&db_preload_timer, db_preload_check, 1000, 1000);
+	db_preload_check(&db_preload_timer, 0);
+}
+
+static void
+db_preload_thread(arg)
+	void	*arg;
+{
+long	sys_pagesize = sysconf(_SC_PAGESIZE);
+
+	for (;;) {
+	db_preload_t	*dp;
+	DB_MPOOLFILE	*mpf;
+	db_pgno_t	 start = 0, end = 0, pgno;
+
+		uv_mutex_lock(&db_preload_mtx);
+		if (!db_preload_stop) {
+			SIMPLEQ_FOREACH(dp, &db_preload_list, dp_list) {
+				if (dp->dp_next >= dp->dp_npages)
+					continue;
+
+				start = dp->dp_next;
+				end = start + DB_PRELOAD_CHUNK;
+				if (end > dp->dp_npages)
+					end = dp->dp_npages;
+				dp->dp_next = end;
+				break;
+			}
+		} else
+			dp = NULL;
+
+		if (dp == NULL) {
+			db_preload_running--;
+			uv_mutex_unlock(&db_preload_mtx);
+			return;
+		}
+		uv_mutex_unlock(&db_preload_mtx);
+
+#ifdef	HAVE_POSIX_FADVISE
+		/*
+		 * Ask the kernel to start reading the whole chunk now, so
+		 * the page-at-a-time reads below mostly hit the page cache.
+		 */
+		if (dp->dp_fd != -1)
+			posix_fadvise(dp->dp_fd, (off_t) start * dp->dp_pagesize,
+				      (off_t) (end - start) * dp->dp_pagesize,
+				      POSIX_FADV_WILLNEED);
+#endif
+
+		mpf = dp->dp_db->get_mpf(dp->dp_db);
+		for (pgno = start; pgno < end; pgno++) {
+		db_pgno_t	 p = pgno;
+		void		*page;
+
+			if (mpf->get(mpf, &p, NULL, 0, &page))
+				continue;
+
+#ifdef	HAVE_MLOCK
+			if (db_preload_lock) {
+			uintptr_t	addr = (uintptr_t) page & ~(sys_pagesize - 1);
+
+				if (mlock((void *) addr,
+					  ((uintptr_t) page - addr) + dp->dp_pagesize) == -1)
+					db_preload_nlockfail++;
+			}
+#endif
+
+			mpf->put(mpf, page, DB_PRIORITY_UNCHANGED, 0);
+		}
+
+		uv_mutex_lock(&db_preload_mtx);
+		db_preload_done += end - start;
+		uv_mutex_unlock(&db_preload_mtx);
+	}
+}
+
+static void
+db_preload_check(timer, status)
 	uv_timer_t	*timer;
 {
-	db_env->txn_checkpoint(db_env, 0, 0, 0);
+uint64_t	done;
+int		running, pct;
+static int	last_pct = -1;
+
+	uv_mutex_lock(&db_preload_mtx);
+	done = db_preload_done;
+	running = db_preload_running;
+	uv_mutex_unlock(&db_preload_mtx);
+
+	pct = (int) (done * 100 / db_preload_total);
+	if (pct / 10 != last_pct / 10) {
+		nts_logm(DB_fac, M_DB_PRELOADPROG, pct,
+			 (unsigned long) done, (unsigned long) db_preload_total);
+		last_pct = pct;
+	}
+
+	if (!db_preload_warmed && (pct >= db_preload_warm || running == 0)) {
+		db_preload_warmed = 1;
+		nts_logm(DB_fac, M_DB_PRELOADWARM, pct);
+		db_preload_warm_cb();
+	}
+
+	if (running)
+		return;
+
+	uv_timer_stop(&db_preload_timer);
+	db_preload_join();
+
+	if (db_preload_nlockfail)
+		nts_logm(DB_fac, M_DB_PRELOADLOCK, db_preload_nlockfail);
+	nts_logm(DB_fac, M_DB_PRELOADDONE, (unsigned long) done,
+		 (long) (time(NULL) - db_preload_started));
+}
+
+static void
+db_preload_join()
+{
+db_preload_t	*dp;
+int		 i;
+
+	if (db_preload_threads == NULL)
+		return;
+
+	uv_mutex_lock(&db_preload_mtx);
+	db_preload_stop = 1;
+	uv_mutex_unlock(&db_preload_mtx);
+
+	for (i = 0; i < db_preload_nthreads; i++)
+		uv_thread_join(&db_preload_threads[i]);
+	free(db_preload_threads);
+	db_preload_threads = NULL;
+
+	while (dp = SIMPLEQ_FIRST(&db_preload_list)) {
+		SIMPLEQ_REMOVE_HEAD(&db_preload_list, dp_list);
+		free(dp->dp_name);
+		free(dp);
+	}
 }
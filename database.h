@@ -12,10 +12,13 @@
 #ifndef	NTS_DATABASE_H
 #define NTS_DATABASE_H
 
+#include	<time.h>
+
 #include	<db.h>
 
 int	 db_init(void);
 int	 db_run(void);
+int	 db_start(void);
 void	 db_shutdown(void);
 
 typedef int (*db_sort_function) (DB *, DBT const *, DBT const *);
@@ -25,6 +28,43 @@ DB_TXN	*db_new_txn(uint32_t flags);
 int	 db_txn_commit(DB_TXN *);
 int	 db_txn_abort(DB_TXN *);
 
+/*
+ * Register a database to be read into the cache at startup, then start
+ * reading; the callback is called once the cache is warm enough.
+ */
+void	 db_preload_add(DB *, char const *name);
+void	 db_preload_start(void (*warm) (void));
+extern int	db_preload_emp;
+extern int	db_preload_queues;
+
+/*
+ * Checkpoint and transaction latency statistics.  Transaction times are
+ * kept separately for transactions which finished while a checkpoint was
+ * running ([1]) and those which didn't ([0]).
+ */
+#define	DB_CKP_NONE	-1	/* No checkpoint needed */
+#define	DB_CKP_LOG	0	/* Log size threshold reached */
+#define	DB_CKP_DIRTY	1	/* Dirty page threshold reached */
+#define	DB_CKP_TIME	2	/* checkpoint-interval passed */
+
+typedef struct db_stats {
+	uint64_t	ds_ckp_count[3];
+	uint64_t	ds_ckp_last_usec;
+	uint64_t	ds_ckp_max_usec;
+	uint64_t	ds_ckp_total_usec;
+	time_t		ds_ckp_last;
+	int		ds_in_checkpoint;
+	int		ds_dirty_pct;
+	uint64_t	ds_log_since_ckp;
+	uint64_t	ds_trickle_pages;
+	uint64_t	ds_txn_count[2];
+	uint64_t	ds_txn_usec[2];
+	uint64_t	ds_txn_max_usec[2];
+} db_stats_t;
+
+void	 db_get_stats(db_stats_t *);
+void	 db_txn_latency(uint64_t usec);
+
 extern DB_ENV	*db_env;
 
 #endif	/* !NTS_DATABASE_H */
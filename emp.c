@@ -135,6 +135,13 @@ emp_run()
 				phl_get_last_decayed, DB_AUTO_COMMIT);
 	}
 
+	if (db_preload_emp) {
+		if (emp_db)
+			db_preload_add(emp_db, "emp.db");
+		if (phl_db)
+			db_preload_add(phl_db, "phl.db");
+	}
+
 	if (do_phl_tracking || do_emp_tracking) {
 		uv_timer_init(loop, &emp_clean_timer);
 		uv_timer_start(&emp_clean_timer, start_emp_clean,
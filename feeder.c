@@ -16,6 +16,8 @@
 
 #include	<string.h>
 #include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
 #include	<stdio.h>
 #include	<stdarg.h>
 #include	<assert.h>
@@ -29,6 +31,18 @@
 #include	"config.h"
 #include	"hash.h"
 
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+# include	<sys/sendfile.h>
+# include	<poll.h>
+# define	USE_SENDFILE
+#endif
+
+/*
+ * How long (in seconds) to wait for a peer to accept more data while
+ * sending articles with sendfile().
+ */
+#define	FCONN_SENDFILE_TIMEOUT	300
+
 static feeder_t	*feeder_new(server_t *);
 static void	 feeder_log(int sev, feeder_t *fe, char const *fmt, ...)
 			attr_printf(3, 4);
@@ -42,11 +56,25 @@ static void	 on_fconn_dns_done(uv_getaddrinfo_t *, int, struct addrinfo *);
 static void	 on_fconn_write_done(uv_write_t *, int);
 static void	 on_fconn_shutdown_done(uv_shutdown_t *, int);
 static void	 on_fconn_close_done(uv_handle_t *);
+static void	 on_fconn_reconnect(uv_handle_t *);
 
 static void	 fconn_connect(fconn_t *);
+static void	 fconn_abort(fconn_t *);
 static void	 fconn_puts(fconn_t *, char const *text);
 static void	 fconn_printf(fconn_t *, char const *fmt, ...) attr_printf(2, 3);
 static void	 fconn_vprintf(fconn_t *, char const *fmt, va_list);
+static void	 fconn_send(fconn_t *, fconn_write_t *);
+static void	 fconn_pump(fconn_t *);
+static void	 fconn_start_write(fconn_t *, fconn_write_t *);
+static void	 fconn_write_free(fconn_write_t *);
+#ifdef USE_SENDFILE
+static void	 fconn_sender_init(void);
+static void	 fconn_start_sendfile(fconn_t *);
+static int	 fconn_sender_append(struct fconn_sender *, fconn_write_t *);
+static void	 fconn_sender_run(void *);
+static void	 fconn_sender_wake(void);
+static void	 on_fconn_sender_done(uv_async_t *, int);
+#endif
 static void	 fconn_log(int sev, fconn_t *fe, char const *fmt, ...)
 			attr_printf(3, 4);
 static void	 fconn_vlog(int sev, fconn_t *fe, char const *fmt, va_list);
@@ -73,6 +101,43 @@ static int (*fconn_handlers[]) (fconn_t *, char *) = {
 	fc_running
 };
 
+#ifdef USE_SENDFILE
+/*
+ * Articles in spool files are sent with sendfile() by the sender thread,
+ * so a slow peer holds up neither the main loop nor the worker threads.
+ * sendfile() writes to the socket directly, so once a connection starts
+ * sending this way, everything written to it goes through the thread until
+ * its queue drains; the thread writes each connection's queue back to back,
+ * waiting in poll() for whichever sockets are full.
+ *
+ * The thread uses its own descriptor for the socket, so it stays valid if
+ * the connection is closed in the meantime.  fs_fc is only touched by the
+ * main loop and fs_last only by the thread; the lists, fs_done and fs_error
+ * are protected by sender_mtx.
+ */
+typedef struct fconn_sender {
+	fconn_t			*fs_fc;
+	int			 fs_sock;
+	int			 fs_error;
+	int			 fs_done;
+	time_t			 fs_last;	/* When data was last written */
+	fconn_write_list_t	 fs_writes;	/* Still to be written */
+	fconn_write_list_t	 fs_written;	/* Freed by the main loop */
+	TAILQ_ENTRY(fconn_sender) fs_list;
+} fconn_sender_t;
+
+static TAILQ_HEAD(, fconn_sender) sender_active
+		= TAILQ_HEAD_INITIALIZER(sender_active);
+static TAILQ_HEAD(, fconn_sender) sender_done
+		= TAILQ_HEAD_INITIALIZER(sender_done);
+static uv_mutex_t	 sender_mtx;
+static uv_thread_t	 sender_thread;
+static uv_async_t	 sender_async;
+static int		 sender_pipe[2] = { -1, -1 };
+static int		 sender_running;
+static int		 sender_stop;
+#endif
+
 int
 feeder_init()
 {
@@ -87,12 +152,45 @@ server_t	*se;
 	SLIST_FOREACH(se, &servers, se_list)
 		se->se_feeder = feeder_new(se);
 
+#ifdef USE_SENDFILE
+	fconn_sender_init();
+#endif
+	return 0;
+}
+
+/*
+ * Start the sender thread.  This must be called after forking.
+ */
+int
+feeder_start()
+{
+#ifdef USE_SENDFILE
+int	err;
+
+	if (err = uv_thread_create(&sender_thread, fconn_sender_run, NULL)) {
+		nts_log("feeder: cannot create sender thread: %s",
+			uv_strerror(err));
+		return -1;
+	}
+
+	sender_running = 1;
+#endif
 	return 0;
 }
 
 void
 feeder_shutdown()
 {
+#ifdef USE_SENDFILE
+	if (sender_running) {
+		uv_mutex_lock(&sender_mtx);
+		sender_stop = 1;
+		uv_mutex_unlock(&sender_mtx);
+		fconn_sender_wake();
+		uv_thread_join(&sender_thread);
+		sender_running = 0;
+	}
+#endif
 }
 
 static feeder_t *
@@ -180,23 +278,51 @@ uv_connect_t	*req;
                 bind = (struct sockaddr *) &fe->fe_server->se_bind_v6;
         }
 
+	/*
+	 * Create the socket ourselves, so the sender thread can have its
+	 * own descriptor for it.  This is done before the handle is
+	 * initialised, so a failure here can just free the connection.
+	 */
+	if ((fc->fc_sock = socket(fc->fc_cur_addr->ai_family,
+				  SOCK_STREAM, 0)) == -1) {
+		fconn_log(LOG_ERR, fc, "socket: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (fcntl(fc->fc_sock, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fc->fc_sock, F_SETFD, FD_CLOEXEC) == -1) {
+		fconn_log(LOG_ERR, fc, "fcntl: %s", strerror(errno));
+		close(fc->fc_sock);
+		goto fail;
+	}
+
 	if (ret = uv_tcp_init(loop, &fc->fc_stream)) {
 		fconn_log(LOG_ERR, fc, "uv_tcp_init: %s", uv_strerror(ret));
-		return;
+		close(fc->fc_sock);
+		goto fail;
 	}
 
 	fc->fc_stream.data = fc;
 
+	/*
+	 * From here on the handle belongs to the loop, so errors have to
+	 * close it; on_fconn_close_done frees the connection.
+	 */
+	if (ret = uv_tcp_open(&fc->fc_stream, fc->fc_sock)) {
+		fconn_log(LOG_ERR, fc, "uv_tcp_open: %s", uv_strerror(ret));
+		close(fc->fc_sock);
+		goto err;
+	}
+
 	if (ret = uv_tcp_nodelay(&fc->fc_stream, 1)) {
 		fconn_log(LOG_ERR, fc, "uv_tcp_nodelay: %s", uv_strerror(ret));
-		return;
+		goto err;
 	}
 
 	if (bind) {
 		if (ret = uv_tcp_bind(&fc->fc_stream, bind)) {
 			fconn_log(LOG_ERR, fc, "uv_tcp_bind: %s", uv_strerror(ret));
-			fconn_destroy(fc);
-			return;
+			goto err;
 		}
 	}
 
@@ -205,8 +331,8 @@ uv_connect_t	*req;
 	if (ret = uv_tcp_connect(req, &fc->fc_stream, fc->fc_cur_addr->ai_addr,
 				 on_fconn_connect_done)) {
 		fconn_log(LOG_ERR, fc, "uv_tcp_connect: %s", uv_strerror(ret));
-		fconn_destroy(fc);
-		return;
+		free(req);
+		goto err;
 	}
 
 #if 0
@@ -218,6 +344,34 @@ uv_connect_t	*req;
 	fc->fc_state = FS_WAIT_GREETING;
 	time(&fc->fc_last_used);
 	return;
+
+fail:
+	TAILQ_REMOVE(&fe->fe_conns, fc, fc_list);
+	fconn_destroy(fc);
+	return;
+
+err:
+	fconn_abort(fc);
+}
+
+/*
+ * Give up on a connection whose handle has been initialised but which
+ * never got as far as running; it's freed once the handle is closed.
+ */
+static void
+fconn_abort(fc)
+	fconn_t	*fc;
+{
+	TAILQ_REMOVE(&fc->fc_feeder->fe_conns, fc, fc_list);
+	fc->fc_flags |= FC_DEAD;
+	uv_close((uv_handle_t *) &fc->fc_stream, on_fconn_close_done);
+}
+
+static void
+on_fconn_reconnect(handle)
+	uv_handle_t	*handle;
+{
+	fconn_connect(handle->data);
 }
 
 static void
@@ -226,17 +380,21 @@ on_fconn_connect_done(req, status)
 {
 fconn_t		*fc = req->data;
 
+	free(req);
+
 	if (status) {
 		fconn_log(LOG_INFO, fc, "connect: %s", uv_strerror(status));
 
-		if ((fc->fc_cur_addr = fc->fc_cur_addr->ai_next) == NULL) {
+		/* fconn_connect already moved on to the next address */
+		if (fc->fc_cur_addr == NULL) {
 			fconn_log(LOG_INFO, fc, "out of addresses");
 			time(&fc->fc_feeder->fe_last_fail);
-			fconn_destroy(fc);
+			fconn_abort(fc);
 			return;
 		}
 
-		fconn_connect(fc);
+		/* Each address gets a new socket, so close this one first */
+		uv_close((uv_handle_t *) &fc->fc_stream, on_fconn_reconnect);
 		return;
 	}
 
@@ -634,8 +792,7 @@ fconn_vprintf(fc, fmt, ap)
 {
 char            *buf;
 int              len;
-uv_write_t      *wr;
-uv_buf_t         ubuf;
+fconn_write_t	*fw;
 
 #define PRINTF_BUFSZ    1024
 
@@ -646,30 +803,425 @@ uv_buf_t         ubuf;
 		vsnprintf(buf, len + 1, fmt, ap);
 	}
 
-	wr = xcalloc(1, sizeof(*wr));
+	fw = xcalloc(1, sizeof(*fw));
+	fw->fw_buf = buf;
+	fw->fw_len = len;
+	fconn_send(fc, fw);
+}
 
-	ubuf = uv_buf_init(buf, len);
-	wr->data = fc;
+/*
+ * Queue a write on a feeder connection.  Writes are normally passed
+ * straight to libuv, but while articles are being sent with sendfile(),
+ * everything else goes to the sender thread behind them.
+ */
+static void
+fconn_send(fc, fw)
+	fconn_t		*fc;
+	fconn_write_t	*fw;
+{
+	fw->fw_fc = fc;
+
+#ifdef USE_SENDFILE
+	if (fc->fc_sender && TAILQ_EMPTY(&fc->fc_sendq) &&
+	    fconn_sender_append(fc->fc_sender, fw))
+		return;
+#endif
+
+	if (TAILQ_EMPTY(&fc->fc_sendq) && !fc->fc_sender &&
+	    !(fw->fw_article && fw->fw_view.sv_text == NULL)) {
+		fconn_start_write(fc, fw);
+		return;
+	}
 
-	uv_write(wr, (uv_stream_t *) &fc->fc_stream, &ubuf, 1, on_fconn_write_done);
+	TAILQ_INSERT_TAIL(&fc->fc_sendq, fw, fw_list);
+	fconn_pump(fc);
+}
+
+/*
+ * Start as many queued writes as possible.
+ */
+static void
+fconn_pump(fc)
+	fconn_t	*fc;
+{
+fconn_write_t	*fw;
+
+	if (fc->fc_flags & (FC_DEAD | FC_DRAIN))
+		return;
+
+	while ((fw = TAILQ_FIRST(&fc->fc_sendq)) != NULL) {
+		if (fc->fc_sender)
+			return;
+
+		if (fw->fw_article && fw->fw_view.sv_text == NULL) {
+#ifdef USE_SENDFILE
+			/*
+			 * sendfile() writes to the socket directly, so
+			 * anything already given to libuv has to be written
+			 * first.  After that the sender thread takes
+			 * everything queued, and whatever is sent while it
+			 * runs.
+			 */
+			if (fc->fc_nwrites)
+				return;
+
+			fconn_start_sendfile(fc);
+			return;
+#else
+			abort();
+#endif
+		}
+
+		TAILQ_REMOVE(&fc->fc_sendq, fw, fw_list);
+		fconn_start_write(fc, fw);
+	}
+}
+
+static void
+fconn_start_write(fc, fw)
+	fconn_t		*fc;
+	fconn_write_t	*fw;
+{
+uv_buf_t	ubufs[3];
+int		nbufs = 1;
+
+	ubufs[0] = uv_buf_init(fw->fw_buf, fw->fw_len);
+	if (fw->fw_article) {
+		ubufs[1] = uv_buf_init((char *) fw->fw_view.sv_text,
+				       fw->fw_view.sv_len);
+		ubufs[2] = uv_buf_init(".\r\n", 3);
+		nbufs = 3;
+	}
+
+	fc->fc_nwrites++;
+	fw->fw_req.data = fw;
+	uv_write(&fw->fw_req, (uv_stream_t *) &fc->fc_stream, ubufs, nbufs,
+		 on_fconn_write_done);
 }
 
 static void
 on_fconn_write_done(wr, status)
 	uv_write_t	*wr;
 {
-fconn_t	*fc = wr->data;
+fconn_write_t	*fw = wr->data;
+fconn_t		*fc = fw->fw_fc;
 
-	free(wr->bufs[0].base);
-	free(wr);
+	fconn_write_free(fw);
+	fc->fc_nwrites--;
 
-	if (status == 0)
+	if (status == 0) {
+		fconn_pump(fc);
 		return;
+	}
 
 	fconn_log(LOG_INFO, fc, "write error: %s", uv_strerror(status));
 	fconn_close(fc, 0);
 }
 
+static void
+fconn_write_free(fw)
+	fconn_write_t	*fw;
+{
+	if (fw->fw_article)
+		spool_view_release(&fw->fw_view);
+	free(fw->fw_buf);
+	free(fw);
+}
+
+#ifdef USE_SENDFILE
+static void
+fconn_sender_init()
+{
+int	i;
+
+	if (pipe(sender_pipe) == -1)
+		panic("feeder: cannot create sender pipe: %s", strerror(errno));
+
+	for (i = 0; i < 2; i++)
+		if (fcntl(sender_pipe[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(sender_pipe[i], F_SETFD, FD_CLOEXEC) == -1)
+			panic("feeder: cannot set up sender pipe: %s",
+			      strerror(errno));
+
+	uv_mutex_init(&sender_mtx);
+	uv_async_init(loop, &sender_async, on_fconn_sender_done);
+}
+
+static void
+fconn_sender_wake()
+{
+	while (write(sender_pipe[1], "", 1) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Hand everything queued on the connection to the sender thread.
+ */
+static void
+fconn_start_sendfile(fc)
+	fconn_t	*fc;
+{
+fconn_sender_t	*fs;
+int		 fd;
+
+	if ((fd = dup(fc->fc_sock)) == -1) {
+		fconn_log(LOG_INFO, fc, "dup: %s", strerror(errno));
+		fconn_close(fc, 0);
+		return;
+	}
+
+	fs = xcalloc(1, sizeof(*fs));
+	fs->fs_fc = fc;
+	fs->fs_sock = fd;
+	time(&fs->fs_last);
+	TAILQ_INIT(&fs->fs_writes);
+	TAILQ_INIT(&fs->fs_written);
+	TAILQ_CONCAT(&fs->fs_writes, &fc->fc_sendq, fw_list);
+	fc->fc_sender = fs;
+
+	uv_mutex_lock(&sender_mtx);
+	TAILQ_INSERT_TAIL(&sender_active, fs, fs_list);
+	uv_mutex_unlock(&sender_mtx);
+	fconn_sender_wake();
+}
+
+/*
+ * Add a write to a running sender.  Returns 0 if the sender has already
+ * finished, in which case the caller has to queue it instead.
+ */
+static int
+fconn_sender_append(fs, fw)
+	fconn_sender_t	*fs;
+	fconn_write_t	*fw;
+{
+	uv_mutex_lock(&sender_mtx);
+	if (fs->fs_done) {
+		uv_mutex_unlock(&sender_mtx);
+		return 0;
+	}
+
+	/*
+	 * No need to wake the thread: a running sender is either being
+	 * written right now, or waiting for its socket.
+	 */
+	TAILQ_INSERT_TAIL(&fs->fs_writes, fw, fw_list);
+	uv_mutex_unlock(&sender_mtx);
+	return 1;
+}
+
+/*
+ * Write as much of fw as the socket will take.  Returns 0 once it has all
+ * been written, 1 if the socket is full, or -1 on error.
+ */
+static int
+fconn_sender_write_one(fs, fw)
+	fconn_sender_t	*fs;
+	fconn_write_t	*fw;
+{
+size_t	pos;
+ssize_t	n;
+off_t	off;
+
+	for (;;) {
+		if ((pos = fw->fw_pos) < fw->fw_len)
+			n = write(fs->fs_sock, fw->fw_buf + pos, fw->fw_len - pos);
+		else if (!fw->fw_article)
+			return 0;
+		else if ((pos -= fw->fw_len) < fw->fw_view.sv_len) {
+			if (fw->fw_view.sv_text)
+				n = write(fs->fs_sock, fw->fw_view.sv_text + pos,
+					  fw->fw_view.sv_len - pos);
+			else {
+				off = fw->fw_view.sv_offset + pos;
+				n = sendfile(fs->fs_sock, fw->fw_view.sv_fd, &off,
+					     fw->fw_view.sv_len - pos);
+			}
+		} else if ((pos -= fw->fw_view.sv_len) < 3)
+			n = write(fs->fs_sock, ".\r\n" + pos, 3 - pos);
+		else
+			return 0;
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+
+		/* The spool file is shorter than the view */
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		fw->fw_pos += n;
+		time(&fs->fs_last);
+	}
+}
+
+/*
+ * The sender has nothing more to write, or failed; give it back to the
+ * main loop.  Called with sender_mtx held.
+ */
+static void
+fconn_sender_finish(fs)
+	fconn_sender_t	*fs;
+{
+	fs->fs_done = 1;
+	TAILQ_REMOVE(&sender_active, fs, fs_list);
+	TAILQ_INSERT_TAIL(&sender_done, fs, fs_list);
+	uv_async_send(&sender_async);
+}
+
+static void
+fconn_sender_write(fs)
+	fconn_sender_t	*fs;
+{
+fconn_write_t	*fw;
+int		 ret;
+
+	for (;;) {
+		uv_mutex_lock(&sender_mtx);
+		if ((fw = TAILQ_FIRST(&fs->fs_writes)) == NULL) {
+			fconn_sender_finish(fs);
+			uv_mutex_unlock(&sender_mtx);
+			return;
+		}
+		uv_mutex_unlock(&sender_mtx);
+
+		if ((ret = fconn_sender_write_one(fs, fw)) == 1)
+			return;
+
+		uv_mutex_lock(&sender_mtx);
+		if (ret == -1) {
+			fs->fs_error = errno;
+			fconn_sender_finish(fs);
+			uv_mutex_unlock(&sender_mtx);
+			return;
+		}
+
+		TAILQ_REMOVE(&fs->fs_writes, fw, fw_list);
+		TAILQ_INSERT_TAIL(&fs->fs_written, fw, fw_list);
+		uv_mutex_unlock(&sender_mtx);
+	}
+}
+
+static void
+fconn_sender_run(arg)
+	void	*arg;
+{
+struct pollfd	 *pfds = NULL;
+fconn_sender_t	**fss = NULL, *fs;
+size_t		  nalloc = 0, n, i;
+time_t		  now;
+char		  c;
+
+	for (;;) {
+		/*
+		 * Only this thread removes senders from the active list, so
+		 * the ones collected here stay valid until the next pass.
+		 */
+		uv_mutex_lock(&sender_mtx);
+		if (sender_stop) {
+			uv_mutex_unlock(&sender_mtx);
+			break;
+		}
+
+		n = 1;
+		TAILQ_FOREACH(fs, &sender_active, fs_list)
+			n++;
+
+		if (n > nalloc) {
+			nalloc = n * 2;
+			pfds = xrealloc(pfds, sizeof(*pfds) * nalloc);
+			fss = xrealloc(fss, sizeof(*fss) * nalloc);
+		}
+
+		pfds[0].fd = sender_pipe[0];
+		pfds[0].events = POLLIN;
+		i = 1;
+		TAILQ_FOREACH(fs, &sender_active, fs_list) {
+			fss[i] = fs;
+			pfds[i].fd = fs->fs_sock;
+			pfds[i].events = POLLOUT;
+			i++;
+		}
+		uv_mutex_unlock(&sender_mtx);
+
+		if (poll(pfds, n, 1000) == -1) {
+			if (errno == EINTR)
+				continue;
+			panic("feeder: sender poll: %s", strerror(errno));
+		}
+
+		if (pfds[0].revents & POLLIN)
+			while (read(sender_pipe[0], &c, 1) == 1)
+				;
+
+		time(&now);
+		for (i = 1; i < n; i++) {
+			fs = fss[i];
+
+			if (pfds[i].revents) {
+				fconn_sender_write(fs);
+				continue;
+			}
+
+			if (now - fs->fs_last >= FCONN_SENDFILE_TIMEOUT) {
+				uv_mutex_lock(&sender_mtx);
+				fs->fs_error = ETIMEDOUT;
+				fconn_sender_finish(fs);
+				uv_mutex_unlock(&sender_mtx);
+			}
+		}
+	}
+
+	free(pfds);
+	free(fss);
+}
+
+static void
+on_fconn_sender_done(async, status)
+	uv_async_t	*async;
+{
+fconn_sender_t	*fs;
+fconn_write_t	*fw;
+fconn_t		*fc;
+
+	for (;;) {
+		uv_mutex_lock(&sender_mtx);
+		if ((fs = TAILQ_FIRST(&sender_done)) != NULL)
+			TAILQ_REMOVE(&sender_done, fs, fs_list);
+		uv_mutex_unlock(&sender_mtx);
+
+		if (fs == NULL)
+			return;
+
+		close(fs->fs_sock);
+		TAILQ_CONCAT(&fs->fs_written, &fs->fs_writes, fw_list);
+		while ((fw = TAILQ_FIRST(&fs->fs_written)) != NULL) {
+			TAILQ_REMOVE(&fs->fs_written, fw, fw_list);
+			fconn_write_free(fw);
+		}
+
+		/* The connection was destroyed while we were sending */
+		if ((fc = fs->fs_fc) != NULL) {
+			fc->fc_sender = NULL;
+
+			if (fs->fs_error) {
+				fconn_log(LOG_INFO, fc, "write error: %s",
+					  strerror(fs->fs_error));
+				fconn_close(fc, 0);
+			} else
+				fconn_pump(fc);
+		}
+
+		free(fs);
+	}
+}
+#endif	/* USE_SENDFILE */
+
 /*
  * Write raw data to a feeder connection.  This is more efficient than
  * fconn_printf, and never copies.
@@ -679,14 +1231,12 @@ fconn_puts(fc, text)
 	fconn_t		*fc;
 	char const	*text;
 {
-uv_write_t	*wr;
-uv_buf_t         ubuf;
-	wr = xcalloc(1, sizeof(*wr));
-
-	ubuf = uv_buf_init(xstrdup(text), strlen(text));
-	wr->data = fc;
+fconn_write_t	*fw;
 
-	uv_write(wr, (uv_stream_t *) &fc->fc_stream, &ubuf, 1, on_fconn_write_done);
+	fw = xcalloc(1, sizeof(*fw));
+	fw->fw_buf = xstrdup(text);
+	fw->fw_len = strlen(text);
+	fconn_send(fc, fw);
 }
 
 /*
@@ -833,8 +1383,8 @@ fconn_check(fc, qe)
 static void
 fconn_takethis(fconn_t *fc, qent_t *qe)
 {
-spool_header_t	  hdr;
-char		 *text;
+fconn_write_t	*fw;
+int		 len, flags = 0;
 
 	/*
 	 * If this article has already been offered, don't offer it
@@ -848,14 +1398,22 @@ char		 *text;
 		return;
 	}
 
+#ifdef USE_SENDFILE
+	flags |= SPOOL_VIEW_FD;
+#endif
+
 	/*
 	 * Most likely cause of this is that the spool file containing
 	 * the article expired.
 	 */
-	if (!spool_fetch_text(qe->qe_pos.sp_id, qe->qe_pos.sp_offset, &hdr, &text)) {
+	fw = xcalloc(1, sizeof(*fw));
+	if (spool_view(qe->qe_pos.sp_id, qe->qe_pos.sp_offset,
+		       &fw->fw_view, flags) == -1) {
+		free(fw);
 		qefree(qe);
 		return;
 	}
+	fw->fw_article = 1;
 
 	hash_insert(fc->fc_feeder->fe_pending,
 		    qe->qe_msgid,
@@ -867,10 +1425,14 @@ char		 *text;
 	++fc->fc_ncq;
 	TAILQ_INSERT_TAIL(&fc->fc_cq, qe, qe_list);
 
-	fconn_printf(fc, "TAKETHIS %s\r\n%s.\r\n",
-			qe->qe_msgid,
-			text);
-	free(text);
+	/*
+	 * Send the article straight from the spool view, without copying it,
+	 * or with sendfile() if the view is a file.
+	 */
+	len = strlen(qe->qe_msgid) + sizeof("TAKETHIS \r\n");
+	fw->fw_buf = xmalloc(len);
+	fw->fw_len = snprintf(fw->fw_buf, len, "TAKETHIS %s\r\n", qe->qe_msgid);
+	fconn_send(fc, fw);
 }
 
 static void
@@ -1076,6 +1638,24 @@ static void
 fconn_destroy(fc)
 	fconn_t	*fc;
 {
+fconn_write_t	*fw;
+
+#ifdef USE_SENDFILE
+	/*
+	 * If articles are being sent, shut down the sender's copy of the
+	 * socket so it stops waiting, and tell it the connection has gone.
+	 */
+	if (fc->fc_sender) {
+		shutdown(fc->fc_sender->fs_sock, SHUT_RDWR);
+		fc->fc_sender->fs_fc = NULL;
+	}
+#endif
+
+	while ((fw = TAILQ_FIRST(&fc->fc_sendq)) != NULL) {
+		TAILQ_REMOVE(&fc->fc_sendq, fw, fw_list);
+		fconn_write_free(fw);
+	}
+
 	if (fc->fc_addrs)
 		uv_freeaddrinfo(fc->fc_addrs);
 
@@ -1119,6 +1699,7 @@ fconn_t	*fc;
 	fc = xcalloc(1, sizeof(*fc));
 	fc->fc_feeder = fe;
 	TAILQ_INIT(&fc->fc_cq);
+	TAILQ_INIT(&fc->fc_sendq);
 
 	return fc;
 }
@@ -40,8 +40,28 @@ struct	feeder;
 #define	FC_FULL		0x2
 #define	FC_DRAIN	0x4
 
+/*
+ * A write to a feeder connection: either a command, or an article (a
+ * TAKETHIS command followed by the article from a spool view).
+ */
+typedef struct fconn_write {
+	uv_write_t		 fw_req;
+	struct fconn		*fw_fc;
+	char			*fw_buf;
+	size_t			 fw_len;
+	int			 fw_article;
+	spool_view_t		 fw_view;
+	size_t			 fw_pos;
+	TAILQ_ENTRY(fconn_write) fw_list;
+} fconn_write_t;
+
+typedef TAILQ_HEAD(fconn_write_list, fconn_write) fconn_write_list_t;
+
+struct fconn_sender;
+
 typedef struct fconn {
 	uv_tcp_t		 fc_stream;
+	int			 fc_sock;
 	struct feeder		*fc_feeder;
 	char			*fc_strname;
 	fconn_state_t		 fc_state;
@@ -53,6 +73,9 @@ typedef struct fconn {
 				*fc_cur_addr;
 	int			 fc_flags;
 	charq_t			*fc_rdbuf;
+	int			 fc_nwrites;
+	fconn_write_list_t	 fc_sendq;
+	struct fconn_sender	*fc_sender;
 	TAILQ_ENTRY(fconn)	 fc_list;
 } fconn_t;
 
@@ -75,6 +98,7 @@ typedef struct feeder {
 
 int	feeder_init(void);
 int	feeder_run(void);
+int	feeder_start(void);
 void	feeder_shutdown(void);
 void	feeder_notify(struct feeder *);
 
@@ -208,8 +208,9 @@ hash_remove(table, key, keylen)
 uint32_t	 h;
 hash_bucket_t	*head;
 hash_item_t	*ie;
+void		*data;
 
-	h = nts_hash4(key, keylen) & (table->ht_nbuckets - 1);
+	h = table->ht_hash(key, keylen) & (table->ht_nbuckets - 1);
 	assert(h < table->ht_nbuckets);
 	head = &table->ht_buckets[h];
 
@@ -219,12 +220,13 @@ hash_item_t	*ie;
 		if (table->ht_compare(key, ie->hi_key, keylen))
 			continue;
 
+		data = ie->hi_data;
 		if (table->ht_data_free)
 			table->ht_data_free(ie->hi_data);
 		LIST_REMOVE(ie, hi_link);
 		free(ie->hi_key);
 		free(ie);
-		return ie->hi_data;
+		return data;
 	}
 
 	return NULL;
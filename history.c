@@ -1,5 +1,5 @@
 /* RT/NTS -- a lightweight, high performance news transit server. */
-/* 
+/*
  * Copyright (c) 2011-2013 River Tarnell.
  *
  * Permission is granted to anyone to use this software for any purpose,
@@ -8,10 +8,24 @@
  * warranty.
  */
 
+/*
+ * The history is stored as a set of time partitions.  Each partition is a
+ * hash database (history.<start>.db) mapping message-id to arrival time,
+ * and holds every article which arrived during [start, start + period).
+ * Lookups probe the newest partition first, since that's where a duplicate
+ * is most likely to be; expiry simply removes whole partitions once their
+ * newest possible entry is older than history-remember.
+ */
+
+#include	<sys/types.h>
+#include	<sys/stat.h>
+
 #include	<time.h>
 #include	<string.h>
 #include	<stdlib.h>
+#include	<stdio.h>
 #include	<assert.h>
+#include	<dirent.h>
 
 #include	<db.h>
 
@@ -21,19 +35,60 @@
 #include	"database.h"
 #include	"nts.h"
 #include	"historymsg.h"
+#include	"hash.h"
+
+typedef struct history_part {
+	time_t	 hp_start;
+	time_t	 hp_end;
+	DB	*hp_db;
+	DB	*hp_idx;	/* Secondary index, legacy history only */
+	char	 hp_name[64];
+} history_part_t;
 
 static int	 history_get_msgid(DB *, DBT const *, DBT const *, DBT *);
 static void	 history_clean(uv_work_t *);
 static void	 history_clean_done(uv_work_t *, int);
 static void	 history_run_clean(uv_timer_t *, int);
 
-static DB		*history_db;
-static DB		*history_by_msgid;
+static int	 history_open_part(history_part_t *, time_t, int);
+static int	 history_open_legacy(void);
+static void	 history_close_part(history_part_t *);
+static history_part_t *history_current_part(time_t);
+static history_part_t *history_find_part(time_t);
+static int	 history_part_get(history_part_t *, DB_TXN *, DBT *, DBT *);
+static void	 history_insert_part(history_part_t *);
+static int	 history_put(char const **, int);
+
+/*
+ * A reservation is a tentative history entry for an article which is
+ * being received; it's held in memory until the article is either
+ * committed to the history or cancelled.  While the reservation exists,
+ * other attempts to reserve the same message-id return HISTORY_BUSY.
+ */
+struct history_resv {
+	char	*hr_msgid;
+};
+
+static hash_table_t	*history_resv_table;
+static uv_mutex_t	 history_resv_mtx;
+
+/*
+ * Partitions, sorted newest first.  history_lock protects the array itself;
+ * database operations are done with the read lock held, so a partition
+ * can't be closed while something is using it.
+ */
+static history_part_t	**history_parts;
+static int		  history_nparts;
+static uv_rwlock_t	  history_lock;
+
 static uint64_t		 remember;
+static uint64_t		 history_period = 60 * 60 * 24;
 static uv_timer_t	 history_clean_timer;
 
 static config_schema_opt_t history_opts[] = {
 	{ "remember", OPT_TYPE_DURATION, config_simple_duration, &remember },
+	{ "partition-period", OPT_TYPE_DURATION,
+	  config_simple_duration, &history_period },
 	{ }
 };
 
@@ -45,74 +100,291 @@ int
 history_init()
 {
 	config_add_stanza(&history_stanza);
+	uv_rwlock_init(&history_lock);
+	uv_mutex_init(&history_resv_mtx);
+	history_resv_table = hash_new(4096, NULL, NULL, NULL);
 	return 0;
 }
 
 int
 history_run()
 {
-int	ret;
+char const	*home;
+DIR		*dir;
+struct dirent	*de;
+int		 ret, i;
+
+	if (history_period < 60) {
+		nts_logm(HISTORY_fac, M_HISTORY_BADPERIOD);
+		return -1;
+	}
 
-	if (ret = db_create(&history_db, db_env, 0)) {
+	if (ret = db_env->get_home(db_env, &home)) {
 		nts_logm(HISTORY_fac, M_HISTORY_HDLERR, db_strerror(ret));
 		return -1;
 	}
 
-	/* 250 = msg-id; 8 = timestamp */
-	if (ret = history_db->set_re_len(history_db, 250 + 8)) {
-		nts_logm(HISTORY_fac, M_HISTORY_RLNFAIL, db_strerror(ret));
+	if ((dir = opendir(home)) == NULL) {
+		nts_logm(HISTORY_fac, M_HISTORY_DIRFAIL, home, strerror(errno));
 		return -1;
 	}
 
-	if (ret = history_db->set_re_pad(history_db, '\0')) {
-		nts_logm(HISTORY_fac, M_HISTORY_PADFAIL, db_strerror(ret));
+	while (de = readdir(dir)) {
+	history_part_t	*hp;
+	unsigned long	 start;
+	char		 junk;
+
+		if (sscanf(de->d_name, "history.%lu.d%c", &start, &junk) != 2 ||
+		    junk != 'b')
+			continue;
+
+		hp = xcalloc(1, sizeof(*hp));
+		if (history_open_part(hp, (time_t) start, 0) == -1) {
+			free(hp);
+			closedir(dir);
+			return -1;
+		}
+
+		history_insert_part(hp);
+	}
+	closedir(dir);
+
+	if (history_open_legacy() == -1)
+		return -1;
+
+	if (history_current_part(time(NULL)) == NULL)
 		return -1;
+
+	/* Newest partitions are the most likely to be hit */
+	for (i = 0; i < history_nparts; i++) {
+	history_part_t	*hp = history_parts[i];
+		if (hp->hp_idx)
+			db_preload_add(hp->hp_idx, "history_msgid.idx");
+		else
+			db_preload_add(hp->hp_db, hp->hp_name);
 	}
 
-	if (ret = history_db->set_q_extentsize(history_db, 262144000)) {
-		nts_logm(HISTORY_fac, M_HISTORY_EXTNFAIL, db_strerror(ret));
+	uv_timer_init(loop, &history_clean_timer);
+	uv_timer_start(&history_clean_timer, history_run_clean, 60 * 1000, 60 * 1000);
+
+	return 0;
+}
+
+/*
+ * Open (or create) the partition starting at the given time.
+ */
+static int
+history_open_part(hp, start, create)
+	history_part_t	*hp;
+	time_t		 start;
+{
+int	ret;
+
+	hp->hp_start = start;
+	hp->hp_end = start + history_period;
+	snprintf(hp->hp_name, sizeof(hp->hp_name), "history.%lu.db",
+		 (unsigned long) start);
+
+	if (ret = db_create(&hp->hp_db, db_env, 0)) {
+		nts_logm(HISTORY_fac, M_HISTORY_HDLERR, db_strerror(ret));
+		return -1;
+	}
+
+	if (ret = hp->hp_db->open(hp->hp_db, NULL, hp->hp_name, NULL,
+			DB_HASH, DB_CREATE | DB_AUTO_COMMIT | DB_THREAD, 0600)) {
+		nts_logm(HISTORY_fac, M_HISTORY_OPNFAIL,
+			 hp->hp_name, db_strerror(ret));
+		hp->hp_db->close(hp->hp_db, 0);
+		return -1;
+	}
+
+	if (create)
+		nts_logm(HISTORY_fac, M_HISTORY_PARTNEW, hp->hp_name);
+	return 0;
+}
+
+/*
+ * Older versions of NTS stored the history in a single queue database,
+ * with a secondary message-id index.  If one exists, keep using it for
+ * lookups until the newest entry in it has expired, then remove it.
+ */
+static int
+history_open_legacy()
+{
+history_part_t	*hp;
+DBC		*curs;
+DBT		 key, data;
+db_recno_t	 recno;
+char		 dbuf[258];
+char const	*home;
+char		 path[1024];
+struct stat	 sb;
+int		 ret;
+
+	/* No legacy history, which is the normal case */
+	db_env->get_home(db_env, &home);
+	snprintf(path, sizeof(path), "%s/history.db", home);
+	if (stat(path, &sb) == -1)
+		return 0;
+
+	hp = xcalloc(1, sizeof(*hp));
+	strlcpy(hp->hp_name, "history.db", sizeof(hp->hp_name));
+
+	if (ret = db_create(&hp->hp_db, db_env, 0)) {
+		nts_logm(HISTORY_fac, M_HISTORY_HDLERR, db_strerror(ret));
+		free(hp);
 		return -1;
 	}
 
-	if (ret = history_db->open(history_db, NULL, "history.db", NULL,
-			DB_QUEUE, DB_CREATE | DB_AUTO_COMMIT, 0600)) {
+	if (ret = hp->hp_db->open(hp->hp_db, NULL, "history.db", NULL,
+			DB_QUEUE, DB_AUTO_COMMIT | DB_THREAD, 0600)) {
 		nts_logm(HISTORY_fac, M_HISTORY_OPNFAIL,
 			 "history.db", db_strerror(ret));
 		return -1;
 	}
 
-	if (ret = db_create(&history_by_msgid, db_env, 0)) {
+	if (ret = db_create(&hp->hp_idx, db_env, 0)) {
 		nts_logm(HISTORY_fac, M_HISTORY_HDLERR, db_strerror(ret));
 		return -1;
 	}
 
-	if (ret = history_by_msgid->open(history_by_msgid, NULL, "history_msgid.idx", NULL,
-			DB_HASH, DB_CREATE | DB_AUTO_COMMIT, 0600)) {
+	if (ret = hp->hp_idx->open(hp->hp_idx, NULL, "history_msgid.idx", NULL,
+			DB_HASH, DB_CREATE | DB_AUTO_COMMIT | DB_THREAD, 0600)) {
 		nts_logm(HISTORY_fac, M_HISTORY_OPNFAIL,
 			 "history_msgid.idx", db_strerror(ret));
 		return -1;
 	}
 
-	if (ret = history_db->associate(history_db, NULL, history_by_msgid, 
+	if (ret = hp->hp_db->associate(hp->hp_db, NULL, hp->hp_idx,
 					history_get_msgid, DB_AUTO_COMMIT)) {
 		nts_logm(HISTORY_fac, M_HISTORY_ASSCFAIL, db_strerror(ret));
 		return -1;
 	}
 
-	uv_timer_init(loop, &history_clean_timer);
-	uv_timer_start(&history_clean_timer, history_run_clean, 3600 * 1000, 3600 * 1000);
+	/*
+	 * The legacy history expires when its newest entry does; treat it
+	 * as a partition ending at that time.
+	 */
+	bzero(&key, sizeof(key));
+	key.data = &recno;
+	key.ulen = sizeof(recno);
+	key.flags = DB_DBT_USERMEM;
+
+	bzero(&data, sizeof(data));
+	data.data = dbuf;
+	data.ulen = sizeof(dbuf);
+	data.flags = DB_DBT_USERMEM;
+
+	if (ret = hp->hp_db->cursor(hp->hp_db, NULL, &curs, 0))
+		panic("history: cannot open cursor: %s", db_strerror(ret));
+
+	if ((ret = curs->get(curs, &key, &data, DB_LAST)) == 0)
+		hp->hp_end = int64get(dbuf);
+	else if (ret != DB_NOTFOUND)
+		panic("history: cannot fetch entries: %s", db_strerror(ret));
+	curs->c_close(curs);
 
+	hp->hp_start = 0;
+	nts_logm(HISTORY_fac, M_HISTORY_LEGACY, hp->hp_name);
+	history_insert_part(hp);
 	return 0;
 }
 
+static void
+history_close_part(hp)
+	history_part_t	*hp;
+{
+	if (hp->hp_idx)
+		hp->hp_idx->close(hp->hp_idx, 0);
+	if (hp->hp_db)
+		hp->hp_db->close(hp->hp_db, 0);
+	hp->hp_idx = hp->hp_db = NULL;
+}
+
+/*
+ * Insert a partition into the list, keeping it sorted newest first.
+ * Caller must hold the write lock (or be running before any threads).
+ */
+static void
+history_insert_part(hp)
+	history_part_t	*hp;
+{
+int	i;
+
+	history_parts = xrealloc(history_parts,
+			sizeof(*history_parts) * (history_nparts + 1));
+
+	for (i = history_nparts; i > 0; i--) {
+		if (history_parts[i - 1]->hp_start >= hp->hp_start)
+			break;
+		history_parts[i] = history_parts[i - 1];
+	}
+
+	history_parts[i] = hp;
+	history_nparts++;
+}
+
+/*
+ * Return the partition new entries arriving at 'now' should go in,
+ * creating it if necessary.  Must be called without the lock held.
+ */
+static history_part_t *
+history_current_part(now)
+	time_t	now;
+{
+history_part_t	*hp;
+time_t		 start = now - (now % history_period);
+
+	uv_rwlock_rdlock(&history_lock);
+	if (history_nparts && history_parts[0]->hp_start == start) {
+		hp = history_parts[0];
+		uv_rwlock_rdunlock(&history_lock);
+		return hp;
+	}
+	uv_rwlock_rdunlock(&history_lock);
+
+	uv_rwlock_wrlock(&history_lock);
+	if (history_nparts && history_parts[0]->hp_start >= start) {
+		hp = history_parts[0];
+		uv_rwlock_wrunlock(&history_lock);
+		return hp;
+	}
+
+	hp = xcalloc(1, sizeof(*hp));
+	if (history_open_part(hp, start, 1) == -1) {
+		free(hp);
+		uv_rwlock_wrunlock(&history_lock);
+		return NULL;
+	}
+
+	history_insert_part(hp);
+	uv_rwlock_wrunlock(&history_lock);
+	return hp;
+}
+
+/*
+ * Look up a message-id in one partition.  Returns 0 if found, otherwise
+ * a Berkeley DB error.
+ */
+static int
+history_part_get(hp, txn, key, data)
+	history_part_t	*hp;
+	DB_TXN		*txn;
+	DBT		*key, *data;
+{
+	if (hp->hp_idx)
+		return hp->hp_idx->get(hp->hp_idx, txn, key, data, 0);
+	return hp->hp_db->get(hp->hp_db, txn, key, data, 0);
+}
+
 int
 history_check(mid)
 	char const	*mid;
 {
 DBT		key, data;
-int		ret;
+int		ret, i;
 char		dbuf[258];
-	
+
 	bzero(&key, sizeof(key));
 	bzero(&data, sizeof(data));
 
@@ -123,46 +395,74 @@ char		dbuf[258];
 	data.ulen = sizeof(dbuf);
 	data.flags |= DB_DBT_USERMEM;
 
-	for (;;) {
-		if (ret = history_by_msgid->get(history_by_msgid, NULL, &key, &data, 0)) {
-			if (ret == DB_LOCK_DEADLOCK)
-				continue;
+	uv_rwlock_rdlock(&history_lock);
 
-			if (ret == DB_NOTFOUND)
-				return 0;
+	for (i = 0; i < history_nparts; i++) {
+		while ((ret = history_part_get(history_parts[i], NULL,
+						&key, &data)) == DB_LOCK_DEADLOCK)
+			;
 
-			panic("history: failed to fetch history entry: %s", db_strerror(ret));
+		if (ret == 0) {
+			uv_rwlock_rdunlock(&history_lock);
+			return 1;
 		}
 
-		return 1;
+		if (ret != DB_NOTFOUND)
+			panic("history: failed to fetch history entry: %s", db_strerror(ret));
 	}
 
-	return 1;
+	uv_rwlock_rdunlock(&history_lock);
+	return 0;
 }
 
 int
 history_add_multiple(mids)
 	char const	**mids;
+{
+	return history_put(mids, 1);
+}
+
+int
+history_add(mid)
+	char const	*mid;
+{
+char const	*mids[2];
+
+	mids[0] = mid;
+	mids[1] = NULL;
+	return history_put(mids, 1);
+}
+
+/*
+ * Add a NULL-terminated list of entries to the current partition, in a
+ * single transaction.  If probe is set, entries already in an older
+ * partition are skipped; the current partition is always checked by the
+ * put itself.
+ */
+static int
+history_put(mids, probe)
+	char const	**mids;
 {
 DBT		 key, data;
-int		 ret;
+int		 ret, i;
 time_t		 now = time(NULL);
 char		 dbuf[258];
 DB_TXN		*txn;
-const char	**p;
-db_recno_t	 recno;
+history_part_t	*cur;
+uint64_t	 start;
+char const	**p;
+
+	if ((cur = history_current_part(now)) == NULL)
+		panic("history: cannot create history partition");
 
 	bzero(&key, sizeof(key));
 	bzero(&data, sizeof(data));
+	data.data = dbuf;
+	data.ulen = sizeof(dbuf);
+	data.flags = DB_DBT_USERMEM;
 
-	key.data = &recno;
-	key.ulen = sizeof(recno);
-	key.flags = DB_DBT_USERMEM;
-
-	data.data = &dbuf;
-	data.size = sizeof(dbuf);
-
-	int64put(dbuf, now);
+	uv_rwlock_rdlock(&history_lock);
+	start = uv_hrtime();
 
 	for (;;) {
 		txn = db_new_txn(DB_TXN_WRITE_NOSYNC);
@@ -170,16 +470,41 @@ db_recno_t	 recno;
 		for (p = mids; *p; p++) {
 			assert(strlen(*p) <= 250);
 
-			bzero(dbuf + 8, 250);
-			bcopy(*p, dbuf + 8, strlen(*p));
+			key.data = (void *) *p;
+			key.size = strlen(*p);
+
+			for (i = 0; probe && i < history_nparts; i++) {
+				if (history_parts[i] == cur)
+					continue;
+
+				ret = history_part_get(history_parts[i], txn,
+						       &key, &data);
+				if (ret == 0)
+					break;
 
-			recno = 0;
-			if (ret = history_db->put(history_db, txn, &key, &data, DB_APPEND)) {
+				if (ret == DB_LOCK_DEADLOCK)
+					goto tryagain;
+
+				if (ret != DB_NOTFOUND)
+					panic("history: failed to check history entry: %s",
+					      db_strerror(ret));
+			}
+
+			/* Already in an older partition */
+			if (probe && i < history_nparts)
+				continue;
+
+			int64put(dbuf, now);
+			data.size = 8;
+
+			if (ret = cur->hp_db->put(cur->hp_db, txn, &key, &data,
+						  DB_NOOVERWRITE)) {
 				if (ret == DB_LOCK_DEADLOCK)
 					goto tryagain;
 
 				if (ret != DB_KEYEXIST)
-					panic("history: failed to add history entry: %s", db_strerror(ret));
+					panic("history: failed to add history entry: %s",
+					      db_strerror(ret));
 			}
 		}
 
@@ -190,75 +515,196 @@ db_recno_t	 recno;
 		txn->abort(txn);
 	}
 
+	uv_rwlock_rdunlock(&history_lock);
+	db_txn_latency((uv_hrtime() - start) / 1000);
 	return 0;
 }
-int
-history_add(mid)
-	char const	*mid;
+
+/*
+ * Return the partition holding entries which arrived at 'when', creating
+ * it if necessary.  Unlike history_current_part(), this works for any
+ * time, not just the newest partition.  Must be called without the lock
+ * held.
+ */
+static history_part_t *
+history_find_part(when)
+	time_t	when;
 {
-DBT		 key, mkey, data;
-int		 ret;
-time_t		 now = time(NULL);
-char		 dbuf[250 + 8];
+history_part_t	*hp;
+time_t		 start = when - (when % history_period);
+int		 i;
+
+	uv_rwlock_wrlock(&history_lock);
+	for (i = 0; i < history_nparts; i++) {
+		hp = history_parts[i];
+		if (!hp->hp_idx && hp->hp_start <= when && when < hp->hp_end) {
+			uv_rwlock_wrunlock(&history_lock);
+			return hp;
+		}
+	}
+
+	hp = xcalloc(1, sizeof(*hp));
+	if (history_open_part(hp, start, 1) == -1) {
+		free(hp);
+		uv_rwlock_wrunlock(&history_lock);
+		return NULL;
+	}
+
+	history_insert_part(hp);
+	uv_rwlock_wrunlock(&history_lock);
+	return hp;
+}
+
+static int
+history_ent_cmp(a_, b_)
+	void const	*a_, *b_;
+{
+history_ent_t const	*a = a_, *b = b_;
+
+	if (a->he_part != b->he_part)
+		return a->he_part < b->he_part ? -1 : 1;
+	return strcmp(a->he_msgid, b->he_msgid);
+}
+
+/*
+ * Add a batch of entries at once, as when rebuilding the history.  The
+ * batch is sorted by partition and message-id, and each partition's
+ * entries are added in a few large transactions rather than one for each
+ * entry.  Older partitions aren't checked, and entries which have already
+ * expired are skipped.  Returns the number of entries added.
+ */
+#define	HISTORY_LOAD_TXN	1000	/* Entries per transaction */
+
+size_t
+history_load(ents, nents)
+	history_ent_t	*ents;
+	size_t		 nents;
+{
+history_part_t	*hp;
+time_t		 oldest = time(NULL) - history_remember;
+size_t		 i, j, n, added = 0, tadded;
+DBT		 key, data;
 DB_TXN		*txn;
-db_recno_t	 recno = 0;
+char		 dbuf[8];
+int		 ret;
+
+	for (i = 0; i < nents; i++)
+		ents[i].he_part = ents[i].he_time - (ents[i].he_time % history_period);
+	qsort(ents, nents, sizeof(*ents), history_ent_cmp);
 
 	bzero(&key, sizeof(key));
 	bzero(&data, sizeof(data));
+	data.data = dbuf;
+	data.size = sizeof(dbuf);
 
-	key.data = &recno;
-	key.size = sizeof(recno);
-	key.ulen = sizeof(recno);
-	key.flags = DB_DBT_USERMEM;
+	for (i = 0; i < nents; i += n) {
+		for (n = 1; i + n < nents && n < HISTORY_LOAD_TXN &&
+		     ents[i + n].he_part == ents[i].he_part; n++)
+			;
 
-	bzero(&mkey, sizeof(mkey));
-	mkey.data = (void *) mid;
-	mkey.size = strlen(mid);
+		if (ents[i].he_part + (time_t) history_period <= oldest)
+			continue;
 
-	data.data = &dbuf;
-	data.size = sizeof(dbuf);
-	data.ulen = sizeof(dbuf);
-	data.flags = DB_DBT_USERMEM;
+		if ((hp = history_find_part(ents[i].he_time)) == NULL)
+			panic("history: cannot create history partition");
 
-	for (;;) {
-		txn = db_new_txn(DB_TXN_WRITE_NOSYNC);
+		uv_rwlock_rdlock(&history_lock);
+		for (;;) {
+			txn = db_new_txn(DB_TXN_WRITE_NOSYNC);
+			tadded = 0;
 
-		ret = history_by_msgid->get(history_by_msgid, txn, &mkey, &data, DB_RMW);
-		if (ret == 0) {
-			txn->abort(txn);
-			return 0;
-		}
+			for (j = i; j < i + n; j++) {
+				key.data = (void *) ents[j].he_msgid;
+				key.size = strlen(ents[j].he_msgid);
+				int64put(dbuf, ents[j].he_time);
+
+				ret = hp->hp_db->put(hp->hp_db, txn, &key, &data,
+						     DB_NOOVERWRITE);
+				if (ret == 0)
+					tadded++;
+				else if (ret == DB_LOCK_DEADLOCK)
+					break;
+				else if (ret != DB_KEYEXIST)
+					panic("history: failed to add history entry: %s",
+					      db_strerror(ret));
+			}
 
-		if (ret == DB_LOCK_DEADLOCK) {
+			if (j == i + n)
+				break;
 			txn->abort(txn);
-			continue;
 		}
 
-		if (ret && (ret != DB_NOTFOUND))
-			panic("history: failed to check history entry: %s",
+		if (ret = txn->commit(txn, 0))
+			panic("history: cannot commit history txn: %s",
 			      db_strerror(ret));
+		uv_rwlock_rdunlock(&history_lock);
+		added += tadded;
+	}
 
-		bzero(dbuf, sizeof(dbuf));
-		int64put(dbuf, now);
+	return added;
+}
 
-		assert(strlen(mid) <= 250);
-		bcopy(mid, dbuf + 8, strlen(mid));
+int
+history_reserve(mid, resvp)
+	char const	 *mid;
+	history_resv_t	**resvp;
+{
+history_resv_t	*hr;
 
-		if (ret = history_db->put(history_db, txn, &key, &data, DB_APPEND)) {
-			if (ret == DB_LOCK_DEADLOCK) {
-				txn->abort(txn);
-				continue;
-			}
+	*resvp = NULL;
 
-			if (ret != DB_KEYEXIST)
-				panic("history: failed to add history entry: %s", db_strerror(ret));
-		}
+	uv_mutex_lock(&history_resv_mtx);
+	if (hash_find(history_resv_table, mid, strlen(mid))) {
+		uv_mutex_unlock(&history_resv_mtx);
+		return HISTORY_BUSY;
+	}
 
-		txn->commit(txn, 0);
-		break;
+	hr = xcalloc(1, sizeof(*hr));
+	hr->hr_msgid = xstrdup(mid);
+	hash_insert(history_resv_table, mid, strlen(mid), hr);
+	uv_mutex_unlock(&history_resv_mtx);
+
+	/*
+	 * The reservation is visible before the history is probed, so
+	 * a concurrent reserve for the same message-id can't slip in
+	 * between the probe and the commit.
+	 */
+	if (history_check(mid)) {
+		history_cancel(hr);
+		return HISTORY_PRESENT;
 	}
 
-	return 0;
+	*resvp = hr;
+	return HISTORY_RESERVED;
+}
+
+void
+history_commit(hr)
+	history_resv_t	*hr;
+{
+char const	*mids[2];
+
+	/*
+	 * history_reserve already checked every partition, so there's no
+	 * need to probe again; add the entry before dropping the
+	 * reservation so there's no window where neither exists.
+	 */
+	mids[0] = hr->hr_msgid;
+	mids[1] = NULL;
+	history_put(mids, 0);
+	history_cancel(hr);
+}
+
+void
+history_cancel(hr)
+	history_resv_t	*hr;
+{
+	uv_mutex_lock(&history_resv_mtx);
+	hash_remove(history_resv_table, hr->hr_msgid, strlen(hr->hr_msgid));
+	uv_mutex_unlock(&history_resv_mtx);
+
+	free(hr->hr_msgid);
+	free(hr);
 }
 
 static int
@@ -285,8 +731,23 @@ history_run_clean(timer, status)
 	uv_timer_t	*timer;
 {
 uv_work_t	*req;
-	req = xcalloc(1, sizeof(*req));
+time_t		 oldest = time(NULL) - history_remember;
+int		 i, expired = 0;
+
+	/*
+	 * Don't bother the threadpool unless a partition has actually
+	 * expired; this runs every minute.
+	 */
+	uv_rwlock_rdlock(&history_lock);
+	for (i = 1; i < history_nparts; i++)
+		if (history_parts[i]->hp_end <= oldest)
+			expired = 1;
+	uv_rwlock_rdunlock(&history_lock);
+
+	if (!expired)
+		return;
 
+	req = xcalloc(1, sizeof(*req));
 	uv_queue_work(loop, req, history_clean, history_clean_done);
 }
 
@@ -301,108 +762,97 @@ static void
 history_clean(req)
 	uv_work_t	*req;
 {
-time_t		 oldest;
-DBT		 key, data, delkeys;
-size_t		 expired = 0;
-char		 dbuf[258];
-db_recno_t	 kbuf;
-
-#define BSZ	(258 * 100)
-
-	bzero(&key, sizeof(key));
-	key.data = &kbuf;
-	key.ulen = sizeof(kbuf);
-	key.flags = DB_DBT_USERMEM;
-
-	bzero(&data, sizeof(data));
-	data.data = dbuf;
-	data.ulen = sizeof(dbuf);
-	data.flags |= DB_DBT_USERMEM;
-
-	bzero(&delkeys, sizeof(delkeys));
-	delkeys.data = xmalloc(BSZ);
-	delkeys.ulen = BSZ;
-
-	oldest = time(NULL) - history_remember;
-
-	for (;;) {
-	DBC		*curs;
+time_t		  oldest = time(NULL) - history_remember;
+history_part_t	**expired;
+int		  nexpired = 0, i;
+
+	/*
+	 * Detach expired partitions under the write lock, so nothing can be
+	 * using them, then close and remove them without it.  The newest
+	 * partition is never expired.
+	 */
+	uv_rwlock_wrlock(&history_lock);
+	expired = xcalloc(history_nparts, sizeof(*expired));
+	while (history_nparts > 1 &&
+	       history_parts[history_nparts - 1]->hp_end <= oldest)
+		expired[nexpired++] = history_parts[--history_nparts];
+	uv_rwlock_wrunlock(&history_lock);
+
+	for (i = 0; i < nexpired; i++) {
+	history_part_t	*hp = expired[i];
 	int		 ret;
-	DB_TXN		*txn;
-	void		*p;
-	int		 n = 100;
 
-		txn = db_new_txn(DB_TXN_WRITE_NOSYNC);
+		history_close_part(hp);
 
-		if (ret = history_db->cursor(history_db, txn, &curs, 0))
-			panic("history: cannot open cursor: %s", db_strerror(ret));
+		if (ret = db_env->dbremove(db_env, NULL, hp->hp_name, NULL,
+					   DB_AUTO_COMMIT))
+			nts_logm(HISTORY_fac, M_HISTORY_RMFAIL,
+				 hp->hp_name, db_strerror(ret));
+		else
+			nts_logm(HISTORY_fac, M_HISTORY_PARTEXP, hp->hp_name);
 
-		DB_MULTIPLE_RECNO_WRITE_INIT(p, &delkeys);
+		if (strcmp(hp->hp_name, "history.db") == 0 &&
+		    (ret = db_env->dbremove(db_env, NULL, "history_msgid.idx",
+					    NULL, DB_AUTO_COMMIT)))
+			nts_logm(HISTORY_fac, M_HISTORY_RMFAIL,
+				 "history_msgid.idx", db_strerror(ret));
 
-		for (n = 0; n < 100; n++) {
-		time_t	added;
+		free(hp);
+	}
 
-			if (ret = curs->get(curs, &key, &data, DB_NEXT)) {
-				if (ret == DB_LOCK_DEADLOCK) {
-					curs->c_close(curs);
-					goto deadlock;
-				}
-				if (ret == DB_NOTFOUND)
-					break;
-				panic("history: cannot fetch entries: %s", db_strerror(ret));
-			}
-			added = int64get(data.data);
-			if (added >= oldest)
-				break;
-			DB_MULTIPLE_RECNO_WRITE_NEXT(p, &delkeys, kbuf, NULL, 0);
-		}
-		curs->c_close(curs);
-		curs = NULL;
+	free(expired);
+}
 
-		if (n == 0) {
-			if (ret = txn->commit(txn, 0)) {
-				if (ret == DB_LOCK_DEADLOCK)
-					goto deadlock;
-				panic("history: cannot removed expired entries: %s",
-						db_strerror(ret));
+int
+history_get_partitions(info)
+	history_part_info_t	**info;
+{
+int	i, n;
+
+	uv_rwlock_rdlock(&history_lock);
+	n = history_nparts;
+	*info = xcalloc(n ? n : 1, sizeof(**info));
+
+	for (i = 0; i < n; i++) {
+	history_part_t		*hp = history_parts[i];
+	history_part_info_t	*hi = &(*info)[i];
+	DB_HASH_STAT		*hs;
+	DB_QUEUE_STAT		*qs;
+
+		strlcpy(hi->hpi_name, hp->hp_name, sizeof(hi->hpi_name));
+		hi->hpi_start = hp->hp_start;
+		hi->hpi_end = hp->hp_end;
+
+		if (hp->hp_idx) {
+			if (hp->hp_db->stat(hp->hp_db, NULL, &qs, DB_FAST_STAT) == 0) {
+				hi->hpi_entries = qs->qs_nkeys;
+				hi->hpi_bytes = (uint64_t) qs->qs_pages * qs->qs_pagesize;
+				free(qs);
 			}
-			break;
-		}
-
-		if (ret = history_db->del(history_db, txn, &delkeys, DB_MULTIPLE)) {
-			if (ret == DB_LOCK_DEADLOCK)
-				goto deadlock;
-			panic("history: cannot removed expired entries: %s",
-					db_strerror(ret));
-
+		} else if (hp->hp_db->stat(hp->hp_db, NULL, &hs, DB_FAST_STAT) == 0) {
+			hi->hpi_entries = hs->hash_nkeys;
+			hi->hpi_bytes = (uint64_t) hs->hash_pagecnt * hs->hash_pagesize;
+			free(hs);
 		}
-		if (ret = txn->commit(txn, 0)) {
-			if (ret == DB_LOCK_DEADLOCK)
-				goto deadlock;
-			panic("history: cannot removed expired entries: %s",
-					db_strerror(ret));
-		}
-
-		expired += n;
-		continue;
-
-deadlock:	;
-		txn->abort(txn);
 	}
 
-	free(delkeys.data);
-	nts_logm(HISTORY_fac, M_HISTORY_EXPIRED, (unsigned long) expired);
-
-	return;
+	uv_rwlock_rdunlock(&history_lock);
+	return n;
 }
 
 void
 history_shutdown()
 {
-	if (history_by_msgid)
-		history_by_msgid->close(history_by_msgid, 0);
-	if (history_db)
-		history_db->close(history_db, 0);
+int	i;
+
+	uv_rwlock_wrlock(&history_lock);
+	for (i = 0; i < history_nparts; i++) {
+		history_close_part(history_parts[i]);
+		free(history_parts[i]);
+	}
 
-	history_by_msgid = history_db = NULL;
+	free(history_parts);
+	history_parts = NULL;
+	history_nparts = 0;
+	uv_rwlock_wrunlock(&history_lock);
 }
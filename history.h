@@ -29,9 +29,47 @@ int	history_add(char const *mid);
 int	history_add_multiple(char const **mids);
 
 /*
- * Mark this article as pending.
+ * Add a batch of message-ids with the times they arrived, e.g. when
+ * rebuilding the history from the spool.  The batch is reordered.
+ * Returns the number of entries that weren't already present.
  */
-void	history_add_pending(char const *mid, void *);
-void	history_clear_pending_for_client(void *);
+typedef struct history_ent {
+	char const	*he_msgid;
+	time_t		 he_time;
+	time_t		 he_part;	/* Used by history_load() */
+} history_ent_t;
+
+size_t	history_load(history_ent_t *, size_t);
+
+/*
+ * Return a description of each history partition, newest first.  The
+ * returned array should be freed by the caller.
+ */
+typedef struct history_part_info {
+	char		hpi_name[64];
+	time_t		hpi_start;
+	time_t		hpi_end;
+	uint64_t	hpi_entries;
+	uint64_t	hpi_bytes;
+} history_part_info_t;
+
+int	history_get_partitions(history_part_info_t **);
+
+/*
+ * Look up a message-id and, if it's not present, reserve a tentative
+ * history entry for it in the same step.  On HISTORY_RESERVED, *resv is
+ * set to a handle which must later be passed to exactly one of
+ * history_commit() (add the entry) or history_cancel() (forget it).
+ * HISTORY_BUSY means another reservation for this message-id exists.
+ */
+typedef struct history_resv history_resv_t;
+
+#define	HISTORY_RESERVED	0
+#define	HISTORY_PRESENT		1
+#define	HISTORY_BUSY		2
+
+int	history_reserve(char const *mid, history_resv_t **resv);
+void	history_commit(history_resv_t *);
+void	history_cancel(history_resv_t *);
 
 #endif	/* !NTS_HISTORY_H */
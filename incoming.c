@@ -55,16 +55,31 @@ handle_one_article(buf)
 time_t		 age, oldest;
 article_t	*article;
 int		 filter_result;
-char		*filter_name;
+char		*filter_name, *text;
 
-	if ((article = article_parse(buf->ab_text)) == NULL) {
+	if ((text = artbuf_text(buf)) == NULL) {
+		log_article(buf->ab_msgid, NULL,
+			    buf->ab_client->cl_server,
+			    '-', "staging-error");
+		history_cancel(buf->ab_resv);
+		buf->ab_resv = NULL;
+		return IN_ERR_STAGING;
+	}
+
+	article = article_parse(text);
+	if (text != buf->ab_text)
+		free(text);
+
+	if (article == NULL) {
 		client_log(LOG_NOTICE, buf->ab_client,
 			   "%s: cannot parse article",
 			   buf->ab_msgid);
 		log_article(buf->ab_msgid, NULL,
 			    buf->ab_client->cl_server,
 			    '-', "cannot-parse");
-		history_add(buf->ab_msgid);
+		history_commit(buf->ab_resv);
+		buf->ab_resv = NULL;
+		buf->ab_flags |= AB_COMMITTED;
 		return IN_ERR_CANNOT_PARSE;
 	}
 
@@ -74,6 +89,8 @@ char		*filter_name;
 		log_article(article->art_msgid, NULL,
 			    buf->ab_client->cl_server,
 			    '-', "too-old");
+		history_cancel(buf->ab_resv);
+		buf->ab_resv = NULL;
 		return IN_ERR_TOO_OLD;
 	}
 
@@ -83,13 +100,6 @@ char		*filter_name;
 			   buf->ab_msgid,
 			   article->art_msgid);
 
-	if (history_check(article->art_msgid)) {
-		log_article(article->art_msgid, NULL,
-			    buf->ab_client->cl_server,
-			    '-', "duplicate");
-		return IN_ERR_DUPLICATE;
-	}
-
 	emp_track(article);
 
 	filter_result = filter_article(article, buf->ab_client->cl_strname,
@@ -101,7 +111,9 @@ char		*filter_name;
 			    buf->ab_client->cl_server, '-',
 			    "filter/%s",
 			    filter_name);
-		history_add(buf->ab_msgid);
+		history_commit(buf->ab_resv);
+		buf->ab_resv = NULL;
+		buf->ab_flags |= AB_COMMITTED;
 		return IN_ERR_FILTER;
 	}
 
@@ -115,7 +127,9 @@ char		*filter_name;
 	if (article->art_refs == 0)
 #endif
 	article_free(article);
-	history_add(buf->ab_msgid);
+	history_commit(buf->ab_resv);
+	buf->ab_resv = NULL;
+	buf->ab_flags |= AB_COMMITTED;
 	return IN_OK;
 }
 
@@ -130,6 +144,7 @@ uv_work_t	*req = xcalloc(1, sizeof(*req));
 	iw->iw_artbuf = artbuf;
 	iw->iw_client = client;
 	req->data = iw;
+	artbuf->ab_flags |= AB_INWORKER;
 
 	uv_queue_work(loop, req, on_new_work, on_work_done);
 }
@@ -140,6 +155,7 @@ on_work_done(req, status)
 {
 incoming_work_t	*iw = req->data;
 
+	iw->iw_artbuf->ab_flags &= ~AB_INWORKER;
 	client_incoming_reply(iw->iw_client, iw->iw_artbuf);
 	free(iw);
 	free(req);
@@ -18,6 +18,7 @@
 #define	IN_ERR_FILTER		2
 #define	IN_ERR_DUPLICATE	3
 #define	IN_ERR_CANNOT_PARSE	4
+#define	IN_ERR_STAGING		5
 
 struct artbuf;
 void	process_article(client_t *, artbuf_t *);
@@ -44,6 +44,7 @@
 #include	"auth.h"
 #include	"article.h"
 #include	"ctl.h"
+#include	"rebuild.h"
 
 #include	"ntsmsg.h"
 #include	"dbmsg.h"
@@ -59,6 +60,9 @@ static void	*server_stanza_start(conf_stanza_t *, void *);
 static void	 server_set_common_paths(conf_stanza_t *, conf_option_t *, void *, void *);
 
 uint64_t	 max_article_size = 1024 * 1024;
+char		*spill_path;
+uint64_t	 spill_size = 256 * 1024;
+uint64_t	 memory_budget;
 uint64_t	 history_remember = 60 * 60 * 24 * 10; /* 10 days */
 int		 defer_pending = 1;
 char		*contact_address = "nowhere@example.com";
@@ -91,6 +95,12 @@ static config_schema_opt_t server_opts[] = {
 				server_set_common_paths },
 	{ "max-size",		OPT_TYPE_QUANTITY,
 				config_simple_quantity, &max_article_size },
+	{ "spill-path",		OPT_TYPE_STRING,
+				config_simple_string, &spill_path },
+	{ "spill-size",		OPT_TYPE_QUANTITY,
+				config_simple_quantity, &spill_size },
+	{ "memory-budget",	OPT_TYPE_QUANTITY,
+				config_simple_quantity, &memory_budget },
 	{ "defer-pending",	OPT_TYPE_BOOLEAN,
 				config_simple_boolean, &defer_pending },
 	{ "history-remember",	OPT_TYPE_DURATION,
@@ -129,7 +139,8 @@ usage(pname)
 	char const	*pname;
 {
 	fprintf(stderr,
-"usage: %1$s [-n | -y] [-c <conffile>] [-p <pidfile>]\n"
+"usage: %1$s [-n | -y | -Z] [-c <conffile>] [-p <pidfile>]\n"
+"       %1$s [-c <conffile>] [-R] [-q <peer>[,<peer>...] [-P <pos>]]\n"
 "       %1$s [-c <conffile>] -x <command> [args...]\n"
 "       %1$s -M <msgid>\n"
 "       %1$s -V\n"
@@ -140,7 +151,14 @@ usage(pname)
 "    -x <command>       send a control command to a running NTS\n"
 "    -p <pidfile>       specify the pid file location\n"
 "    -c <conffile>      specify the configuration file\n"
-"    -y                 check spool files and exit\n"
+"    -y                 check spool files and exit; -yy to uncompress\n"
+"                       articles as well\n"
+"    -Z                 compare spool compression methods and exit\n"
+"    -R                 rebuild the history from the spool and exit\n"
+"    -q <peers>         re-queue articles in the spool for the given peers\n"
+"                       and exit\n"
+"    -P <pos>           with -q, only re-queue articles from spool position\n"
+"                       <pos> (as <id>,<offset>) onwards\n"
 "    -M <msgid>         print detailed explanation for given message\n"
 , pname);
 }
@@ -152,8 +170,8 @@ main(argc, argv)
 char const	*conf_name = CONF_NAME;
 int		 c;
 FILE		*pidf = NULL;
-int		 nflag = 0, yflag = 0;
-char		*control_command = NULL;
+int		 nflag = 0, yflag = 0, Zflag = 0, Rflag = 0;
+char		*control_command = NULL, *requeue = NULL, *requeue_from = NULL;
 struct group	*grp = NULL;
 struct passwd	*pwd = NULL;
 int		 devnull;
@@ -174,7 +192,7 @@ char		*s;
 	case 'D': strlcat(version_string, "(DEVELOPMENT)", sizeof(version_string)); break;
 	}
 
-	while ((c = getopt(argc, argv, "M:Vc:p:nx:yD:")) != -1) {
+	while ((c = getopt(argc, argv, "M:Vc:p:nx:yZRq:P:D:")) != -1) {
 		switch (c) {
 			case 'V':
 				printf("%s\n", version_string);
@@ -211,6 +229,22 @@ char		*s;
 				++yflag;
 				break;
 
+			case 'Z':
+				++Zflag;
+				break;
+
+			case 'R':
+				++Rflag;
+				break;
+
+			case 'q':
+				requeue = optarg;
+				break;
+
+			case 'P':
+				requeue_from = optarg;
+				break;
+
 			case 'M':
 				explain_msg(optarg);
 				return 0;
@@ -266,7 +300,13 @@ char		*s;
 		return execute_control_command(control_command);
 
 	if (yflag)
-		return spool_check();
+		return spool_check(yflag > 1);
+
+	if (Zflag)
+		return spool_codec_report();
+
+	if (Rflag || requeue)
+		return rebuild_run(Rflag, requeue, requeue_from);
 
 	if (runas_group) {
 		if ((grp = getgrnam(runas_group)) == NULL)
@@ -371,6 +411,18 @@ char		*s;
 
 	nts_logm(NTS_fac, M_NTS_RUNNING, version_string, pathhost);
 
+	/*
+	 * Start background threads; this must be done after forking.
+	 */
+	if (db_start() == -1 || spool_start() == -1 || server_start() == -1 ||
+	    feeder_start() == -1)
+		panic("nts: failed to start (see above messages)");
+
+	/*
+	 * Don't accept connections until the database cache is warm.
+	 */
+	db_preload_start(client_listen_start);
+
 	uv_run(loop, UV_RUN_DEFAULT);
 	return 0;
 }
@@ -479,6 +531,7 @@ nts_shutdown(reason)
 	char const	*reason;
 {
 	nts_logm(NTS_fac, M_NTS_SHUTDWN, reason);
+	feeder_shutdown();
 	spool_shutdown();
 	server_shutdown();
 	filter_shutdown();
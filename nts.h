@@ -64,6 +64,9 @@ typedef struct path_ent {
 typedef SIMPLEQ_HEAD(path_list, path_ent) path_list_t;
 
 extern uint64_t		 max_article_size;
+extern char		*spill_path;
+extern uint64_t		 spill_size;
+extern uint64_t		 memory_budget;
 extern int		 defer_pending;
 extern char		*contact_address;
 extern char		*pathhost;
@@ -193,6 +196,9 @@ uint32_t arc4random(void);
 # define ATOMIC
 # define atomic_cas_ptr(p,o,n) __sync_val_compare_and_swap(p,o,n)
 # define atomic_inc_ulong(p) __sync_fetch_and_add(p,1)
+# define atomic_add_64_nv(p,n) __sync_add_and_fetch(p,n)
+# define atomic_inc_uint_nv(p) __sync_add_and_fetch(p,1)
+# define atomic_dec_uint_nv(p) __sync_sub_and_fetch(p,1)
 #endif
 
 #define	ARRAY_HEAD(headname, type)					\
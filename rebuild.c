@@ -0,0 +1,247 @@
+/* RT/NTS -- a lightweight, high performance news transit server. */
+/* 
+ * Copyright (c) 2011-2013 River Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Rebuilding from the spool (nts -R, nts -q).  spool_walk() reads the
+ * spool files in parallel and hands over batches of message-ids and
+ * arrival times.  Each batch goes into the history with history_load(),
+ * and articles after the starting position are added back to the peers'
+ * queues if server_wants_article() still says they should be.
+ */
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<stdio.h>
+
+#include	<uv.h>
+
+#include	"rebuild.h"
+#include	"spool.h"
+#include	"history.h"
+#include	"server.h"
+#include	"filter.h"
+#include	"database.h"
+#include	"article.h"
+#include	"nts.h"
+#include	"log.h"
+
+#include	"ntsmsg.h"
+
+#define	REBUILD_PROGRESS	(10 * 1000000000ULL)	/* Log every 10s */
+
+typedef struct rebuild {
+	int		  rb_history;
+	server_t	**rb_peers;
+	int		  rb_npeers;
+
+	int		  rb_have_from;
+	spool_pos_t	  rb_from;
+	time_t		  rb_from_time;
+
+	/* The queues aren't opened for threads, so they're used one at a time */
+	uv_mutex_t	  rb_mtx;
+	uint64_t	  rb_articles;
+	uint64_t	  rb_added;
+	uint64_t	  rb_queued;
+	uint64_t	  rb_last;
+} rebuild_t;
+
+static int	rebuild_batch(spool_walk_ent_t *, size_t, void *);
+static int	rebuild_find_from(spool_index_entry_t *, void *);
+static int	rebuild_wanted(rebuild_t *, spool_walk_ent_t *);
+
+int
+rebuild_run(history, peers, from)
+	int		 history;
+	char		*peers;
+	char const	*from;
+{
+rebuild_t	 rb;
+char		*name;
+unsigned long	 id, offset;
+uint64_t	 start;
+int		 ret;
+
+	bzero(&rb, sizeof(rb));
+	rb.rb_history = history;
+	uv_mutex_init(&rb.rb_mtx);
+
+	if (db_run() == -1 ||
+	    history_run() == -1 ||
+	    spool_run() == -1 ||
+	    server_run() == -1 ||
+	    filter_run() == -1)
+		return 1;
+
+	while (peers && (name = next_comma(&peers))) {
+	server_t	*se;
+
+		if ((se = server_find_by_name(name)) == NULL ||
+		    se->se_send_to == NULL) {
+			nts_logm(NTS_fac, M_NTS_RBLDNOPEER, name);
+			return 1;
+		}
+
+		rb.rb_peers = xrealloc(rb.rb_peers,
+				sizeof(*rb.rb_peers) * (rb.rb_npeers + 1));
+		rb.rb_peers[rb.rb_npeers++] = se;
+	}
+
+	/*
+	 * Positions on other devices can't be compared with the starting
+	 * position, so there it's the article's arrival time that counts.
+	 */
+	if (from) {
+		if (sscanf(from, "%lx,%lu", &id, &offset) != 2) {
+			nts_logm(NTS_fac, M_NTS_RBLDBADPOS, from);
+			return 1;
+		}
+
+		rb.rb_have_from = 1;
+		rb.rb_from.sp_id = id;
+		rb.rb_from.sp_offset = offset;
+		if (spool_index_scan(0, 0, rebuild_find_from, &rb) == 0) {
+			nts_logm(NTS_fac, M_NTS_RBLDBADPOS, from);
+			return 1;
+		}
+	}
+
+	nts_logm(NTS_fac, M_NTS_RBLDBEGIN,
+		 history ? " history" : "",
+		 rb.rb_npeers ? " queues" : "");
+
+	start = rb.rb_last = uv_hrtime();
+	ret = spool_walk(rebuild_batch, &rb);
+
+	/* The batches were committed without syncing */
+	if (db_env->log_flush(db_env, NULL))
+		ret = 1;
+
+	nts_logm(NTS_fac, M_NTS_RBLDDONE,
+		 (unsigned long) rb.rb_articles, (unsigned long) rb.rb_added,
+		 (unsigned long) rb.rb_queued,
+		 (double) (uv_hrtime() - start) / 1e9);
+
+	spool_shutdown();
+	server_shutdown();
+	filter_shutdown();
+	history_shutdown();
+	db_shutdown();
+
+	free(rb.rb_peers);
+	uv_mutex_destroy(&rb.rb_mtx);
+	return ret;
+}
+
+static int
+rebuild_find_from(ie, udata)
+	spool_index_entry_t	*ie;
+	void			*udata;
+{
+rebuild_t	*rb = udata;
+
+	if (ie->ie_pos.sp_id != rb->rb_from.sp_id ||
+	    ie->ie_pos.sp_offset != rb->rb_from.sp_offset)
+		return 0;
+
+	rb->rb_from_time = ie->ie_time;
+	return 1;
+}
+
+/*
+ * Whether an article is at or after the starting position.
+ */
+static int
+rebuild_wanted(rb, we)
+	rebuild_t		*rb;
+	spool_walk_ent_t	*we;
+{
+	if (!rb->rb_have_from)
+		return 1;
+
+	if (SPOOL_ID_DEV(we->we_pos.sp_id) != SPOOL_ID_DEV(rb->rb_from.sp_id))
+		return we->we_time >= rb->rb_from_time;
+
+	if (we->we_pos.sp_id != rb->rb_from.sp_id)
+		return we->we_pos.sp_id > rb->rb_from.sp_id;
+	return we->we_pos.sp_offset >= rb->rb_from.sp_offset;
+}
+
+static int
+rebuild_batch(ents, nents, udata)
+	spool_walk_ent_t	*ents;
+	size_t			 nents;
+	void			*udata;
+{
+rebuild_t	*rb = udata;
+history_ent_t	*hents;
+size_t		 i, nh = 0, added = 0;
+uint64_t	 queued = 0, now;
+int		 j;
+
+	if (rb->rb_history) {
+		hents = xcalloc(nents, sizeof(*hents));
+		for (i = 0; i < nents; i++) {
+			if (!ents[i].we_msgid[0])
+				continue;
+			hents[nh].he_msgid = ents[i].we_msgid;
+			hents[nh].he_time = ents[i].we_time;
+			nh++;
+		}
+
+		added = history_load(hents, nh);
+		free(hents);
+	}
+
+	for (i = 0; rb->rb_npeers && i < nents; i++) {
+	article_t	*art;
+	DB_TXN		*txn;
+	int		 ret;
+
+		if (!ents[i].we_msgid[0] || !rebuild_wanted(rb, &ents[i]))
+			continue;
+
+		if ((art = spool_fetch(ents[i].we_pos.sp_id,
+				       ents[i].we_pos.sp_offset)) == NULL)
+			continue;
+
+		uv_mutex_lock(&rb->rb_mtx);
+		txn = db_new_txn(DB_TXN_WRITE_NOSYNC);
+		for (j = 0; j < rb->rb_npeers; j++) {
+			if (!server_wants_article(rb->rb_peers[j], art))
+				continue;
+			server_addq(rb->rb_peers[j], art, txn);
+			queued++;
+		}
+
+		if (ret = txn->commit(txn, 0))
+			panic("rebuild: cannot commit queue txn: %s",
+			      db_strerror(ret));
+		uv_mutex_unlock(&rb->rb_mtx);
+
+		article_free(art);
+	}
+
+	uv_mutex_lock(&rb->rb_mtx);
+	rb->rb_articles += nents;
+	rb->rb_added += added;
+	rb->rb_queued += queued;
+
+	if ((now = uv_hrtime()) - rb->rb_last >= REBUILD_PROGRESS) {
+		nts_logm(NTS_fac, M_NTS_RBLDPROG,
+			 (unsigned long) rb->rb_articles,
+			 (unsigned long) rb->rb_added,
+			 (unsigned long) rb->rb_queued);
+		rb->rb_last = now;
+	}
+	uv_mutex_unlock(&rb->rb_mtx);
+
+	return 0;
+}
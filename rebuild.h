@@ -0,0 +1,23 @@
+/* RT/NTS -- a lightweight, high performance news transit server. */
+/* 
+ * Copyright (c) 2011-2013 River Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef	NTS_REBUILD_H
+#define	NTS_REBUILD_H
+
+/*
+ * Rebuild the history and/or peer queues from the articles in the spool,
+ * for when they've been lost or damaged.  NTS must not be running.  peers
+ * is a comma-separated list of peers whose queues to rebuild, or NULL;
+ * from is the spool position ("<id>,<offset>") to start queueing from, or
+ * NULL to queue everything in the spool.  Returns 0 on success.
+ */
+int	rebuild_run(int history, char *peers, char const *from);
+
+#endif	/* !NTS_REBUILD_H */
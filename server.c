@@ -52,6 +52,35 @@ static void	 server_update_dns(uv_timer_t *, int);
 
 static void	 do_stats(uv_timer_t *, int);
 
+static void	 server_expire(spool_id_t);
+static void	 server_purge(void *);
+static uint64_t	 server_purge_db(DB *, spool_id_t);
+
+/*
+ * When the spool deletes a file, every queue entry pointing into it is
+ * dead.  Rather than leave them for the feeders to find one at a time,
+ * the purge thread removes them in bulk.
+ *
+ * The purge thread walks servers without a lock.  That's safe because
+ * the list, and each server's queue databases, are set up before
+ * server_run() returns and never change after that; there is no config
+ * reload.  Anything that adds one has to stop the purge thread first.
+ */
+#define	SERVER_PURGE_BATCH	1000
+
+typedef struct server_purge_ent {
+	spool_id_t				spe_id;
+	SIMPLEQ_ENTRY(server_purge_ent)		spe_list;
+} server_purge_ent_t;
+
+static uv_thread_t	 purge_thread;
+static uv_mutex_t	 purge_mtx;
+static uv_cond_t	 purge_cond;
+static int		 purge_running,
+			 purge_stop;
+static SIMPLEQ_HEAD(server_purge_list, server_purge_ent) purge_list =
+	SIMPLEQ_HEAD_INITIALIZER(purge_list);
+
 static uv_timer_t	stats_timer,
 			dns_timer;
 
@@ -129,10 +158,25 @@ server_map_t	*match;
 	return match->sm_server;
 }
 
+server_t *
+server_find_by_name(name)
+	char const	*name;
+{
+server_t	*se;
+
+	SLIST_FOREACH(se, &servers, se_list)
+		if (strcmp(se->se_name, name) == 0)
+			return se;
+	return NULL;
+}
+
 int
 server_init()
 {
 	config_add_stanza(&peer_stanza);
+	uv_mutex_init(&purge_mtx);
+	uv_cond_init(&purge_cond);
+	spool_set_expire_hook(server_expire);
 	return 0;
 }
 
@@ -149,8 +193,28 @@ uint64_t	apos, bpos;
 	bpos = int64get(b->data + sizeof(uint32_t));
 
 	if (aid != bid)
-		return aid - bid;
-	return apos - bpos;
+		return aid < bid ? -1 : 1;
+	if (apos != bpos)
+		return apos < bpos ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Start the purge thread.  This must be called after forking.
+ */
+int
+server_start()
+{
+int	err;
+
+	if (err = uv_thread_create(&purge_thread, server_purge, NULL)) {
+		nts_log("server: cannot create purge thread: %s",
+			uv_strerror(err));
+		return -1;
+	}
+
+	purge_running = 1;
+	return 0;
 }
 
 int
@@ -217,6 +281,11 @@ int		 ret;
 					NULL, DB_BTREE, DB_CREATE | DB_AUTO_COMMIT, 0))
 			panic("server: cannot open defer database: %s",
 				db_strerror(ret));
+
+		if (db_preload_queues) {
+			snprintf(dbname, sizeof(dbname), "queue.%s.db", se->se_name);
+			db_preload_add(se->se_q, dbname);
+		}
 	}
 
 	rebuild_server_map();
@@ -789,7 +858,7 @@ server_wants_article(se, art)
 {
 hostlist_entry_t	*hl;
 
-	if (se->se_max_size && (strlen(art->art_content) > se->se_max_size))
+	if (se->se_max_size && (article_length(art) > se->se_max_size))
 		return 0;
 
 	SLIST_FOREACH(hl, &se->se_exclude, hl_list) {
@@ -815,10 +884,146 @@ hostlist_entry_t	*hl;
 void
 server_shutdown()
 {
-server_t	*se;
+	if (purge_running) {
+		uv_mutex_lock(&purge_mtx);
+		purge_stop = 1;
+		uv_cond_signal(&purge_cond);
+		uv_mutex_unlock(&purge_mtx);
+		uv_thread_join(&purge_thread);
+		purge_running = 0;
+	}
+}
 
-	SLIST_FOREACH(se, &servers, se_list) {
+static void
+server_expire(id)
+	spool_id_t	id;
+{
+server_purge_ent_t	*spe;
+
+	spe = xcalloc(1, sizeof(*spe));
+	spe->spe_id = id;
+
+	uv_mutex_lock(&purge_mtx);
+	SIMPLEQ_INSERT_TAIL(&purge_list, spe, spe_list);
+	uv_cond_signal(&purge_cond);
+	uv_mutex_unlock(&purge_mtx);
+}
+
+static void
+server_purge(arg)
+	void	*arg;
+{
+	uv_mutex_lock(&purge_mtx);
+
+	for (;;) {
+	server_purge_ent_t	*spe;
+	spool_id_t		 id;
+	server_t		*se;
+
+		while (!purge_stop && SIMPLEQ_EMPTY(&purge_list))
+			uv_cond_wait(&purge_cond, &purge_mtx);
+		if (purge_stop)
+			break;
+
+		spe = SIMPLEQ_FIRST(&purge_list);
+		SIMPLEQ_REMOVE_HEAD(&purge_list, spe_list);
+		uv_mutex_unlock(&purge_mtx);
+
+		id = spe->spe_id;
+		free(spe);
+
+		SLIST_FOREACH(se, &servers, se_list) {
+		uint64_t	nq, nd;
+			if (se->se_q == NULL)
+				continue;
+
+			nq = server_purge_db(se->se_q, id);
+			nd = server_purge_db(se->se_deferred, id);
+			if (nq || nd)
+				nts_log("peer \"%s\": %lu queued and %lu "
+					"deferred articles lost to expiry of "
+					"spool file %.8lX", se->se_name,
+					(long unsigned) nq, (long unsigned) nd,
+					(long unsigned) id);
+		}
+
+		uv_mutex_lock(&purge_mtx);
 	}
+
+	uv_mutex_unlock(&purge_mtx);
+}
+
+/*
+ * Delete every entry in db for spool file id.  The entries are contiguous
+ * in the btree, so this is a cursor walk from the first of them, in
+ * transactions of SERVER_PURGE_BATCH to keep feeders from waiting on us.
+ */
+static uint64_t
+server_purge_db(db, id)
+	DB		*db;
+	spool_id_t	 id;
+{
+uint64_t	 n = 0;
+unsigned char	 kbuf[4 + 8];
+int		 ret, i, done = 0;
+
+	while (!done) {
+	DBT	 key, data;
+	DB_TXN	*txn;
+	DBC	*curs;
+
+		uv_mutex_lock(&purge_mtx);
+		done = purge_stop;
+		uv_mutex_unlock(&purge_mtx);
+		if (done)
+			break;
+
+		bzero(&key, sizeof(key));
+		bzero(&data, sizeof(data));
+		pack(kbuf, "uU", id, (uint64_t) 0);
+		key.data = kbuf;
+		key.size = key.ulen = sizeof(kbuf);
+		key.flags = DB_DBT_USERMEM;
+		data.flags = DB_DBT_PARTIAL;
+
+		txn = db_new_txn(DB_TXN_WRITE_NOSYNC);
+		if (ret = db->cursor(db, txn, &curs, 0)) {
+			db_txn_abort(txn);
+			if (ret == DB_LOCK_DEADLOCK)
+				continue;
+			nts_log("server: cannot open cursor for purge: %s",
+				db_strerror(ret));
+			break;
+		}
+
+		ret = curs->get(curs, &key, &data, DB_SET_RANGE);
+		for (i = 0; ret == 0 && i < SERVER_PURGE_BATCH; i++) {
+			if (key.size != sizeof(kbuf) || int32get(kbuf) != id) {
+				ret = DB_NOTFOUND;
+				break;
+			}
+			if (ret = curs->del(curs, 0))
+				break;
+			ret = curs->get(curs, &key, &data, DB_NEXT);
+		}
+
+		curs->close(curs);
+
+		if (ret && ret != DB_NOTFOUND) {
+			db_txn_abort(txn);
+			if (ret == DB_LOCK_DEADLOCK)
+				continue;
+			nts_log("server: cannot purge queue entries: %s",
+				db_strerror(ret));
+			break;
+		}
+
+		db_txn_commit(txn);
+		n += i;
+		done = (ret == DB_NOTFOUND);
+	}
+
+	return n;
 }
 
 int
@@ -98,6 +98,7 @@ typedef struct server {
 				 se_in_deferred,
 				 se_in_refused,
 				 se_in_rejected,
+				 se_in_inflight,
 				 se_out_accepted,
 				 se_out_deferred,
 				 se_out_refused,
@@ -128,19 +129,26 @@ typedef struct server {
 
 	int			 se_buffer;
 
+	uint64_t		 se_mem,	/* Bytes held by clients */
+				 se_mem_peak;
+
 	client_list_t		 se_clients;
 
 	SLIST_ENTRY(server)	 se_list;
 } server_t;
 
 typedef SLIST_HEAD(server_list, server) server_list_t;
+
+/* Fixed once server_run() returns; other threads walk it unlocked. */
 extern server_list_t servers;
 
 int		 server_init(void);
 int		 server_run(void);
+int		 server_start(void);
 void		 server_shutdown(void);
 
 server_t	*server_find_by_address(struct sockaddr_storage *);
+server_t	*server_find_by_name(char const *);
 void		 server_add_backlog(server_t *, struct article *, DB_TXN *);
 void		 server_set_spool_pos(server_t *, spool_pos_t *);
 int		 server_wants_article(server_t *, article_t *art);
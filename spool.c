@@ -16,18 +16,73 @@
  * max-files is reached.
  *
  * At the start of each file, we store its current valid length, which is
- * fsynced every 10 seconds.  We also fsync the spool after every article
- * write.  At startup, we start at the last saved spool position, and verify
- * every article after that until the end of the file.  Articles which are
- * fully written will be verified okay, while articles which were partially
- * written (e.g. due to host crash) will be discarded.  These articles were
- * never fully received from a peer, so the peer will re-send them later.
+ * updated after each batch of articles is synced, and fsynced every 10
+ * seconds.  We also fsync the spool after every article write, although
+ * the writer thread (see below) syncs several articles at once when more
+ * than one is waiting.  At startup, we start at the last saved spool
+ * position, and verify every article after that until the end of the file.
+ * Articles which are fully written will be verified okay, while articles
+ * which were partially written (e.g. due to host crash) will be discarded.
+ * These articles were never fully received from a peer, so the peer will
+ * re-send them later.  Several files can be verified at once; see
+ * spool_dev_open().
  */
 
 /*
- * The spool code is NOT internally thread-safe.  Locking is done at the
- * interface between spool and the rest of NTS, i.e. in spool_fetch_text
- * and spool_store.
+ * spool_store() and spool_fetch_text() may be called from any number of
+ * threads at once.  Each device's file ring is protected by its sd_mtx, a
+ * read/write lock: stores and fetches hold it for reading, and it's only
+ * held for writing to rotate or delete files.  The little global state there
+ * is has a mutex of its own, declared next to it.
+ *
+ * Spool files are reference counted.  sd_files holds one reference to each
+ * file, and readers take another with spool_file_get() while holding the
+ * device's sd_mtx, then drop the lock before reading.  A file rotated out of
+ * the spool is only unmapped and deleted when the last reference is
+ * released, so a slow reader never holds up rotation.
+ *
+ * spool_store() reserves space in the current spool file by atomically
+ * adding the article's length to sf_alloc, and then writes the article
+ * itself, so any number of threads can be writing at once.  It holds
+ * sd_mtx as a read lock while doing this, which stops the file being
+ * rotated underneath it.  It then queues the written range for the writer
+ * thread and waits.
+ *
+ * The writer thread takes every range that's waiting, syncs once for the
+ * whole batch, and then advances sf_size, the "durable up to" watermark, over
+ * any ranges which are now contiguous with it.  Ranges written out of order
+ * are held until the ranges before them are synced, and their writers aren't
+ * woken until then.  sf_size is the only size ever written to disk, so a
+ * crash can never leave the stored size pointing past an incompletely
+ * written article, and spool_verify() will discard anything after the first
+ * incomplete article.
+ *
+ * The spool can be spread across several devices, each a directory of its
+ * own with its own size, file ring, writer thread and prep thread.  The
+ * device an article is stored on is kept in the top bits of its spool id;
+ * the rest is the number of the file within the device.  The device given
+ * by the spool stanza's path is device 0, so a single-device spool has the
+ * same ids it always had.
+ *
+ * Devices can be grouped into spool classes, each with its own compression
+ * setting, and articles are routed to a class at store time by type, size
+ * and newsgroups.  Devices not in any class make up the default class, used
+ * for articles which don't match any other.
+ *
+ * Compressed articles are either zlib or zstd, which is recorded in the
+ * article's header flags.  A zstd class can also use a dictionary, trained
+ * from the first few megabytes of articles stored in the class once it has
+ * no dictionary, and kept as .zdict-<id> in each of the class's devices.
+ * zstd records the dictionary id in every compressed article, so articles
+ * stay readable after the class gets a new dictionary, as long as the old
+ * dictionary file is left where it is.
+ *
+ * The "direct" method bypasses the page cache, for spools too large to
+ * cache usefully.  Data is read and written with O_DIRECT, so each record
+ * starts on a SPOOL_DIRECT_ALIGN boundary and is followed by a padding
+ * record up to the next one; see spool_direct_write().  The size at the
+ * start of the file is still written through the page cache, in a block of
+ * its own.
  */
 
 #include	<sys/types.h>
@@ -39,12 +94,14 @@
 #include	<unistd.h>
 #include	<fcntl.h>
 #include	<string.h>
+#include	<strings.h>
 #include	<errno.h>
 #include	<assert.h>
 #include	<dirent.h>
 #include	<limits.h>
 
 #include	<zlib.h>
+#include	<uv.h>
 
 #include	"spool.h"
 #include	"config.h"
@@ -52,25 +109,45 @@
 #include	"log.h"
 #include	"crc.h"
 #include	"spoolmsg.h"
+#include	"hash.h"
+#include	"article.h"
+#include	"wildmat.h"
+
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+# define	USE_ZSTD
+# include	<zstd.h>
+# include	<zdict.h>
+#endif
 
 #ifndef HAVE_FDATASYNC
 # define fdatasync fsync
 #endif
 
+#ifndef IOV_MAX
+# define IOV_MAX 16
+#endif
+
 int		 spool_do_sync = 1;
 static char	*spool_path;
 static uint64_t	 spool_size = 1024 * 1024 * 100; /* 100MB */
 static int64_t	 spool_max_files = 10;
 static int	 spool_check_crc = 0;
 static int	 spool_compress;
+static int	 spool_codec;
+static int	 spool_use_dict;
+static uint64_t	 spool_cache_size = 1024 * 1024 * 16; /* 16MB */
+static int64_t	 spool_verify_threads = 4;
+static spool_expire_fn	 spool_expire_hook;
 static int	 spool_cfgerrors;
 static enum {
 	M_FILE,
-	M_MMAP
+	M_MMAP,
+	M_DIRECT
 } spool_method = sizeof(void *) >= 8 ? M_MMAP : M_FILE;
 
 static void	 spool_set_method(conf_stanza_t *, conf_option_t *, void *, void *);
 static void	 spool_set_compress(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_set_codec(conf_stanza_t *, conf_option_t *, void *, void *);
 
 static config_schema_opt_t spool_opts[] = {
 	{ "path",	OPT_TYPE_STRING,	config_simple_string,	&spool_path },
@@ -80,6 +157,10 @@ static config_schema_opt_t spool_opts[] = {
 	{ "check-crc",	OPT_TYPE_BOOLEAN,	config_simple_boolean,	&spool_check_crc },
 	{ "method",	OPT_TYPE_STRING,	spool_set_method },
 	{ "compress",	OPT_TYPE_NUMBER,	spool_set_compress },
+	{ "compress-method", OPT_TYPE_STRING,	spool_set_codec },
+	{ "dictionary",	OPT_TYPE_BOOLEAN,	config_simple_boolean,	&spool_use_dict },
+	{ "cache-size",	OPT_TYPE_QUANTITY,	config_simple_quantity,	&spool_cache_size },
+	{ "verify-threads", OPT_TYPE_NUMBER,	config_simple_number,	&spool_verify_threads },
 	{ }
 };
 
@@ -87,55 +168,425 @@ static config_schema_stanza_t spool_stanza = {
 	"spool", 0, spool_opts, NULL, NULL
 };
 
+#define	SPOOL_MAX_DEVS		256
+
+/*
+ * Compression methods.  zlib levels go up to 9, zstd levels to 22.
+ */
+#define	SPOOL_ZLIB		0
+#define	SPOOL_ZSTD		1
+#define	SPOOL_MAX_LEVEL		22
+#define	SPOOL_MAX_ZLIB_LEVEL	9
+
+struct spool_file;
+struct spool_store_req;
+struct spool_class;
+
+typedef struct spool_dev {
+	int			 sd_id;
+	char			*sd_path;
+	uint64_t		 sd_size;
+	int64_t			 sd_max_files;
+	int			 sd_error;
+
+	/*
+	 * The file ring.  sd_mtx is held for reading while storing into or
+	 * taking a reference to a file, and for writing while rotating.
+	 */
+	uv_rwlock_t		 sd_mtx;
+	struct spool_file	**sd_files;
+	size_t			 sd_base;
+	int			 sd_cur_file;
+
+	/* The writer thread; see spool_thread_run() */
+	struct spool_store_req *volatile sd_queue;
+	struct spool_store_req	*sd_held;
+	volatile unsigned	 sd_pending;
+	uv_sem_t		 sd_wakeup;
+	uv_thread_t		 sd_thread;
+	int			 sd_thread_running;
+	int			 sd_thread_stop;
+
+	/* The prep thread; see spool_prep_run() */
+	uv_mutex_t		 sd_prep_mtx;
+	uv_cond_t		 sd_prep_cv;
+	uv_thread_t		 sd_prep_thread;
+	int			 sd_prep_running;
+	int			 sd_prep_stop;
+	struct spool_file	*sd_next;
+	struct spool_file	*sd_dead;
+	struct spool_class	*sd_train;	/* Class waiting for a dictionary */
+} spool_dev_t;
+
+/*
+ * spool_devs is indexed by device id; spool_devlist holds the same devices
+ * in id order, for spool_pick_dev() and anything else that visits them all.
+ */
+static spool_dev_t	*spool_devs[SPOOL_MAX_DEVS];
+static spool_dev_t	**spool_devlist;
+static int		 spool_ndevs;
+
+static void	*spool_dev_stanza_start(conf_stanza_t *, void *);
+static void	 spool_dev_stanza_end(conf_stanza_t *, void *);
+static void	 spool_dev_set_id(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_dev_set_path(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_dev_set_size(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_dev_set_max_files(conf_stanza_t *, conf_option_t *, void *, void *);
+
+static config_schema_opt_t spool_dev_opts[] = {
+	{ "id",		OPT_TYPE_NUMBER,	spool_dev_set_id },
+	{ "path",	OPT_TYPE_STRING,	spool_dev_set_path },
+	{ "size",	OPT_TYPE_QUANTITY,	spool_dev_set_size },
+	{ "max-files",	OPT_TYPE_NUMBER,	spool_dev_set_max_files },
+	{ }
+};
+
+static config_schema_stanza_t spool_dev_stanza = {
+	"spool-device", SC_MANY, spool_dev_opts,
+	spool_dev_stanza_start, spool_dev_stanza_end
+};
+
+typedef struct spool_class {
+	char			*spc_name;
+	int			 spc_compress;
+	int			 spc_codec;
+	int			 spc_dict;
+	uint32_t		 spc_art_types;
+	wildmat_t		*spc_groups;
+	uint64_t		 spc_min_size;
+	uint64_t		 spc_max_size;
+	int			*spc_dev_ids;
+	int			 spc_ndev_ids;
+	spool_dev_t		**spc_devs;
+	int			 spc_ndevs;
+	volatile unsigned	 spc_next_dev;
+	struct spool_class	*spc_next;
+
+#ifdef USE_ZSTD
+	/* The dictionary; see spool_dict_sample().  Protected by spool_zstd_mtx. */
+	ZSTD_CDict		*spc_cdict;
+	int			 spc_dict_state;
+	char			*spc_samples;
+	size_t			*spc_sample_sizes;
+	unsigned		 spc_nsamples;
+	size_t			 spc_sample_len;
+#endif
+} spool_class_t;
+
+/*
+ * Classes are checked in the order they appear in the configuration, which
+ * is the reverse of the order the configuration code hands them to us.
+ */
+static spool_class_t	*spool_classes;
+static spool_class_t	 spool_default_class;
+
+static void	*spool_class_stanza_start(conf_stanza_t *, void *);
+static void	 spool_class_stanza_end(conf_stanza_t *, void *);
+static void	 spool_class_set_devices(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_class_set_compress(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_class_set_codec(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_class_set_dict(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_class_set_types(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_class_set_groups(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_class_set_min_size(conf_stanza_t *, conf_option_t *, void *, void *);
+static void	 spool_class_set_max_size(conf_stanza_t *, conf_option_t *, void *, void *);
+
+static config_schema_opt_t spool_class_opts[] = {
+	{ "devices",		OPT_TYPE_NUMBER | OPT_LIST,	spool_class_set_devices },
+	{ "compress",		OPT_TYPE_NUMBER | OPT_TYPE_BOOLEAN, spool_class_set_compress },
+	{ "compress-method",	OPT_TYPE_STRING,		spool_class_set_codec },
+	{ "dictionary",		OPT_TYPE_BOOLEAN,		spool_class_set_dict },
+	{ "article-types",	OPT_TYPE_STRING | OPT_LIST,	spool_class_set_types },
+	{ "groups",		OPT_TYPE_STRING | OPT_LIST,	spool_class_set_groups },
+	{ "min-size",		OPT_TYPE_QUANTITY,		spool_class_set_min_size },
+	{ "max-size",		OPT_TYPE_QUANTITY,		spool_class_set_max_size },
+	{ }
+};
+
+static config_schema_stanza_t spool_class_stanza = {
+	"spool-class", SC_MANY | SC_REQTITLE, spool_class_opts,
+	spool_class_stanza_start, spool_class_stanza_end
+};
+
+static spool_dev_t *spool_dev_new(int);
+static int	 spool_setup_devs(void);
+static int	 spool_setup_classes(void);
+static int	 spool_check_codec(spool_class_t *);
+static spool_class_t *spool_pick_class(article_t *, size_t);
+static unsigned char *spool_compress_text(spool_class_t *, char const *, size_t,
+				    size_t *, uint32_t *);
+static int	 spool_uncompress(uint32_t, void const *, size_t,
+				  unsigned char *, size_t *, char const **);
+static int	 spool_dev_run(spool_dev_t *);
+static void	 spool_dev_run_thread(void *);
+static void	 spool_dev_open(spool_dev_t *, size_t);
+static int	 spool_dev_start(spool_dev_t *);
+static void	 spool_dev_shutdown(spool_dev_t *);
+static spool_dev_t *spool_pick_dev(spool_class_t *);
+
 typedef struct spool_file {
 	int		 sf_fd;
-	off_t		 sf_size;
+	int		 sf_dfd;	/* O_DIRECT, for M_DIRECT */
+	off_t		 sf_size;	/* Written and synced; see spool_size_mtx */
+	volatile uint64_t sf_alloc;	/* Reserved by spool_store() */
+	volatile unsigned sf_refs;
+	int		 sf_delete;
 	char		 sf_fname[PATH_MAX];
 	unsigned char	*sf_addr;
 	size_t		 sf_dsz;
+	spool_dev_t	*sf_dev;
+	struct spool_file *sf_next;	/* On sd_dead */
+
+	/* The index; see spool_idx_append() */
+	int		 sf_idx_fd;
+	uint64_t	 sf_nidx;	/* See spool_size_mtx */
+	int		 sf_idx_broken;
 } spool_file_t;
 
-static spool_file_t	*spool_files;
-static size_t		 spool_base;
-static int		 spool_cur_file;
 static uv_timer_t	 spool_timer;
 
+/*
+ * Each article in a spool file is a header followed by the article data.
+ * Format 1 headers, written by older versions, are SPOOL_HDR_SIZE bytes:
+ *
+ *	magic (NSPL) 4, data length 4, header length 1, flags 4,
+ *	EMP score 8, PHL score 8, CRC 8, text length 4
+ *
+ * Format 2 headers are a fixed core of SPOOL_HDR_CORE bytes followed by
+ * extensions, each a type (1 byte), a length (2 bytes) and a value:
+ *
+ *	magic (NSP2) 4, data length 4, header length 2, flags 4,
+ *	EMP score 8, PHL score 8, text length 4
+ *
+ * Readers skip extensions they don't know, so new ones can be added without
+ * another format change.  The end of the data is marked by SPOOL_HDR_SIZE
+ * bytes starting with SPOOL_MAGIC_EOS.  Readers look at SPOOL_HDR_SIZE bytes
+ * first, which always holds the core of either format; spool_store() always
+ * writes a longer header than that.
+ *
+ * Between records, the direct method writes padding records: SPOOL_MAGIC_PAD
+ * and the padding's length (4 bytes), at least SPOOL_HDR_SIZE, then zeroes.
+ * spool_decode_header() returns these with the length in sa_hdr_len, so
+ * anything walking the file steps over them like any other record.
+ */
 #define	SPOOL_HDR_SIZE	(4 + 4 + 1 + 4 + 8 + 8 + 8 + 4)
+#define	SPOOL_HDR_CORE	(4 + 4 + 2 + 4 + 8 + 8 + 4)
+#define	SPOOL_HDR_MAX	512		/* Largest header spool_store() writes */
 #define	SPOOL_MAGIC	0x4E53504C	/* NSPL */
+#define	SPOOL_MAGIC_V2	0x4E535032	/* NSP2 */
 #define	SPOOL_MAGIC_EOS	0x4E454E44	/* NEND */
+#define	SPOOL_MAGIC_PAD	0x4E504144	/* NPAD */
+
+#define	SPOOL_DIRECT_ALIGN	4096
+#define	SPOOL_ALIGN_UP(n)	(((n) + SPOOL_DIRECT_ALIGN - 1) &	\
+				 ~((uint64_t) SPOOL_DIRECT_ALIGN - 1))
+
+#define	SPOOL_EXT_MSGID	1	/* Message-ID, without a terminator */
+#define	SPOOL_EXT_TIME	2	/* Arrival time, 8 bytes */
+#define	SPOOL_EXT_CODEC	3	/* SPOOL_CODEC_*, 1 byte */
+#define	SPOOL_EXT_CSUM	4	/* SPOOL_CSUM_*, 1 byte, then the checksum */
+#define	SPOOL_EXT_BODY	5	/* Offset of the body in the text, 4 bytes */
 
 static void	spool_verify(spool_file_t *);
-static void	spool_file_open(spool_id_t, int create);
-static void	spool_file_close(spool_id_t, int delete);
+static void	spool_file_name(spool_dev_t *, char *, size_t);
+static spool_file_t *spool_file_new(spool_dev_t *, char const *,
+				    int create, int prefault);
+static void	spool_file_open(spool_dev_t *, int, int create);
+static void	spool_file_close(spool_dev_t *, int, int delete);
+static void	spool_file_free(spool_file_t *);
+static spool_file_t *spool_file_get(spool_id_t);
+static void	spool_file_release(spool_file_t *);
 static ssize_t	spool_read_header(spool_file_t *, spool_offset_t, spool_header_t *);
+static size_t	spool_decode_header(unsigned char const *, size_t,
+				    spool_header_t *);
+static size_t	spool_encode_header(unsigned char *, article_t const *,
+				    uint32_t flags, size_t datalen,
+				    size_t textlen, uint64_t crc, time_t);
 static void	spool_write_eos(spool_file_t *, spool_offset_t);
+static ssize_t	spool_pread(spool_file_t *, void *, size_t, off_t);
+static void	*spool_dbuf_get(size_t);
+static void	spool_dbuf_put(void *, size_t);
+static size_t	spool_direct_pad(uint64_t);
+static void	spool_direct_init(void);
+static void	spool_direct_align(spool_file_t *);
+static void	spool_direct_write(spool_file_t *, spool_offset_t,
+				   struct iovec const *, int, size_t);
+static ssize_t	spool_direct_read(spool_file_t *, void *, size_t, off_t);
+static ssize_t	spool_direct_pread(spool_file_t *, void *, size_t, off_t);
+static void	spool_direct_forget(spool_file_t *);
 static void	spool_do_write_size(uv_timer_t *, int);
-static void	spool_write_size(void);
+static void	spool_write_size(spool_dev_t *);
+static void	spool_store_size(spool_file_t *);
+static void	spool_idx_name(char const *, char *);
+static void	spool_idx_load(spool_file_t *);
+static int	spool_idx_rebuild(spool_file_t *, spool_offset_t);
+static void	spool_idx_encode(unsigned char *, spool_index_entry_t const *);
+static void	spool_idx_decode(unsigned char const *, spool_index_entry_t *);
+static int	spool_scan_msgid(char const *, size_t, char *, size_t);
 
-#ifdef notyet
+/*
+ * An article written by spool_store(), queued for the device's writer thread
+ * to sync.  A request with no file is a barrier: it's completed once every
+ * request queued before it has been synced.
+ */
+typedef struct spool_store_req {
+	spool_file_t		*sr_file;
+	spool_offset_t		 sr_offset;
+	size_t			 sr_hdrlen;
+	size_t			 sr_datalen;
+	size_t			 sr_padlen;	/* M_DIRECT only */
+	uint32_t		 sr_flags;
+	uint64_t		 sr_msgid;	/* For the index */
+	time_t			 sr_time;
+	uint64_t		 sr_queued;
+	uv_sem_t		 sr_done;
+	struct spool_store_req	*sr_next;
+} spool_store_req_t;
+
+#ifndef ATOMIC
 static uv_mutex_t	 spool_queue_mtx;
-static uv_thread_t	 spool_thread;
-static uv_loop_t	*spool_loop;
-statuc uv_async_t	 spool_wakeup;
-static void	 spool_thread_run(void *);
+static uv_mutex_t	 spool_alloc_mtx;
+#endif
+
+static void	spool_thread_run(void *);
+static void	spool_queue_push(spool_dev_t *, spool_store_req_t *);
+static void	spool_sync_batch(spool_dev_t *, spool_store_req_t *,
+				 spool_store_req_t *);
+static void	spool_drain(spool_dev_t *);
+static void	spool_rotate(spool_dev_t *, spool_id_t);
+static void	spool_idx_append(spool_file_t *, spool_store_req_t *);
 
-spool_store_req_t	*spool_queue,
-			*spool_queue_tail;
+/*
+ * The next spool file is created ahead of time by the prep thread, under a
+ * temporary name, so that spool_rotate() only has to rename it into place.
+ * The prep thread also closes and deletes files rotated out of the spool.
+ * sd_next and sd_dead are protected by sd_prep_mtx.
+ */
+#define	SPOOL_NEXT	".next"
+
+static void	spool_prep_run(void *);
+
+/*
+ * Upper bounds of the latency (usec) and batch size histogram buckets.
+ */
+uint64_t const	spool_lat_buckets[SPOOL_LAT_BUCKETS] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+	50000, 100000, 1000000, UINT64_MAX
+};
+
+uint64_t const	spool_batch_buckets[SPOOL_BATCH_BUCKETS] = {
+	1, 2, 4, 8, 16, 32, 64, 128, UINT64_MAX
+};
+
+/*
+ * spool_size_mtx protects sf_size, which is updated by the writer thread
+ * without holding sd_mtx, and spool_stats.
+ */
+static uv_mutex_t	 spool_size_mtx;
+static spool_stats_t	 spool_stats;
+static size_t		 spool_pagesize;
+
+/*
+ * The article cache; see spool_cache_add().  Everything here is protected by
+ * spool_cache_mtx.
+ */
+typedef struct spool_cent {
+	spool_pos_t		 ce_pos;
+	spool_header_t		 ce_hdr;
+	char			*ce_text;
+	size_t			 ce_len;
+	unsigned		 ce_refs;
+	int			 ce_cached;
+	TAILQ_ENTRY(spool_cent)	 ce_lru;
+} spool_cent_t;
+
+#define	SPOOL_CACHE_KEYLEN	(4 + 8)
+
+static uv_mutex_t	 spool_cache_mtx;
+static hash_table_t	*spool_cache;
+static TAILQ_HEAD(spool_cent_list, spool_cent) spool_cache_lru =
+	TAILQ_HEAD_INITIALIZER(spool_cache_lru);
+static uint64_t		 spool_cache_used;
+static uint64_t		 spool_cache_nents;
+static uint64_t		 spool_cache_hits;
+static uint64_t		 spool_cache_misses;
+static uint64_t		 spool_cache_evictions;
+
+static void		 spool_cache_add(spool_pos_t *, spool_header_t *,
+					 struct iovec const *, int, size_t);
+static spool_cent_t	*spool_cache_get(spool_pos_t *);
+static void		 spool_cache_release(spool_cent_t *);
+static void		 spool_cent_free(spool_cent_t *);
+
+#ifdef USE_ZSTD
+/*
+ * zstd state.  Compression and decompression contexts are kept in a free
+ * list, since they're expensive to create and each can only be used by one
+ * thread at a time.  Every dictionary found in a spool device or trained
+ * since startup is kept in spool_dicts for as long as NTS runs, so that
+ * readers can use a dictionary without holding spool_zstd_mtx.
+ */
+#define	SPOOL_DICT		".zdict-"
+#define	SPOOL_DICT_SIZE		(110 * 1024)		/* Trained dictionary size */
+#define	SPOOL_DICT_SAMPLES	(4 * 1024 * 1024)	/* Sample to train from */
+#define	SPOOL_DICT_MAXSAMPLE	(16 * 1024)		/* Per article */
+
+#define	SPOOL_DICT_SAMPLING	0
+#define	SPOOL_DICT_TRAINING	1
+#define	SPOOL_DICT_DONE		2
+
+typedef struct spool_zctx {
+	ZSTD_CCtx		*zc_cctx;
+	ZSTD_DCtx		*zc_dctx;
+	struct spool_zctx	*zc_next;
+} spool_zctx_t;
+
+typedef struct spool_dict {
+	unsigned		 sdi_id;
+	ZSTD_DDict		*sdi_ddict;
+	void			*sdi_buf;
+	size_t			 sdi_len;
+	time_t			 sdi_mtime;
+	char			 sdi_devs[SPOOL_MAX_DEVS];	/* Devices it's saved in */
+	struct spool_dict	*sdi_next;
+} spool_dict_t;
+
+static uv_mutex_t	 spool_zstd_mtx;
+static spool_zctx_t	*spool_zctxs;
+static spool_dict_t	*spool_dicts;
+
+static spool_zctx_t	*spool_zctx_get(void);
+static void		 spool_zctx_put(spool_zctx_t *);
+static spool_dict_t	*spool_dict_find(unsigned);
+static spool_dict_t	*spool_dict_add(void *, size_t, time_t);
+static int		 spool_dict_load(spool_dev_t *);
+static int		 spool_dict_write(spool_dev_t *, spool_dict_t *);
+static int		 spool_setup_dicts(void);
+static void		 spool_dict_sample(spool_class_t *, char const *, size_t);
+static void		 spool_dict_train(spool_class_t *);
 #endif
 
-static uv_rwlock_t	 spool_mtx;
+#ifndef ATOMIC
+static uv_mutex_t	 spool_ref_mtx;
+#endif
 
 int
 spool_init()
 {
-#if notyet
-	spool_loop = uv_loop_new();
+	uv_mutex_init(&spool_size_mtx);
+#ifndef ATOMIC
 	uv_mutex_init(&spool_queue_mtx);
-#else
-	uv_rwlock_init(&spool_mtx);
+	uv_mutex_init(&spool_alloc_mtx);
+	uv_mutex_init(&spool_ref_mtx);
+#endif
+	uv_mutex_init(&spool_cache_mtx);
+#ifdef USE_ZSTD
+	uv_mutex_init(&spool_zstd_mtx);
 #endif
 
 	config_add_stanza(&spool_stanza);
+	config_add_stanza(&spool_dev_stanza);
+	config_add_stanza(&spool_class_stanza);
 	return 0;
 }
 
@@ -157,7 +608,15 @@ char	*v = opt->co_value->cv_string;
 		spool_method = M_MMAP;
 	else if (strcmp(v, "file") == 0)
 		spool_method = M_FILE;
-	else {
+	else if (strcmp(v, "direct") == 0) {
+#ifdef O_DIRECT
+		spool_method = M_DIRECT;
+#else
+		nts_logm(SPOOL_fac, M_SPOOL_NODIRECT,
+			 opt->co_file, opt->co_lineno);
+		++spool_cfgerrors;
+#endif
+	} else {
 		nts_logm(SPOOL_fac, M_SPOOL_BADMETHOD,
 			 opt->co_file, opt->co_lineno, v);
 		++spool_cfgerrors;
@@ -172,861 +631,4925 @@ spool_set_compress(stz, opt, udata, arg)
 {
 int	n = opt->co_value->cv_number;
 
-	if (n < 1 || n > 9) {
-		nts_logm(SPOOL_fac, M_SPOOL_BADCOMPR, opt->co_file, opt->co_lineno);
+	if (n < 1 || n > SPOOL_MAX_LEVEL) {
+		nts_logm(SPOOL_fac, M_SPOOL_BADCOMPR, opt->co_file, opt->co_lineno,
+			 SPOOL_MAX_LEVEL);
 		++spool_cfgerrors;
 		return;
 	}
 
 	spool_compress = n;
 }
-int
-spool_run()
-{
-spool_id_t	*files = NULL;
-size_t		 nfiles = 0, i;
-DIR		*dir;
-struct dirent	*de;
 
-	if (spool_cfgerrors) {
-		nts_logm(SPOOL_fac, M_SPOOL_CFGERRS, spool_cfgerrors);
-		return -1;
-	}
-
-	if (!spool_path) {
-		nts_logm(SPOOL_fac, M_SPOOL_NOPATH);
-		return -1;
-	}
-
-	if (mkdir(spool_path, 0700) == -1 && errno != EEXIST) {
-		nts_logm(SPOOL_fac, M_SPOOL_MKDFAIL,
-			 spool_path, strerror(errno));
-		return -1;
-	}
-
-	if ((dir = opendir(spool_path)) == NULL) {
-		nts_logm(SPOOL_fac, M_SPOOL_DOPNFAIL,
-			 spool_path, strerror(errno));
-		return -1;
-	}
+static int
+spool_codec_from_opt(opt)
+	conf_option_t	*opt;
+{
+char	*v = opt->co_value->cv_string;
 
-	while (de = readdir(dir)) {
-	char		*p;
-	long unsigned	 n;
+	if (strcmp(v, "zlib") == 0)
+		return SPOOL_ZLIB;
+	if (strcmp(v, "zstd") == 0)
+		return SPOOL_ZSTD;
 
-		if (strcmp(de->d_name, ".") == 0 ||
-		    strcmp(de->d_name, "..") == 0)
-			continue;
+	nts_logm(SPOOL_fac, M_SPOOL_BADCODEC, opt->co_file, opt->co_lineno, v);
+	++spool_cfgerrors;
+	return -1;
+}
 
-		n = strtoul(de->d_name, &p, 16);
-		if (*p) {
-			nts_logm(SPOOL_fac, M_SPOOL_JUNK,
-				 spool_path, de->d_name);
-			continue;
-		}
+static void
+spool_set_codec(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+int	codec;
 
-		files = xrealloc(files, sizeof(*files) * (nfiles + 1));
-		files[nfiles] = n;
-		nfiles++;
-	}
-	
-	spool_files = xcalloc(sizeof(*spool_files), spool_max_files);
+	if ((codec = spool_codec_from_opt(opt)) != -1)
+		spool_codec = codec;
+}
 
-	if (nfiles) {
-		/* Open an existing spool */
-		qsort(files, nfiles, sizeof(*files), numcmp);
-		spool_base = files[0];
+static void *
+spool_dev_stanza_start(stz, udata)
+	conf_stanza_t	*stz;
+	void		*udata;
+{
+	return spool_dev_new(-1);
+}
 
-		for (i = 0; i < nfiles; i++)
-			spool_file_open(i, 0);
+static void
+spool_dev_set_id(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+spool_dev_t	*sd = udata;
+int64_t		 n = opt->co_value->cv_number;
 
-		spool_cur_file = nfiles - 1;
-	} else {
-		/* Create a new spool */
-		spool_file_open(0, 1);
-		spool_cur_file = 0;
+	if (n < 1 || n >= SPOOL_MAX_DEVS) {
+		nts_logm(SPOOL_fac, M_SPOOL_DEVBADID, opt->co_file, opt->co_lineno,
+			 SPOOL_MAX_DEVS - 1);
+		++spool_cfgerrors;
+		return;
 	}
-	spool_write_size();
 
-#ifdef notyet
-	uv_thread_create(&spool_thread, spool_thread_run, NULL);
-#else
-	uv_timer_init(loop, &spool_timer);
-	uv_timer_start(&spool_timer, spool_do_write_size, 10 * 1000, 10 * 1000);
-#endif
-	return 0;
+	sd->sd_id = n;
 }
 
-#ifdef notyet
 static void
-spool_thread_run(p)
-	void	*p;
+spool_dev_set_path(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
 {
-	uv_timer_init(spool_loop, &spool_timer);
-	uv_timer_start(&spool_timer, spool_do_write_size, 10 * 1000, 10 * 1000);
-
-	uv_run(spool_loop, UV_RUN_DEFAULT);
+spool_dev_t	*sd = udata;
+	sd->sd_path = xstrdup(opt->co_value->cv_string);
 }
-#endif
 
-void
-spool_close(void)
+static void
+spool_dev_set_size(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
 {
+spool_dev_t	*sd = udata;
+	sd->sd_size = opt->co_value->cv_quantity;
 }
 
-int
-spool_store(art)
-	article_t	*art;
+static void
+spool_dev_set_max_files(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
 {
-spool_file_t	*sf;
-unsigned char	*hdr;
-unsigned char	 hdrbuf[SPOOL_HDR_SIZE * 2];
-int		 hdrpos = 0;
-size_t		 artlen = strlen(art->art_content);
-int		 ret;
-unsigned char	*data;
-unsigned long	 datalen;
-off_t		 s_size;
-unsigned char	*s_addr;
-	/*
-	 * Create the header and compress (if enabled) before we acquire
-	 * the lock.
-	 */
-	art->art_flags |= ART_CRC;
-	art->art_flags &= ~ART_COMPRESSED;
-
-	if (spool_compress && !(art->art_flags & ART_TYPE_YENC)) {
-		datalen = compressBound(strlen(art->art_content));
-		data = xmalloc(datalen);
+spool_dev_t	*sd = udata;
+	sd->sd_max_files = opt->co_value->cv_number;
+}
 
-		if (compress2(data, &datalen, (unsigned char *)art->art_content,
-			      strlen(art->art_content), spool_compress) != Z_OK)
-			panic("spool: compress failed");
+static void
+spool_dev_stanza_end(stz, udata)
+	conf_stanza_t	*stz;
+	void		*udata;
+{
+spool_dev_t	*sd = udata;
 
-		art->art_flags |= ART_COMPRESSED;
-	} else {
-		data = (unsigned char *) art->art_content;
-		datalen = strlen(art->art_content);
+	if (sd->sd_id == -1) {
+		nts_logm(SPOOL_fac, M_SPOOL_DEVNOID, stz->cs_file, stz->cs_lineno);
+		++spool_cfgerrors;
+		return;
 	}
 
-	/* lock is held from here */
-	uv_rwlock_wrlock(&spool_mtx);
-	sf = &spool_files[spool_cur_file];
-
-	/*
-	 * Check if we need to rotate to a new spool file.
-	 */
-	if (sf->sf_size + datalen + SPOOL_HDR_SIZE*2 >= sf->sf_dsz) {
-		spool_write_size();
-		spool_write_eos(sf, sf->sf_size);
-
-		if ((spool_cur_file + 1) == spool_max_files) {
-			spool_file_close(0, 1);
-			spool_base++;
-
-			bcopy(&spool_files[1], &spool_files[0],
-				sizeof(spool_file_t) * (spool_max_files - 1));
-
-			spool_file_open(spool_max_files - 1, 1);
-
-		} else {
-			spool_cur_file++;
-			spool_file_open(spool_cur_file, 1);
-		}
-
-		sf = &spool_files[spool_cur_file];
+	if (!sd->sd_path) {
+		nts_logm(SPOOL_fac, M_SPOOL_DEVNOPATH, stz->cs_file, stz->cs_lineno);
+		++spool_cfgerrors;
+		return;
 	}
 
-	s_size = sf->sf_size;
-	s_addr = sf->sf_addr;
+	if (spool_devs[sd->sd_id]) {
+		nts_logm(SPOOL_fac, M_SPOOL_DEVDUPID, stz->cs_file, stz->cs_lineno,
+			 sd->sd_id);
+		++spool_cfgerrors;
+		return;
+	}
 
-	art->art_spool_pos.sp_id = spool_base + spool_cur_file;
-	art->art_spool_pos.sp_offset = s_size;
+	spool_devs[sd->sd_id] = sd;
+}
 
-	if (spool_method == M_MMAP)
-		hdr = s_addr + s_size;
-	else
-		hdr = hdrbuf;
+static spool_dev_t *
+spool_dev_new(id)
+{
+spool_dev_t	*sd;
+
+	sd = xcalloc(1, sizeof(*sd));
+	sd->sd_id = id;
+	uv_rwlock_init(&sd->sd_mtx);
+	uv_sem_init(&sd->sd_wakeup, 0);
+	uv_mutex_init(&sd->sd_prep_mtx);
+	uv_cond_init(&sd->sd_prep_cv);
+	return sd;
+}
 
-	int32put(hdr + hdrpos, SPOOL_MAGIC);			hdrpos += 4;
-	int32put(hdr + hdrpos, datalen);			hdrpos += 4;
-	int8put(hdr + hdrpos, SPOOL_HDR_SIZE);			hdrpos += 1;
-	int32put(hdr + hdrpos, art->art_flags & ~ART_FILTERED);	hdrpos += 4;
-	int64put(hdr + hdrpos, art->art_emp_score * 1000);	hdrpos += 8;
-	int64put(hdr + hdrpos, art->art_phl_score * 1000);	hdrpos += 8;
-	int64put(hdr + hdrpos, crc64(data, datalen));		hdrpos += 8;
-	int32put(hdr + hdrpos, artlen);				hdrpos += 4;
+static void *
+spool_class_stanza_start(stz, udata)
+	conf_stanza_t	*stz;
+	void		*udata;
+{
+spool_class_t	*cls;
+
+	cls = xcalloc(1, sizeof(*cls));
+	cls->spc_name = xstrdup(stz->cs_title);
+	cls->spc_compress = -1;
+	cls->spc_codec = -1;
+	cls->spc_dict = -1;
+	return cls;
+}
 
-	assert(hdrpos == SPOOL_HDR_SIZE);
+static void
+spool_class_stanza_end(stz, udata)
+	conf_stanza_t	*stz;
+	void		*udata;
+{
+spool_class_t	*cls = udata;
 
-	if (!spool_do_sync) {
-		/*
-		 * Increment the spool's offset and release the lock immediately,
-		 * so that multiple writers can do I/O simultaneously.  This can
-		 * lose articles if a later article is written before the article
-		 * that precedes it and we then crash, so only do it when sync
-		 * is disabled.
-		 */
-		sf->sf_size += SPOOL_HDR_SIZE + datalen;
-		uv_rwlock_wrunlock(&spool_mtx);
+	if (cls->spc_ndev_ids == 0) {
+		nts_logm(SPOOL_fac, M_SPOOL_CLSNODEV, stz->cs_file, stz->cs_lineno,
+			 cls->spc_name);
+		++spool_cfgerrors;
+		return;
 	}
 
-	if (spool_method == M_MMAP) {
-		bcopy(data, hdr + SPOOL_HDR_SIZE, datalen);
-		if (spool_do_sync)
-			spool_write_eos(sf, s_size + datalen + SPOOL_HDR_SIZE);
-		ret = msync(hdr, SPOOL_HDR_SIZE + datalen + SPOOL_HDR_SIZE,
-				spool_do_sync ? MS_SYNC : MS_ASYNC);
-	} else {
-	struct iovec	iov[3];
-	char		eos[4];
-	ssize_t		want;
-
-		int32put(eos, SPOOL_MAGIC_EOS);
-		iov[0].iov_base = hdrbuf;
-		iov[0].iov_len = SPOOL_HDR_SIZE;
-		iov[1].iov_base = data;
-		iov[1].iov_len = datalen;
-		iov[2].iov_base = eos;
-		iov[2].iov_len = sizeof(eos);
+	cls->spc_next = spool_classes;
+	spool_classes = cls;
+}
 
-		want = iov[0].iov_len + iov[1].iov_len;
-		if (spool_do_sync)
-			want += iov[2].iov_len;
+static void
+spool_class_set_devices(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+spool_class_t	*cls = udata;
+conf_val_t	*val;
 
-		if (pwritev(sf->sf_fd, iov, spool_do_sync ? 3 : 2, s_size) < want)
-			panic("spool: \"%s\": write error: %s",
-			      sf->sf_fname, strerror(errno));
-		if (spool_do_sync)
-			ret = fdatasync(sf->sf_fd);
-		else
-			ret = 0;
+	for (val = opt->co_value; val; val = val->cv_next) {
+		cls->spc_dev_ids = xrealloc(cls->spc_dev_ids,
+			sizeof(*cls->spc_dev_ids) * (cls->spc_ndev_ids + 1));
+		cls->spc_dev_ids[cls->spc_ndev_ids++] = val->cv_number;
 	}
+}
 
-	if (ret == -1)
-		panic("spool: \"%s\": cannot sync: %s", sf->sf_fname, strerror(errno));
+static void
+spool_class_set_compress(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+spool_class_t	*cls = udata;
+int64_t		 n;
 
-	if (art->art_flags & ART_COMPRESSED) {
-		free(data);
-		data = NULL;
-	}
+	if (opt->co_value->cv_type == CV_BOOLEAN) {
+		if (!opt->co_value->cv_boolean) {
+			cls->spc_compress = 0;
+			return;
+		}
+		n = 6;
+	} else
+		n = opt->co_value->cv_number;
 
-	if (spool_do_sync) {
-		sf->sf_size += SPOOL_HDR_SIZE + datalen;
-		uv_rwlock_wrunlock(&spool_mtx);
+	if (n < 1 || n > SPOOL_MAX_LEVEL) {
+		nts_logm(SPOOL_fac, M_SPOOL_BADCOMPR, opt->co_file, opt->co_lineno,
+			 SPOOL_MAX_LEVEL);
+		++spool_cfgerrors;
+		return;
 	}
 
-	return 0;
+	cls->spc_compress = n;
 }
 
-article_t *
-spool_fetch(spid, spos)
-	spool_id_t	 spid;
-	spool_offset_t	 spos;
+static void
+spool_class_set_codec(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
 {
-spool_header_t	 hdr;
-char		*text;
-article_t	*art;
+spool_class_t	*cls = udata;
+int		 codec;
 
-	if (spool_fetch_text(spid, spos, &hdr, &text) == -1)
-		return NULL;
-
-	art = article_parse(text);
-	free(text);
-	text = NULL;
+	if ((codec = spool_codec_from_opt(opt)) != -1)
+		cls->spc_codec = codec;
+}
 
-	if (!art)
-		return NULL;
+static void
+spool_class_set_dict(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+spool_class_t	*cls = udata;
+	cls->spc_dict = opt->co_value->cv_boolean;
+}
 
-	art->art_emp_score = hdr.sa_emp_score;
-	art->art_phl_score = hdr.sa_phl_score;
-	art->art_flags |= hdr.sa_flags;
+static void
+spool_class_set_types(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+spool_class_t	*cls = udata;
+conf_val_t	*val;
+
+	for (val = opt->co_value; val; val = val->cv_next) {
+	char	*s = val->cv_string;
+		if (strcmp(s, "mime-binary") == 0)
+			cls->spc_art_types |= ART_TYPE_MIME_BINARY;
+		else if (strcmp(s, "uuencode") == 0)
+			cls->spc_art_types |= ART_TYPE_UUE;
+		else if (strcmp(s, "yenc") == 0)
+			cls->spc_art_types |= ART_TYPE_YENC;
+		else if (strcmp(s, "binary") == 0)
+			cls->spc_art_types |= ART_TYPE_BINARY;
+		else if (strcmp(s, "mime-text") == 0)
+			cls->spc_art_types |= ART_TYPE_MIME_TEXT;
+		else if (strcmp(s, "html") == 0)
+			cls->spc_art_types |= ART_TYPE_HTML;
+		else {
+			nts_logm(SPOOL_fac, M_SPOOL_BADTYPE,
+				 opt->co_file, opt->co_lineno, s);
+			++spool_cfgerrors;
+		}
+	}
+}
 
-	art->art_spool_pos.sp_id = spid;
-	art->art_spool_pos.sp_offset = spos;
-	art->art_hdr_len = hdr.sa_hdr_len;
+static void
+spool_class_set_groups(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+spool_class_t	*cls = udata;
+	cls->spc_groups = wildmat_from_value(opt->co_value);
+}
 
-	return art;
+static void
+spool_class_set_min_size(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
+{
+spool_class_t	*cls = udata;
+	cls->spc_min_size = opt->co_value->cv_quantity;
 }
 
-int
-spool_fetch_text(spid, spos, hdr, text)
-	spool_id_t	  spid;
-	spool_offset_t	  spos;
-	spool_header_t	 *hdr;
-	char		**text;
+static void
+spool_class_set_max_size(stz, opt, udata, arg)
+	conf_stanza_t	*stz;
+	conf_option_t	*opt;
+	void		*udata, *arg;
 {
-char		*artdata;
-char		*artstr;
-spool_file_t	*sf;
-size_t		 artloc;
+spool_class_t	*cls = udata;
+	cls->spc_max_size = opt->co_value->cv_quantity;
+}
 
-	uv_rwlock_rdlock(&spool_mtx);
+/*
+ * Add device 0, from the spool stanza, and fill in whatever the spool-device
+ * stanzas left to default to the spool stanza's settings.
+ */
+static int
+spool_setup_devs()
+{
+int	i;
 
-	if (spid < spool_base || spid > (spool_base + spool_cur_file)) {
-		uv_rwlock_rdunlock(&spool_mtx);
-		errno = EINVAL;
+	if (spool_cfgerrors) {
+		nts_logm(SPOOL_fac, M_SPOOL_CFGERRS, spool_cfgerrors);
 		return -1;
 	}
 
-	sf = &spool_files[spid - spool_base];
-	if (spos + SPOOL_HDR_SIZE > sf->sf_size) {
-		uv_rwlock_rdunlock(&spool_mtx);
-		errno = EINVAL;
+	if (!spool_path) {
+		nts_logm(SPOOL_fac, M_SPOOL_NOPATH);
 		return -1;
 	}
 
-	spool_read_header(sf, spos, hdr);
+	spool_devs[0] = spool_dev_new(0);
+	spool_devs[0]->sd_path = spool_path;
 
-	if (hdr->sa_magic == SPOOL_MAGIC_EOS) {
-		uv_rwlock_rdunlock(&spool_mtx);
-		errno = EINVAL;
+	for (i = 0; i < SPOOL_MAX_DEVS; i++) {
+	spool_dev_t	*sd;
+
+		if ((sd = spool_devs[i]) == NULL)
+			continue;
+
+		if (sd->sd_size == 0)
+			sd->sd_size = spool_size;
+		if (sd->sd_max_files == 0)
+			sd->sd_max_files = spool_max_files;
+
+		spool_devlist = xrealloc(spool_devlist,
+				sizeof(*spool_devlist) * (spool_ndevs + 1));
+		spool_devlist[spool_ndevs++] = sd;
+	}
+
+	return spool_setup_classes();
+}
+
+/*
+ * Resolve the classes' device ids, and put every device which isn't in a
+ * class into the default class.
+ */
+static int
+spool_setup_classes()
+{
+spool_class_t	*cls;
+char		 used[SPOOL_MAX_DEVS];
+int		 i;
+
+	bzero(used, sizeof(used));
+
+	for (cls = spool_classes; cls; cls = cls->spc_next) {
+		for (i = 0; i < cls->spc_ndev_ids; i++) {
+		int	id = cls->spc_dev_ids[i];
+
+			if (id < 0 || id >= SPOOL_MAX_DEVS || !spool_devs[id]) {
+				nts_logm(SPOOL_fac, M_SPOOL_CLSBADDEV,
+					 cls->spc_name, id);
+				return -1;
+			}
+
+			if (used[id]) {
+				nts_logm(SPOOL_fac, M_SPOOL_CLSDUPDEV,
+					 cls->spc_name, id);
+				return -1;
+			}
+
+			used[id] = 1;
+			cls->spc_devs = xrealloc(cls->spc_devs,
+				sizeof(*cls->spc_devs) * (cls->spc_ndevs + 1));
+			cls->spc_devs[cls->spc_ndevs++] = spool_devs[id];
+		}
+
+		if (cls->spc_compress == -1)
+			cls->spc_compress = spool_compress;
+		if (cls->spc_codec == -1)
+			cls->spc_codec = spool_codec;
+		if (cls->spc_dict == -1)
+			cls->spc_dict = spool_use_dict;
+
+		if (spool_check_codec(cls) == -1)
+			return -1;
+	}
+
+	spool_default_class.spc_name = "default";
+	spool_default_class.spc_compress = spool_compress;
+	spool_default_class.spc_codec = spool_codec;
+	spool_default_class.spc_dict = spool_use_dict;
+
+	if (spool_check_codec(&spool_default_class) == -1)
 		return -1;
+
+	for (i = 0; i < spool_ndevs; i++) {
+	spool_class_t	*def = &spool_default_class;
+
+		if (used[spool_devlist[i]->sd_id])
+			continue;
+
+		def->spc_devs = xrealloc(def->spc_devs,
+				sizeof(*def->spc_devs) * (def->spc_ndevs + 1));
+		def->spc_devs[def->spc_ndevs++] = spool_devlist[i];
 	}
 
-	if (hdr->sa_magic != SPOOL_MAGIC) {
-		nts_logm(SPOOL_fac, M_SPOOL_BADMAGIC,
-			 sf->sf_fname, (int) spid, (long unsigned) spos);
-		uv_rwlock_rdunlock(&spool_mtx);
-		errno = EIO;
+	if (spool_default_class.spc_ndevs == 0) {
+		nts_logm(SPOOL_fac, M_SPOOL_NODEFDEV);
 		return -1;
 	}
 
-	artloc = spos + hdr->sa_hdr_len;
+	return 0;
+}
 
-	if (artloc + hdr->sa_len > sf->sf_size) {
-		nts_logm(SPOOL_fac, M_SPOOL_TOOLONG,
-			 sf->sf_fname,
-			 (long unsigned) spid, (long unsigned) spos);
-		uv_rwlock_rdunlock(&spool_mtx);
-		errno = EIO;
+/*
+ * Return the class for an article: the first one it matches, or the default
+ * class.  As with filters, an article has to match every criterion given.
+ */
+static spool_class_t *
+spool_pick_class(art, len)
+	article_t	*art;
+	size_t		 len;
+{
+spool_class_t	*cls;
+
+	for (cls = spool_classes; cls; cls = cls->spc_next) {
+		if (cls->spc_art_types &&
+		    (cls->spc_art_types & art->art_flags) == 0)
+			continue;
+
+		if (cls->spc_min_size && len < cls->spc_min_size)
+			continue;
+
+		if (cls->spc_max_size && len > cls->spc_max_size)
+			continue;
+
+		if (cls->spc_groups) {
+		strlist_entry_t	*ge;
+
+			SIMPLEQ_FOREACH(ge, &art->art_groups, sl_list)
+				if (wildmat_match(cls->spc_groups, ge->sl_str))
+					break;
+			if (ge == NULL)
+				continue;
+		}
+
+		return cls;
+	}
+
+	return &spool_default_class;
+}
+
+/*
+ * Check that a class's compression settings can be used.
+ */
+static int
+spool_check_codec(cls)
+	spool_class_t	*cls;
+{
+	if (!cls->spc_compress)
+		return 0;
+
+	if (cls->spc_codec == SPOOL_ZLIB &&
+	    cls->spc_compress > SPOOL_MAX_ZLIB_LEVEL) {
+		nts_logm(SPOOL_fac, M_SPOOL_ZLIBLEVEL, cls->spc_name,
+			 cls->spc_compress, SPOOL_MAX_ZLIB_LEVEL);
 		return -1;
 	}
 
-	if (spool_method == M_MMAP) {
-		artdata = (char *) sf->sf_addr + artloc;
-	} else {
-		artdata = xmalloc(hdr->sa_len);
-		if (pread(sf->sf_fd, artdata, hdr->sa_len, artloc) < hdr->sa_len)
-			panic("spool: \"%s\": read: %s",
-				sf->sf_fname, strerror(errno));
+#ifndef USE_ZSTD
+	if (cls->spc_codec == SPOOL_ZSTD) {
+		nts_logm(SPOOL_fac, M_SPOOL_NOZSTD, cls->spc_name);
+		return -1;
 	}
+#endif
 
-	if (spool_check_crc && (hdr->sa_flags & ART_CRC)) {
-		if (crc64(artdata, hdr->sa_len) != hdr->sa_crc) {
-			nts_logm(SPOOL_fac, M_SPOOL_BADCRC, sf->sf_fname);
-			if (spool_method == M_FILE) {
-				free(artdata);
-				artdata = NULL;
-			}
-			uv_rwlock_rdunlock(&spool_mtx);
-			errno = EIO;
-			return -1;
-		}
+	return 0;
+}
+
+/*
+ * Compress an article's text for storing in cls, and add the flags which say
+ * how it was compressed.  Returns a buffer the caller must free.
+ */
+static unsigned char *
+spool_compress_text(cls, text, len, datalen, flags)
+	spool_class_t	*cls;
+	char const	*text;
+	size_t		 len, *datalen;
+	uint32_t	*flags;
+{
+unsigned char	*data;
+unsigned long	 zlen;
+
+#ifdef USE_ZSTD
+	if (cls->spc_codec == SPOOL_ZSTD) {
+	spool_zctx_t	*zc = NULL;
+	ZSTD_CDict	*cdict;
+	size_t		 ret;
+
+		uv_mutex_lock(&spool_zstd_mtx);
+		if ((zc = spool_zctxs) != NULL)
+			spool_zctxs = zc->zc_next;
+		cdict = cls->spc_cdict;
+		if (cls->spc_dict && cls->spc_dict_state == SPOOL_DICT_SAMPLING)
+			spool_dict_sample(cls, text, len);
+		uv_mutex_unlock(&spool_zstd_mtx);
+
+		if (zc == NULL)
+			zc = spool_zctx_get();
+
+		*datalen = ZSTD_compressBound(len);
+		data = xmalloc(*datalen);
+
+		if (cdict)
+			ret = ZSTD_compress_usingCDict(zc->zc_cctx, data, *datalen,
+						       text, len, cdict);
+		else
+			ret = ZSTD_compressCCtx(zc->zc_cctx, data, *datalen,
+						text, len, cls->spc_compress);
+		spool_zctx_put(zc);
+
+		if (ZSTD_isError(ret))
+			panic("spool: compress failed: %s", ZSTD_getErrorName(ret));
+
+		*datalen = ret;
+		*flags |= ART_COMPRESSED | ART_ZSTD;
+		return data;
 	}
+#endif
 
-	if (hdr->sa_flags & ART_COMPRESSED) {
-	unsigned char	*data;
-	unsigned long	 datasize;
-	int		 ret;
+	zlen = compressBound(len);
+	data = xmalloc(zlen);
 
-		datasize = hdr->sa_text_len;
-		data = xmalloc(datasize);
+	if (compress2(data, &zlen, (unsigned char const *) text, len,
+		      cls->spc_compress) != Z_OK)
+		panic("spool: compress failed");
 
-		if ((ret = uncompress(data, &datasize, (unsigned char *) artdata,
-		                      hdr->sa_len)) != Z_OK) {
-			nts_logm(SPOOL_fac, M_SPOOL_UNCMPFAIL,
-				 sf->sf_fname, zError(ret));
+	*datalen = zlen;
+	*flags |= ART_COMPRESSED;
+	return data;
+}
 
-			if (spool_method == M_FILE) {
-				free(artdata);
-				artdata = NULL;
+/*
+ * Uncompress an article stored with the given flags into dst, which holds
+ * *dstlen bytes.  On failure, *err is set to the reason.
+ */
+static int
+spool_uncompress(flags, src, srclen, dst, dstlen, err)
+	uint32_t	 flags;
+	void const	*src;
+	size_t		 srclen;
+	unsigned char	*dst;
+	size_t		*dstlen;
+	char const	**err;
+{
+unsigned long	zlen = *dstlen;
+int		ret;
+
+	if (flags & ART_ZSTD) {
+#ifdef USE_ZSTD
+	spool_zctx_t	*zc;
+	spool_dict_t	*di = NULL;
+	unsigned	 id;
+	size_t		 zret;
+
+		if (id = ZSTD_getDictID_fromFrame(src, srclen)) {
+			uv_mutex_lock(&spool_zstd_mtx);
+			di = spool_dict_find(id);
+			uv_mutex_unlock(&spool_zstd_mtx);
+
+			if (di == NULL) {
+				*err = "dictionary not found";
+				return -1;
 			}
+		}
 
-			free(data);
-			data = NULL;
+		zc = spool_zctx_get();
+		if (di)
+			zret = ZSTD_decompress_usingDDict(zc->zc_dctx, dst, *dstlen,
+							  src, srclen, di->sdi_ddict);
+		else
+			zret = ZSTD_decompressDCtx(zc->zc_dctx, dst, *dstlen,
+						   src, srclen);
+		spool_zctx_put(zc);
 
-			uv_rwlock_rdunlock(&spool_mtx);
-			errno = EIO;
+		if (ZSTD_isError(zret)) {
+			*err = ZSTD_getErrorName(zret);
 			return -1;
 		}
 
-		artstr = xmalloc(datasize + 1);
-		bcopy(data, artstr, datasize);
-		artstr[datasize] = 0;
-		free(data);
-		data = NULL;
-	} else {
-		artstr = xmalloc(hdr->sa_len);
-		bcopy(artdata, artstr, hdr->sa_len + 1);
-		artstr[hdr->sa_len] = 0;
+		*dstlen = zret;
+		return 0;
+#else
+		*err = "zstd support not compiled in";
+		return -1;
+#endif
 	}
 
-	if (spool_method == M_FILE) {
-		free(artdata);
-		artdata = NULL;
+	if ((ret = uncompress(dst, &zlen, src, srclen)) != Z_OK) {
+		*err = zError(ret);
+		return -1;
 	}
 
-	*text = artstr;
-	uv_rwlock_rdunlock(&spool_mtx);
+	*dstlen = zlen;
 	return 0;
 }
 
-static void
-spool_do_write_size(timer, status)
-	uv_timer_t	*timer;
+#ifdef USE_ZSTD
+static spool_zctx_t *
+spool_zctx_get()
 {
-	uv_rwlock_wrlock(&spool_mtx);
-	spool_write_size();
-	uv_rwlock_wrunlock(&spool_mtx);
+spool_zctx_t	*zc;
+
+	uv_mutex_lock(&spool_zstd_mtx);
+	if ((zc = spool_zctxs) != NULL)
+		spool_zctxs = zc->zc_next;
+	uv_mutex_unlock(&spool_zstd_mtx);
+
+	if (zc)
+		return zc;
+
+	zc = xcalloc(1, sizeof(*zc));
+	if ((zc->zc_cctx = ZSTD_createCCtx()) == NULL ||
+	    (zc->zc_dctx = ZSTD_createDCtx()) == NULL)
+		panic("spool: out of memory for zstd context");
+	return zc;
 }
 
 static void
-spool_write_size()
+spool_zctx_put(zc)
+	spool_zctx_t	*zc;
 {
-spool_file_t	*sf;
+	uv_mutex_lock(&spool_zstd_mtx);
+	zc->zc_next = spool_zctxs;
+	spool_zctxs = zc;
+	uv_mutex_unlock(&spool_zstd_mtx);
+}
 
-	sf = &spool_files[spool_cur_file];
+/*
+ * Find a dictionary by id.  The caller holds spool_zstd_mtx.
+ */
+static spool_dict_t *
+spool_dict_find(id)
+	unsigned	id;
+{
+spool_dict_t	*di;
 
-	if (spool_method == M_MMAP) {
-		int64put(sf->sf_addr, sf->sf_size);
-		if (msync(sf->sf_addr, sf->sf_size, MS_SYNC) == -1)
-			panic("spool: \"%s/%.8lx\": %s",
-					spool_path, (long unsigned) spool_base 
-					+ spool_cur_file, strerror(errno));
-	} else {
-	char	szbuf[sizeof(uint64_t)];
-		int64put(szbuf, sf->sf_size);
-		if (pwrite(sf->sf_fd, szbuf, sizeof(szbuf), 0) < sizeof(szbuf)
-		    || fdatasync(sf->sf_fd) == -1)
-			panic("spool: \"%s\": write error: %s",
-				sf->sf_fname, strerror(errno));
+	for (di = spool_dicts; di; di = di->sdi_next)
+		if (di->sdi_id == id)
+			return di;
+	return NULL;
+}
+
+/*
+ * Add a dictionary, taking ownership of buf, or return the existing one with
+ * the same id.  Returns NULL if buf isn't a zstd dictionary.
+ */
+static spool_dict_t *
+spool_dict_add(buf, len, mtime)
+	void	*buf;
+	size_t	 len;
+	time_t	 mtime;
+{
+spool_dict_t	*di;
+unsigned	 id;
+
+	if ((id = ZSTD_getDictID_fromDict(buf, len)) == 0) {
+		free(buf);
+		return NULL;
+	}
+
+	uv_mutex_lock(&spool_zstd_mtx);
+	if ((di = spool_dict_find(id)) != NULL) {
+		uv_mutex_unlock(&spool_zstd_mtx);
+		free(buf);
+		return di;
 	}
+
+	di = xcalloc(1, sizeof(*di));
+	di->sdi_id = id;
+	di->sdi_buf = buf;
+	di->sdi_len = len;
+	di->sdi_mtime = mtime;
+	if ((di->sdi_ddict = ZSTD_createDDict(buf, len)) == NULL)
+		panic("spool: out of memory for zstd dictionary");
+
+	di->sdi_next = spool_dicts;
+	spool_dicts = di;
+	uv_mutex_unlock(&spool_zstd_mtx);
+	return di;
 }
 
-static void
-spool_verify(sf)
-	spool_file_t	*sf;
+/*
+ * Load every dictionary saved in a device.
+ */
+static int
+spool_dict_load(sd)
+	spool_dev_t	*sd;
 {
-off_t		pos;
-struct stat	sb;
-char		hdrbuf[SPOOL_HDR_SIZE];
-ssize_t		n;
+DIR		*dir;
+struct dirent	*de;
 
-	if (fstat(sf->sf_fd, &sb) == -1)
-		panic("spool: \"%s\": fstat: %s",
-				sf->sf_fname, strerror(errno));
+	if ((dir = opendir(sd->sd_path)) == NULL) {
+		nts_logm(SPOOL_fac, M_SPOOL_DOPNFAIL,
+			 sd->sd_path, strerror(errno));
+		return -1;
+	}
+
+	while (de = readdir(dir)) {
+	char		 path[PATH_MAX];
+	struct stat	 sb;
+	spool_dict_t	*di;
+	void		*buf;
+	int		 fd;
+
+		if (strncmp(de->d_name, SPOOL_DICT, strlen(SPOOL_DICT)) ||
+		    strchr(de->d_name + strlen(SPOOL_DICT), '.'))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", sd->sd_path, de->d_name);
+
+		if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+			nts_logm(SPOOL_fac, M_SPOOL_DICTRDFAIL, path, strerror(errno));
+			if (fd != -1)
+				close(fd);
+			closedir(dir);
+			return -1;
+		}
+
+		buf = xmalloc(sb.st_size);
+		if (read(fd, buf, sb.st_size) < sb.st_size) {
+			nts_logm(SPOOL_fac, M_SPOOL_DICTRDFAIL, path,
+				 errno ? strerror(errno) : "short read");
+			free(buf);
+			close(fd);
+			closedir(dir);
+			return -1;
+		}
+		close(fd);
+
+		if ((di = spool_dict_add(buf, sb.st_size, sb.st_mtime)) == NULL) {
+			nts_logm(SPOOL_fac, M_SPOOL_DICTRDFAIL, path,
+				 "not a zstd dictionary");
+			closedir(dir);
+			return -1;
+		}
+
+		uv_mutex_lock(&spool_zstd_mtx);
+		di->sdi_devs[sd->sd_id] = 1;
+		uv_mutex_unlock(&spool_zstd_mtx);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/*
+ * Save a dictionary in a device.  It's written under a temporary name first,
+ * so a crash can't leave a partial dictionary behind.
+ */
+static int
+spool_dict_write(sd, di)
+	spool_dev_t	*sd;
+	spool_dict_t	*di;
+{
+char	path[PATH_MAX], tmp[PATH_MAX];
+int	fd;
+
+	snprintf(path, sizeof(path), "%s/%s%08x", sd->sd_path, SPOOL_DICT,
+		 di->sdi_id);
+	snprintf(tmp, sizeof(tmp), "%s/%s%08x.tmp", sd->sd_path, SPOOL_DICT,
+		 di->sdi_id);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		nts_logm(SPOOL_fac, M_SPOOL_DICTWRFAIL, tmp, strerror(errno));
+		return -1;
+	}
+
+	if (write(fd, di->sdi_buf, di->sdi_len) < (ssize_t) di->sdi_len ||
+	    fsync(fd) == -1) {
+		nts_logm(SPOOL_fac, M_SPOOL_DICTWRFAIL, tmp,
+			 errno ? strerror(errno) : "short write");
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, path) == -1) {
+		nts_logm(SPOOL_fac, M_SPOOL_DICTWRFAIL, path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	uv_mutex_lock(&spool_zstd_mtx);
+	di->sdi_devs[sd->sd_id] = 1;
+	uv_mutex_unlock(&spool_zstd_mtx);
+	return 0;
+}
+
+/*
+ * Give each dictionary class the newest dictionary found in any of its
+ * devices, and save it in any of the class's devices which don't have it.
+ * A class with no dictionary starts sampling articles to train one.
+ */
+static int
+spool_setup_dicts()
+{
+spool_class_t	*cls = spool_classes;
+
+	for (;;) {
+	spool_dict_t	*di, *best = NULL;
+	int		 i;
+
+		if (cls == NULL)
+			cls = &spool_default_class;
+
+		if (cls->spc_compress && cls->spc_codec == SPOOL_ZSTD &&
+		    cls->spc_dict) {
+			for (di = spool_dicts; di; di = di->sdi_next)
+				for (i = 0; i < cls->spc_ndevs; i++)
+					if (di->sdi_devs[cls->spc_devs[i]->sd_id] &&
+					    (!best || di->sdi_mtime > best->sdi_mtime))
+						best = di;
+
+			if (best) {
+				for (i = 0; i < cls->spc_ndevs; i++)
+					if (!best->sdi_devs[cls->spc_devs[i]->sd_id] &&
+					    spool_dict_write(cls->spc_devs[i], best) == -1)
+						return -1;
+
+				if ((cls->spc_cdict = ZSTD_createCDict(best->sdi_buf,
+						best->sdi_len, cls->spc_compress)) == NULL)
+					panic("spool: out of memory for zstd dictionary");
+				cls->spc_dict_state = SPOOL_DICT_DONE;
+			} else
+				cls->spc_dict_state = SPOOL_DICT_SAMPLING;
+		} else
+			cls->spc_dict_state = SPOOL_DICT_DONE;
+
+		if (cls == &spool_default_class)
+			break;
+		cls = cls->spc_next;
+	}
+
+	return 0;
+}
+
+/*
+ * Add an article to a class's training sample.  Once there's enough, hand
+ * the class to the prep thread of its first device to train a dictionary.
+ * The caller holds spool_zstd_mtx.
+ */
+static void
+spool_dict_sample(cls, text, len)
+	spool_class_t	*cls;
+	char const	*text;
+	size_t		 len;
+{
+spool_dev_t	*sd;
+
+	if (len > SPOOL_DICT_MAXSAMPLE)
+		len = SPOOL_DICT_MAXSAMPLE;
+
+	if (cls->spc_samples == NULL)
+		cls->spc_samples = xmalloc(SPOOL_DICT_SAMPLES + SPOOL_DICT_MAXSAMPLE);
+
+	bcopy(text, cls->spc_samples + cls->spc_sample_len, len);
+	cls->spc_sample_len += len;
+	cls->spc_sample_sizes = xrealloc(cls->spc_sample_sizes,
+			sizeof(*cls->spc_sample_sizes) * (cls->spc_nsamples + 1));
+	cls->spc_sample_sizes[cls->spc_nsamples++] = len;
+
+	if (cls->spc_sample_len < SPOOL_DICT_SAMPLES)
+		return;
+
+	cls->spc_dict_state = SPOOL_DICT_TRAINING;
+
+	sd = cls->spc_devs[0];
+	uv_mutex_lock(&sd->sd_prep_mtx);
+	sd->sd_train = cls;
+	uv_cond_signal(&sd->sd_prep_cv);
+	uv_mutex_unlock(&sd->sd_prep_mtx);
+}
+
+/*
+ * Train a dictionary for a class from its sample, save it in each of the
+ * class's devices, and start using it.  This runs in the prep thread; the
+ * sample isn't touched by anything else once the class is training.  If
+ * anything fails, the class carries on without a dictionary.
+ */
+static void
+spool_dict_train(cls)
+	spool_class_t	*cls;
+{
+spool_dict_t	*di = NULL;
+ZSTD_CDict	*cdict = NULL;
+void		*buf;
+size_t		 len;
+int		 i;
+
+	buf = xmalloc(SPOOL_DICT_SIZE);
+	len = ZDICT_trainFromBuffer(buf, SPOOL_DICT_SIZE, cls->spc_samples,
+				    cls->spc_sample_sizes, cls->spc_nsamples);
+
+	if (ZDICT_isError(len)) {
+		nts_logm(SPOOL_fac, M_SPOOL_DICTFAIL, cls->spc_name,
+			 ZDICT_getErrorName(len));
+		free(buf);
+		goto done;
+	}
+
+	if ((di = spool_dict_add(buf, len, time(NULL))) == NULL) {
+		nts_logm(SPOOL_fac, M_SPOOL_DICTFAIL, cls->spc_name,
+			 "no dictionary id");
+		goto done;
+	}
+
+	for (i = 0; i < cls->spc_ndevs; i++)
+		if (spool_dict_write(cls->spc_devs[i], di) == -1)
+			goto done;
+
+	if ((cdict = ZSTD_createCDict(di->sdi_buf, di->sdi_len,
+				      cls->spc_compress)) == NULL)
+		panic("spool: out of memory for zstd dictionary");
+
+	nts_logm(SPOOL_fac, M_SPOOL_DICTNEW, cls->spc_name, di->sdi_id,
+		 (int) cls->spc_nsamples, (long unsigned) di->sdi_len);
+
+done:
+	uv_mutex_lock(&spool_zstd_mtx);
+	cls->spc_cdict = cdict;
+	cls->spc_dict_state = SPOOL_DICT_DONE;
+	free(cls->spc_samples);
+	free(cls->spc_sample_sizes);
+	cls->spc_samples = NULL;
+	cls->spc_sample_sizes = NULL;
+	cls->spc_nsamples = 0;
+	cls->spc_sample_len = 0;
+	uv_mutex_unlock(&spool_zstd_mtx);
+}
+#endif	/* USE_ZSTD */
+
+int
+spool_run()
+{
+uv_thread_t	*thrs;
+int		*started;
+int		 i, ret = 0;
+
+	if (spool_setup_devs() == -1)
+		return -1;
+
+	if (spool_cache_size)
+		spool_cache = hash_new(spool_cache_size / 4096, NULL, NULL, NULL);
+	spool_pagesize = sysconf(_SC_PAGESIZE);
+	if (spool_method == M_DIRECT)
+		spool_direct_init();
+
+	/*
+	 * Opening a device can mean verifying its last file, so do all the
+	 * devices at once.
+	 */
+	if (spool_ndevs == 1) {
+		if (spool_dev_run(spool_devlist[0]) == -1)
+			return -1;
+	} else {
+		thrs = xcalloc(spool_ndevs, sizeof(*thrs));
+		started = xcalloc(spool_ndevs, sizeof(*started));
+
+		for (i = 0; i < spool_ndevs; i++)
+			if (uv_thread_create(&thrs[i], spool_dev_run_thread,
+					     spool_devlist[i]) == 0)
+				started[i] = 1;
+			else
+				spool_dev_run(spool_devlist[i]);
+
+		for (i = 0; i < spool_ndevs; i++) {
+			if (started[i])
+				uv_thread_join(&thrs[i]);
+			if (spool_devlist[i]->sd_error)
+				ret = -1;
+		}
+
+		free(thrs);
+		free(started);
+		if (ret == -1)
+			return -1;
+	}
+
+#ifdef USE_ZSTD
+	if (spool_setup_dicts() == -1)
+		return -1;
+#endif
+
+	uv_timer_init(loop, &spool_timer);
+	uv_timer_start(&spool_timer, spool_do_write_size, 10 * 1000, 10 * 1000);
+	return 0;
+}
+
+static void
+spool_dev_run_thread(arg)
+	void	*arg;
+{
+	spool_dev_run(arg);
+}
+
+static int
+spool_dev_run(sd)
+	spool_dev_t	*sd;
+{
+spool_id_t	*files = NULL;
+size_t		 nfiles = 0;
+DIR		*dir;
+struct dirent	*de;
+char		 next[PATH_MAX];
+
+	sd->sd_error = 1;
+
+	if (mkdir(sd->sd_path, 0700) == -1 && errno != EEXIST) {
+		nts_logm(SPOOL_fac, M_SPOOL_MKDFAIL,
+			 sd->sd_path, strerror(errno));
+		return -1;
+	}
+
+#ifdef USE_ZSTD
+	if (spool_dict_load(sd) == -1)
+		return -1;
+#endif
+
+	if ((dir = opendir(sd->sd_path)) == NULL) {
+		nts_logm(SPOOL_fac, M_SPOOL_DOPNFAIL,
+			 sd->sd_path, strerror(errno));
+		return -1;
+	}
+
+	/* A file prepared for rotation but never used */
+	snprintf(next, sizeof(next), "%s/%s", sd->sd_path, SPOOL_NEXT);
+	if (unlink(next) == -1 && errno != ENOENT) {
+		nts_logm(SPOOL_fac, M_SPOOL_UNLKFAIL, next, strerror(errno));
+		closedir(dir);
+		return -1;
+	}
+
+	while (de = readdir(dir)) {
+	char		*p;
+	long unsigned	 n;
+
+		/* ., .., the dictionaries and the indexes */
+		if (*de->d_name == '.')
+			continue;
+
+		n = strtoul(de->d_name, &p, 16);
+		if (*p) {
+			nts_logm(SPOOL_fac, M_SPOOL_JUNK,
+				 sd->sd_path, de->d_name);
+			continue;
+		}
+
+		if (n > SPOOL_FILE_MASK) {
+			nts_logm(SPOOL_fac, M_SPOOL_BIGFILE,
+				 sd->sd_path, de->d_name);
+			closedir(dir);
+			free(files);
+			return -1;
+		}
+
+		files = xrealloc(files, sizeof(*files) * (nfiles + 1));
+		files[nfiles] = n;
+		nfiles++;
+	}
+	closedir(dir);
+
+	sd->sd_files = xcalloc(sizeof(*sd->sd_files), sd->sd_max_files);
+
+	if (nfiles) {
+	size_t	skip = 0;
+
+		/* Open an existing spool */
+		qsort(files, nfiles, sizeof(*files), numcmp);
+
+		/*
+		 * A file rotated out while it was still being read isn't
+		 * deleted until the last reader is done, so after a crash
+		 * it can be left behind.
+		 */
+		for (; nfiles - skip > sd->sd_max_files; skip++) {
+		char	fname[PATH_MAX], iname[PATH_MAX];
+
+			spool_file_name(sd, fname, files[skip]);
+			spool_idx_name(fname, iname);
+			nts_logm(SPOOL_fac, M_SPOOL_EXTRAFILE, sd->sd_path,
+				 fname + strlen(sd->sd_path) + 1);
+			if ((unlink(iname) == -1 && errno != ENOENT) ||
+			    unlink(fname) == -1) {
+				nts_logm(SPOOL_fac, M_SPOOL_UNLKFAIL, fname,
+					 strerror(errno));
+				free(files);
+				return -1;
+			}
+			if (spool_expire_hook)
+				spool_expire_hook(SPOOL_ID(sd->sd_id, files[skip]));
+		}
+		nfiles -= skip;
+		sd->sd_base = files[skip];
+
+		spool_dev_open(sd, nfiles);
+		sd->sd_cur_file = nfiles - 1;
+	} else {
+		/* Create a new spool */
+		spool_file_open(sd, 0, 1);
+		sd->sd_cur_file = 0;
+	}
+	free(files);
+
+	spool_write_size(sd);
+	sd->sd_error = 0;
+	return 0;
+}
+
+/*
+ * Open a device's existing files.  After a crash, any of them might need to
+ * be verified, so they're opened by several threads at once, each taking
+ * the next file to open until there are none left.
+ */
+typedef struct spool_opener {
+	spool_dev_t	*so_dev;
+	uv_mutex_t	 so_mtx;
+	size_t		 so_next;
+	size_t		 so_nfiles;
+} spool_opener_t;
+
+static void
+spool_dev_open_thread(arg)
+	void	*arg;
+{
+spool_opener_t	*so = arg;
+size_t		 num;
+
+	for (;;) {
+		uv_mutex_lock(&so->so_mtx);
+		num = so->so_next++;
+		uv_mutex_unlock(&so->so_mtx);
+
+		if (num >= so->so_nfiles)
+			return;
+		spool_file_open(so->so_dev, num, 0);
+	}
+}
+
+static void
+spool_dev_open(sd, nfiles)
+	spool_dev_t	*sd;
+	size_t		 nfiles;
+{
+spool_opener_t	 so;
+uv_thread_t	*thrs;
+int		 nthrs = 0, i;
+
+	bzero(&so, sizeof(so));
+	so.so_dev = sd;
+	so.so_nfiles = nfiles;
+	uv_mutex_init(&so.so_mtx);
+
+	thrs = xcalloc(spool_verify_threads > 1 ? spool_verify_threads : 1,
+		       sizeof(*thrs));
+	for (i = 1; i < spool_verify_threads && i < nfiles; i++)
+		if (uv_thread_create(&thrs[nthrs], spool_dev_open_thread, &so) == 0)
+			++nthrs;
+
+	spool_dev_open_thread(&so);
+	for (i = 0; i < nthrs; i++)
+		uv_thread_join(&thrs[i]);
+
+	free(thrs);
+	uv_mutex_destroy(&so.so_mtx);
+}
+
+int
+spool_start()
+{
+int	i;
+
+	for (i = 0; i < spool_ndevs; i++)
+		if (spool_dev_start(spool_devlist[i]) == -1)
+			return -1;
+	return 0;
+}
+
+static int
+spool_dev_start(sd)
+	spool_dev_t	*sd;
+{
+int	err;
+
+	if (err = uv_thread_create(&sd->sd_thread, spool_thread_run, sd)) {
+		nts_logm(SPOOL_fac, M_SPOOL_THRFAIL, uv_strerror(err));
+		return -1;
+	}
+
+	sd->sd_thread_running = 1;
+
+	if (err = uv_thread_create(&sd->sd_prep_thread, spool_prep_run, sd)) {
+		nts_logm(SPOOL_fac, M_SPOOL_THRFAIL, uv_strerror(err));
+		return -1;
+	}
+
+	sd->sd_prep_running = 1;
+	return 0;
+}
+
+/*
+ * The prep thread.  Files waiting to be deleted come first, since they're
+ * holding disk space the next file may need, and dictionary training comes
+ * last.
+ */
+static void
+spool_prep_run(arg)
+	void	*arg;
+{
+spool_dev_t	*sd = arg;
+spool_file_t	*sf;
+char		 fname[PATH_MAX];
+
+	snprintf(fname, sizeof(fname), "%s/%s", sd->sd_path, SPOOL_NEXT);
+
+	uv_mutex_lock(&sd->sd_prep_mtx);
+	for (;;) {
+		if (sf = sd->sd_dead) {
+			sd->sd_dead = sf->sf_next;
+			uv_mutex_unlock(&sd->sd_prep_mtx);
+			spool_file_free(sf);
+			uv_mutex_lock(&sd->sd_prep_mtx);
+			continue;
+		}
+
+		if (sd->sd_prep_stop)
+			break;
+
+		if (sd->sd_next == NULL) {
+			uv_mutex_unlock(&sd->sd_prep_mtx);
+			sf = spool_file_new(sd, fname, 1, 1);
+			uv_mutex_lock(&sd->sd_prep_mtx);
+			sd->sd_next = sf;
+			continue;
+		}
+
+#ifdef USE_ZSTD
+		if (sd->sd_train) {
+		spool_class_t	*cls = sd->sd_train;
+
+			sd->sd_train = NULL;
+			uv_mutex_unlock(&sd->sd_prep_mtx);
+			spool_dict_train(cls);
+			uv_mutex_lock(&sd->sd_prep_mtx);
+			continue;
+		}
+#endif
+
+		uv_cond_wait(&sd->sd_prep_cv, &sd->sd_prep_mtx);
+	}
+	uv_mutex_unlock(&sd->sd_prep_mtx);
+}
+
+/*
+ * Add a request to the writer queue.  The queue is a LIFO list which the
+ * writer takes in one go and reverses, so queueing never blocks on the
+ * writer.
+ */
+static void
+spool_queue_push(sd, req)
+	spool_dev_t		*sd;
+	spool_store_req_t	*req;
+{
+#ifdef ATOMIC
+spool_store_req_t	*head;
+#endif
+
+	req->sr_queued = uv_hrtime();
+	uv_sem_init(&req->sr_done, 0);
+
+#ifdef ATOMIC
+	do {
+		head = sd->sd_queue;
+		req->sr_next = head;
+	} while (atomic_cas_ptr(&sd->sd_queue, head, req) != head);
+#else
+	uv_mutex_lock(&spool_queue_mtx);
+	req->sr_next = sd->sd_queue;
+	sd->sd_queue = req;
+	uv_mutex_unlock(&spool_queue_mtx);
+#endif
+
+	uv_sem_post(&sd->sd_wakeup);
+}
+
+static spool_store_req_t *
+spool_queue_take(sd)
+	spool_dev_t	*sd;
+{
+spool_store_req_t	*head, *next, *list = NULL;
+
+#ifdef ATOMIC
+	do {
+		head = sd->sd_queue;
+	} while (atomic_cas_ptr(&sd->sd_queue, head, NULL) != head);
+#else
+	uv_mutex_lock(&spool_queue_mtx);
+	head = sd->sd_queue;
+	sd->sd_queue = NULL;
+	uv_mutex_unlock(&spool_queue_mtx);
+#endif
+
+	/* Reverse into the order the requests were queued in */
+	for (; head; head = next) {
+		next = head->sr_next;
+		head->sr_next = list;
+		list = head;
+	}
+
+	return list;
+}
+
+static void
+spool_thread_run(p)
+	void	*p;
+{
+spool_dev_t		*sd = p;
+spool_store_req_t	*batch, *end;
+int			 n, i;
+
+	for (;;) {
+		uv_sem_wait(&sd->sd_wakeup);
+
+		/*
+		 * We get one wakeup per request, so after taking a batch of
+		 * several requests, the next few wakeups may find the queue
+		 * empty.
+		 */
+		if ((batch = spool_queue_take(sd)) == NULL) {
+			if (sd->sd_thread_stop)
+				break;
+			continue;
+		}
+
+		for (n = 0, end = batch; end; end = end->sr_next)
+			n++;
+
+		uv_mutex_lock(&spool_size_mtx);
+		for (i = 0; i < SPOOL_BATCH_BUCKETS - 1; i++)
+			if (n <= spool_batch_buckets[i])
+				break;
+		spool_stats.sst_batch_hist[i]++;
+		if (n > spool_stats.sst_max_batch)
+			spool_stats.sst_max_batch = n;
+		uv_mutex_unlock(&spool_size_mtx);
+
+		/*
+		 * Rotation waits for the queue to drain, so a file change can
+		 * only happen at a barrier.
+		 */
+		while (batch) {
+			for (end = batch->sr_next; end; end = end->sr_next)
+				if (end->sr_file != batch->sr_file)
+					break;
+
+			spool_sync_batch(sd, batch, end);
+			batch = end;
+		}
+	}
+}
+
+/*
+ * Sync the requests from first up to (not including) end, which are all in
+ * the same spool file, then complete any which are now contiguous with the
+ * durable size.
+ */
+static void
+spool_sync_batch(sd, first, end)
+	spool_dev_t		*sd;
+	spool_store_req_t	*first, *end;
+{
+spool_file_t		*sf = first->sr_file;
+spool_store_req_t	*req, *next, **hp, *done = NULL, **dtail = &done;
+spool_offset_t		 lo = UINT64_MAX, hi = 0;
+uint64_t		 start, now;
+int			 ret, i;
+
+	if (sf == NULL) {
+		assert(sd->sd_held == NULL);
+		for (req = first; req != end; req = next) {
+			next = req->sr_next;
+			uv_sem_post(&req->sr_done);
+		}
+		return;
+	}
+
+	for (req = first; req != end; req = req->sr_next) {
+		if (req->sr_offset < lo)
+			lo = req->sr_offset;
+		if (req->sr_offset + req->sr_hdrlen + req->sr_datalen +
+		    req->sr_padlen > hi)
+			hi = req->sr_offset + req->sr_hdrlen + req->sr_datalen +
+			     req->sr_padlen;
+	}
+
+	start = uv_hrtime();
+	if (spool_method == M_MMAP) {
+		/* msync() needs a page-aligned address */
+		lo &= ~(spool_pagesize - 1);
+		ret = msync(sf->sf_addr + lo, hi - lo,
+			    spool_do_sync ? MS_SYNC : MS_ASYNC);
+	} else if (spool_do_sync)
+		ret = fdatasync(sf->sf_fd);
+	else
+		ret = 0;
+
+	if (ret == -1)
+		panic("spool: \"%s\": cannot sync: %s", sf->sf_fname, strerror(errno));
+
+	/*
+	 * Merge the batch into the held list, which is sorted by offset.
+	 */
+	for (req = first; req != end; req = next) {
+		next = req->sr_next;
+		assert(sd->sd_held == NULL || sd->sd_held->sr_file == sf);
+
+		for (hp = &sd->sd_held; *hp; hp = &(*hp)->sr_next)
+			if ((*hp)->sr_offset > req->sr_offset)
+				break;
+		req->sr_next = *hp;
+		*hp = req;
+	}
+
+	now = uv_hrtime();
+
+	uv_mutex_lock(&spool_size_mtx);
+	while (sd->sd_held && sd->sd_held->sr_offset == sf->sf_size) {
+	uint64_t	lat;
+
+		req = sd->sd_held;
+		sd->sd_held = req->sr_next;
+		sf->sf_size += req->sr_hdrlen + req->sr_datalen + req->sr_padlen;
+
+		spool_stats.sst_articles++;
+		spool_stats.sst_bytes += req->sr_hdrlen + req->sr_datalen;
+
+		lat = (now - req->sr_queued) / 1000;
+		for (i = 0; i < SPOOL_LAT_BUCKETS - 1; i++)
+			if (lat <= spool_lat_buckets[i])
+				break;
+		spool_stats.sst_lat_hist[i]++;
+
+		*dtail = req;
+		dtail = &req->sr_next;
+	}
+	*dtail = NULL;
+
+	/*
+	 * Record the new size in the file as well, so there's less for
+	 * spool_verify() to do after a crash.  It isn't synced until the
+	 * next batch or spool_write_size(), but whichever size is on disk
+	 * is correct, since the articles before it are already synced.
+	 * Without sync, the size could reach the disk before the articles,
+	 * so leave it to spool_write_size().
+	 */
+	if (done && spool_do_sync)
+		spool_store_size(sf);
+
+	spool_stats.sst_batches++;
+	spool_stats.sst_sync_usec += (now - start) / 1000;
+	if ((now - start) / 1000 > spool_stats.sst_sync_max_usec)
+		spool_stats.sst_sync_max_usec = (now - start) / 1000;
+	uv_mutex_unlock(&spool_size_mtx);
+
+	if (done)
+		spool_idx_append(sf, done);
+
+	/*
+	 * The request belongs to the waiting thread, so it can't be touched
+	 * once it's been completed.
+	 */
+	for (req = done; req; req = next) {
+		next = req->sr_next;
+		uv_sem_post(&req->sr_done);
+	}
+}
+
+/*
+ * Wait until every request queued on the device so far has been synced.
+ * Must be called with sd_mtx write-locked, so no new requests can be queued
+ * and every reserved range has been written.
+ */
+static void
+spool_drain(sd)
+	spool_dev_t	*sd;
+{
+spool_store_req_t	req;
+
+	if (!sd->sd_thread_running)
+		return;
+
+	bzero(&req, sizeof(req));
+	spool_queue_push(sd, &req);
+	uv_sem_wait(&req.sr_done);
+	uv_sem_destroy(&req.sr_done);
+}
+
+/*
+ * The article cache holds the text of recently stored articles, so that
+ * feeders sending the same article to many peers don't each have to read
+ * and decompress it.  Entries are reference counted; an entry evicted while
+ * a view still refers to it is freed when the view is released.
+ */
+static void
+spool_cache_key(key, pos)
+	unsigned char	*key;
+	spool_pos_t	*pos;
+{
+	int32put(key, pos->sp_id);
+	int64put(key + 4, pos->sp_offset);
+}
+
+static void
+spool_cache_add(pos, hdr, text, ntext, len)
+	spool_pos_t		*pos;
+	spool_header_t		*hdr;
+	struct iovec const	*text;
+	int			 ntext;
+	size_t			 len;
+{
+spool_cent_t	*ce;
+unsigned char	 key[SPOOL_CACHE_KEYLEN];
+size_t		 n = 0;
+int		 i;
+
+	/*
+	 * Don't let one huge article push everything else out.
+	 */
+	if (len > spool_cache_size / 16)
+		return;
+
+	ce = xcalloc(1, sizeof(*ce));
+	ce->ce_pos = *pos;
+	ce->ce_hdr = *hdr;
+	ce->ce_text = xmalloc(len);
+	for (i = 0; i < ntext; n += text[i++].iov_len)
+		bcopy(text[i].iov_base, ce->ce_text + n, text[i].iov_len);
+	ce->ce_len = len;
+	ce->ce_cached = 1;
+	spool_cache_key(key, pos);
+
+	uv_mutex_lock(&spool_cache_mtx);
+
+	while (spool_cache_used + len > spool_cache_size) {
+	spool_cent_t	*old = TAILQ_LAST(&spool_cache_lru, spool_cent_list);
+	unsigned char	 okey[SPOOL_CACHE_KEYLEN];
+
+		spool_cache_key(okey, &old->ce_pos);
+		hash_remove(spool_cache, okey, sizeof(okey));
+		TAILQ_REMOVE(&spool_cache_lru, old, ce_lru);
+		spool_cache_used -= old->ce_len;
+		spool_cache_nents--;
+		spool_cache_evictions++;
+
+		old->ce_cached = 0;
+		if (old->ce_refs == 0)
+			spool_cent_free(old);
+	}
+
+	if (!hash_insert(spool_cache, key, sizeof(key), ce)) {
+		uv_mutex_unlock(&spool_cache_mtx);
+		spool_cent_free(ce);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&spool_cache_lru, ce, ce_lru);
+	spool_cache_used += len;
+	spool_cache_nents++;
+	uv_mutex_unlock(&spool_cache_mtx);
+}
+
+/*
+ * Find an article in the cache, and return it with a reference held.
+ */
+static spool_cent_t *
+spool_cache_get(pos)
+	spool_pos_t	*pos;
+{
+spool_cent_t	*ce;
+hash_item_t	*ie;
+unsigned char	 key[SPOOL_CACHE_KEYLEN];
+
+	spool_cache_key(key, pos);
+
+	uv_mutex_lock(&spool_cache_mtx);
+	if ((ie = hash_find(spool_cache, key, sizeof(key))) == NULL) {
+		spool_cache_misses++;
+		uv_mutex_unlock(&spool_cache_mtx);
+		return NULL;
+	}
+
+	ce = ie->hi_data;
+	spool_cache_hits++;
+	ce->ce_refs++;
+	TAILQ_REMOVE(&spool_cache_lru, ce, ce_lru);
+	TAILQ_INSERT_HEAD(&spool_cache_lru, ce, ce_lru);
+	uv_mutex_unlock(&spool_cache_mtx);
+	return ce;
+}
+
+static void
+spool_cache_release(ce)
+	spool_cent_t	*ce;
+{
+int	dofree;
+
+	uv_mutex_lock(&spool_cache_mtx);
+	dofree = (--ce->ce_refs == 0 && !ce->ce_cached);
+	uv_mutex_unlock(&spool_cache_mtx);
+
+	if (dofree)
+		spool_cent_free(ce);
+}
+
+static void
+spool_cent_free(ce)
+	spool_cent_t	*ce;
+{
+	free(ce->ce_text);
+	free(ce);
+}
+
+void
+spool_get_stats(st)
+	spool_stats_t	*st;
+{
+	uv_mutex_lock(&spool_size_mtx);
+	*st = spool_stats;
+	uv_mutex_unlock(&spool_size_mtx);
+
+	uv_mutex_lock(&spool_cache_mtx);
+	st->sst_cache_size = spool_cache_size;
+	st->sst_cache_used = spool_cache_used;
+	st->sst_cache_entries = spool_cache_nents;
+	st->sst_cache_hits = spool_cache_hits;
+	st->sst_cache_misses = spool_cache_misses;
+	st->sst_cache_evictions = spool_cache_evictions;
+	uv_mutex_unlock(&spool_cache_mtx);
+}
+
+void
+spool_close(void)
+{
+}
+
+/*
+ * Reserve len bytes in sf and return the offset of the reservation.
+ */
+static spool_offset_t
+spool_reserve(sf, len)
+	spool_file_t	*sf;
+	size_t		 len;
+{
+#ifdef ATOMIC
+	return atomic_add_64_nv(&sf->sf_alloc, len) - len;
+#else
+spool_offset_t	off;
+	uv_mutex_lock(&spool_alloc_mtx);
+	off = sf->sf_alloc;
+	sf->sf_alloc += len;
+	uv_mutex_unlock(&spool_alloc_mtx);
+	return off;
+#endif
+}
+
+/*
+ * Choose one of the class's devices for a new article: the one with the
+ * fewest stores in progress, looking at the devices in turn from a different
+ * one each time, so that idle devices are used round-robin.
+ */
+static spool_dev_t *
+spool_pick_dev(cls)
+	spool_class_t	*cls;
+{
+spool_dev_t	*sd, *best;
+unsigned	 start;
+int		 i;
+
+	if (cls->spc_ndevs == 1)
+		return cls->spc_devs[0];
+
+#ifdef ATOMIC
+	start = atomic_inc_uint_nv(&cls->spc_next_dev);
+#else
+	uv_mutex_lock(&spool_alloc_mtx);
+	start = ++cls->spc_next_dev;
+	uv_mutex_unlock(&spool_alloc_mtx);
+#endif
+
+	best = cls->spc_devs[start % cls->spc_ndevs];
+	for (i = 1; i < cls->spc_ndevs; i++) {
+		sd = cls->spc_devs[(start + i) % cls->spc_ndevs];
+		if (sd->sd_pending < best->sd_pending)
+			best = sd;
+	}
+
+	return best;
+}
+
+static void
+spool_dev_busy(sd, n)
+	spool_dev_t	*sd;
+{
+#ifdef ATOMIC
+	if (n > 0)
+		atomic_inc_uint_nv(&sd->sd_pending);
+	else
+		atomic_dec_uint_nv(&sd->sd_pending);
+#else
+	uv_mutex_lock(&spool_alloc_mtx);
+	sd->sd_pending += n;
+	uv_mutex_unlock(&spool_alloc_mtx);
+#endif
+}
+
+int
+spool_store(art)
+	article_t	*art;
+{
+spool_class_t		*cls;
+spool_dev_t		*sd;
+spool_file_t		*sf;
+spool_store_req_t	 req;
+unsigned char		 hdr[SPOOL_HDR_MAX];
+size_t			 hdrlen, padlen = 0, eoslen = SPOOL_HDR_SIZE;
+size_t			 artlen;
+unsigned char		*data = NULL;
+char			*flat = NULL;
+size_t			 datalen;
+struct iovec		 text[3], iov[4];
+int			 ntext, niov, i;
+spool_id_t		 id;
+spool_offset_t		 off;
+uint64_t		 crc = 0;
+time_t			 now;
+
+	/*
+	 * The text is art_content with the Path: prefix (if any) spliced
+	 * in, so it's written as up to three pieces rather than copied.
+	 */
+	text[0].iov_base = art->art_content;
+	if (art->art_path_prefix) {
+		text[0].iov_len = art->art_path_off;
+		text[1].iov_base = art->art_path_prefix;
+		text[1].iov_len = strlen(art->art_path_prefix);
+		text[2].iov_base = art->art_content + art->art_path_off;
+		text[2].iov_len = strlen(text[2].iov_base);
+		ntext = 3;
+	} else {
+		text[0].iov_len = strlen(art->art_content);
+		ntext = 1;
+	}
+
+	for (artlen = 0, i = 0; i < ntext; i++)
+		artlen += text[i].iov_len;
+
+	/*
+	 * Create the header and compress (if enabled) before we acquire
+	 * the lock.  The compressors want the text in one piece.
+	 */
+	art->art_flags |= ART_CRC;
+	art->art_flags &= ~(ART_COMPRESSED | ART_ZSTD);
+	cls = spool_pick_class(art, artlen);
+
+	if (cls->spc_compress && !(art->art_flags & ART_TYPE_YENC)) {
+		if (ntext > 1) {
+		size_t	n = 0;
+
+			flat = xmalloc(artlen);
+			for (i = 0; i < ntext; n += text[i++].iov_len)
+				bcopy(text[i].iov_base, flat + n, text[i].iov_len);
+			text[0].iov_base = flat;
+			text[0].iov_len = artlen;
+			ntext = 1;
+		}
+
+		data = spool_compress_text(cls, text[0].iov_base, artlen,
+					   &datalen, &art->art_flags);
+		iov[1].iov_base = data;
+		iov[1].iov_len = datalen;
+		niov = 2;
+	} else {
+		bcopy(text, &iov[1], sizeof(*text) * ntext);
+		datalen = artlen;
+		niov = 1 + ntext;
+	}
+
+	now = time(NULL);
+	for (i = 1; i < niov; i++)
+		crc = crc64_update(crc, iov[i].iov_base, iov[i].iov_len);
+	hdrlen = spool_encode_header(hdr, art, art->art_flags & ~ART_FILTERED,
+				     datalen, artlen, crc, now);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdrlen;
+
+	if (spool_method == M_DIRECT) {
+		padlen = spool_direct_pad(hdrlen + datalen);
+		eoslen = SPOOL_DIRECT_ALIGN;
+	}
+
+	/*
+	 * Reserve space in the device's current file.  If it doesn't fit,
+	 * rotate to a new file and try again.  Once one reservation has
+	 * failed, every later one will too, so the successful reservations
+	 * are always a contiguous range at the start of the file.
+	 */
+	sd = spool_pick_dev(cls);
+	spool_dev_busy(sd, 1);
+
+	for (;;) {
+		uv_rwlock_rdlock(&sd->sd_mtx);
+		sf = sd->sd_files[sd->sd_cur_file];
+		id = SPOOL_ID(sd->sd_id, sd->sd_base + sd->sd_cur_file);
+		off = spool_reserve(sf, hdrlen + datalen + padlen);
+
+		if (off + hdrlen + datalen + padlen + eoslen < sf->sf_dsz)
+			break;
+
+		uv_rwlock_rdunlock(&sd->sd_mtx);
+		spool_rotate(sd, id);
+	}
+
+	art->art_spool_pos.sp_id = id;
+	art->art_spool_pos.sp_offset = off;
+
+	if (spool_method == M_MMAP) {
+	size_t	n = 0;
+
+		for (i = 0; i < niov; n += iov[i++].iov_len)
+			bcopy(iov[i].iov_base, sf->sf_addr + off + n,
+			      iov[i].iov_len);
+	} else if (spool_method == M_DIRECT) {
+		spool_direct_write(sf, off, iov, niov, padlen);
+	} else {
+		if (pwritev(sf->sf_fd, iov, niov, off) != hdrlen + datalen)
+			panic("spool: \"%s\": write error: %s",
+			      sf->sf_fname, strerror(errno));
+	}
+
+	req.sr_file = sf;
+	req.sr_offset = off;
+	req.sr_hdrlen = hdrlen;
+	req.sr_datalen = datalen;
+	req.sr_padlen = padlen;
+	req.sr_flags = art->art_flags & ~ART_FILTERED;
+	req.sr_msgid = art->art_msgid ?
+		crc64(art->art_msgid, strlen(art->art_msgid)) : 0;
+	req.sr_time = now;
+	spool_queue_push(sd, &req);
+
+	uv_rwlock_rdunlock(&sd->sd_mtx);
+
+	uv_sem_wait(&req.sr_done);
+	uv_sem_destroy(&req.sr_done);
+	spool_dev_busy(sd, -1);
+
+	/*
+	 * Cache the article for the feeders, unless they can read it from
+	 * the spool without copying it anyway.
+	 */
+	if (spool_cache && (spool_method != M_MMAP ||
+			    (art->art_flags & ART_COMPRESSED))) {
+	spool_header_t	sh;
+
+		spool_decode_header(hdr, hdrlen, &sh);
+		spool_cache_add(&art->art_spool_pos, &sh, text, ntext, artlen);
+	}
+
+	free(flat);
+	if (art->art_flags & ART_COMPRESSED)
+		free(data);
+
+	return 0;
+}
+
+/*
+ * Rotate the device to a new spool file, unless another thread already
+ * rotated away from file id.
+ */
+static void
+spool_rotate(sd, id)
+	spool_dev_t	*sd;
+	spool_id_t	 id;
+{
+spool_file_t	*sf, *nsf;
+uint64_t	 start, usec;
+int		 num, stalled = 0, expired = 0;
+spool_id_t	 expid;
+char		 fname[PATH_MAX];
+
+	uv_rwlock_wrlock(&sd->sd_mtx);
+
+	if (id != SPOOL_ID(sd->sd_id, sd->sd_base + sd->sd_cur_file)) {
+		uv_rwlock_wrunlock(&sd->sd_mtx);
+		return;
+	}
+
+	if (sd->sd_base + sd->sd_cur_file == SPOOL_FILE_MASK)
+		panic("spool: \"%s\": no more spool file numbers", sd->sd_path);
+
+	start = uv_hrtime();
+
+	/*
+	 * Every reserved range has been written, since writers hold the read
+	 * lock; once they're synced, sf_size is the end of the last article,
+	 * and the failed reservations past it can be discarded.
+	 */
+	spool_drain(sd);
+	sf = sd->sd_files[sd->sd_cur_file];
+	sf->sf_alloc = sf->sf_size;
+
+	spool_write_size(sd);
+	spool_write_eos(sf, sf->sf_size);
+
+	if ((sd->sd_cur_file + 1) == sd->sd_max_files) {
+		expid = SPOOL_ID(sd->sd_id, sd->sd_base);
+		expired = 1;
+		spool_file_close(sd, 0, 1);
+		sd->sd_base++;
+
+		bcopy(&sd->sd_files[1], &sd->sd_files[0],
+			sizeof(spool_file_t *) * (sd->sd_max_files - 1));
+		num = sd->sd_max_files - 1;
+	} else
+		num = ++sd->sd_cur_file;
+
+	/*
+	 * Take the prepared file, and have the prep thread start another once
+	 * this one has been renamed out of its way.
+	 */
+	spool_file_name(sd, fname, sd->sd_base + num);
+
+	uv_mutex_lock(&sd->sd_prep_mtx);
+	if (nsf = sd->sd_next) {
+		if (rename(nsf->sf_fname, fname) == -1)
+			panic("spool: \"%s\": cannot rename to \"%s\": %s",
+				nsf->sf_fname, fname, strerror(errno));
+		strcpy(nsf->sf_fname, fname);
+		sd->sd_next = NULL;
+		uv_cond_signal(&sd->sd_prep_cv);
+	}
+	uv_mutex_unlock(&sd->sd_prep_mtx);
+
+	if (nsf == NULL) {
+		/* The prep thread hasn't caught up; create it ourselves */
+		nsf = spool_file_new(sd, fname, 1, 0);
+		stalled = 1;
+	}
+	sd->sd_files[num] = nsf;
+
+	uv_rwlock_wrunlock(&sd->sd_mtx);
+
+	if (expired && spool_expire_hook)
+		spool_expire_hook(expid);
+
+	usec = (uv_hrtime() - start) / 1000;
+	uv_mutex_lock(&spool_size_mtx);
+	spool_stats.sst_rotations++;
+	spool_stats.sst_rotate_stalls += stalled;
+	if (usec > spool_stats.sst_rotate_max_usec)
+		spool_stats.sst_rotate_max_usec = usec;
+	uv_mutex_unlock(&spool_size_mtx);
+}
+
+article_t *
+spool_fetch(spid, spos)
+	spool_id_t	 spid;
+	spool_offset_t	 spos;
+{
+spool_header_t	 hdr;
+char		*text;
+article_t	*art;
+
+	if (spool_fetch_text(spid, spos, &hdr, &text) == -1)
+		return NULL;
+
+	art = article_parse(text);
+	free(text);
+	text = NULL;
+
+	if (!art)
+		return NULL;
+
+	art->art_emp_score = hdr.sa_emp_score;
+	art->art_phl_score = hdr.sa_phl_score;
+	art->art_flags |= hdr.sa_flags;
+
+	art->art_spool_pos.sp_id = spid;
+	art->art_spool_pos.sp_offset = spos;
+	art->art_hdr_len = hdr.sa_hdr_len;
+
+	return art;
+}
+
+int
+spool_fetch_text(spid, spos, hdr, text)
+	spool_id_t	  spid;
+	spool_offset_t	  spos;
+	spool_header_t	 *hdr;
+	char		**text;
+{
+spool_view_t	view;
+char		*artstr;
+
+	if (spool_view(spid, spos, &view, 0) == -1)
+		return -1;
+
+	*hdr = view.sv_hdr;
+	artstr = xmalloc(view.sv_len + 1);
+	bcopy(view.sv_text, artstr, view.sv_len);
+	artstr[view.sv_len] = 0;
+	spool_view_release(&view);
+
+	*text = artstr;
+	return 0;
+}
+
+int
+spool_view(spid, spos, view, flags)
+	spool_id_t	 spid;
+	spool_offset_t	 spos;
+	spool_view_t	*view;
+	int		 flags;
+{
+char		*artdata;
+spool_file_t	*sf;
+spool_header_t	*hdr = &view->sv_hdr;
+size_t		 artloc;
+
+	bzero(view, sizeof(*view));
+
+	if ((sf = spool_file_get(spid)) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (spool_cache) {
+	spool_pos_t	 pos;
+	spool_cent_t	*ce;
+
+		pos.sp_id = spid;
+		pos.sp_offset = spos;
+
+		if ((ce = spool_cache_get(&pos)) != NULL) {
+			spool_file_release(sf);
+			view->sv_cent = ce;
+			view->sv_hdr = ce->ce_hdr;
+			view->sv_text = ce->ce_text;
+			view->sv_len = ce->ce_len;
+			return 0;
+		}
+	}
+
+	if (spos + SPOOL_HDR_SIZE > sf->sf_alloc) {
+		spool_file_release(sf);
+		errno = EINVAL;
+		return -1;
+	}
+
+	spool_read_header(sf, spos, hdr);
+
+	if (hdr->sa_magic == SPOOL_MAGIC_EOS) {
+		spool_file_release(sf);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (hdr->sa_magic != SPOOL_MAGIC) {
+		nts_logm(SPOOL_fac, M_SPOOL_BADMAGIC,
+			 sf->sf_fname, (int) spid, (long unsigned) spos);
+		spool_file_release(sf);
+		errno = EIO;
+		return -1;
+	}
+
+	artloc = spos + hdr->sa_hdr_len;
+
+	if (artloc + hdr->sa_len > sf->sf_alloc) {
+		nts_logm(SPOOL_fac, M_SPOOL_TOOLONG,
+			 sf->sf_fname,
+			 (long unsigned) spid, (long unsigned) spos);
+		spool_file_release(sf);
+		errno = EIO;
+		return -1;
+	}
+
+	/*
+	 * If the caller can send the article straight from the file, and we
+	 * don't need to look at it, don't read it.  Not for M_DIRECT, since
+	 * sendfile() would go through the page cache.
+	 */
+	if ((flags & SPOOL_VIEW_FD) && spool_method == M_FILE &&
+	    !(hdr->sa_flags & ART_COMPRESSED) &&
+	    !(spool_check_crc && (hdr->sa_flags & ART_CRC))) {
+		view->sv_file = sf;
+		view->sv_fd = sf->sf_fd;
+		view->sv_offset = artloc;
+		view->sv_len = hdr->sa_len;
+		return 0;
+	}
+
+	if (spool_method == M_MMAP) {
+		artdata = (char *) sf->sf_addr + artloc;
+	} else {
+		artdata = xmalloc(hdr->sa_len);
+		if (spool_pread(sf, artdata, hdr->sa_len, artloc) != hdr->sa_len)
+			panic("spool: \"%s\": read: %s",
+				sf->sf_fname, strerror(errno));
+	}
+
+	if (spool_check_crc && (hdr->sa_flags & ART_CRC)) {
+		if (crc64(artdata, hdr->sa_len) != hdr->sa_crc) {
+			nts_logm(SPOOL_fac, M_SPOOL_BADCRC, sf->sf_fname);
+			if (spool_method != M_MMAP) {
+				free(artdata);
+				artdata = NULL;
+			}
+			spool_file_release(sf);
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	if (hdr->sa_flags & ART_COMPRESSED) {
+	unsigned char	*data;
+	size_t		 datasize;
+	char const	*err;
+
+		datasize = hdr->sa_text_len;
+		data = xmalloc(datasize);
+
+		if (spool_uncompress(hdr->sa_flags, artdata, hdr->sa_len,
+				     data, &datasize, &err) == -1) {
+			nts_logm(SPOOL_fac, M_SPOOL_UNCMPFAIL,
+				 sf->sf_fname, err);
+
+			if (spool_method != M_MMAP) {
+				free(artdata);
+				artdata = NULL;
+			}
+
+			free(data);
+			data = NULL;
+
+			spool_file_release(sf);
+			errno = EIO;
+			return -1;
+		}
+
+		if (spool_method != M_MMAP) {
+			free(artdata);
+			artdata = NULL;
+		}
+
+		view->sv_buf = (char *) data;
+		view->sv_text = view->sv_buf;
+		view->sv_len = datasize;
+	} else if (spool_method != M_MMAP) {
+		view->sv_buf = artdata;
+		view->sv_text = view->sv_buf;
+		view->sv_len = hdr->sa_len;
+	} else {
+		/*
+		 * Point directly into the mapping, and keep the reference to
+		 * the file until the view is released.
+		 */
+		view->sv_file = sf;
+		view->sv_text = artdata;
+		view->sv_len = hdr->sa_len;
+		return 0;
+	}
+
+	spool_file_release(sf);
+	return 0;
+}
+
+void
+spool_view_release(view)
+	spool_view_t	*view;
+{
+	if (view->sv_file)
+		spool_file_release(view->sv_file);
+	if (view->sv_cent)
+		spool_cache_release(view->sv_cent);
+	free(view->sv_buf);
+	bzero(view, sizeof(*view));
+}
+
+static void
+spool_do_write_size(timer, status)
+	uv_timer_t	*timer;
+{
+int	i;
+
+	for (i = 0; i < spool_ndevs; i++) {
+		uv_rwlock_rdlock(&spool_devlist[i]->sd_mtx);
+		spool_write_size(spool_devlist[i]);
+		uv_rwlock_rdunlock(&spool_devlist[i]->sd_mtx);
+	}
+}
+
+static void
+spool_write_size(sd)
+	spool_dev_t	*sd;
+{
+spool_file_t	*sf;
+off_t		 size;
+
+	sf = sd->sd_files[sd->sd_cur_file];
+
+	uv_mutex_lock(&spool_size_mtx);
+	size = sf->sf_size;
+	spool_store_size(sf);
+	uv_mutex_unlock(&spool_size_mtx);
+
+	if (spool_method == M_MMAP) {
+		if (msync(sf->sf_addr, size, MS_SYNC) == -1)
+			panic("spool: \"%s\": %s", sf->sf_fname, strerror(errno));
+	} else {
+		if (fdatasync(sf->sf_fd) == -1)
+			panic("spool: \"%s\": write error: %s",
+				sf->sf_fname, strerror(errno));
+	}
+}
+
+/*
+ * Write the file's size to its header, without syncing it.  The caller
+ * holds spool_size_mtx, which stops two threads writing the header at once.
+ */
+static void
+spool_store_size(sf)
+	spool_file_t	*sf;
+{
+char	szbuf[sizeof(uint64_t)];
+
+	if (spool_method == M_MMAP) {
+		int64put(sf->sf_addr, sf->sf_size);
+		return;
+	}
+
+	int64put(szbuf, sf->sf_size);
+	if (pwrite(sf->sf_fd, szbuf, sizeof(szbuf), 0) < sizeof(szbuf))
+		panic("spool: \"%s\": write error: %s",
+			sf->sf_fname, strerror(errno));
+}
+
+/*
+ * Read from a spool file opened with M_FILE or M_DIRECT.
+ */
+static ssize_t
+spool_pread(sf, buf, len, pos)
+	spool_file_t	*sf;
+	void		*buf;
+	size_t		 len;
+	off_t		 pos;
+{
+	if (spool_method == M_DIRECT)
+		return spool_direct_read(sf, buf, len, pos);
+	return pread(sf->sf_fd, buf, len, pos);
+}
+
+/*
+ * The direct method writes each record from an aligned buffer.  Buffers up
+ * to SPOOL_DBUF_SIZE are kept on a free list for reuse, linked through their
+ * first bytes; larger ones are allocated for the write and freed after it.
+ */
+#define	SPOOL_DBUF_SIZE		(256 * 1024)
+#define	SPOOL_DBUF_KEEP		64
+
+static uv_mutex_t	 spool_dbuf_mtx;
+static void		*spool_dbufs;
+static int		 spool_ndbufs;
+
+/*
+ * Reads go through a small cache of SPOOL_DCACHE_CHUNK-sized pieces of the
+ * spool files, so that reading an article's header and then its data, or
+ * several feeders reading the same article, doesn't mean one O_DIRECT read
+ * each.  Each slot only holds data below the file's sf_size when it was
+ * read, which is never written again.  Larger reads bypass the cache.
+ */
+#define	SPOOL_DCACHE_CHUNK	(64 * 1024)
+#define	SPOOL_DCACHE_SLOTS	64
+
+typedef struct spool_dchunk {
+	uv_mutex_t	 dc_mtx;
+	spool_file_t	*dc_file;	/* NULL if empty */
+	off_t		 dc_start;
+	size_t		 dc_valid;
+	unsigned char	*dc_buf;
+} spool_dchunk_t;
+
+static spool_dchunk_t	 spool_dcache[SPOOL_DCACHE_SLOTS];
+
+static void *
+spool_dbuf_get(len)
+	size_t	len;
+{
+void	*buf = NULL;
+int	 err;
+
+	if (len <= SPOOL_DBUF_SIZE) {
+		uv_mutex_lock(&spool_dbuf_mtx);
+		if (buf = spool_dbufs) {
+			spool_dbufs = *(void **) buf;
+			spool_ndbufs--;
+		}
+		uv_mutex_unlock(&spool_dbuf_mtx);
+
+		if (buf)
+			return buf;
+		len = SPOOL_DBUF_SIZE;
+	}
+
+	if ((err = posix_memalign(&buf, SPOOL_DIRECT_ALIGN, len)) != 0)
+		panic("spool: out of memory for aligned buffer: %s",
+		      strerror(err));
+	return buf;
+}
+
+static void
+spool_dbuf_put(buf, len)
+	void	*buf;
+	size_t	 len;
+{
+	if (len <= SPOOL_DBUF_SIZE) {
+		uv_mutex_lock(&spool_dbuf_mtx);
+		if (spool_ndbufs < SPOOL_DBUF_KEEP) {
+			*(void **) buf = spool_dbufs;
+			spool_dbufs = buf;
+			spool_ndbufs++;
+			buf = NULL;
+		}
+		uv_mutex_unlock(&spool_dbuf_mtx);
+	}
+
+	free(buf);
+}
+
+static void
+spool_direct_init()
+{
+int	i, err;
+
+	uv_mutex_init(&spool_dbuf_mtx);
+
+	for (i = 0; i < SPOOL_DCACHE_SLOTS; i++) {
+		uv_mutex_init(&spool_dcache[i].dc_mtx);
+		if ((err = posix_memalign((void **) &spool_dcache[i].dc_buf,
+					  SPOOL_DIRECT_ALIGN,
+					  SPOOL_DCACHE_CHUNK)) != 0)
+			panic("spool: out of memory for read cache: %s",
+			      strerror(err));
+	}
+}
+
+/*
+ * Return the padding needed after len bytes to reach the next block
+ * boundary.  A padding record can't be shorter than SPOOL_HDR_SIZE, so a
+ * smaller gap is padded out to the boundary after.
+ */
+static size_t
+spool_direct_pad(len)
+	uint64_t	len;
+{
+size_t	pad = SPOOL_ALIGN_UP(len) - len;
+
+	if (pad > 0 && pad < SPOOL_HDR_SIZE)
+		pad += SPOOL_DIRECT_ALIGN;
+	return pad;
+}
+
+/*
+ * Pad a file out to a block boundary, so that the direct writes which
+ * follow are aligned.  This is needed for every new file, whose first
+ * block holds the size, and for files written with another method.  The
+ * padding and the new EOS go through the page cache, before any direct
+ * write to the same blocks.
+ */
+static void
+spool_direct_align(sf)
+	spool_file_t	*sf;
+{
+unsigned char	 buf[SPOOL_DIRECT_ALIGN * 2 + SPOOL_HDR_SIZE];
+size_t		 pad;
+
+	if ((pad = spool_direct_pad(sf->sf_size)) == 0 ||
+	    sf->sf_size + pad + SPOOL_HDR_SIZE > sf->sf_dsz)
+		return;
+
+	bzero(buf, pad + SPOOL_HDR_SIZE);
+	int32put(buf, SPOOL_MAGIC_PAD);
+	int32put(buf + 4, pad);
+	int32put(buf + pad, SPOOL_MAGIC_EOS);
+
+	if (pwrite(sf->sf_fd, buf, pad + SPOOL_HDR_SIZE, sf->sf_size) !=
+	    pad + SPOOL_HDR_SIZE)
+		panic("spool: \"%s\": write: %s", sf->sf_fname, strerror(errno));
+
+	uv_mutex_lock(&spool_size_mtx);
+	sf->sf_size += pad;
+	spool_store_size(sf);
+	uv_mutex_unlock(&spool_size_mtx);
+
+	if (fdatasync(sf->sf_fd) == -1)
+		panic("spool: \"%s\": write error: %s",
+		      sf->sf_fname, strerror(errno));
+}
+
+/*
+ * Write a record (gathered from iov), and the padding after it, at off with
+ * O_DIRECT.  off is on a block boundary, since every reservation is a whole
+ * number of blocks.
+ */
+static void
+spool_direct_write(sf, off, iov, niov, padlen)
+	spool_file_t		*sf;
+	spool_offset_t		 off;
+	struct iovec const	*iov;
+	int			 niov;
+	size_t			 padlen;
+{
+size_t		 len = padlen, n = 0;
+unsigned char	*buf;
+int		 i;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	assert(off % SPOOL_DIRECT_ALIGN == 0 && len % SPOOL_DIRECT_ALIGN == 0);
+
+	buf = spool_dbuf_get(len);
+	for (i = 0; i < niov; n += iov[i++].iov_len)
+		bcopy(iov[i].iov_base, buf + n, iov[i].iov_len);
+	if (padlen) {
+		bzero(buf + n, padlen);
+		int32put(buf + n, SPOOL_MAGIC_PAD);
+		int32put(buf + n + 4, padlen);
+	}
+
+	if (pwrite(sf->sf_dfd, buf, len, off) != (ssize_t) len)
+		panic("spool: \"%s\": write error: %s",
+		      sf->sf_fname, strerror(errno));
+	spool_dbuf_put(buf, len);
+}
+
+/*
+ * Read len bytes at pos with O_DIRECT, through the read cache if they're
+ * in one chunk.  Returns len, or -1 on error.
+ */
+static ssize_t
+spool_direct_read(sf, buf, len, pos)
+	spool_file_t	*sf;
+	void		*buf;
+	size_t		 len;
+	off_t		 pos;
+{
+spool_dchunk_t	*dc;
+off_t		 start = pos & ~((off_t) SPOOL_DCACHE_CHUNK - 1);
+off_t		 size;
+ssize_t		 n;
+
+	if (pos + len > start + SPOOL_DCACHE_CHUNK)
+		return spool_direct_pread(sf, buf, len, pos);
+
+	dc = &spool_dcache[(((uintptr_t) sf >> 4) + start / SPOOL_DCACHE_CHUNK)
+			   % SPOOL_DCACHE_SLOTS];
+	uv_mutex_lock(&dc->dc_mtx);
+
+	if (dc->dc_file != sf || dc->dc_start != start ||
+	    pos + len > start + dc->dc_valid) {
+		uv_mutex_lock(&spool_size_mtx);
+		size = sf->sf_size;
+		uv_mutex_unlock(&spool_size_mtx);
+
+		dc->dc_file = NULL;
+		if ((n = pread(sf->sf_dfd, dc->dc_buf, SPOOL_DCACHE_CHUNK,
+			       start)) == -1) {
+			uv_mutex_unlock(&dc->dc_mtx);
+			return -1;
+		}
+
+		if (n > size - start)
+			n = size - start > 0 ? size - start : 0;
+		dc->dc_file = sf;
+		dc->dc_start = start;
+		dc->dc_valid = n;
+
+		/* Past sf_size, which only a bad position would be */
+		if (pos + len > start + dc->dc_valid) {
+			uv_mutex_unlock(&dc->dc_mtx);
+			return spool_direct_pread(sf, buf, len, pos);
+		}
+	}
+
+	bcopy(dc->dc_buf + (pos - start), buf, len);
+	uv_mutex_unlock(&dc->dc_mtx);
+	return len;
+}
+
+/*
+ * Read len bytes at pos with O_DIRECT, bypassing the read cache.
+ */
+static ssize_t
+spool_direct_pread(sf, buf, len, pos)
+	spool_file_t	*sf;
+	void		*buf;
+	size_t		 len;
+	off_t		 pos;
+{
+off_t		 start = pos & ~((off_t) SPOOL_DIRECT_ALIGN - 1);
+size_t		 alen = SPOOL_ALIGN_UP(pos + len) - start;
+unsigned char	*abuf;
+ssize_t		 n;
+
+	abuf = spool_dbuf_get(alen);
+	if ((n = pread(sf->sf_dfd, abuf, alen, start)) != -1) {
+		if (n < (pos - start) + (ssize_t) len) {
+			errno = EIO;
+			n = -1;
+		} else {
+			bcopy(abuf + (pos - start), buf, len);
+			n = len;
+		}
+	}
+	spool_dbuf_put(abuf, alen);
+	return n;
+}
+
+/*
+ * Drop a file that's being closed from the read cache, so that a new file
+ * at the same address isn't mistaken for it.
+ */
+static void
+spool_direct_forget(sf)
+	spool_file_t	*sf;
+{
+int	i;
+
+	for (i = 0; i < SPOOL_DCACHE_SLOTS; i++) {
+		uv_mutex_lock(&spool_dcache[i].dc_mtx);
+		if (spool_dcache[i].dc_file == sf)
+			spool_dcache[i].dc_file = NULL;
+		uv_mutex_unlock(&spool_dcache[i].dc_mtx);
+	}
+}
+
+/*
+ * Verification maps the part of the file being verified a window at a time,
+ * so that any size of spool file can be verified on a 32-bit system.  The
+ * verified size is written back to the file every SPOOL_VERIFY_CKPT bytes,
+ * so a crash during recovery doesn't have to start again from the
+ * beginning.
+ */
+#define	SPOOL_VERIFY_WINDOW	(64 * 1024 * 1024)
+#define	SPOOL_VERIFY_CKPT	(256 * 1024 * 1024)
+#define	SPOOL_VERIFY_PROGRESS	(5 * 1000000000ULL)	/* Log every 5s */
+
+typedef struct spool_vwin {
+	int		 vw_fd;
+	unsigned char	*vw_addr;
+	off_t		 vw_start;
+	size_t		 vw_len;
+	off_t		 vw_fsize;
+	int		 vw_err;
+} spool_vwin_t;
+
+/*
+ * Return len bytes at pos in the file, or NULL if they're past the end of
+ * the file or can't be mapped, in which case vw_err is set.  spool_check()
+ * uses this too.
+ */
+static unsigned char *
+spool_vwin_map(vw, pos, len)
+	spool_vwin_t	*vw;
+	off_t		 pos;
+	size_t		 len;
+{
+	if (pos + (off_t) len > vw->vw_fsize)
+		return NULL;
+
+	if (vw->vw_addr && pos >= vw->vw_start &&
+	    pos + len <= vw->vw_start + vw->vw_len)
+		return vw->vw_addr + (pos - vw->vw_start);
+
+	if (vw->vw_addr)
+		munmap(vw->vw_addr, vw->vw_len);
+
+	vw->vw_start = pos & ~((off_t) spool_pagesize - 1);
+	vw->vw_len = SPOOL_VERIFY_WINDOW;
+	if (vw->vw_len < pos + len - vw->vw_start)
+		vw->vw_len = pos + len - vw->vw_start;
+	if (vw->vw_start + vw->vw_len > vw->vw_fsize)
+		vw->vw_len = vw->vw_fsize - vw->vw_start;
+
+	if ((vw->vw_addr = mmap(NULL, vw->vw_len, PROT_READ, MAP_SHARED,
+				vw->vw_fd, vw->vw_start)) == MAP_FAILED) {
+		vw->vw_addr = NULL;
+		vw->vw_err = errno;
+		return NULL;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	madvise(vw->vw_addr, vw->vw_len, MADV_SEQUENTIAL);
+#endif
+	return vw->vw_addr + (pos - vw->vw_start);
+}
+
+static void
+spool_vwin_unmap(vw)
+	spool_vwin_t	*vw;
+{
+	if (vw->vw_addr)
+		munmap(vw->vw_addr, vw->vw_len);
+	vw->vw_addr = NULL;
+}
+
+/*
+ * Map and decode the article header at pos, and return it; a format 2 header
+ * is mapped in full, so its extensions can be read.  Returns NULL if it can't
+ * be mapped, as spool_vwin_map() does.
+ */
+static unsigned char *
+spool_vwin_header(vw, pos, hdr)
+	spool_vwin_t	*vw;
+	off_t		 pos;
+	spool_header_t	*hdr;
+{
+unsigned char	*p;
+size_t		 len;
+
+	if ((p = spool_vwin_map(vw, pos, SPOOL_HDR_SIZE)) == NULL)
+		return NULL;
+
+	if ((len = spool_decode_header(p, SPOOL_HDR_SIZE, hdr)) > SPOOL_HDR_SIZE) {
+		if ((p = spool_vwin_map(vw, pos, len)) == NULL)
+			return NULL;
+		spool_decode_header(p, len, hdr);
+	}
+
+	return p;
+}
+
+/*
+ * spool_vwin_map() for spool_verify(), which can't carry on if it can't
+ * read the file.
+ */
+static unsigned char *
+spool_verify_map(sf, vw, pos, len)
+	spool_file_t	*sf;
+	spool_vwin_t	*vw;
+	off_t		 pos;
+	size_t		 len;
+{
+unsigned char	*p;
+
+	if ((p = spool_vwin_map(vw, pos, len)) == NULL && vw->vw_err) {
+		nts_logm(SPOOL_fac, M_SPOOL_VFYRDFAIL,
+			 sf->sf_fname, strerror(vw->vw_err));
+		panic("spool: unrecoverable error during verify");
+	}
+	return p;
+}
+
+/*
+ * Write the verified size to the file.  If eos is set, also write an EOS
+ * header there, discarding anything after it.
+ */
+static void
+spool_verify_ckpt(sf, pos, eos)
+	spool_file_t	*sf;
+	off_t		 pos;
+	int		 eos;
+{
+unsigned char	buf[SPOOL_HDR_SIZE];
+
+	if (eos) {
+		bzero(buf, sizeof(buf));
+		int32put(buf, SPOOL_MAGIC_EOS);
+		if (pwrite(sf->sf_fd, buf, sizeof(buf), pos) < sizeof(buf))
+			goto err;
+	}
+
+	int64put(buf, pos);
+	if (pwrite(sf->sf_fd, buf, sizeof(uint64_t), 0) < sizeof(uint64_t) ||
+	    fdatasync(sf->sf_fd) == -1)
+		goto err;
+	return;
+
+err:
+	nts_logm(SPOOL_fac, M_SPOOL_VFYWRFAIL, sf->sf_fname, strerror(errno));
+	panic("spool: unrecoverable error during verify");
+}
+
+static void
+spool_verify(sf)
+	spool_file_t	*sf;
+{
+off_t		 pos, from, ckpt;
+size_t		 len;
+struct stat	 sb;
+spool_vwin_t	 vw;
+unsigned char	*p;
+uint64_t	 start, last, now;
+
+	if (fstat(sf->sf_fd, &sb) == -1)
+		panic("spool: \"%s\": fstat: %s",
+				sf->sf_fname, strerror(errno));
+
+	if (sb.st_size < sf->sf_size) {
+		nts_logm(SPOOL_fac, M_SPOOL_VFYBADSZ, sf->sf_fname);
+		sf->sf_size = 8;
+	}
+
+	bzero(&vw, sizeof(vw));
+	vw.vw_fd = sf->sf_fd;
+	vw.vw_fsize = sb.st_size;
+
+	/*
+	 * The stored size should point at an EOS header.
+	 */
+	if ((p = spool_verify_map(sf, &vw, sf->sf_size, SPOOL_HDR_SIZE)) != NULL &&
+	    int32get(p) == SPOOL_MAGIC_EOS) {
+		spool_vwin_unmap(&vw);
+		return;
+	}
+
+	nts_logm(SPOOL_fac, M_SPOOL_VFYBEGIN, sf->sf_fname,
+		 (unsigned long) sf->sf_size, (unsigned long) sb.st_size);
+
+	/*
+	 * The most likely cause of this error (spool file longer than the
+	 * stored size) is that we didn't shut down cleanly, so articles
+	 * were written to the spool but the size wasn't updated.  Starting
+	 * at the stored size, walk the spool and verify each article.  If
+	 * we find an invalid article, assume a partial write and truncate
+	 * the spool file at that point, discarding all remaining data.
+	 *
+	 * We can't lose articles doing this, because we fsync() after every
+	 * complete article write.  The purpose of this check is to avoid
+	 * half-written articles in the spool.  The article(s) we discarded will
+	 * be re-sent by the remote peer eventually.
+	 */
+	start = last = uv_hrtime();
+	from = ckpt = sf->sf_size;
+
+	for (pos = sf->sf_size; pos < sb.st_size;) {
+	spool_header_t	 hdr;
+
+		if ((p = spool_verify_map(sf, &vw, pos, SPOOL_HDR_SIZE)) == NULL)
+			goto error;
+		if ((len = spool_decode_header(p, SPOOL_HDR_SIZE, &hdr)) >
+		    SPOOL_HDR_SIZE) {
+			if ((p = spool_verify_map(sf, &vw, pos, len)) == NULL)
+				goto error;
+			spool_decode_header(p, len, &hdr);
+		}
+
+		if (hdr.sa_magic == SPOOL_MAGIC_EOS) {
+			nts_logm(SPOOL_fac, M_SPOOL_EOS, sf->sf_fname,
+				 (unsigned long) pos);
+			goto done;
+		}
+
+		if (hdr.sa_magic == SPOOL_MAGIC_PAD &&
+		    pos + hdr.sa_hdr_len <= sb.st_size) {
+			pos += hdr.sa_hdr_len;
+			continue;
+		}
+
+		if (hdr.sa_magic != SPOOL_MAGIC)
+			goto error;
+
+		if ((p = spool_verify_map(sf, &vw, pos + hdr.sa_hdr_len,
+					  hdr.sa_len)) == NULL)
+			goto error;
+
+		if ((hdr.sa_flags & ART_CRC) && crc64(p, hdr.sa_len) != hdr.sa_crc)
+			goto error;
+
+		pos += hdr.sa_hdr_len + hdr.sa_len;
+
+		if (pos - ckpt >= SPOOL_VERIFY_CKPT) {
+			spool_verify_ckpt(sf, pos, 0);
+			ckpt = pos;
+		}
+
+		if ((now = uv_hrtime()) - last >= SPOOL_VERIFY_PROGRESS) {
+			nts_logm(SPOOL_fac, M_SPOOL_VFYPROG, sf->sf_fname,
+				 (unsigned long) pos, (unsigned long) sb.st_size,
+				 (int) (pos * 100 / sb.st_size));
+			last = now;
+		}
+	}
+
+	nts_logm(SPOOL_fac, M_SPOOL_NOEOS, sf->sf_fname);
+	spool_verify_ckpt(sf, pos, 1);
+	goto finish;
+
+error:
+	nts_logm(SPOOL_fac, M_SPOOL_VFYIVART, sf->sf_fname,
+		 (unsigned long) pos);
+	spool_verify_ckpt(sf, pos, 1);
+	goto finish;
+
+done:
+	spool_verify_ckpt(sf, pos, 0);
+
+finish:
+	spool_vwin_unmap(&vw);
+	sf->sf_size = pos;
+	nts_logm(SPOOL_fac, M_SPOOL_VFYOKAY, sf->sf_fname,
+		 (unsigned long) (pos - from),
+		 (double) (uv_hrtime() - start) / 1e9);
+}
+
+/*
+ * Each spool file has an index, ".<file>.idx" alongside it, so the articles
+ * in the file can be listed without reading it.  The index is a header
+ * (SPOOL_IDX_MAGIC and the version) followed by an entry for each article,
+ * in the order they're stored:
+ *
+ *	offset		8 bytes
+ *	length		4 bytes, including the spool header
+ *	flags		4 bytes
+ *	message-id	8 bytes, crc64() of the message-id
+ *	time		8 bytes, when the article was stored
+ *
+ * The writer thread appends to it once the articles are synced, but the
+ * index itself is never synced.  If it's missing or behind the spool file
+ * after a crash, the missing entries are rebuilt from the spool file at
+ * startup.
+ */
+#define	SPOOL_IDX_MAGIC		0x4E494458	/* NIDX */
+#define	SPOOL_IDX_VERSION	1
+#define	SPOOL_IDX_HDR_SIZE	(4 + 4)
+#define	SPOOL_IDX_ENT_SIZE	(8 + 4 + 4 + 8 + 8)
+#define	SPOOL_IDX_BATCH		1024	/* Entries read or written at once */
+
+#define	SPOOL_IDX_POS(n)	(SPOOL_IDX_HDR_SIZE + (off_t) (n) * SPOOL_IDX_ENT_SIZE)
+
+static void
+spool_idx_name(fname, buf)
+	char const	*fname;
+	char		*buf;
+{
+char const	*p;
+
+	if ((p = strrchr(fname, '/')) == NULL)
+		snprintf(buf, PATH_MAX, ".%s.idx", fname);
+	else
+		snprintf(buf, PATH_MAX, "%.*s/.%s.idx",
+			 (int) (p - fname), fname, p + 1);
+}
+
+static void
+spool_idx_encode(buf, ie)
+	unsigned char			*buf;
+	spool_index_entry_t const	*ie;
+{
+	int64put(buf, ie->ie_pos.sp_offset);
+	int32put(buf + 8, ie->ie_len);
+	int32put(buf + 12, ie->ie_flags);
+	int64put(buf + 16, ie->ie_msgid);
+	int64put(buf + 24, (uint64_t) ie->ie_time);
+}
+
+static void
+spool_idx_decode(buf, ie)
+	unsigned char const	*buf;
+	spool_index_entry_t	*ie;
+{
+	ie->ie_pos.sp_offset = int64get(buf);
+	ie->ie_len = int32get(buf + 8);
+	ie->ie_flags = int32get(buf + 12);
+	ie->ie_msgid = int64get(buf + 16);
+	ie->ie_time = (time_t) int64get(buf + 24);
+}
+
+/*
+ * Index the synced requests in done, which are in offset order.  Only the
+ * writer thread calls this once the file is in use, so it can read sf_nidx
+ * without the lock.  If the index can't be written, it's abandoned, and
+ * rebuilt at the next startup.
+ */
+static void
+spool_idx_append(sf, done)
+	spool_file_t		*sf;
+	spool_store_req_t	*done;
+{
+unsigned char		 buf[SPOOL_IDX_BATCH * SPOOL_IDX_ENT_SIZE];
+spool_store_req_t	*req = done;
+spool_index_entry_t	 ie;
+char			 iname[PATH_MAX];
+size_t			 n;
+int			 fd;
+
+	if (sf->sf_idx_broken)
+		return;
+
+	spool_idx_name(sf->sf_fname, iname);
+
+	/* A file created since startup doesn't have an index until now */
+	if (sf->sf_idx_fd == -1) {
+		if ((fd = open(iname, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+			goto err;
+
+		int32put(buf, SPOOL_IDX_MAGIC);
+		int32put(buf + 4, SPOOL_IDX_VERSION);
+		if (pwrite(fd, buf, SPOOL_IDX_HDR_SIZE, 0) != SPOOL_IDX_HDR_SIZE) {
+			close(fd);
+			goto err;
+		}
+
+		uv_mutex_lock(&spool_size_mtx);
+		sf->sf_idx_fd = fd;
+		uv_mutex_unlock(&spool_size_mtx);
+	}
+
+	while (req) {
+		for (n = 0; req && n < SPOOL_IDX_BATCH; req = req->sr_next, n++) {
+			ie.ie_pos.sp_offset = req->sr_offset;
+			ie.ie_len = req->sr_hdrlen + req->sr_datalen;
+			ie.ie_flags = req->sr_flags;
+			ie.ie_msgid = req->sr_msgid;
+			ie.ie_time = req->sr_time;
+			spool_idx_encode(buf + n * SPOOL_IDX_ENT_SIZE, &ie);
+		}
+
+		if (pwrite(sf->sf_idx_fd, buf, n * SPOOL_IDX_ENT_SIZE,
+			   SPOOL_IDX_POS(sf->sf_nidx)) != n * SPOOL_IDX_ENT_SIZE)
+			goto err;
+
+		uv_mutex_lock(&spool_size_mtx);
+		sf->sf_nidx += n;
+		uv_mutex_unlock(&spool_size_mtx);
+	}
+	return;
+
+err:
+	/*
+	 * Readers might still be using the descriptor, so it stays open
+	 * until the file is freed.
+	 */
+	nts_logm(SPOOL_fac, M_SPOOL_IDXFAIL, iname, strerror(errno));
+	sf->sf_idx_broken = 1;
+	unlink(iname);
+}
+
+/*
+ * Open the index of a file that's just been opened (and verified), discard
+ * any entries past the end of the file, and add any that are missing.
+ */
+static void
+spool_idx_load(sf)
+	spool_file_t	*sf;
+{
+char		 iname[PATH_MAX];
+unsigned char	 buf[SPOOL_IDX_ENT_SIZE];
+struct stat	 sb;
+uint64_t	 lo = 0, hi = 0, mid;
+spool_offset_t	 pos = sizeof(uint64_t);
+spool_index_entry_t ie;
+
+	spool_idx_name(sf->sf_fname, iname);
+	if ((sf->sf_idx_fd = open(iname, O_RDWR | O_CREAT, 0600)) == -1 ||
+	    fstat(sf->sf_idx_fd, &sb) == -1)
+		goto err;
+
+	if (sb.st_size >= SPOOL_IDX_HDR_SIZE &&
+	    pread(sf->sf_idx_fd, buf, SPOOL_IDX_HDR_SIZE, 0) == SPOOL_IDX_HDR_SIZE &&
+	    int32get(buf) == SPOOL_IDX_MAGIC &&
+	    int32get(buf + 4) == SPOOL_IDX_VERSION)
+		hi = (sb.st_size - SPOOL_IDX_HDR_SIZE) / SPOOL_IDX_ENT_SIZE;
+	else {
+		int32put(buf, SPOOL_IDX_MAGIC);
+		int32put(buf + 4, SPOOL_IDX_VERSION);
+		if (pwrite(sf->sf_idx_fd, buf, SPOOL_IDX_HDR_SIZE, 0) !=
+		    SPOOL_IDX_HDR_SIZE)
+			goto err;
+	}
+
+	/*
+	 * Verification might have truncated the file, so find the entries
+	 * that are still inside it.  They're in offset order.
+	 */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pread(sf->sf_idx_fd, buf, sizeof(buf), SPOOL_IDX_POS(mid)) !=
+		    sizeof(buf))
+			goto err;
+		spool_idx_decode(buf, &ie);
+
+		if (ie.ie_pos.sp_offset + ie.ie_len <= sf->sf_size) {
+			lo = mid + 1;
+			pos = ie.ie_pos.sp_offset + ie.ie_len;
+		} else
+			hi = mid;
+	}
+
+	if (ftruncate(sf->sf_idx_fd, SPOOL_IDX_POS(lo)) == -1)
+		goto err;
+	sf->sf_nidx = lo;
+
+	if (pos < sf->sf_size && spool_idx_rebuild(sf, pos) == -1) {
+		/* The entries didn't end on an article; start again */
+		if (ftruncate(sf->sf_idx_fd, SPOOL_IDX_HDR_SIZE) == -1)
+			goto err;
+		sf->sf_nidx = 0;
+		if (spool_idx_rebuild(sf, sizeof(uint64_t)) == -1)
+			goto err;
+	}
+	return;
+
+err:
+	nts_logm(SPOOL_fac, M_SPOOL_IDXFAIL, iname, strerror(errno));
+	if (sf->sf_idx_fd != -1)
+		close(sf->sf_idx_fd);
+	sf->sf_idx_fd = -1;
+	sf->sf_nidx = 0;
+	sf->sf_idx_broken = 1;
+	unlink(iname);
+}
+
+/*
+ * Index the articles from pos to the end of the file.  Format 1 headers
+ * don't record when each article arrived, so the file's modification time
+ * stands in for those.  Returns -1 if pos isn't the start of an article, or if the
+ * index can't be written (with errno set).
+ */
+static int
+spool_idx_rebuild(sf, pos)
+	spool_file_t	*sf;
+	spool_offset_t	 pos;
+{
+spool_vwin_t		 vw;
+struct stat		 sb;
+spool_index_entry_t	 ie;
+spool_header_t		 hdr;
+spool_offset_t		 from = pos;
+unsigned char		*p, *ents;
+char			*text = NULL;
+size_t			 textsz = 0, n = 0;
+uint64_t		 nart = 0;
+int			 ret = -1;
+
+	if (fstat(sf->sf_fd, &sb) == -1)
+		return -1;
+
+	bzero(&vw, sizeof(vw));
+	vw.vw_fd = sf->sf_fd;
+	vw.vw_fsize = sf->sf_size;
+	ents = xmalloc(SPOOL_IDX_BATCH * SPOOL_IDX_ENT_SIZE);
+
+	while (pos < sf->sf_size) {
+	char		 msgid[256];
+	size_t		 len;
+	char const	*err;
+	int		 found;
+
+		if ((p = spool_vwin_header(&vw, pos, &hdr)) == NULL)
+			goto bad;
+
+		if (hdr.sa_magic == SPOOL_MAGIC_PAD) {
+			pos += hdr.sa_hdr_len;
+			continue;
+		}
+
+		if (hdr.sa_magic != SPOOL_MAGIC)
+			goto bad;
+
+		/*
+		 * A format 2 header has the msgid, so the article doesn't
+		 * have to be read.
+		 */
+		if ((found = hdr.sa_msgid_len > 0) != 0) {
+			bcopy(p + hdr.sa_msgid_off, msgid, hdr.sa_msgid_len);
+			msgid[hdr.sa_msgid_len] = 0;
+		}
+
+		if ((p = spool_vwin_map(&vw, pos + hdr.sa_hdr_len,
+					hdr.sa_len)) == NULL)
+			goto bad;
+
+		if (found)
+			;
+		else if (!(hdr.sa_flags & ART_COMPRESSED))
+			found = spool_scan_msgid((char const *) p, hdr.sa_len,
+						 msgid, sizeof(msgid)) == 0;
+		else {
+			if (textsz < hdr.sa_text_len) {
+				textsz = hdr.sa_text_len;
+				text = xrealloc(text, textsz);
+			}
+
+			len = hdr.sa_text_len;
+			found = spool_uncompress(hdr.sa_flags, p, hdr.sa_len,
+						 (unsigned char *) text, &len,
+						 &err) == 0 &&
+				spool_scan_msgid(text, len, msgid,
+						 sizeof(msgid)) == 0;
+		}
+
+		ie.ie_pos.sp_offset = pos;
+		ie.ie_len = hdr.sa_hdr_len + hdr.sa_len;
+		ie.ie_flags = hdr.sa_flags;
+		ie.ie_msgid = found ? crc64(msgid, strlen(msgid)) : 0;
+		ie.ie_time = hdr.sa_time ? hdr.sa_time : sb.st_mtime;
+		spool_idx_encode(ents + n * SPOOL_IDX_ENT_SIZE, &ie);
+
+		pos += hdr.sa_hdr_len + hdr.sa_len;
+		nart++;
+
+		if (++n == SPOOL_IDX_BATCH) {
+			if (pwrite(sf->sf_idx_fd, ents, n * SPOOL_IDX_ENT_SIZE,
+				   SPOOL_IDX_POS(sf->sf_nidx)) != n * SPOOL_IDX_ENT_SIZE)
+				goto done;
+			sf->sf_nidx += n;
+			n = 0;
+		}
+	}
+
+	if (n && pwrite(sf->sf_idx_fd, ents, n * SPOOL_IDX_ENT_SIZE,
+			SPOOL_IDX_POS(sf->sf_nidx)) != n * SPOOL_IDX_ENT_SIZE)
+		goto done;
+	sf->sf_nidx += n;
+
+	/* Padding after the last entry doesn't count */
+	if (nart)
+		nts_logm(SPOOL_fac, M_SPOOL_IDXBUILD, sf->sf_fname,
+			 (unsigned long) from, (unsigned long) nart);
+	ret = 0;
+	goto done;
+
+bad:
+	errno = vw.vw_err ? vw.vw_err : EINVAL;
+
+done:
+	spool_vwin_unmap(&vw);
+	free(ents);
+	free(text);
+	return ret;
+}
+
+static int	spool_idx_scan_file(spool_file_t *, spool_id_t, time_t, time_t,
+				    int (*)(spool_index_entry_t *, void *),
+				    void *);
+
+int
+spool_index_scan(from, to, cb, udata)
+	time_t	  from, to;
+	int	(*cb)(spool_index_entry_t *, void *);
+	void	 *udata;
+{
+spool_dev_t	*sd;
+spool_file_t	*sf;
+size_t		 num, first, last;
+int		 i, ret;
+
+	for (i = 0; i < spool_ndevs; i++) {
+		sd = spool_devlist[i];
+
+		uv_rwlock_rdlock(&sd->sd_mtx);
+		first = sd->sd_base;
+		last = sd->sd_base + sd->sd_cur_file;
+		uv_rwlock_rdunlock(&sd->sd_mtx);
+
+		for (num = first; num <= last; num++) {
+			/* It's gone if it was rotated out since */
+			if ((sf = spool_file_get(SPOOL_ID(sd->sd_id, num))) == NULL)
+				continue;
+			ret = spool_idx_scan_file(sf, SPOOL_ID(sd->sd_id, num),
+						  from, to, cb, udata);
+			spool_file_release(sf);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int
+spool_idx_scan_file(sf, id, from, to, cb, udata)
+	spool_file_t	 *sf;
+	spool_id_t	  id;
+	time_t		  from, to;
+	int		(*cb)(spool_index_entry_t *, void *);
+	void		 *udata;
+{
+unsigned char		 buf[SPOOL_IDX_BATCH * SPOOL_IDX_ENT_SIZE];
+spool_index_entry_t	 ie;
+uint64_t		 nidx, i, n, j;
+int			 fd, ret;
+
+	/* Entries up to sf_nidx are complete, even if more are being added */
+	uv_mutex_lock(&spool_size_mtx);
+	fd = sf->sf_idx_fd;
+	nidx = sf->sf_nidx;
+	uv_mutex_unlock(&spool_size_mtx);
+
+	for (i = 0; i < nidx; i += n) {
+		n = nidx - i;
+		if (n > SPOOL_IDX_BATCH)
+			n = SPOOL_IDX_BATCH;
+
+		if (pread(fd, buf, n * SPOOL_IDX_ENT_SIZE, SPOOL_IDX_POS(i)) !=
+		    n * SPOOL_IDX_ENT_SIZE) {
+			nts_logm(SPOOL_fac, M_SPOOL_IDXFAIL, sf->sf_fname,
+				 strerror(errno));
+			return 0;
+		}
+
+		for (j = 0; j < n; j++) {
+			spool_idx_decode(buf + j * SPOOL_IDX_ENT_SIZE, &ie);
+			ie.ie_pos.sp_id = id;
+
+			if ((from && ie.ie_time < from) || (to && ie.ie_time > to))
+				continue;
+			if (ret = cb(&ie, udata))
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+void
+spool_shutdown()
+{
+int	i;
+
+	for (i = 0; i < spool_ndevs; i++)
+		spool_dev_shutdown(spool_devlist[i]);
+}
+
+static void
+spool_dev_shutdown(sd)
+	spool_dev_t	*sd;
+{
+	uv_rwlock_wrlock(&sd->sd_mtx);
+
+	if (sd->sd_thread_running) {
+		spool_drain(sd);
+		sd->sd_thread_stop = 1;
+		uv_sem_post(&sd->sd_wakeup);
+		uv_thread_join(&sd->sd_thread);
+		sd->sd_thread_running = 0;
+	}
+
+	spool_write_size(sd);
+	spool_write_eos(sd->sd_files[sd->sd_cur_file],
+			sd->sd_files[sd->sd_cur_file]->sf_size);
+	uv_rwlock_wrunlock(&sd->sd_mtx);
+
+	/* The prep thread finishes any pending deletes before it exits */
+	uv_mutex_lock(&sd->sd_prep_mtx);
+	if (sd->sd_prep_running) {
+		sd->sd_prep_stop = 1;
+		uv_cond_signal(&sd->sd_prep_cv);
+		uv_mutex_unlock(&sd->sd_prep_mtx);
+		uv_thread_join(&sd->sd_prep_thread);
+		uv_mutex_lock(&sd->sd_prep_mtx);
+		sd->sd_prep_running = 0;
+	}
+	uv_mutex_unlock(&sd->sd_prep_mtx);
+
+	while (sd->sd_dead) {
+	spool_file_t	*sf = sd->sd_dead;
+		sd->sd_dead = sf->sf_next;
+		spool_file_free(sf);
+	}
+
+	if (sd->sd_next) {
+		sd->sd_next->sf_delete = 1;
+		spool_file_free(sd->sd_next);
+		sd->sd_next = NULL;
+	}
+}
+
+static void
+spool_file_name(sd, buf, num)
+	spool_dev_t	*sd;
+	char		*buf;
+	size_t		 num;
+{
+	snprintf(buf, PATH_MAX, "%s/%.8lX", sd->sd_path, (unsigned long) num);
+}
+
+static void
+spool_file_open(sd, num, create)
+	spool_dev_t	*sd;
+{
+char	fname[PATH_MAX];
+
+	spool_file_name(sd, fname, sd->sd_base + num);
+	sd->sd_files[num] = spool_file_new(sd, fname, create, 0);
+}
+
+/*
+ * Open the spool file fname, or create it if create is set.  A new file's
+ * blocks are allocated up front, and if prefault is set, its mapping is
+ * populated too, so that writing articles to it doesn't stall on either.
+ */
+static spool_file_t *
+spool_file_new(sd, fname, create, prefault)
+	spool_dev_t	*sd;
+	char const	*fname;
+{
+spool_file_t	*sf;
+int		 flags = O_RDWR, mflags = MAP_FILE | MAP_SHARED;
+
+	sf = xcalloc(1, sizeof(*sf));
+	sf->sf_dev = sd;
+	sf->sf_refs = 1;
+	sf->sf_dfd = -1;
+	sf->sf_idx_fd = -1;
+
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+
+	strlcpy(sf->sf_fname, fname, sizeof(sf->sf_fname));
+	if ((sf->sf_fd = open(sf->sf_fname, flags, 0600)) == -1)
+		panic("spool: \"%s\" cannot %s: %s",
+			sf->sf_fname, create ? "create" : "open",
+			strerror(errno));
+
+	if (create) {
+	uint64_t	sz = sizeof(uint64_t);
+	char		szbuf[sizeof(uint64_t)];
+	char		eos[SPOOL_HDR_SIZE];
+#ifdef HAVE_POSIX_FALLOCATE
+	int		err;
+#endif
+
+		int64put(szbuf, sz);
+		if (pwrite(sf->sf_fd, szbuf, sizeof(szbuf), 0) < sizeof(szbuf))
+			panic("spool: \"%s\": cannot initialise: %s",
+				sf->sf_fname, strerror(errno));
+
+		bzero(eos, sizeof(eos));
+		int32put(eos, SPOOL_MAGIC_EOS);
+		if (pwrite(sf->sf_fd, eos, sizeof(eos), sizeof(uint64_t)) < sizeof(eos))
+			panic("spool: \"%s\": cannot initialise: %s",
+				sf->sf_fname, strerror(errno));
+
+		sf->sf_size = sz;
+
+#ifdef HAVE_POSIX_FALLOCATE
+		/*
+		 * Not every filesystem can preallocate; a sparse file will
+		 * do on those.
+		 */
+		if ((err = posix_fallocate(sf->sf_fd, 0, sd->sd_size)) != 0 &&
+		    err != EINVAL && err != EOPNOTSUPP)
+			panic("spool: \"%s\": fallocate: %s",
+				sf->sf_fname, strerror(err));
+#endif
+		if (ftruncate(sf->sf_fd, sd->sd_size) == -1)
+			panic("spool: \"%s\": ftruncate: %s",
+				sf->sf_fname, strerror(errno));
+		sf->sf_dsz = sd->sd_size;
+	} else {
+	char		szbuf[sizeof(uint64_t)];
+	struct stat	sb;
+		if (pread(sf->sf_fd, szbuf, sizeof(szbuf), 0) < sizeof(szbuf))
+			panic("spool: \"%s\": cannot read: %s",
+					sf->sf_fname, strerror(errno));
+
+		sf->sf_size = int64get(szbuf);
+		spool_verify(sf);
+		if (fstat(sf->sf_fd, &sb) == -1)
+			panic("spool: \"%s\": fstat: %s",
+					sf->sf_fname, strerror(errno));
+		sf->sf_dsz = sb.st_size;
+		spool_idx_load(sf);
+	}
+
+#ifdef O_DIRECT
+	if (spool_method == M_DIRECT) {
+		if ((sf->sf_dfd = open(sf->sf_fname, O_RDWR | O_DIRECT)) == -1)
+			panic("spool: \"%s\" cannot open for direct I/O: %s",
+				sf->sf_fname, strerror(errno));
+		spool_direct_align(sf);
+	}
+#endif
+
+	sf->sf_alloc = sf->sf_size;
+
+	/* Too full to align, so too full to use */
+	if (spool_method == M_DIRECT && sf->sf_size % SPOOL_DIRECT_ALIGN)
+		sf->sf_alloc = sf->sf_dsz;
+
+	if (spool_method == M_MMAP) {
+#ifdef MAP_POPULATE
+		if (prefault)
+			mflags |= MAP_POPULATE;
+#endif
+		if ((sf->sf_addr = mmap(NULL, sf->sf_dsz, PROT_READ | PROT_WRITE,
+				mflags, sf->sf_fd, 0)) == MAP_FAILED)
+			panic("spool: \"%s\": mmap: %s",
+					sf->sf_fname, strerror(errno));
+	}
+
+	return sf;
+}
+
+/*
+ * Remove a file from the spool.  The file is closed, and deleted if del is
+ * set, once the last reader has released it.
+ */
+static void
+spool_file_close(sd, num, del)
+	spool_dev_t	*sd;
+	int		 num, del;
+{
+spool_file_t	*sf = sd->sd_files[num];
+
+	sd->sd_files[num] = NULL;
+	sf->sf_delete = del;
+	spool_file_release(sf);
+}
+
+/*
+ * Return the spool file for the given id with a reference held, or NULL if
+ * the file doesn't exist.  The file stays valid, even if it's rotated out of
+ * the spool, until the reference is released with spool_file_release().
+ */
+static spool_file_t *
+spool_file_get(spid)
+	spool_id_t	spid;
+{
+spool_dev_t	*sd;
+spool_file_t	*sf;
+size_t		 num = SPOOL_ID_FILE(spid);
+
+	if ((sd = spool_devs[SPOOL_ID_DEV(spid)]) == NULL || sd->sd_files == NULL)
+		return NULL;
+
+	uv_rwlock_rdlock(&sd->sd_mtx);
+
+	if (num < sd->sd_base || num > (sd->sd_base + sd->sd_cur_file)) {
+		uv_rwlock_rdunlock(&sd->sd_mtx);
+		return NULL;
+	}
+
+	sf = sd->sd_files[num - sd->sd_base];
+#ifdef ATOMIC
+	atomic_inc_uint_nv(&sf->sf_refs);
+#else
+	uv_mutex_lock(&spool_ref_mtx);
+	sf->sf_refs++;
+	uv_mutex_unlock(&spool_ref_mtx);
+#endif
+
+	uv_rwlock_rdunlock(&sd->sd_mtx);
+	return sf;
+}
+
+static void
+spool_file_release(sf)
+	spool_file_t	*sf;
+{
+spool_dev_t	*sd = sf->sf_dev;
+unsigned	 refs;
+
+#ifdef ATOMIC
+	refs = atomic_dec_uint_nv(&sf->sf_refs);
+#else
+	uv_mutex_lock(&spool_ref_mtx);
+	refs = --sf->sf_refs;
+	uv_mutex_unlock(&spool_ref_mtx);
+#endif
+
+	if (refs)
+		return;
+
+	/*
+	 * Closing a file means syncing it, and deleting one can take a while
+	 * on some filesystems, so leave that to the prep thread.
+	 */
+	uv_mutex_lock(&sd->sd_prep_mtx);
+	if (sd->sd_prep_running) {
+		sf->sf_next = sd->sd_dead;
+		sd->sd_dead = sf;
+		uv_cond_signal(&sd->sd_prep_cv);
+		uv_mutex_unlock(&sd->sd_prep_mtx);
+		return;
+	}
+	uv_mutex_unlock(&sd->sd_prep_mtx);
+
+	spool_file_free(sf);
+}
+
+static void
+spool_file_free(sf)
+	spool_file_t	*sf;
+{
+	/* There's no need to sync a file that's about to be deleted */
+	if (!sf->sf_delete) {
+		if (spool_method == M_MMAP)
+			msync(sf->sf_addr, sf->sf_size, MS_SYNC);
+		else
+			fdatasync(sf->sf_fd);
+
+		if (ftruncate(sf->sf_fd, sf->sf_size) == -1) {
+			panic("spool: \"%s\": ftruncate: %s",
+				sf->sf_fname, strerror(errno));
+		}
+	}
+
+	if (spool_method == M_MMAP)
+		munmap(sf->sf_addr, sf->sf_dsz);
+
+	close(sf->sf_fd);
+	if (sf->sf_dfd != -1) {
+		spool_direct_forget(sf);
+		close(sf->sf_dfd);
+	}
+	if (sf->sf_idx_fd != -1)
+		close(sf->sf_idx_fd);
+
+	if (sf->sf_delete) {
+	char	iname[PATH_MAX];
+
+		/*
+		 * The index goes first, so a crash can't leave one behind.
+		 * It might not exist if nothing was stored in the file.
+		 */
+		spool_idx_name(sf->sf_fname, iname);
+		unlink(iname);
+
+		if (unlink(sf->sf_fname) == -1)
+			panic("spool: %s: cannot unlink: %s",
+					sf->sf_fname, strerror(errno));
+	}
+
+	free(sf);
+}
+
+/*
+ * Read the header at pos into hdr and return its length.  A header that
+ * doesn't fit in the file is returned with sa_magic set to 0.
+ */
+static ssize_t
+spool_read_header(sf, pos, hdr)
+	spool_file_t	*sf;
+	spool_offset_t	 pos;
+	spool_header_t	*hdr;
+{
+unsigned char	 rdbuf[SPOOL_HDR_MAX], *buf;
+size_t		 len;
+
+	if (spool_method == M_MMAP) {
+		len = spool_decode_header(sf->sf_addr + pos, SPOOL_HDR_SIZE,
+					  hdr);
+		if (len > SPOOL_HDR_SIZE) {
+			if (pos + len > sf->sf_dsz) {
+				hdr->sa_magic = 0;
+				return len;
+			}
+			spool_decode_header(sf->sf_addr + pos, len, hdr);
+		}
+		return len;
+	}
+
+	if (spool_pread(sf, rdbuf, SPOOL_HDR_SIZE, pos) != SPOOL_HDR_SIZE)
+		panic("spool: \"%s\": read: %s", sf->sf_fname,
+				strerror(errno));
+	len = spool_decode_header(rdbuf, SPOOL_HDR_SIZE, hdr);
+	if (len <= SPOOL_HDR_SIZE)
+		return len;
+
+	/*
+	 * A format 2 header with extensions past the first read.  Anything
+	 * longer than SPOOL_HDR_MAX was written by a newer version.
+	 */
+	buf = len <= sizeof(rdbuf) ? rdbuf : xmalloc(len);
+	if (spool_pread(sf, buf, len, pos) != (ssize_t) len)
+		hdr->sa_magic = 0;
+	else
+		spool_decode_header(buf, len, hdr);
+	if (buf != rdbuf)
+		free(buf);
+	return len;
+}
+
+/*
+ * Decode the header in hdrbuf, of which avail bytes (at least SPOOL_HDR_SIZE)
+ * are present, and return its full length.  If that's more than avail, the
+ * format 2 extensions haven't been decoded and the caller should try again
+ * with the whole header.  Either format is returned with sa_magic set to
+ * SPOOL_MAGIC; a header that isn't valid has it set to 0.
+ */
+static size_t
+spool_decode_header(hdrbuf, avail, hdr)
+	unsigned char const	*hdrbuf;
+	size_t			 avail;
+	spool_header_t		*hdr;
+{
+int			 hdrpos = 0;
+unsigned char const	*v;
+size_t			 vlen;
+
+	bzero(hdr, sizeof(*hdr));
+	hdr->sa_magic = int32get(hdrbuf + hdrpos);				hdrpos += 4;
+
+	if (hdr->sa_magic == SPOOL_MAGIC) {
+		hdr->sa_version = 1;
+		hdr->sa_len = int32get(hdrbuf + hdrpos);			hdrpos += 4;
+		hdr->sa_hdr_len = int8get(hdrbuf + hdrpos);			hdrpos += 1;
+		hdr->sa_flags = int32get(hdrbuf + hdrpos);			hdrpos += 4;
+		hdr->sa_emp_score = ((double) int64get(hdrbuf + hdrpos)) / 1000; hdrpos += 8;
+		hdr->sa_phl_score = ((double) int64get(hdrbuf + hdrpos)) / 1000; hdrpos += 8;
+		hdr->sa_crc = int64get(hdrbuf + hdrpos);			hdrpos += 8;
+		hdr->sa_text_len = int32get(hdrbuf + hdrpos);			hdrpos += 4;
+		assert(hdrpos == SPOOL_HDR_SIZE);
+
+		if (hdr->sa_flags & ART_ZSTD)
+			hdr->sa_codec = SPOOL_CODEC_ZSTD;
+		else if (hdr->sa_flags & ART_COMPRESSED)
+			hdr->sa_codec = SPOOL_CODEC_ZLIB;
+		if (hdr->sa_flags & ART_CRC)
+			hdr->sa_csum = SPOOL_CSUM_CRC64;
+
+		if (hdr->sa_hdr_len < SPOOL_HDR_SIZE) {
+			hdr->sa_magic = 0;
+			return SPOOL_HDR_SIZE;
+		}
+		return hdr->sa_hdr_len;
+	}
+
+	if (hdr->sa_magic == SPOOL_MAGIC_PAD) {
+	uint32_t	padlen = int32get(hdrbuf + hdrpos);
+
+		if (padlen < SPOOL_HDR_SIZE || padlen > UINT16_MAX)
+			hdr->sa_magic = 0;
+		else
+			hdr->sa_hdr_len = padlen;
+		return SPOOL_HDR_SIZE;
+	}
+
+	if (hdr->sa_magic != SPOOL_MAGIC_V2)
+		return SPOOL_HDR_SIZE;
+
+	hdr->sa_magic = SPOOL_MAGIC;
+	hdr->sa_version = 2;
+	hdr->sa_len = int32get(hdrbuf + hdrpos);				hdrpos += 4;
+	hdr->sa_hdr_len = int16get(hdrbuf + hdrpos);				hdrpos += 2;
+	hdr->sa_flags = int32get(hdrbuf + hdrpos);				hdrpos += 4;
+	hdr->sa_emp_score = ((double) int64get(hdrbuf + hdrpos)) / 1000;	hdrpos += 8;
+	hdr->sa_phl_score = ((double) int64get(hdrbuf + hdrpos)) / 1000;	hdrpos += 8;
+	hdr->sa_text_len = int32get(hdrbuf + hdrpos);				hdrpos += 4;
+	assert(hdrpos == SPOOL_HDR_CORE);
+
+	if (hdr->sa_hdr_len < SPOOL_HDR_CORE) {
+		hdr->sa_magic = 0;
+		return SPOOL_HDR_SIZE;
+	}
+
+	if (hdr->sa_hdr_len > avail)
+		return hdr->sa_hdr_len;
+
+	/*
+	 * The flags are what the reader goes by; the codec extension is for
+	 * codecs that don't have a flag.  There's only a checksum if the
+	 * header has one.
+	 */
+	if (hdr->sa_flags & ART_ZSTD)
+		hdr->sa_codec = SPOOL_CODEC_ZSTD;
+	else if (hdr->sa_flags & ART_COMPRESSED)
+		hdr->sa_codec = SPOOL_CODEC_ZLIB;
+	hdr->sa_flags &= ~ART_CRC;
+
+	while (hdrpos + 3 <= hdr->sa_hdr_len) {
+		vlen = int16get(hdrbuf + hdrpos + 1);
+		v = hdrbuf + hdrpos + 3;
+		if (hdrpos + 3 + vlen > hdr->sa_hdr_len) {
+			hdr->sa_magic = 0;
+			break;
+		}
+
+		switch (hdrbuf[hdrpos]) {
+		case SPOOL_EXT_MSGID:
+			if (vlen > 0 && vlen <= UINT8_MAX) {
+				hdr->sa_msgid_off = hdrpos + 3;
+				hdr->sa_msgid_len = vlen;
+			}
+			break;
+
+		case SPOOL_EXT_TIME:
+			if (vlen == 8)
+				hdr->sa_time = int64get(v);
+			break;
+
+		case SPOOL_EXT_CODEC:
+			if (vlen == 1)
+				hdr->sa_codec = *v;
+			break;
+
+		case SPOOL_EXT_CSUM:
+			if (vlen == 9 && *v == SPOOL_CSUM_CRC64) {
+				hdr->sa_csum = SPOOL_CSUM_CRC64;
+				hdr->sa_crc = int64get(v + 1);
+				hdr->sa_flags |= ART_CRC;
+			}
+			break;
+
+		case SPOOL_EXT_BODY:
+			if (vlen == 4)
+				hdr->sa_body = int32get(v);
+			break;
+		}
+
+		hdrpos += 3 + vlen;
+	}
+
+	return hdr->sa_hdr_len;
+}
+
+/*
+ * Build a format 2 header for an article in buf, which must have room for
+ * SPOOL_HDR_MAX bytes, and return its length.
+ */
+static size_t
+spool_encode_header(buf, art, flags, datalen, textlen, crc, now)
+	unsigned char	*buf;
+	article_t const	*art;
+	uint32_t	 flags;
+	size_t		 datalen, textlen;
+	uint64_t	 crc;
+	time_t		 now;
+{
+size_t	hdrpos = 0, idlen, bodylen;
+
+	int32put(buf + hdrpos, SPOOL_MAGIC_V2);				hdrpos += 4;
+	int32put(buf + hdrpos, datalen);				hdrpos += 4;
+	hdrpos += 2;	/* Header length; filled in below */
+	int32put(buf + hdrpos, flags);					hdrpos += 4;
+	int64put(buf + hdrpos, (uint64_t) (art->art_emp_score * 1000));	hdrpos += 8;
+	int64put(buf + hdrpos, (uint64_t) (art->art_phl_score * 1000));	hdrpos += 8;
+	int32put(buf + hdrpos, textlen);				hdrpos += 4;
+	assert(hdrpos == SPOOL_HDR_CORE);
+
+	if (art->art_msgid && (idlen = strlen(art->art_msgid)) > 0 &&
+	    idlen <= UINT8_MAX) {
+		buf[hdrpos] = SPOOL_EXT_MSGID;
+		int16put(buf + hdrpos + 1, idlen);
+		bcopy(art->art_msgid, buf + hdrpos + 3, idlen);
+		hdrpos += 3 + idlen;
+	}
+
+	buf[hdrpos] = SPOOL_EXT_TIME;
+	int16put(buf + hdrpos + 1, 8);
+	int64put(buf + hdrpos + 3, (uint64_t) now);
+	hdrpos += 3 + 8;
+
+	buf[hdrpos] = SPOOL_EXT_CODEC;
+	int16put(buf + hdrpos + 1, 1);
+	if (flags & ART_ZSTD)
+		buf[hdrpos + 3] = SPOOL_CODEC_ZSTD;
+	else if (flags & ART_COMPRESSED)
+		buf[hdrpos + 3] = SPOOL_CODEC_ZLIB;
+	else
+		buf[hdrpos + 3] = SPOOL_CODEC_NONE;
+	hdrpos += 3 + 1;
+
+	if (flags & ART_CRC) {
+		buf[hdrpos] = SPOOL_EXT_CSUM;
+		int16put(buf + hdrpos + 1, 9);
+		buf[hdrpos + 3] = SPOOL_CSUM_CRC64;
+		int64put(buf + hdrpos + 4, crc);
+		hdrpos += 3 + 9;
+	}
+
+	/* art_body is the end of the text */
+	if (art->art_body && (bodylen = strlen(art->art_body)) < textlen) {
+		buf[hdrpos] = SPOOL_EXT_BODY;
+		int16put(buf + hdrpos + 1, 4);
+		int32put(buf + hdrpos + 3, textlen - bodylen);
+		hdrpos += 3 + 4;
+	}
+
+	assert(hdrpos > SPOOL_HDR_SIZE && hdrpos <= SPOOL_HDR_MAX);
+	int16put(buf + 8, hdrpos);
+	return hdrpos;
+}
+
+static void
+spool_write_eos(sf, pos)
+	spool_file_t	*sf;
+	spool_offset_t	 pos;
+{
+	if (spool_method == M_MMAP) {
+		bzero(sf->sf_addr + pos, SPOOL_HDR_SIZE);
+		int32put(sf->sf_addr + pos, SPOOL_MAGIC_EOS);
+	} else if (spool_method == M_DIRECT && pos % SPOOL_DIRECT_ALIGN == 0) {
+	unsigned char	*eos = spool_dbuf_get(SPOOL_DIRECT_ALIGN);
+
+		bzero(eos, SPOOL_DIRECT_ALIGN);
+		int32put(eos, SPOOL_MAGIC_EOS);
+		if (pwrite(sf->sf_dfd, eos, SPOOL_DIRECT_ALIGN, pos) !=
+		    SPOOL_DIRECT_ALIGN)
+			panic("spool: \"%s\": write: %s", sf->sf_fname,
+			      strerror(errno));
+		spool_dbuf_put(eos, SPOOL_DIRECT_ALIGN);
+	} else {
+	char	eos[sizeof(uint32_t)];
+		int32put(eos, SPOOL_MAGIC_EOS);
+		if (pwrite(sf->sf_fd, eos, sizeof(eos), pos) < sizeof(eos))
+			panic("spool: \"%s\": write: %s", sf->sf_fname,
+			      strerror(errno));
+	}
+
+}
+
+void
+spool_get_cur_pos(pos)
+	spool_pos_t	*pos;
+{
+spool_dev_t	*sd = spool_devs[0];
+
+	uv_rwlock_rdlock(&sd->sd_mtx);
+	uv_mutex_lock(&spool_size_mtx);
+	pos->sp_id = SPOOL_ID(0, sd->sd_base + sd->sd_cur_file);
+	pos->sp_offset = sd->sd_files[sd->sd_cur_file]->sf_size;
+	uv_mutex_unlock(&spool_size_mtx);
+	uv_rwlock_rdunlock(&sd->sd_mtx);
+}
+
+void
+spool_set_expire_hook(fn)
+	spool_expire_fn	fn;
+{
+	spool_expire_hook = fn;
+}
+
+/*
+ * spool_walk() reads every article in the spool, several files at once,
+ * and hands them to the callback in batches.  Only the headers are looked
+ * at, for the message-id; the arrival time comes from the file's index.
+ */
+#define	SPOOL_WALK_BATCH	1024
+
+typedef struct spool_walk {
+	spool_file_t	**wk_files;
+	spool_id_t	 *wk_ids;
+	size_t		  wk_nfiles;
+	size_t		  wk_next;
+	uv_mutex_t	  wk_mtx;
+	int		  wk_ret;
+	int		(*wk_cb)(spool_walk_ent_t *, size_t, void *);
+	void		 *wk_udata;
+} spool_walk_t;
+
+static void	spool_walk_thread(void *);
+static int	spool_walk_file(spool_walk_t *, spool_file_t *, spool_id_t);
+
+int
+spool_walk(cb, udata)
+	int	(*cb)(spool_walk_ent_t *, size_t, void *);
+	void	 *udata;
+{
+spool_walk_t	 wk;
+spool_dev_t	*sd;
+spool_file_t	*sf;
+uv_thread_t	*thrs;
+size_t		 num, first, last, n;
+long		 ncpu;
+int		 nthrs = 0, i;
+
+	bzero(&wk, sizeof(wk));
+	wk.wk_cb = cb;
+	wk.wk_udata = udata;
+	uv_mutex_init(&wk.wk_mtx);
+
+	for (i = 0; i < spool_ndevs; i++) {
+		sd = spool_devlist[i];
+
+		uv_rwlock_rdlock(&sd->sd_mtx);
+		first = sd->sd_base;
+		last = sd->sd_base + sd->sd_cur_file;
+		uv_rwlock_rdunlock(&sd->sd_mtx);
+
+		for (num = first; num <= last; num++) {
+			if ((sf = spool_file_get(SPOOL_ID(sd->sd_id, num))) == NULL)
+				continue;
+
+			wk.wk_files = xrealloc(wk.wk_files,
+					sizeof(*wk.wk_files) * (wk.wk_nfiles + 1));
+			wk.wk_ids = xrealloc(wk.wk_ids,
+					sizeof(*wk.wk_ids) * (wk.wk_nfiles + 1));
+			wk.wk_files[wk.wk_nfiles] = sf;
+			wk.wk_ids[wk.wk_nfiles++] = SPOOL_ID(sd->sd_id, num);
+		}
+	}
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+
+	thrs = xcalloc(ncpu, sizeof(*thrs));
+	for (i = 1; i < ncpu && i < wk.wk_nfiles; i++)
+		if (uv_thread_create(&thrs[nthrs], spool_walk_thread, &wk) == 0)
+			++nthrs;
+
+	spool_walk_thread(&wk);
+	for (i = 0; i < nthrs; i++)
+		uv_thread_join(&thrs[i]);
+	free(thrs);
+
+	for (n = 0; n < wk.wk_nfiles; n++)
+		spool_file_release(wk.wk_files[n]);
+	free(wk.wk_files);
+	free(wk.wk_ids);
+	uv_mutex_destroy(&wk.wk_mtx);
+	return wk.wk_ret;
+}
+
+static void
+spool_walk_thread(arg)
+	void	*arg;
+{
+spool_walk_t	*wk = arg;
+size_t		 n;
+int		 ret;
+
+	for (;;) {
+		uv_mutex_lock(&wk->wk_mtx);
+		n = wk->wk_next++;
+		ret = wk->wk_ret;
+		uv_mutex_unlock(&wk->wk_mtx);
+
+		if (ret || n >= wk->wk_nfiles)
+			return;
+
+		if (ret = spool_walk_file(wk, wk->wk_files[n], wk->wk_ids[n])) {
+			uv_mutex_lock(&wk->wk_mtx);
+			if (wk->wk_ret == 0)
+				wk->wk_ret = ret;
+			uv_mutex_unlock(&wk->wk_mtx);
+			return;
+		}
+	}
+}
+
+/*
+ * Walk one file, returning the callback's value if it stopped the walk.
+ * Articles stored while the walk is running are left out.
+ */
+static int
+spool_walk_file(wk, sf, id)
+	spool_walk_t	*wk;
+	spool_file_t	*sf;
+	spool_id_t	 id;
+{
+spool_walk_ent_t	*ents;
+spool_vwin_t		 vw;
+spool_header_t		 hdr;
+spool_index_entry_t	 ie;
+struct stat		 sb;
+unsigned char		*p, *idx = NULL;
+char			*text = NULL;
+size_t			 textsz = 0, len, n = 0;
+uint64_t		 nidx, k = 0;
+spool_offset_t		 pos = sizeof(uint64_t);
+int			 idxfd, ret = 0;
+
+	bzero(&vw, sizeof(vw));
+	vw.vw_fd = sf->sf_fd;
+
+	uv_mutex_lock(&spool_size_mtx);
+	vw.vw_fsize = sf->sf_size;
+	idxfd = sf->sf_idx_fd;
+	nidx = sf->sf_nidx;
+	uv_mutex_unlock(&spool_size_mtx);
+
+	if (fstat(sf->sf_fd, &sb) == -1)
+		sb.st_mtime = time(NULL);
+
+	if (nidx) {
+		idx = xmalloc(nidx * SPOOL_IDX_ENT_SIZE);
+		if (pread(idxfd, idx, nidx * SPOOL_IDX_ENT_SIZE,
+			  SPOOL_IDX_POS(0)) != nidx * SPOOL_IDX_ENT_SIZE) {
+			nts_logm(SPOOL_fac, M_SPOOL_IDXFAIL, sf->sf_fname,
+				 strerror(errno));
+			nidx = 0;
+		}
+	}
+
+	ents = xcalloc(SPOOL_WALK_BATCH, sizeof(*ents));
+
+	while (pos < vw.vw_fsize) {
+	spool_walk_ent_t	*we = &ents[n];
+	char const		*err;
+
+		if ((p = spool_vwin_header(&vw, pos, &hdr)) == NULL)
+			break;
+
+		if (hdr.sa_magic == SPOOL_MAGIC_PAD) {
+			pos += hdr.sa_hdr_len;
+			continue;
+		}
+
+		if (hdr.sa_magic != SPOOL_MAGIC)
+			break;
+
+		we->we_pos.sp_id = id;
+		we->we_pos.sp_offset = pos;
+		we->we_flags = hdr.sa_flags;
+		we->we_time = hdr.sa_time ? hdr.sa_time : sb.st_mtime;
+		we->we_msgid[0] = 0;
+
+		if (hdr.sa_msgid_len > 0) {
+			bcopy(p + hdr.sa_msgid_off, we->we_msgid,
+			      hdr.sa_msgid_len);
+			we->we_msgid[hdr.sa_msgid_len] = 0;
+		}
+
+		if ((p = spool_vwin_map(&vw, pos + hdr.sa_hdr_len,
+					hdr.sa_len)) == NULL)
+			break;
+
+		for (; k < nidx; k++) {
+			spool_idx_decode(idx + k * SPOOL_IDX_ENT_SIZE, &ie);
+			if (ie.ie_pos.sp_offset >= pos)
+				break;
+		}
+		if (k < nidx && ie.ie_pos.sp_offset == pos && !hdr.sa_time)
+			we->we_time = ie.ie_time;
+
+		if (we->we_msgid[0])
+			;
+		else if (!(hdr.sa_flags & ART_COMPRESSED))
+			spool_scan_msgid((char const *) p, hdr.sa_len,
+					 we->we_msgid, sizeof(we->we_msgid));
+		else {
+			if (textsz < hdr.sa_text_len) {
+				textsz = hdr.sa_text_len;
+				text = xrealloc(text, textsz);
+			}
+
+			len = hdr.sa_text_len;
+			if (spool_uncompress(hdr.sa_flags, p, hdr.sa_len,
+					     (unsigned char *) text, &len, &err) == 0)
+				spool_scan_msgid(text, len, we->we_msgid,
+						 sizeof(we->we_msgid));
+		}
+
+		pos += hdr.sa_hdr_len + hdr.sa_len;
+
+		if (++n == SPOOL_WALK_BATCH) {
+			if (ret = wk->wk_cb(ents, n, wk->wk_udata))
+				goto done;
+			n = 0;
+		}
+	}
+
+	if (n)
+		ret = wk->wk_cb(ents, n, wk->wk_udata);
+
+done:
+	spool_vwin_unmap(&vw);
+	free(ents);
+	free(text);
+	free(idx);
+	return ret;
+}
+
+/*
+ * Find the message-id in an article's headers, without parsing the rest
+ * of the article.  The result is the same as article_parse()'s, except
+ * that a message-id folded over several lines isn't found.  Returns -1 if
+ * there isn't one or it doesn't fit in buf.
+ */
+static int
+spool_scan_msgid(text, len, buf, bufsz)
+	char const	*text;
+	size_t		 len;
+	char		*buf;
+	size_t		 bufsz;
+{
+char const	*p = text, *end = text + len, *eol, *v;
+size_t		 n;
+
+	while (p < end) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+
+		/* The blank line at the end of the headers */
+		if (eol == p || (eol == p + 1 && *p == '\r'))
+			break;
+
+		if (eol - p > 11 && strncasecmp(p, "message-id:", 11) == 0) {
+			for (v = p + 11; v < eol && (*v == ' ' || *v == '\t'); v++)
+				;
+			n = eol - v;
+			if (n && v[n - 1] == '\r')
+				n--;
+			if (n == 0 || n >= bufsz)
+				return -1;
+
+			bcopy(v, buf, n);
+			buf[n] = 0;
+			return 0;
+		}
+
+		p = eol + 1;
+	}
+
+	return -1;
+}
+
+/*
+ * spool_check() scans every file in the spool, several at once, and prints
+ * what it finds as key=value lines, one for each file, one for each error,
+ * and the totals:
+ *
+ *	file dev=0 path=/var/spool/nts/00000004 articles=1278 ...
+ *	error dev=0 path=/var/spool/nts/00000004 offset=104882 reason=crc
+ *	total files=8 articles=10240 ... errors=1
+ *
+ * With deep set (nts -yy), compressed articles are uncompressed as well.
+ */
+#define	SPOOL_CHECK_SIZES	8
+#define	SPOOL_CHECK_TYPES	6
+
+static uint64_t const	spool_check_sizes[SPOOL_CHECK_SIZES] = {
+	1024, 4096, 16384, 65536, 262144, 1048576, 4194304, UINT64_MAX
+};
+static char const *const spool_check_size_names[SPOOL_CHECK_SIZES] = {
+	"1k", "4k", "16k", "64k", "256k", "1m", "4m", "big"
+};
+
+/* Checked in order; the first one that matches is the article's type. */
+static struct {
+	uint32_t	 type;
+	char const	*name;
+} const spool_check_types[SPOOL_CHECK_TYPES] = {
+	{ ART_TYPE_YENC,	"yenc" },
+	{ ART_TYPE_UUE,		"uuencode" },
+	{ ART_TYPE_MIME_BINARY,	"mime_binary" },
+	{ ART_TYPE_HTML,	"html" },
+	{ ART_TYPE_MIME_TEXT,	"mime_text" },
+	{ 0,			"text" }
+};
+
+typedef struct spool_check_stats {
+	uint64_t	cs_articles;
+	uint64_t	cs_disk_bytes;
+	uint64_t	cs_text_bytes;
+	uint64_t	cs_zlib;
+	uint64_t	cs_zstd;
+	uint64_t	cs_indexed;
+	uint64_t	cs_format[2];	/* Format 1 and 2 headers */
+	uint64_t	cs_sizes[SPOOL_CHECK_SIZES];
+	uint64_t	cs_types[SPOOL_CHECK_TYPES];
+	uint64_t	cs_errors;
+} spool_check_stats_t;
+
+typedef struct spool_check_err {
+	uint64_t	 cke_offset;
+	char const	*cke_reason;
+} spool_check_err_t;
+
+typedef struct spool_check_file {
+	spool_dev_t		*ckf_dev;
+	char			 ckf_path[PATH_MAX];
+	spool_check_stats_t	 ckf_stats;
+	spool_check_err_t	*ckf_errs;
+} spool_check_file_t;
+
+typedef struct spool_check {
+	spool_check_file_t	*ck_files;
+	size_t			 ck_nfiles;
+	size_t			 ck_next;
+	uv_mutex_t		 ck_mtx;
+	int			 ck_deep;
+} spool_check_t;
+
+static void	spool_check_list(spool_check_t *, spool_dev_t *);
+static void	spool_check_thread(void *);
+static void	spool_check_file(spool_check_t *, spool_check_file_t *);
+static unsigned char *spool_check_idx(spool_check_file_t *, uint64_t *);
+static void	spool_check_error(spool_check_file_t *, uint64_t, char const *);
+static void	spool_check_print(char const *, spool_check_stats_t *);
+
+int
+spool_check(deep)
+	int	deep;
+{
+spool_check_t		 ck;
+spool_check_stats_t	 total;
+char			 tag[PATH_MAX + 32];
+uv_thread_t		*thrs;
+long			 ncpu;
+int			 nthrs = 0, i, j;
+size_t			 n;
+
+	if (spool_setup_devs() == -1)
+		return 1;
+
+	bzero(&ck, sizeof(ck));
+	ck.ck_deep = deep;
+	uv_mutex_init(&ck.ck_mtx);
+
+	for (i = 0; i < spool_ndevs; i++) {
+#ifdef USE_ZSTD
+		if (deep && spool_dict_load(spool_devlist[i]) == -1)
+			return 1;
+#endif
+		spool_check_list(&ck, spool_devlist[i]);
+	}
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+
+	thrs = xcalloc(ncpu, sizeof(*thrs));
+	for (i = 1; i < ncpu && i < ck.ck_nfiles; i++)
+		if (uv_thread_create(&thrs[nthrs], spool_check_thread, &ck) == 0)
+			++nthrs;
+
+	spool_check_thread(&ck);
+	for (i = 0; i < nthrs; i++)
+		uv_thread_join(&thrs[i]);
+	free(thrs);
+
+	bzero(&total, sizeof(total));
+
+	for (n = 0; n < ck.ck_nfiles; n++) {
+	spool_check_file_t	*ckf = &ck.ck_files[n];
+	spool_check_stats_t	*cs = &ckf->ckf_stats;
+
+		snprintf(tag, sizeof(tag), "file dev=%d path=%s",
+			 ckf->ckf_dev->sd_id, ckf->ckf_path);
+		spool_check_print(tag, cs);
+
+		for (j = 0; j < cs->cs_errors; j++)
+			printf("error dev=%d path=%s offset=%"PRIu64" reason=%s\n",
+			       ckf->ckf_dev->sd_id, ckf->ckf_path,
+			       ckf->ckf_errs[j].cke_offset,
+			       ckf->ckf_errs[j].cke_reason);
+		free(ckf->ckf_errs);
+
+		total.cs_articles += cs->cs_articles;
+		total.cs_disk_bytes += cs->cs_disk_bytes;
+		total.cs_text_bytes += cs->cs_text_bytes;
+		total.cs_zlib += cs->cs_zlib;
+		total.cs_zstd += cs->cs_zstd;
+		total.cs_indexed += cs->cs_indexed;
+		total.cs_format[0] += cs->cs_format[0];
+		total.cs_format[1] += cs->cs_format[1];
+		for (j = 0; j < SPOOL_CHECK_SIZES; j++)
+			total.cs_sizes[j] += cs->cs_sizes[j];
+		for (j = 0; j < SPOOL_CHECK_TYPES; j++)
+			total.cs_types[j] += cs->cs_types[j];
+		total.cs_errors += cs->cs_errors;
+	}
+
+	snprintf(tag, sizeof(tag), "total files=%lu", (long unsigned) ck.ck_nfiles);
+	spool_check_print(tag, &total);
+
+	free(ck.ck_files);
+	uv_mutex_destroy(&ck.ck_mtx);
+	return total.cs_errors ? 1 : 0;
+}
+
+/*
+ * Add a device's spool files to the list to check.
+ */
+static void
+spool_check_list(ck, sd)
+	spool_check_t	*ck;
+	spool_dev_t	*sd;
+{
+spool_id_t	*files = NULL;
+size_t		 nfiles = 0, i;
+DIR		*dir;
+struct dirent	*de;
+
+	if ((dir = opendir(sd->sd_path)) == NULL) {
+		ck->ck_files = xrealloc(ck->ck_files,
+				sizeof(*ck->ck_files) * (ck->ck_nfiles + 1));
+		bzero(&ck->ck_files[ck->ck_nfiles], sizeof(*ck->ck_files));
+		ck->ck_files[ck->ck_nfiles].ckf_dev = sd;
+		strlcpy(ck->ck_files[ck->ck_nfiles].ckf_path, sd->sd_path, PATH_MAX);
+		spool_check_error(&ck->ck_files[ck->ck_nfiles++], 0, "opendir");
+		return;
+	}
+
+	while (de = readdir(dir)) {
+	char		*p;
+	long unsigned	 n;
+
+		if (*de->d_name == '.')
+			continue;
+
+		n = strtoul(de->d_name, &p, 16);
+		if (*p)
+			continue;
+
+		files = xrealloc(files, sizeof(*files) * (nfiles + 1));
+		files[nfiles++] = n;
+	}
+	closedir(dir);
+
+	qsort(files, nfiles, sizeof(*files), numcmp);
+
+	ck->ck_files = xrealloc(ck->ck_files,
+			sizeof(*ck->ck_files) * (ck->ck_nfiles + nfiles));
+	for (i = 0; i < nfiles; i++) {
+	spool_check_file_t	*ckf = &ck->ck_files[ck->ck_nfiles++];
+
+		bzero(ckf, sizeof(*ckf));
+		ckf->ckf_dev = sd;
+		spool_file_name(sd, ckf->ckf_path, files[i]);
+	}
+
+	free(files);
+}
+
+static void
+spool_check_thread(arg)
+	void	*arg;
+{
+spool_check_t	*ck = arg;
+size_t		 n;
 
-	if (sb.st_size < sf->sf_size) {
-		nts_logm(SPOOL_fac, M_SPOOL_VFYBADSZ, sf->sf_fname);
-		sf->sf_size = 8;
+	for (;;) {
+		uv_mutex_lock(&ck->ck_mtx);
+		n = ck->ck_next++;
+		uv_mutex_unlock(&ck->ck_mtx);
+
+		if (n >= ck->ck_nfiles)
+			return;
+		if (ck->ck_files[n].ckf_stats.cs_errors == 0)
+			spool_check_file(ck, &ck->ck_files[n]);
 	}
+}
 
-	/*
-	 * 37 bytes after sz should be an EOS header
-	 */
-	if ((n = pread(sf->sf_fd, hdrbuf, sizeof(hdrbuf), sf->sf_size)) == -1) {
-		nts_logm(SPOOL_fac, M_SPOOL_VFYRDFAIL,
-			 sf->sf_fname, strerror(errno));
-		panic("spool: unrecoverable error during verify");
+static void
+spool_check_file(ck, ckf)
+	spool_check_t		*ck;
+	spool_check_file_t	*ckf;
+{
+spool_check_stats_t	*cs = &ckf->ckf_stats;
+spool_vwin_t		 vw;
+struct stat		 sb;
+unsigned char		*p, *buf = NULL, *idx;
+size_t			 bufsz = 0;
+uint64_t		 pos = sizeof(uint64_t), spsz, nidx;
+int			 i;
+
+	bzero(&vw, sizeof(vw));
+
+	if ((vw.vw_fd = open(ckf->ckf_path, O_RDONLY)) == -1) {
+		spool_check_error(ckf, 0, "open");
+		return;
 	}
 
-	if (n == SPOOL_HDR_SIZE) {
-		if (int32get(hdrbuf) == SPOOL_MAGIC_EOS)
-			return;
+	if (fstat(vw.vw_fd, &sb) == -1) {
+		spool_check_error(ckf, 0, "stat");
+		close(vw.vw_fd);
+		return;
 	}
+	vw.vw_fsize = sb.st_size;
 
-	nts_logm(SPOOL_fac, M_SPOOL_VFYBEGIN, sf->sf_fname,
-		 (unsigned long) sf->sf_size);
+	if ((p = spool_vwin_map(&vw, 0, sizeof(uint64_t))) == NULL) {
+		spool_check_error(ckf, 0, "header");
+		close(vw.vw_fd);
+		return;
+	}
+	spsz = int64get(p);
 
-	/*
-	 * The most likely cause of this error (spool file longer than the
-	 * stored size) is that we didn't shut down cleanly, so articles
-	 * were written to the spool but the size wasn't updated.  Starting
-	 * at the stored size, walk the spool and verify each article.  If
-	 * we find an invalid article, assume a partial write and truncate
-	 * the spool file at that point, discarding all remaining data.
-	 *
-	 * We can't lose articles doing this, because we fsync() after every
-	 * complete article write.  The purpose of this check is to avoid
-	 * half-written articles in the spool.  The article(s) we discarded will
-	 * be re-sent by the remote peer eventually.
-	 */
-	for (pos = sf->sf_size; pos < sb.st_size;) {
-	spool_header_t	 hdr;
-	char		*data = NULL;
+	if (spsz > sb.st_size)
+		spool_check_error(ckf, 0, "size");
+	else if ((p = spool_vwin_map(&vw, spsz, SPOOL_HDR_SIZE)) == NULL ||
+		 int32get(p) != SPOOL_MAGIC_EOS)
+		spool_check_error(ckf, spsz, "no_eos");
 
-		if (pread(sf->sf_fd, hdrbuf, sizeof(hdrbuf), pos) < sizeof(hdrbuf))
-			goto error;
+	idx = spool_check_idx(ckf, &nidx);
 
-		hdr.sa_magic = int32get(hdrbuf + 0);
-		hdr.sa_len = int32get(hdrbuf + 4);
-		hdr.sa_hdr_len = int8get(hdrbuf + 8);
-		hdr.sa_flags = int32get(hdrbuf + 9);
-		hdr.sa_emp_score = ((double) int64get(hdrbuf + 13)) / 1000;
-		hdr.sa_phl_score = ((double) int64get(hdrbuf + 21)) / 1000;
-		hdr.sa_crc = int64get(hdrbuf + 29);
+	for (;;) {
+	spool_header_t	hdr;
 
-		if (hdr.sa_magic == SPOOL_MAGIC_EOS) {
-			nts_logm(SPOOL_fac, M_SPOOL_EOS, sf->sf_fname,
-				 (unsigned long) sf->sf_size);
-			sf->sf_size = pos;
-			return;
+		if ((p = spool_vwin_header(&vw, pos, &hdr)) == NULL) {
+			spool_check_error(ckf, pos, vw.vw_err ? "read" : "truncated");
+			break;
 		}
 
-		if (hdr.sa_magic != SPOOL_MAGIC)
-			goto error;
+		if (hdr.sa_magic == SPOOL_MAGIC_EOS)
+			break;
 
-		data = xmalloc(hdr.sa_len);
-		if (pread(sf->sf_fd, data, hdr.sa_len, pos + hdr.sa_hdr_len) <
-				hdr.sa_hdr_len)
-			goto error;
+		if (hdr.sa_magic == SPOOL_MAGIC_PAD) {
+			pos += hdr.sa_hdr_len;
+			continue;
+		}
 
-		if (hdr.sa_flags & ART_CRC) {
-			if (crc64(data, hdr.sa_len) != hdr.sa_crc)
-				goto error;
+		if (hdr.sa_magic != SPOOL_MAGIC) {
+			spool_check_error(ckf, pos, "magic");
+			break;
 		}
+		cs->cs_format[hdr.sa_version - 1]++;
 
-		free(data);
-		data = NULL;
-		pos += hdr.sa_hdr_len + hdr.sa_len;
-		continue;
+		if ((p = spool_vwin_map(&vw, pos + hdr.sa_hdr_len,
+					hdr.sa_len)) == NULL) {
+			spool_check_error(ckf, pos, vw.vw_err ? "read" : "truncated");
+			break;
+		}
 
-error:
-		free(data);
-		data = NULL;
+		/*
+		 * The index can be behind the file, but what it has must
+		 * match.  After a mismatch, the rest is ignored.
+		 */
+		if (cs->cs_articles < nidx) {
+		spool_index_entry_t	ie;
+
+			spool_idx_decode(idx + SPOOL_IDX_POS(cs->cs_articles), &ie);
+			if (ie.ie_pos.sp_offset != pos ||
+			    ie.ie_len != hdr.sa_hdr_len + hdr.sa_len ||
+			    ie.ie_flags != hdr.sa_flags) {
+				spool_check_error(ckf, pos, "index");
+				nidx = cs->cs_articles;
+			} else
+				cs->cs_indexed++;
+		}
 
-		nts_logm(SPOOL_fac, M_SPOOL_VFYIVART, sf->sf_fname,
-			 (unsigned long) pos);
-		sf->sf_size = pos;
+		cs->cs_articles++;
+		cs->cs_disk_bytes += hdr.sa_len;
+		cs->cs_text_bytes += hdr.sa_text_len;
+
+		if (hdr.sa_flags & ART_ZSTD)
+			cs->cs_zstd++;
+		else if (hdr.sa_flags & ART_COMPRESSED)
+			cs->cs_zlib++;
+
+		for (i = 0; i < SPOOL_CHECK_SIZES - 1; i++)
+			if (hdr.sa_text_len <= spool_check_sizes[i])
+				break;
+		cs->cs_sizes[i]++;
+
+		for (i = 0; i < SPOOL_CHECK_TYPES - 1; i++)
+			if (hdr.sa_flags & spool_check_types[i].type)
+				break;
+		cs->cs_types[i]++;
+
+		if ((hdr.sa_flags & ART_CRC) && crc64(p, hdr.sa_len) != hdr.sa_crc)
+			spool_check_error(ckf, pos, "crc");
+		else if (ck->ck_deep && (hdr.sa_flags & ART_COMPRESSED)) {
+		size_t		 len = hdr.sa_text_len;
+		char const	*err;
+
+			if (bufsz < len) {
+				bufsz = len;
+				buf = xrealloc(buf, bufsz);
+			}
 
-		bzero(hdrbuf, sizeof(hdrbuf));
-		int64put(hdrbuf, SPOOL_MAGIC_EOS);
-		if (pwrite(sf->sf_fd, hdrbuf, sizeof(hdrbuf), pos) < sizeof(hdrbuf)) {
-			nts_logm(SPOOL_fac, M_SPOOL_VFYWRFAIL, sf->sf_fname,
-				 strerror(errno));
-			panic("spool: unrecoverable error during verify");
+			if (spool_uncompress(hdr.sa_flags, p, hdr.sa_len,
+					     buf, &len, &err) == -1)
+				spool_check_error(ckf, pos, "uncompress");
+			else if (len != hdr.sa_text_len)
+				spool_check_error(ckf, pos, "length");
 		}
 
-		nts_logm(SPOOL_fac, M_SPOOL_VFYOKAY);
-		return;
+		pos += hdr.sa_hdr_len + hdr.sa_len;
 	}
 
-	nts_logm(SPOOL_fac, M_SPOOL_NOEOS, sf->sf_fname);
+	if (nidx > cs->cs_articles)
+		spool_check_error(ckf, pos, "index");
 
-	bzero(hdrbuf, sizeof(hdrbuf));
-	int64put(hdrbuf, SPOOL_MAGIC_EOS);
-	if (pwrite(sf->sf_fd, hdrbuf, sizeof(hdrbuf), pos) < sizeof(hdrbuf)) {
-		nts_logm(SPOOL_fac, M_SPOOL_VFYWRFAIL, sf->sf_fname,
-			 strerror(errno));
-		panic("spool: unrecoverable error during verify");
+	free(idx);
+	free(buf);
+	spool_vwin_unmap(&vw);
+	close(vw.vw_fd);
+}
+
+/*
+ * Read the file's index, returning its entries and setting *nidx to the
+ * number of them.  A missing index isn't an error, since it'll be rebuilt
+ * when the spool is next opened.
+ */
+static unsigned char *
+spool_check_idx(ckf, nidx)
+	spool_check_file_t	*ckf;
+	uint64_t		*nidx;
+{
+char		 iname[PATH_MAX];
+unsigned char	*idx;
+struct stat	 sb;
+int		 fd;
+
+	*nidx = 0;
+	spool_idx_name(ckf->ckf_path, iname);
+	if ((fd = open(iname, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			spool_check_error(ckf, 0, "index");
+		return NULL;
 	}
-	sf->sf_size = pos;
+
+	if (fstat(fd, &sb) == -1) {
+		spool_check_error(ckf, 0, "index");
+		close(fd);
+		return NULL;
+	}
+
+	idx = xmalloc(sb.st_size + 1);
+	if (pread(fd, idx, sb.st_size, 0) != sb.st_size ||
+	    sb.st_size < SPOOL_IDX_HDR_SIZE ||
+	    int32get(idx) != SPOOL_IDX_MAGIC ||
+	    int32get(idx + 4) != SPOOL_IDX_VERSION) {
+		spool_check_error(ckf, 0, "index");
+		free(idx);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	*nidx = (sb.st_size - SPOOL_IDX_HDR_SIZE) / SPOOL_IDX_ENT_SIZE;
+	return idx;
 }
 
-void
-spool_shutdown()
+static void
+spool_check_error(ckf, offset, reason)
+	spool_check_file_t	*ckf;
+	uint64_t		 offset;
+	char const		*reason;
 {
-	spool_write_size();
+spool_check_stats_t	*cs = &ckf->ckf_stats;
+
+	ckf->ckf_errs = xrealloc(ckf->ckf_errs,
+			sizeof(*ckf->ckf_errs) * (cs->cs_errors + 1));
+	ckf->ckf_errs[cs->cs_errors].cke_offset = offset;
+	ckf->ckf_errs[cs->cs_errors].cke_reason = reason;
+	cs->cs_errors++;
 }
 
 static void
-spool_file_open(num, create)
-	spool_id_t	num;
+spool_check_print(tag, cs)
+	char const		*tag;
+	spool_check_stats_t	*cs;
 {
-spool_file_t	*sf = &spool_files[num];
-int		 flags = O_RDWR;
+int	i;
+
+	printf("%s articles=%"PRIu64" disk_bytes=%"PRIu64" text_bytes=%"PRIu64
+	       " ratio=%.2f zlib=%"PRIu64" zstd=%"PRIu64" indexed=%"PRIu64
+	       " v1=%"PRIu64" v2=%"PRIu64,
+	       tag, cs->cs_articles, cs->cs_disk_bytes, cs->cs_text_bytes,
+	       cs->cs_disk_bytes ? (double) cs->cs_text_bytes / cs->cs_disk_bytes : 1.0,
+	       cs->cs_zlib, cs->cs_zstd, cs->cs_indexed,
+	       cs->cs_format[0], cs->cs_format[1]);
+
+	for (i = 0; i < SPOOL_CHECK_SIZES; i++)
+		printf(" size_%s=%"PRIu64, spool_check_size_names[i],
+		       cs->cs_sizes[i]);
+	for (i = 0; i < SPOOL_CHECK_TYPES; i++)
+		printf(" type_%s=%"PRIu64, spool_check_types[i].name,
+		       cs->cs_types[i]);
+
+	printf(" errors=%"PRIu64"\n", cs->cs_errors);
+}
 
-	if (create)
-		flags |= O_CREAT | O_EXCL;
+/*
+ * spool_codec_report() compares the compression methods on a sample of the
+ * articles already in the spool, taken from the newest files in each device.
+ * yEnc articles are left out, since they're never compressed.  The sample is
+ * split in two: the dictionary is trained on one half, and every method is
+ * measured on the other, so the dictionary doesn't get to see the articles
+ * it's measured on.
+ */
+#define	SPOOL_REPORT_ARTS	2000
+#define	SPOOL_REPORT_BYTES	(32 * 1024 * 1024)
+
+typedef struct spool_sample {
+	char		*ss_text;
+	size_t		 ss_len;
+	unsigned char	*ss_data;
+	size_t		 ss_datalen;
+	uint32_t	 ss_flags;
+} spool_sample_t;
+
+typedef struct spool_report {
+	spool_sample_t	*sr_samples;
+	int		 sr_nsamples;
+	int		 sr_max_samples;
+	size_t		 sr_bytes;
+	size_t		 sr_max_bytes;
+	int		 sr_stored[3];	/* Uncompressed, zlib, zstd */
+} spool_report_t;
+
+static void	spool_report_dev(spool_dev_t *, spool_report_t *);
+static void	spool_report_file(char const *, spool_report_t *);
+static void	spool_report_method(char const *, spool_class_t *,
+				    spool_sample_t *, int);
 
-	snprintf(sf->sf_fname, sizeof(sf->sf_fname), "%s/%.8lX", spool_path,
-			(unsigned long) num + spool_base);
-	if ((sf->sf_fd = open(sf->sf_fname, flags, 0600)) == -1)
-		panic("spool: \"%s\" cannot %s: %s",
-			sf->sf_fname, create ? "create" : "open",
-			strerror(errno));
+int
+spool_codec_report()
+{
+static struct {
+	char const	*name;
+	int		 codec;
+	int		 level;
+	int		 dict;
+} methods[] = {
+	{ "zlib-1",		SPOOL_ZLIB,	1 },
+	{ "zlib-6",		SPOOL_ZLIB,	6 },
+	{ "zlib-9",		SPOOL_ZLIB,	9 },
+#ifdef USE_ZSTD
+	{ "zstd-1",		SPOOL_ZSTD,	1 },
+	{ "zstd-3",		SPOOL_ZSTD,	3 },
+	{ "zstd-9",		SPOOL_ZSTD,	9 },
+	{ "zstd-19",		SPOOL_ZSTD,	19 },
+	{ "zstd-3+dict",	SPOOL_ZSTD,	3,	1 },
+#endif
+	{ }
+};
+spool_report_t	 rep;
+spool_sample_t	*tests;
+int		 ntests = 0, i;
+size_t		 testbytes = 0;
+#ifdef USE_ZSTD
+ZSTD_CDict	*cdict = NULL;
+spool_dict_t	*di;
+char		*tbuf;
+size_t		*tsizes, tlen = 0, dlen;
+unsigned	 ntrain = 0;
+void		*dbuf;
+#endif
 
-	if (create) {
-	uint64_t	sz = sizeof(uint64_t);
-	char		szbuf[sizeof(uint64_t)];
-	char		eos[SPOOL_HDR_SIZE];
+	if (spool_setup_devs() == -1)
+		return 1;
 
-		int64put(szbuf, sz);
-		if (pwrite(sf->sf_fd, szbuf, sizeof(szbuf), 0) < sizeof(szbuf))
-			panic("spool: \"%s\": cannot initialise: %s",
-				sf->sf_fname, strerror(errno));
+	bzero(&rep, sizeof(rep));
+	rep.sr_samples = xcalloc(SPOOL_REPORT_ARTS, sizeof(*rep.sr_samples));
 
-		bzero(eos, sizeof(eos));
-		int32put(eos, SPOOL_MAGIC_EOS);
-		if (pwrite(sf->sf_fd, eos, sizeof(eos), sizeof(uint64_t)) < sizeof(eos))
-			panic("spool: \"%s\": cannot initialise: %s",
-				sf->sf_fname, strerror(errno));
+	/*
+	 * Each device gets an equal share of the sample, and anything a
+	 * device can't fill is left to the ones after it.
+	 */
+	for (i = 0; i < spool_ndevs; i++) {
+#ifdef USE_ZSTD
+		if (spool_dict_load(spool_devlist[i]) == -1)
+			return 1;
+#endif
+		rep.sr_max_samples = (int64_t) SPOOL_REPORT_ARTS * (i + 1) / spool_ndevs;
+		rep.sr_max_bytes = (int64_t) SPOOL_REPORT_BYTES * (i + 1) / spool_ndevs;
+		spool_report_dev(spool_devlist[i], &rep);
+	}
 
-		sf->sf_size = sz;
+	printf("nts: sampled %d articles, %lu bytes, from %d spool device(s)\n",
+	       rep.sr_nsamples, (long unsigned) rep.sr_bytes, spool_ndevs);
+	printf("nts: stored as: %d uncompressed, %d zlib, %d zstd\n",
+	       rep.sr_stored[0], rep.sr_stored[1], rep.sr_stored[2]);
 
-		if (ftruncate(sf->sf_fd, spool_size) == -1)
-			panic("spool: \"%s\": ftruncate: %s",
-				sf->sf_fname, strerror(errno));
-		sf->sf_dsz = spool_size;
-	} else {
-	char		szbuf[sizeof(uint64_t)];
-	struct stat	sb;
-		if (pread(sf->sf_fd, szbuf, sizeof(szbuf), 0) < sizeof(szbuf))
-			panic("spool: \"%s\": cannot read: %s",
-					sf->sf_fname, strerror(errno));
+	if (rep.sr_nsamples < 2) {
+		printf("nts: not enough articles to compare\n");
+		return 1;
+	}
 
-		sf->sf_size = int64get(szbuf);
-		spool_verify(sf);
-		if (fstat(sf->sf_fd, &sb) == -1)
-			panic("spool: \"%s\": fstat: %s",
-					sf->sf_fname, strerror(errno));
-		sf->sf_dsz = sb.st_size;
+	tests = xcalloc(rep.sr_nsamples / 2, sizeof(*tests));
+	for (i = 1; i < rep.sr_nsamples; i += 2) {
+		tests[ntests++] = rep.sr_samples[i];
+		testbytes += rep.sr_samples[i].ss_len;
 	}
 
-	if (spool_method == M_MMAP) {
-		if ((sf->sf_addr = mmap(NULL, sf->sf_dsz, PROT_READ | PROT_WRITE,
-				MAP_FILE | MAP_SHARED, sf->sf_fd, 0))
-				== MAP_FAILED)
-			panic("spool: \"%s\": mmap: %s",
-					sf->sf_fname, strerror(errno));
+#ifdef USE_ZSTD
+	tbuf = xmalloc(rep.sr_bytes);
+	tsizes = xcalloc((rep.sr_nsamples + 1) / 2, sizeof(*tsizes));
+	for (i = 0; i < rep.sr_nsamples; i += 2) {
+	size_t	len = rep.sr_samples[i].ss_len;
+
+		if (len > SPOOL_DICT_MAXSAMPLE)
+			len = SPOOL_DICT_MAXSAMPLE;
+		bcopy(rep.sr_samples[i].ss_text, tbuf + tlen, len);
+		tlen += len;
+		tsizes[ntrain++] = len;
 	}
-}
 
-static void
-spool_file_close(num, del)
-	spool_id_t	num;
-	int		del;
-{
-spool_file_t	*sf = &spool_files[num];
+	dbuf = xmalloc(SPOOL_DICT_SIZE);
+	dlen = ZDICT_trainFromBuffer(dbuf, SPOOL_DICT_SIZE, tbuf, tsizes, ntrain);
+	free(tbuf);
+	free(tsizes);
 
-	if (spool_method == M_MMAP) {
-		msync(sf->sf_addr, sf->sf_size, MS_SYNC);
-		munmap(sf->sf_addr, sf->sf_dsz);
+	if (ZDICT_isError(dlen)) {
+		printf("nts: cannot train dictionary: %s\n", ZDICT_getErrorName(dlen));
+		free(dbuf);
+	} else if ((di = spool_dict_add(dbuf, dlen, 0)) == NULL) {
+		printf("nts: cannot train dictionary: no dictionary id\n");
 	} else {
-		fdatasync(sf->sf_fd);
+		printf("nts: trained a %lu byte dictionary on %u articles\n",
+		       (long unsigned) dlen, ntrain);
+		if ((cdict = ZSTD_createCDict(di->sdi_buf, di->sdi_len, 3)) == NULL)
+			panic("spool: out of memory for zstd dictionary");
 	}
+#endif
 
-	if (ftruncate(sf->sf_fd, sf->sf_size) == -1) {
-		panic("spool: \"%s\": ftruncate: %s",
-			sf->sf_fname, strerror(errno));
+	printf("nts: testing on %d articles, %lu bytes\n\n",
+	       ntests, (long unsigned) testbytes);
+	printf("nts:    %-12s %8s %15s %17s\n",
+	       "method", "ratio", "compress MB/s", "uncompress MB/s");
+
+	for (i = 0; methods[i].name; i++) {
+	spool_class_t	cls;
+
+		bzero(&cls, sizeof(cls));
+		cls.spc_name = (char *) methods[i].name;
+		cls.spc_codec = methods[i].codec;
+		cls.spc_compress = methods[i].level;
+#ifdef USE_ZSTD
+		if (methods[i].dict) {
+			if (cdict == NULL)
+				continue;
+			cls.spc_cdict = cdict;
+		}
+#endif
+		spool_report_method(methods[i].name, &cls, tests, ntests);
 	}
 
-	close(sf->sf_fd);
-
-	if (del) {
-		if (unlink(sf->sf_fname) == -1)
-			panic("spool: %s: cannot unlink: %s",
-					sf->sf_fname, strerror(errno));
-	}
+	return 0;
 }
 
-static ssize_t
-spool_read_header(sf, pos, hdr)
-	spool_file_t	*sf;
-	spool_offset_t	 pos;
-	spool_header_t	*hdr;
+/*
+ * Sample a device's files, newest first, until the report is full.
+ */
+static void
+spool_report_dev(sd, rep)
+	spool_dev_t	*sd;
+	spool_report_t	*rep;
 {
-unsigned char	*hdrbuf;
-int		 hdrpos = 0;
-unsigned char	 rdbuf[SPOOL_HDR_SIZE];
+spool_id_t	*files = NULL;
+size_t		 nfiles = 0;
+DIR		*dir;
+struct dirent	*de;
 
-	if (spool_method == M_MMAP)
-		hdrbuf = sf->sf_addr + pos;
-	else {
-		hdrbuf = rdbuf;
-		if (pread(sf->sf_fd, rdbuf, SPOOL_HDR_SIZE, pos) < SPOOL_HDR_SIZE)
-			panic("spool: \"%s\": read: %s", sf->sf_fname,
-					strerror(errno));
+	if ((dir = opendir(sd->sd_path)) == NULL) {
+		printf("nts: \"%s\": cannot open: %s\n", sd->sd_path, strerror(errno));
+		return;
 	}
 
-	hdr->sa_magic = int32get(hdrbuf + hdrpos);				hdrpos += 4;
-	hdr->sa_len = int32get(hdrbuf + hdrpos);				hdrpos += 4;
-	hdr->sa_hdr_len = int8get(hdrbuf + hdrpos);				hdrpos += 1;
-	hdr->sa_flags = int32get(hdrbuf + hdrpos);				hdrpos += 4;
-	hdr->sa_emp_score = ((double) int64get(hdrbuf + hdrpos)) / 1000;	hdrpos += 8;
-	hdr->sa_phl_score = ((double) int64get(hdrbuf + hdrpos)) / 1000;	hdrpos += 8;
-	hdr->sa_crc = int64get(hdrbuf + hdrpos);				hdrpos += 8;
-	hdr->sa_text_len = int32get(hdrbuf + hdrpos);				hdrpos += 4;
+	while (de = readdir(dir)) {
+	char		*p;
+	long unsigned	 n;
 
-	assert(hdrpos == SPOOL_HDR_SIZE);
+		if (*de->d_name == '.')
+			continue;
 
-	return SPOOL_HDR_SIZE;
-}
+		n = strtoul(de->d_name, &p, 16);
+		if (*p)
+			continue;
 
-static void
-spool_write_eos(sf, pos)
-	spool_file_t	*sf;
-	spool_offset_t	 pos;
-{
-	if (spool_method == M_MMAP) {
-		bzero(sf->sf_addr + pos, SPOOL_HDR_SIZE);
-		int32put(sf->sf_addr + pos, SPOOL_MAGIC_EOS);
-	} else {
-	char	eos[sizeof(uint32_t)];
-		int32put(eos, SPOOL_MAGIC_EOS);
-		if (pwrite(sf->sf_fd, eos, sizeof(eos), pos) < sizeof(eos))
-			panic("spool: \"%s\": write: %s", sf->sf_fname,
-			      strerror(errno));
+		files = xrealloc(files, sizeof(*files) * (nfiles + 1));
+		files[nfiles++] = n;
 	}
+	closedir(dir);
 
-}
-
-void
-spool_get_cur_pos(pos)
-	spool_pos_t	*pos;
-{
-	pos->sp_id = spool_base + spool_cur_file;
-	pos->sp_offset = spool_files[spool_cur_file].sf_size;
-}
-
-int
-spool_check()
-{
-DIR		*d;
-struct dirent	*de;
-int		 errors = 0;
+	qsort(files, nfiles, sizeof(*files), numcmp);
 
-	printf("nts: checking spool files in \"%s\"...\n", spool_path);
+	while (nfiles-- > 0 && rep->sr_nsamples < rep->sr_max_samples &&
+	       rep->sr_bytes < rep->sr_max_bytes) {
+	char	path[PATH_MAX];
 
-	if ((d = opendir(spool_path)) == NULL) {
-		printf("nts:    \"%s\": cannot open: %s\n", spool_path, strerror(errno));
-		return 1;
+		spool_file_name(sd, path, files[nfiles]);
+		spool_report_file(path, rep);
 	}
 
-	while (de = readdir(d)) {
-	char		path[PATH_MAX];
-	struct stat	sb;
-	int		fd;
-	char		szbuf[sizeof(uint64_t)];
-	uint64_t	spsz;
-	uint64_t	bread = 0;
-	uint64_t	rawbytes = 0, artbytes = 0;
-	int		narts = 0;
-
-		if (*de->d_name == '.')
-			continue;
-
-		snprintf(path, sizeof(path), "%s/%s", spool_path, de->d_name);
+	free(files);
+}
 
-		if (stat(path, &sb) == -1) {
-			printf("nts:    \"%s\": cannot stat: %s\n",
-				path, strerror(errno));
-			++errors;
-			continue;
-		}
+static void
+spool_report_file(path, rep)
+	char const	*path;
+	spool_report_t	*rep;
+{
+unsigned char	buf[SPOOL_HDR_MAX];
+uint64_t	spsz, off = sizeof(uint64_t);
+size_t		len;
+int		fd;
 
-		if ((fd = open(path, O_RDONLY)) == -1) {
-			printf("nts:    \"%s\": cannot open: %s\n",
-				path, strerror(errno));
-			++errors;
-			continue;
-		}
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		printf("nts: \"%s\": cannot open: %s\n", path, strerror(errno));
+		return;
+	}
 
-		printf("\nnts:    checking \"%s\"\n", path);
+	if (pread(fd, buf, sizeof(uint64_t), 0) < sizeof(uint64_t)) {
+		printf("nts: \"%s\": cannot read header\n", path);
+		close(fd);
+		return;
+	}
+	spsz = int64get(buf);
 
-		if (read(fd, szbuf, sizeof(szbuf)) < sizeof(szbuf)) {
-			printf("nts:    \"%s\": cannot read header: %s\n",
-				path, strerror(errno));
-			++errors;
-			goto next;
+	while (off + SPOOL_HDR_SIZE <= spsz &&
+	       rep->sr_nsamples < rep->sr_max_samples &&
+	       rep->sr_bytes < rep->sr_max_bytes) {
+	spool_header_t	 hdr;
+	spool_sample_t	*ss;
+	char		*data;
+	char const	*err;
+
+		if (pread(fd, buf, SPOOL_HDR_SIZE, off) != SPOOL_HDR_SIZE)
+			break;
+		if ((len = spool_decode_header(buf, SPOOL_HDR_SIZE, &hdr)) >
+		    SPOOL_HDR_SIZE) {
+			if (len > sizeof(buf) ||
+			    pread(fd, buf, len, off) != (ssize_t) len)
+				break;
+			spool_decode_header(buf, len, &hdr);
 		}
-		bread += sizeof(szbuf);
 
-		spsz = int64get(szbuf);
-		if (spsz > sb.st_size) {
-			printf("nts:    \"%s\": size in header (%"PRIu64" bytes)"
-				" is larger than file size (%"PRIu64" bytes)\n",
-				path, spsz, sb.st_size);
-			++errors;
-		}
+		if ((hdr.sa_magic != SPOOL_MAGIC &&
+		     hdr.sa_magic != SPOOL_MAGIC_PAD) ||
+		    off + hdr.sa_hdr_len + hdr.sa_len > spsz)
+			break;
 
-		if (pread(fd, szbuf, 4, spsz) < 4) {
-			printf("nts:    \"%s\": short read on EOS header\n", path);
-			++errors;
+		if (hdr.sa_magic == SPOOL_MAGIC_PAD ||
+		    (hdr.sa_flags & ART_TYPE_YENC)) {
+			off += hdr.sa_hdr_len + hdr.sa_len;
+			continue;
 		}
 
-		if (int32get(szbuf) != SPOOL_MAGIC_EOS) {
-			printf("nts:    \"%s: no EOS header at end of file\n", path);
-			++errors;
+		data = xmalloc(hdr.sa_len);
+		if (pread(fd, data, hdr.sa_len, off + hdr.sa_hdr_len) < hdr.sa_len) {
+			free(data);
+			break;
 		}
-
-		for (;;) {
-		char		 hdrbuf[SPOOL_HDR_SIZE];
-		int		 hdrpos = 0;
-		spool_header_t	 hdr;
-		char		*atext;
-		uint64_t	 crc;
-			if (read(fd, hdrbuf, sizeof(hdrbuf)) < sizeof(hdrbuf)) {
-				printf("nts:    \"%s\": short read on header\n",
-					path);
-				++errors;
-				goto next;
-			}
-
-			hdr.sa_magic = int32get(hdrbuf + hdrpos);                              hdrpos += 4;
-			hdr.sa_len = int32get(hdrbuf + hdrpos);                                hdrpos += 4;
-			hdr.sa_hdr_len = int8get(hdrbuf + hdrpos);                             hdrpos += 1;
-			hdr.sa_flags = int32get(hdrbuf + hdrpos);                              hdrpos += 4;
-			hdr.sa_emp_score = ((double) int64get(hdrbuf + hdrpos)) / 1000;        hdrpos += 8;
-			hdr.sa_phl_score = ((double) int64get(hdrbuf + hdrpos)) / 1000;        hdrpos += 8;
-			hdr.sa_crc = int64get(hdrbuf + hdrpos);                                hdrpos += 8;
-			hdr.sa_text_len = int32get(hdrbuf + hdrpos);                           hdrpos += 4;
-
-			if (hdr.sa_magic == SPOOL_MAGIC_EOS)
-				goto next;
-
-			if (hdr.sa_magic != SPOOL_MAGIC) {
-				printf("nts:    \"%s\": bad magic\n",
-					path);
-				++errors;
-				goto next;
+		off += hdr.sa_hdr_len + hdr.sa_len;
+
+		ss = &rep->sr_samples[rep->sr_nsamples];
+		if (hdr.sa_flags & ART_COMPRESSED) {
+			ss->ss_len = hdr.sa_text_len;
+			ss->ss_text = xmalloc(ss->ss_len);
+			if (spool_uncompress(hdr.sa_flags, data, hdr.sa_len,
+					     (unsigned char *) ss->ss_text,
+					     &ss->ss_len, &err) == -1) {
+				printf("nts: \"%s\": uncompress failed: %s\n",
+				       path, err);
+				free(ss->ss_text);
+				free(data);
+				continue;
 			}
+			free(data);
+			++rep->sr_stored[(hdr.sa_flags & ART_ZSTD) ? 2 : 1];
+		} else {
+			ss->ss_text = data;
+			ss->ss_len = hdr.sa_len;
+			++rep->sr_stored[0];
+		}
 
-			bread += sizeof(hdrbuf);
+		rep->sr_bytes += ss->ss_len;
+		++rep->sr_nsamples;
+	}
 
-			if (hdr.sa_len > (sb.st_size - bread)) {
-				printf("nts:    \"%s\": article extends past end of file\n",
-					path);
-				++errors;
-				goto next;
-			}
+	close(fd);
+}
 
-			atext = malloc(hdr.sa_len);
-			if (read(fd, atext, hdr.sa_len) < hdr.sa_len) {
-				printf("nts:    \"%s\": short read on article text\n",
-					path);
-				++errors;
-				free(atext);
-				atext = NULL;
-				goto next;
-			}
+/*
+ * Compress and uncompress every test article with one method, and print
+ * the results.
+ */
+static void
+spool_report_method(name, cls, tests, ntests)
+	char const	*name;
+	spool_class_t	*cls;
+	spool_sample_t	*tests;
+	int		 ntests;
+{
+uint64_t	 start, ctime, dtime;
+uint64_t	 raw = 0, comp = 0;
+size_t		 maxlen = 0;
+unsigned char	*buf;
+int		 i, errors = 0;
+
+	start = uv_hrtime();
+	for (i = 0; i < ntests; i++) {
+	spool_sample_t	*ss = &tests[i];
+
+		ss->ss_flags = 0;
+		ss->ss_data = spool_compress_text(cls, ss->ss_text, ss->ss_len,
+						  &ss->ss_datalen, &ss->ss_flags);
+	}
+	ctime = uv_hrtime() - start;
 
-			crc = crc64(atext, hdr.sa_len);
-			if (crc != hdr.sa_crc) {
-				printf("nts:    \"%s\": header CRC (%"PRIx64") does not match "
-					"article (%"PRIx64")\n", path, crc, hdr.sa_crc);
-				++errors;
-				free(atext);
-				atext = NULL;
-				continue;
-			}
+	for (i = 0; i < ntests; i++) {
+		raw += tests[i].ss_len;
+		comp += tests[i].ss_datalen;
+		if (tests[i].ss_len > maxlen)
+			maxlen = tests[i].ss_len;
+	}
 
-			free(atext);
-			atext = NULL;
+	buf = xmalloc(maxlen);
 
-			rawbytes += hdr.sa_len;
-			artbytes += hdr.sa_text_len;
-			++narts;
-		}
+	start = uv_hrtime();
+	for (i = 0; i < ntests; i++) {
+	spool_sample_t	*ss = &tests[i];
+	size_t		 len = ss->ss_len;
+	char const	*err;
 
-	next:
-		printf("nts:    \"%s\": %d articles, %"PRIu64" bytes on disk, %"PRIu64" bytes uncompressed, "
-			"%.2fx ratio, %d error(s)\n",  path, narts, rawbytes, artbytes, (double)artbytes / rawbytes,
-			errors);
-		close(fd);
+		if (spool_uncompress(ss->ss_flags, ss->ss_data, ss->ss_datalen,
+				     buf, &len, &err) == -1 || len != ss->ss_len)
+			++errors;
 	}
+	dtime = uv_hrtime() - start;
 
-	closedir(d);
-	return errors;
+	for (i = 0; i < ntests; i++) {
+		free(tests[i].ss_data);
+		tests[i].ss_data = NULL;
+	}
+	free(buf);
+
+	printf("nts:    %-12s %7.2fx %15.1f %17.1f",
+	       name, (double) raw / comp,
+	       (double) raw / 1048576 / ((double) (ctime ? ctime : 1) / 1e9),
+	       (double) raw / 1048576 / ((double) (dtime ? dtime : 1) / 1e9));
+	if (errors)
+		printf(" (%d articles failed to uncompress)", errors);
+	printf("\n");
 }
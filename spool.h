@@ -12,6 +12,7 @@
 #define	SPOOL_H
 
 #include	<inttypes.h>
+#include	<time.h>
 
 struct article;
 
@@ -23,15 +24,44 @@ typedef struct spool_pos {
 	spool_offset_t	sp_offset;
 } spool_pos_t;
 
+/*
+ * A spool id is the device in the top 8 bits and the file number in the
+ * rest.  Positions on the same device are in the order they were stored.
+ */
+#define	SPOOL_FILE_MASK		0xFFFFFFu
+#define	SPOOL_ID_DEV(id)	((id) >> 24)
+#define	SPOOL_ID_FILE(id)	((id) & SPOOL_FILE_MASK)
+#define	SPOOL_ID(dev, num)	(((spool_id_t) (dev) << 24) | (num))
+
+/*
+ * A decoded article header.  The fields after sa_text_len are only stored
+ * by format 2; for format 1 articles they're 0, except sa_codec and sa_csum,
+ * which are worked out from the flags.
+ */
+#define	SPOOL_CODEC_NONE	0
+#define	SPOOL_CODEC_ZLIB	1
+#define	SPOOL_CODEC_ZSTD	2
+
+#define	SPOOL_CSUM_NONE		0
+#define	SPOOL_CSUM_CRC64	1
+
 typedef struct spool_header {
 	uint32_t	sa_magic;
 	uint32_t	sa_len;
-	uint8_t		sa_hdr_len;
+	uint16_t	sa_hdr_len;
 	uint32_t	sa_flags;
 	double		sa_emp_score;
 	double		sa_phl_score;
 	uint64_t	sa_crc;
 	uint32_t	sa_text_len;
+
+	uint8_t		sa_version;
+	uint8_t		sa_codec;	/* SPOOL_CODEC_* */
+	uint8_t		sa_csum;	/* SPOOL_CSUM_*; sa_crc is the value */
+	time_t		sa_time;	/* Arrival time, or 0 */
+	uint32_t	sa_body;	/* Offset of the body in the text, or 0 */
+	uint16_t	sa_msgid_off;	/* Offset of the msgid in the header */
+	uint8_t		sa_msgid_len;	/* ... and its length, or 0 */
 } spool_header_t;
 
 int	spool_init(void);
@@ -49,35 +79,142 @@ int	spool_open(char const *path);
 void	spool_close(void);
 
 /*
- * Store the given article in the spool.  Returns 0 on success or -1 on 
- * failure.
+ * Start the spool writer thread.  This must be called after forking.
  */
-#ifdef notyet
-typedef struct spool_store_req {
-	void	*data;	
+int	spool_start(void);
 
-	struct spool_store_req	*ss_next;
-} spool_store_req_t;
+/*
+ * Store the given article in the spool.  The article is written by the
+ * spool writer thread; this waits until it has been written (and synced,
+ * if enabled).  Returns 0 on success or -1 on failure.
+ */
+int	spool_store(struct article *);
 
-typedef void (*spool_store_cb) (spool_store_req_t *, int status);
+/*
+ * Writer statistics.  sst_lat_hist counts articles by the time from being
+ * queued until written and synced; sst_batch_hist counts writer batches by
+ * the number of articles waiting.  The upper bound of each bucket is given
+ * by spool_lat_buckets and spool_batch_buckets.  sst_rotate_stalls counts
+ * rotations that had to create the next file themselves, because it hadn't
+ * been prepared in time.
+ */
+#define	SPOOL_LAT_BUCKETS	12
+#define	SPOOL_BATCH_BUCKETS	9
+
+typedef struct spool_stats {
+	uint64_t	sst_articles;
+	uint64_t	sst_bytes;
+	uint64_t	sst_batches;
+	uint64_t	sst_max_batch;
+	uint64_t	sst_sync_usec;
+	uint64_t	sst_sync_max_usec;
+	uint64_t	sst_lat_hist[SPOOL_LAT_BUCKETS];
+	uint64_t	sst_batch_hist[SPOOL_BATCH_BUCKETS];
+	uint64_t	sst_rotations;
+	uint64_t	sst_rotate_stalls;
+	uint64_t	sst_rotate_max_usec;
+	uint64_t	sst_cache_size;
+	uint64_t	sst_cache_used;
+	uint64_t	sst_cache_entries;
+	uint64_t	sst_cache_hits;
+	uint64_t	sst_cache_misses;
+	uint64_t	sst_cache_evictions;
+} spool_stats_t;
+
+extern uint64_t const	spool_lat_buckets[SPOOL_LAT_BUCKETS];
+extern uint64_t const	spool_batch_buckets[SPOOL_BATCH_BUCKETS];
+
+void	spool_get_stats(spool_stats_t *);
 
-int	spool_store(struct article *, spool_store_cb);
-#else
-int	spool_store(struct article *);
-#endif
+/*
+ * Check the spool files for consistency, and print statistics about them.
+ * If deep is set, uncompress compressed articles too.
+ */
+int	spool_check(int deep);
+
+/*
+ * Compare the compression methods on a sample of the articles in the spool.
+ */
+int	spool_codec_report(void);
+
+/*
+ * Each spool file has an index with an entry for every article in it.
+ * spool_index_scan() calls cb for each article stored between from and to
+ * (either may be 0 for no limit), a device at a time, oldest first, without
+ * reading the spool itself.  If cb returns non-zero, the scan stops and
+ * returns that; otherwise it returns 0.
+ */
+typedef struct spool_index_entry {
+	spool_pos_t	ie_pos;
+	uint32_t	ie_len;		/* Including the spool header */
+	uint32_t	ie_flags;
+	uint64_t	ie_msgid;	/* crc64() of the message-id */
+	time_t		ie_time;	/* When it was stored */
+} spool_index_entry_t;
+
+int	spool_index_scan(time_t from, time_t to,
+			 int (*cb)(spool_index_entry_t *, void *), void *udata);
 
 /*
- * Check the spool files for consistency.
+ * Read every article in the spool, several files at a time, and call cb
+ * with batches of what was found.  cb is called from several threads at
+ * once.  Only the headers are read, for the message-id, which is empty if
+ * the article doesn't have one.  If cb returns non-zero, the walk stops
+ * and returns that; otherwise it returns 0.
  */
-int	spool_check(void);
+typedef struct spool_walk_ent {
+	spool_pos_t	we_pos;
+	time_t		we_time;	/* When it was stored */
+	uint32_t	we_flags;
+	char		we_msgid[256];
+} spool_walk_ent_t;
+
+int	spool_walk(int (*cb)(spool_walk_ent_t *, size_t, void *), void *udata);
 
 /*
  * Fetch an article from the spool.
  */
 struct article	*spool_fetch(spool_id_t, spool_offset_t);
 int		 spool_fetch_text(spool_id_t, spool_offset_t, spool_header_t *hdr, char **);
+
+/*
+ * A view of an article's text in the spool.  Where possible (i.e., for
+ * uncompressed articles in an mmap spool) the view points directly at the
+ * spool, and the spool file is kept open until the view is released;
+ * otherwise, it points to a private buffer.  The text is not NUL-terminated.
+ *
+ * If SPOOL_VIEW_FD is given and the article is stored uncompressed in a
+ * file spool, sv_text is NULL and the article is the sv_len bytes at
+ * sv_offset in sv_fd, which stays open until the view is released.
+ */
+struct spool_file;
+struct spool_cent;
+
+typedef struct spool_view {
+	spool_header_t		 sv_hdr;
+	char const		*sv_text;
+	size_t			 sv_len;
+	int			 sv_fd;
+	spool_offset_t		 sv_offset;
+	struct spool_file	*sv_file;
+	struct spool_cent	*sv_cent;
+	char			*sv_buf;
+} spool_view_t;
+
+#define	SPOOL_VIEW_FD	0x1
+
+int	spool_view(spool_id_t, spool_offset_t, spool_view_t *, int flags);
+void	spool_view_release(spool_view_t *);
 void		 spool_get_cur_pos(spool_pos_t *);
 
+/*
+ * Set a function to be called with the id of each spool file that is
+ * deleted to make room for new articles.  It's called from the thread
+ * that rotated the spool, so it should do no more than queue the work.
+ */
+typedef void (*spool_expire_fn)(spool_id_t);
+void	spool_set_expire_hook(spool_expire_fn);
+
 void	spool_shutdown(void);
 
 extern int spool_do_sync;